@@ -625,7 +625,25 @@ void test1() {
 	// Thu, 03 Jun 2021 18:10:52 GMT (14:10:52 EDT)
 	conv.withConfig(tzConfig).withTime(1622743852).convert();
 	conv.nextDay(LocalTimeHMS("15:00"));
-	assertTime("", conv.time, "tm_year=121 tm_mon=5 tm_mday=4 tm_hour=19 tm_min=0 tm_sec=0 tm_wday=5");	
+	assertTime("", conv.time, "tm_year=121 tm_mon=5 tm_mday=4 tm_hour=19 tm_min=0 tm_sec=0 tm_wday=5");
+
+	// Fall back day is 25 hours long. Sun, 06 Nov 2022 04:30:00 GMT (00:30:00 EDT)
+	conv.withConfig(tzConfig).withTime(LocalTime::stringToTime("2022-11-06 04:30:00")).convert();
+	conv.nextDay();
+	assertTime("", conv.time, "tm_year=122 tm_mon=10 tm_mday=7 tm_hour=5 tm_min=30 tm_sec=0 tm_wday=1");
+
+	conv.withConfig(tzConfig).withTime(LocalTime::stringToTime("2022-11-06 04:30:00")).convert();
+	conv.nextDay(LocalTimeHMS("00:45"));
+	assertTime("", conv.time, "tm_year=122 tm_mon=10 tm_mday=7 tm_hour=5 tm_min=45 tm_sec=0 tm_wday=1");
+
+	// Spring forward day is 23 hours long. Sun, 13 Mar 2022 04:30:00 GMT (Sat 23:30:00 EST)
+	conv.withConfig(tzConfig).withTime(LocalTime::stringToTime("2022-03-13 04:30:00")).convert();
+	conv.nextDay();
+	assertTime("", conv.time, "tm_year=122 tm_mon=2 tm_mday=14 tm_hour=3 tm_min=30 tm_sec=0 tm_wday=1");
+
+	conv.withConfig(tzConfig).withTime(LocalTime::stringToTime("2022-03-13 04:30:00")).convert();
+	conv.nextDay(LocalTimeHMS("12:00"));
+	assertTime("", conv.time, "tm_year=122 tm_mon=2 tm_mday=13 tm_hour=16 tm_min=0 tm_sec=0 tm_wday=0");
 
 	// 2021 time changes: March 14, November 7
 	conv.withConfig(tzConfig).withTime(LocalTime::stringToTime("2021-02-01 06:40:52")).convert();
@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include <cassert>
+#include <functional>
 
 #include "spark_wiring_json.h"
 #include "spark_wiring_string.h"
@@ -114,7 +115,16 @@ public:
         va_end(ap);
     }
     
+    void write(LogLevel level, const char *data, size_t size) const {
+        if (level >= minimumLevel()) {
+            fwrite(data, 1, size, stdout);
+        }
+    }
+
     void vprintf(LogLevel level, const char *fmt, va_list ap) const {
+        if (level < minimumLevel()) {
+            return;
+        }
         char buf[512];
         vsnprintf(buf, sizeof(buf), fmt, ap);
         const char *levelStr;
@@ -142,6 +152,12 @@ public:
         ::printf("%s %s: %s\n", name.c_str(), levelStr, buf);
     }
 
+    // Messages below this level are discarded (all messages are printed by default)
+    static LogLevel &minimumLevel() {
+        static LogLevel level = LOG_LEVEL_ALL;
+        return level;
+    }
+
     String name;
 };
 // spark_wiring_logging.h
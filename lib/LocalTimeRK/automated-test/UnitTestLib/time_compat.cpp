@@ -17,6 +17,8 @@
 
 #include "time_compat.h"
 
+#include <time.h>
+
 #ifndef HAL_TIME_COMPAT_EXCLUDE
 
 struct tm* localtime32_r(const time32_t* timep, struct tm* result) {
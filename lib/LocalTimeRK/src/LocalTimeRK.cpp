@@ -1224,9 +1224,28 @@ void LocalTimeConvert::nextTime(LocalTimeHMS hms) {
 
 
 void LocalTimeConvert::nextDay(LocalTimeHMS hms) {
+    LocalTimeYMD startYMD = getLocalTimeYMD();
+    LocalTimeYMD nextYMD = startYMD;
+    nextYMD.addDay();
+
     time += 86400;
     convert();
 
+    if (getLocalTimeYMD() == startYMD) {
+        // The day that switches from DST back to standard time is 25 hours long. Without this,
+        // starting before 01:00 local time would land on the same date, and atLocalTime()
+        // would move back to the starting time.
+        time += 3600;
+        convert();
+    }
+    else
+    if (getLocalTimeYMD() > nextYMD) {
+        // The day that switches from standard time to DST is 23 hours long. Without this,
+        // starting after 23:00 local time the day before would skip that date.
+        time -= 3600;
+        convert();
+    }
+
     atLocalTime(hms);
 }
 
@@ -0,0 +1,602 @@
+#include "Particle.h"
+#include "PublishQueuePosixRK.h"
+
+// After PublishQueuePosixRK.h, so withPublishQueuePosixRK() is enabled
+#include "SleepHelper.h"
+
+#include <cassert>
+#include <climits>
+#include <deque>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Host tests for PublishQueuePosixRK: the ring file queue (withRingFile), including wrapping,
+// discarding the oldest events when full, recovery after a simulated reset (deleting the
+// PublishQueueRingFile and loading a new one with the same path), a torn write of the newest
+// record, and changing the size. testQueueRingFile() publishes through PublishQueuePosix to
+// the simulated cloud from SleepHelper's automated-test, and the tests after it check the publish
+// pacing: the rate limit token bucket, the failure backoff and jitter, and sharing the rate limit
+// with SleepHelper's wake event publishes.
+// Any failure prints the line and stops with an assertion, so the exit status is non-zero.
+
+static const char *testDir = "testdata";
+static const char *ringPath = "testdata/ring.dat";
+
+#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
+void _assertInt(const char *msg, int got, int expected, int line) {
+    if (expected != got) {
+        printf("assertion failed %s line %d\n", msg, line);
+        printf("expected: %d\n", expected);
+        printf("     got: %d\n", got);
+        fflush(stdout);
+        assert(false);
+    }
+}
+
+#define assertStr(msg, got, expected) _assertStr(msg, got, expected, __LINE__)
+void _assertStr(const char *msg, const char *got, const char *expected, int line) {
+    if (strcmp(expected, got) != 0) {
+        printf("assertion failed %s line %d\n", msg, line);
+        printf("expected: %s\n", expected);
+        printf("     got: %s\n", got);
+        fflush(stdout);
+        assert(false);
+    }
+}
+
+#define assertRange(msg, got, min, max) _assertRange(msg, got, min, max, __LINE__)
+void _assertRange(const char *msg, int got, int min, int max, int line) {
+    if (got < min || got > max) {
+        printf("assertion failed %s line %d\n", msg, line);
+        printf("expected: %d to %d\n", min, max);
+        printf("     got: %d\n", got);
+        fflush(stdout);
+        assert(false);
+    }
+}
+
+// Bytes used in the ring file by an event with dataLen bytes of data
+static size_t recordLen(size_t dataLen) {
+    return sizeof(PublishQueueRingRecord) + sizeof(PublishQueueEvent) + dataLen;
+}
+
+// Ring file size that holds exactly count events with dataLen bytes of data
+static size_t ringSize(int count, size_t dataLen) {
+    return sizeof(PublishQueueRingHeader) + count * recordLen(dataLen);
+}
+
+// Adds an event named name with dataLen copies of fill, returning the sequence number
+static int addEvent(PublishQueueRingFile &ring, const char *name, size_t dataLen, char fill = 'x') {
+    PublishQueueEvent *event = (PublishQueueEvent *)new char[sizeof(PublishQueueEvent) + dataLen];
+    event->flags = PRIVATE;
+    strcpy(event->eventName, name);
+    memset(event->eventData, fill, dataLen);
+    event->eventData[dataLen] = 0;
+
+    int seq = ring.addEvent(event);
+    delete[] (char *)event;
+    return seq;
+}
+
+// Reads and removes the oldest event, returning its name
+static String removeFront(PublishQueueRingFile &ring) {
+    String result;
+
+    int seq = ring.getFrontSeq();
+    PublishQueueEvent *event = ring.readEvent(seq);
+    if (event) {
+        result = event->eventName;
+        delete[] (char *)event;
+        assertInt("removeEvent", ring.removeEvent(seq), true);
+    }
+    return result;
+}
+
+// Simulates a reset: the PublishQueueRingFile is deleted, closing the file, and a new one is loaded
+static void reload(PublishQueueRingFile *&ring, size_t size) {
+    delete ring;
+    ring = new PublishQueueRingFile();
+    ring->withPath(ringPath).withSize(size);
+    assertInt("load", ring->load(), true);
+}
+
+static void clearTestDir() {
+    mkdir(testDir, 0777);
+    unlink(ringPath);
+}
+
+void testRingWrap() {
+    clearTestDir();
+
+    size_t size = ringSize(5, 100);
+    PublishQueueRingFile *ring = NULL;
+    reload(ring, size);
+
+    // Fill it exactly, then make room at the start of the file
+    for(int ii = 1; ii <= 5; ii++) {
+        assertInt("addEvent", addEvent(*ring, String::format("e%d", ii), 100), ii);
+    }
+    assertStr("removeFront", removeFront(*ring), "e1");
+    assertStr("removeFront", removeFront(*ring), "e2");
+
+    // These go at the start of the file, before e3
+    assertInt("addEvent", addEvent(*ring, "e6", 100), 6);
+    assertInt("addEvent", addEvent(*ring, "e7", 100), 7);
+    assertInt("getQueueLen", ring->getQueueLen(), 5);
+    assertInt("getFrontSeq", ring->getFrontSeq(), 3);
+
+    // The newest records are found after the wrap
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 5);
+    assertInt("getFrontSeq", ring->getFrontSeq(), 3);
+
+    // Removing e3, e4, and e5 moves the head back to the start of the file
+    for(int ii = 3; ii <= 7; ii++) {
+        assertStr("removeFront", removeFront(*ring), String::format("e%d", ii));
+        if (ii == 5) {
+            reload(ring, size);
+            assertInt("getFrontSeq", ring->getFrontSeq(), 6);
+        }
+    }
+    assertInt("getQueueLen", ring->getQueueLen(), 0);
+    assertInt("getFrontSeq", ring->getFrontSeq(), 0);
+
+    // Sequence numbers continue after the queue is emptied and reloaded
+    reload(ring, size);
+    assertInt("addEvent", addEvent(*ring, "e8", 100), 8);
+
+    delete ring;
+}
+
+void testRingDiscard() {
+    clearTestDir();
+
+    size_t size = ringSize(5, 100);
+    PublishQueueRingFile *ring = NULL;
+    reload(ring, size);
+
+    for(int ii = 1; ii <= 5; ii++) {
+        addEvent(*ring, String::format("e%d", ii), 100);
+    }
+
+    // Full, so adding discards the oldest
+    assertInt("addEvent", addEvent(*ring, "e6", 100), 6);
+    assertInt("getQueueLen", ring->getQueueLen(), 5);
+    assertInt("getFrontSeq", ring->getFrontSeq(), 2);
+
+    // A larger event discards as many as needed to fit
+    assertInt("addEvent", addEvent(*ring, "e7", 250), 7);
+    assertInt("getQueueLen", ring->getQueueLen(), 4);
+    assertInt("getFrontSeq", ring->getFrontSeq(), 4);
+
+    // An event that can never fit is not added and doesn't discard anything
+    assertInt("addEvent", addEvent(*ring, "big", size), 0);
+    assertInt("getQueueLen", ring->getQueueLen(), 4);
+
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 4);
+    assertStr("removeFront", removeFront(*ring), "e4");
+    assertStr("removeFront", removeFront(*ring), "e5");
+    assertStr("removeFront", removeFront(*ring), "e6");
+    assertStr("removeFront", removeFront(*ring), "e7");
+
+    delete ring;
+}
+
+void testRingReset() {
+    clearTestDir();
+
+    size_t size = ringSize(8, 50);
+    PublishQueueRingFile *ring = NULL;
+    reload(ring, size);
+
+    for(int ii = 1; ii <= 6; ii++) {
+        addEvent(*ring, String::format("e%d", ii), 50);
+    }
+    assertStr("removeFront", removeFront(*ring), "e1");
+
+    // Reset after reading an event but before removing it: the event is still queued
+    PublishQueueEvent *event = ring->readEvent(ring->getFrontSeq());
+    assertStr("readEvent", event->eventName, "e2");
+    delete[] (char *)event;
+
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 5);
+    assertStr("removeFront", removeFront(*ring), "e2");
+
+    // Adding after the reset continues the sequence
+    assertInt("addEvent", addEvent(*ring, "e7", 50), 7);
+
+    // removeAll survives a reset, and the sequence still continues
+    ring->removeAll();
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 0);
+    assertInt("addEvent", addEvent(*ring, "e8", 50), 8);
+
+    delete ring;
+}
+
+// Randomized adds, removes, and resets of different size events, checked against a deque
+void testRingModel(unsigned seed) {
+    clearTestDir();
+    srand(seed);
+
+    size_t size = 2048 + rand() % 8192;
+    PublishQueueRingFile *ring = NULL;
+    reload(ring, size);
+
+    std::deque<std::pair<int, String>> model;
+    int discarded = 0;
+
+    for(int ii = 0; ii < 5000; ii++) {
+        int op = rand() % 10;
+        if (op < 5) {
+            size_t dataLen = (rand() % 4 == 0) ? (rand() % 1025) : (rand() % 100);
+            String name = String::format("e%d", ii);
+
+            int seq = addEvent(*ring, name, dataLen, 'a' + rand() % 26);
+            if (recordLen(dataLen) > size - sizeof(PublishQueueRingHeader)) {
+                assertInt("addEvent too large", seq, 0);
+                continue;
+            }
+            assertInt("addEvent", seq != 0, true);
+            model.push_back(std::make_pair(seq, name));
+
+            // The ring discards the oldest events to make room
+            while((int)model.size() > ring->getQueueLen()) {
+                model.pop_front();
+                discarded++;
+            }
+        }
+        else
+        if (op < 9) {
+            if (model.empty()) {
+                assertInt("getFrontSeq", ring->getFrontSeq(), 0);
+                continue;
+            }
+            assertInt("getFrontSeq", ring->getFrontSeq(), model.front().first);
+            assertStr("removeFront", removeFront(*ring), model.front().second);
+            model.pop_front();
+        }
+        else {
+            reload(ring, size);
+        }
+
+        assertInt("getQueueLen", ring->getQueueLen(), (int)model.size());
+        if (!model.empty()) {
+            assertInt("getFrontSeq", ring->getFrontSeq(), model.front().first);
+        }
+    }
+
+    // Enough was added to wrap and discard many times
+    assertInt("discarded", discarded > 100, true);
+
+    delete ring;
+}
+
+void testRingTornWrite() {
+    clearTestDir();
+
+    size_t size = ringSize(8, 100);
+    PublishQueueRingFile *ring = NULL;
+    reload(ring, size);
+
+    for(int ii = 1; ii <= 5; ii++) {
+        addEvent(*ring, String::format("e%d", ii), 100);
+    }
+    delete ring;
+    ring = NULL;
+
+    // Change a byte of the data of the newest record, as if the reset happened during the write
+    int fd = open(ringPath, O_RDWR);
+    off_t offset = sizeof(PublishQueueRingHeader) + 4 * recordLen(100) + sizeof(PublishQueueRingRecord) + sizeof(PublishQueueEvent) + 80;
+    lseek(fd, offset, SEEK_SET);
+    write(fd, "y", 1);
+    close(fd);
+
+    // Only the newest event is lost
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 4);
+    assertInt("getFrontSeq", ring->getFrontSeq(), 1);
+
+    // Its sequence number is used again and the record is overwritten
+    assertInt("addEvent", addEvent(*ring, "e5b", 100), 5);
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 5);
+    for(int ii = 1; ii <= 4; ii++) {
+        assertStr("removeFront", removeFront(*ring), String::format("e%d", ii));
+    }
+    assertStr("removeFront", removeFront(*ring), "e5b");
+
+    delete ring;
+}
+
+void testRingResize() {
+    clearTestDir();
+
+    size_t size = ringSize(4, 100);
+    PublishQueueRingFile *ring = NULL;
+    reload(ring, size);
+    for(int ii = 1; ii <= 3; ii++) {
+        addEvent(*ring, String::format("e%d", ii), 100);
+    }
+
+    // A different size clears the file, in either direction
+    size_t largerSize = ringSize(8, 100);
+    reload(ring, largerSize);
+    assertInt("getQueueLen", ring->getQueueLen(), 0);
+
+    struct stat sb;
+    stat(ringPath, &sb);
+    assertInt("file size", (int)sb.st_size, (int)largerSize);
+
+    // All of the larger size is used
+    for(int ii = 1; ii <= 8; ii++) {
+        addEvent(*ring, String::format("e%d", ii), 100);
+    }
+    assertInt("getQueueLen", ring->getQueueLen(), 8);
+    reload(ring, largerSize);
+    assertInt("getQueueLen", ring->getQueueLen(), 8);
+
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 0);
+    for(int ii = 1; ii <= 5; ii++) {
+        addEvent(*ring, String::format("e%d", ii), 100);
+    }
+    assertInt("getQueueLen", ring->getQueueLen(), 4);
+    reload(ring, size);
+    assertInt("getQueueLen", ring->getQueueLen(), 4);
+    assertStr("removeFront", removeFront(*ring), "e2");
+
+    delete ring;
+}
+
+// Events published while offline go to the ring file and are published in order after connecting
+void testQueueRingFile() {
+    clearTestDir();
+
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    std::vector<String> acked;
+    sim.withPublishAckedFunction([&acked](const char *name, const char *data) {
+        acked.push_back(data);
+    });
+
+    PublishQueuePosix &queue = PublishQueuePosix::instance();
+    queue.withRingFile(ringPath, ringSize(20, 10)).withRamQueueSize(0);
+    queue.setup();
+
+    for(int ii = 0; ii < 10; ii++) {
+        queue.publish("test", String::format("%d", ii), PRIVATE | WITH_ACK);
+    }
+    assertInt("getNumEvents", queue.getNumEvents(), 10);
+
+    Particle.connect();
+    while(sim.getSystemMillis() < 120000 && (queue.getNumEvents() != 0 || acked.size() < 10)) {
+        queue.loop();
+        sim.advance(10);
+    }
+
+    assertInt("acked", (int)acked.size(), 10);
+    for(int ii = 0; ii < 10; ii++) {
+        assertStr("acked", acked[ii], String::format("%d", ii));
+    }
+    sim.withPublishAckedFunction(NULL);
+}
+
+// Times publishes were started, in milliseconds since boot, see recordPublishStarts()
+static std::vector<uint64_t> publishStarts;
+
+static void recordPublishStarts() {
+    publishStarts.clear();
+    SleepHelperSim::instance().withPublishStartedFunction([](const char *name, const char *data) {
+        publishStarts.push_back(SleepHelperSim::instance().getSystemMillis());
+    });
+}
+
+// Runs the queue for ms milliseconds, or until it's empty if ms is 0
+static void runQueue(uint64_t ms) {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    PublishQueuePosix &queue = PublishQueuePosix::instance();
+
+    uint64_t endMs = sim.getSystemMillis() + (ms ? ms : 3600000);
+    while(sim.getSystemMillis() < endMs && (ms || queue.getNumEvents() != 0)) {
+        queue.loop();
+        sim.advance(10);
+    }
+}
+
+static void queueEvents(int count) {
+    for(int ii = 0; ii < count; ii++) {
+        PublishQueuePosix::instance().publish("test", String::format("%d", ii), PRIVATE | WITH_ACK);
+    }
+}
+
+// A backlog is sent in a burst of 4, then one per second, without going over the cloud rate limit
+void testRateLimit() {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    sim.withPublishAckMs(100);
+
+    // Idle long enough to earn all of the tokens
+    runQueue(5000);
+    int rateLimited = sim.getCycle().publishRateLimited;
+
+    recordPublishStarts();
+    queueEvents(12);
+    runQueue(0);
+
+    assertInt("publishes", (int)publishStarts.size(), 12);
+    assertInt("publishRateLimited", sim.getCycle().publishRateLimited - rateLimited, 0);
+
+    // The first 4 only wait for the previous one to be acknowledged
+    for(size_t ii = 1; ii < 4; ii++) {
+        assertRange("burst", (int)(publishStarts[ii] - publishStarts[ii - 1]), 100, 120);
+    }
+
+    // Then a token is earned every second, counting from the first publish
+    assertRange("refill", (int)(publishStarts[4] - publishStarts[0]), 1000, 1010);
+    for(size_t ii = 5; ii < publishStarts.size(); ii++) {
+        assertRange("interval", (int)(publishStarts[ii] - publishStarts[ii - 1]), 1000, 1010);
+    }
+}
+
+// Publishes made without the queue use up tokens with consumeRateToken()
+void testConsumeRateToken() {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    runQueue(5000);
+    int rateLimited = sim.getCycle().publishRateLimited;
+
+    recordPublishStarts();
+    for(int ii = 0; ii < 4; ii++) {
+        Particle.publish("direct", "", PRIVATE);
+        PublishQueuePosix::instance().consumeRateToken();
+    }
+    queueEvents(4);
+    runQueue(0);
+
+    assertInt("publishes", (int)publishStarts.size(), 8);
+    assertInt("publishRateLimited", sim.getCycle().publishRateLimited - rateLimited, 0);
+
+    // The queue waits for a token instead of starting another burst of 4
+    for(size_t ii = 4; ii < publishStarts.size(); ii++) {
+        assertRange("interval", (int)(publishStarts[ii] - publishStarts[ii - 1]), 1000, 1010);
+    }
+}
+
+// The wait after a failure doubles up to the maximum, which does not have to be a power of 2 times the minimum
+void testFailureBackoff() {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    PublishQueuePosix &queue = PublishQueuePosix::instance();
+
+    runQueue(5000);
+    queue.withFailureBackoff(5000, 30000, 0);
+    sim.withPublishFailPercent(100);
+
+    recordPublishStarts();
+    queueEvents(1);
+    runQueue(300000);
+
+    // Each retry starts after the 100 millisecond acknowledgement and the wait
+    assertRange("attempts", (int)publishStarts.size(), 10, 12);
+    unsigned long expected = 5000;
+    for(size_t ii = 1; ii < publishStarts.size(); ii++) {
+        assertRange("backoff", (int)(publishStarts[ii] - publishStarts[ii - 1]), 100 + expected, 110 + expected);
+        expected = std::min(expected * 2, 30000UL);
+    }
+
+    sim.withPublishFailPercent(0);
+    runQueue(0);
+}
+
+// The wait after a failure is randomly up to jitterPercent longer or shorter
+void testFailureJitter() {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    PublishQueuePosix &queue = PublishQueuePosix::instance();
+
+    runQueue(5000);
+    queue.withFailureBackoff(5000, 5000, 25);
+    sim.withPublishFailPercent(100);
+
+    recordPublishStarts();
+    queueEvents(1);
+    runQueue(200 * 5000);
+    // 3750 to 6250 milliseconds, plus the acknowledgement, and spread over most of that range
+    int minGap = INT_MAX, maxGap = 0;
+    for(size_t ii = 1; ii < publishStarts.size(); ii++) {
+        int gap = (int)(publishStarts[ii] - publishStarts[ii - 1]);
+        assertRange("jitter", gap, 100 + 3750, 110 + 6250);
+        minGap = std::min(minGap, gap);
+        maxGap = std::max(maxGap, gap);
+    }
+    assertRange("attempts", (int)publishStarts.size(), 150, 270);
+    assertRange("minGap", minGap, 100 + 3750, 100 + 4000);
+    assertRange("maxGap", maxGap, 100 + 6000, 110 + 6250);
+
+    sim.withPublishFailPercent(0);
+    runQueue(0);
+    queue.withFailureBackoff(5000, 300000, 25);
+}
+
+// Runs SleepHelper and the queue until the device has gone to sleep count times
+static void runSleepHelper(int count) {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+
+    size_t numCycles = sim.getCycles().size() + count;
+    uint64_t endMs = sim.getMillis() + 7200000;
+    while(sim.getCycles().size() < numCycles && sim.getMillis() < endMs) {
+        SleepHelper::instance().loop();
+        PublishQueuePosix::instance().loop();
+        sim.loop();
+    }
+    assertInt("slept", (int)sim.getCycles().size(), (int)numCycles);
+}
+
+// SleepHelper wake event publishes use up the queue's rate limit tokens, so the queue doesn't
+// start a burst of 4 right after a burst of wake event publishes
+void testSleepHelperRateLimit() {
+    SleepHelperSim &sim = SleepHelperSim::instance();
+    sim.withMaxEventDataSize(200);
+
+    SleepHelper::instance().settingsFile.withPath("testdata/sleepSettings.json");
+    SleepHelper::instance().persistentData.withPath("testdata/sleepData.dat");
+    SleepHelper::instance()
+        .withPublishQueuePosixRK()
+        .withPublishWindow(4)
+        .withPublishRateLimit(4, 1s)
+        .withEventHistory("testdata/events.txt", "eh");
+    SleepHelper::instance().getScheduleFull().withMinuteOfHour(15);
+    SleepHelper::instance().setup();
+    runSleepHelper(1);
+
+    // Enough events for 8 wake event publishes at the next wake, then the queued events
+    for(int ii = 0; ii < 30; ii++) {
+        SleepHelper::instance().addEvent([ii](JSONWriter &writer) {
+            writer.name("n").value(ii);
+            writer.name("s").value("abcdefghijklmnopqrstuvwxyz");
+        });
+    }
+    queueEvents(8);
+
+    std::vector<String> names;
+    sim.withPublishStartedFunction([&names](const char *name, const char *data) {
+        names.push_back(name);
+        publishStarts.push_back(SleepHelperSim::instance().getSystemMillis());
+    });
+    publishStarts.clear();
+    runSleepHelper(1);
+
+    const SleepHelperSim::CycleStats &cycle = sim.getCycles().back();
+    assertInt("publishes", (int)names.size(), 16);
+    assertStr("first", names.front(), "sleepHelper");
+    assertStr("last", names.back(), "test");
+    assertInt("publishFailCount", cycle.publishFailCount, 0);
+    assertInt("publishRateLimited", cycle.publishRateLimited, 0);
+
+    // Never more than 4 publishes started in a second
+    for(size_t ii = 4; ii < publishStarts.size(); ii++) {
+        assertRange("window", (int)(publishStarts[ii] - publishStarts[ii - 4]), 1000, INT_MAX);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Logger::minimumLevel() = LOG_LEVEL_NONE;
+
+    testRingWrap();
+    testRingDiscard();
+    testRingReset();
+    for(unsigned seed = 1; seed <= 4; seed++) {
+        testRingModel(seed);
+    }
+    testRingTornWrite();
+    testRingResize();
+
+    // These use the PublishQueuePosix singleton, which is set up by testQueueRingFile()
+    testQueueRingFile();
+    testRateLimit();
+    testConsumeRateToken();
+    testFailureBackoff();
+    testFailureJitter();
+    testSleepHelperRateLimit();
+
+    printf("PublishQueueTest passed\n");
+    return 0;
+}
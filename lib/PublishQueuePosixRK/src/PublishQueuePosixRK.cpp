@@ -1,7 +1,10 @@
 #include "PublishQueuePosixRK.h"
 
+#ifndef UNITTEST
 #include "BackgroundPublishRK.h"
+#endif
 
+#include <cstddef>
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -10,6 +13,19 @@ PublishQueuePosix *PublishQueuePosix::_instance;
 
 static Logger _log("app.pubq");
 
+// CRC-32 (IEEE 802.3), continuing from crc
+static uint32_t _crc32(const void *data, size_t len, uint32_t crc = 0) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc ^= p[ii];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
 
 PublishQueuePosix &PublishQueuePosix::instance() {
     if (!_instance) {
@@ -53,10 +69,19 @@ void PublishQueuePosix::setup() {
     // Start the background publish thread
     BackgroundPublishRK::instance().start();
 
-    fileQueue.scanDir();
+    if (ringFile.isEnabled()) {
+        ringFile.load();
+    }
+    else {
+        fileQueue.scanDir();
+    }
 
     checkQueueLimits();
 
+    rateTokens = rateBurst;
+    rateRefillTime = millis();
+    pacingPeriod = rateInterval;
+
     stateHandler = &PublishQueuePosix::stateConnectWait;
 }
 
@@ -77,9 +102,9 @@ bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventDa
     WITH_LOCK(*this) {
         ramQueue.push_back(event);
 
-        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", fileQueue.getQueueLen(), ramQueue.size(), Particle.connected());
+        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", getFileQueueLen(), ramQueue.size(), Particle.connected());
 
-        if (fileQueue.getQueueLen() == 0 && (ramQueue.size() <= ramQueueSize) && Particle.connected()) {
+        if (getFileQueueLen() == 0 && (ramQueue.size() <= ramQueueSize) && Particle.connected()) {
             // No files in the disk-based queue, RAM-based queue is not full, and we are cloud connected
             // Leave the event in the RAM queue and return true
             _log.trace("queued to ramQueue");
@@ -125,6 +150,16 @@ void PublishQueuePosix::writeQueueToFiles() {
             PublishQueueEvent *event = ramQueue.front();
             ramQueue.pop_front();
 
+            if (ringFile.isEnabled()) {
+                int seq = ringFile.addEvent(event);
+
+                // This message is monitored by the automated test tool. If you edit this, change that too.
+                _log.trace("writeQueueToFiles fileNum=%d", seq);
+
+                delete event;
+                continue;
+            }
+
             int fileNum = fileQueue.reserveFile();
 
             int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
@@ -151,6 +186,10 @@ void PublishQueuePosix::writeQueueToFiles() {
 
 
 PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
+    if (ringFile.isEnabled()) {
+        return ringFile.readEvent(fileNum);
+    }
+
     PublishQueueEvent *result = NULL;
 
     int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDONLY);
@@ -195,6 +234,24 @@ PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
     return result;
 }
 
+int PublishQueuePosix::getFileQueueLen() const {
+    return ringFile.isEnabled() ? ringFile.getQueueLen() : fileQueue.getQueueLen();
+}
+
+int PublishQueuePosix::getFileQueueFront() {
+    return ringFile.isEnabled() ? ringFile.getFrontSeq() : fileQueue.getFileFromQueue(false);
+}
+
+void PublishQueuePosix::removeQueueFile(int fileNum) {
+    if (ringFile.isEnabled()) {
+        ringFile.removeEvent(fileNum);
+    }
+    else if (fileQueue.getFileFromQueue(false) == fileNum) {
+        fileQueue.getFileFromQueue(true);
+        fileQueue.removeFileNum(fileNum, false);
+    }
+}
+
 void PublishQueuePosix::clearQueues() {
     WITH_LOCK(*this) {
         while(!ramQueue.empty()) {
@@ -204,7 +261,12 @@ void PublishQueuePosix::clearQueues() {
             delete event;
         }
 
-        fileQueue.removeAll(true);
+        if (ringFile.isEnabled()) {
+            ringFile.removeAll();
+        }
+        else {
+            fileQueue.removeAll(true);
+        }
     }
 
     _log.trace("clearQueues");
@@ -230,10 +292,10 @@ void PublishQueuePosix::checkQueueLimits() {
             writeQueueToFiles();
         }
 
-        while(fileQueue.getQueueLen() > (int)fileQueueSize) {
-            int fileNum = fileQueue.getFileFromQueue(true);
+        while(getFileQueueLen() > (int)fileQueueSize) {
+            int fileNum = getFileQueueFront();
             if (fileNum) {
-                fileQueue.removeFileNum(fileNum, false);
+                removeQueueFile(fileNum);
                 _log.info("discarded event %d", fileNum);
             }
         }
@@ -246,7 +308,7 @@ size_t PublishQueuePosix::getNumEvents() {
     WITH_LOCK(*this) {
         result = ramQueue.size();
         if (result == 0) {
-            result = fileQueue.getQueueLen();
+            result = getFileQueueLen();
 
             if (curEvent && curFileNum == 0) {
                 // This happens when we are sending an event from the RAM queue
@@ -295,15 +357,20 @@ void PublishQueuePosix::stateWait() {
     if (millis() - stateTime < durationMs) {
         return;
     }
+
+    refillRateTokens();
+    if (rateBurst && rateTokens == 0 && getNumEvents() != 0) {
+        // Over the rate limit, wait for a token
+        return;
+    }
     
-    curFileNum = fileQueue.getFileFromQueue(false);
+    curFileNum = getFileQueueFront();
     if (curFileNum) {
         curEvent = readQueueFile(curFileNum);
         if (!curEvent) {
             // Probably a corrupted file, discard
             _log.info("discarding corrupted file %d", curFileNum);
-            fileQueue.getFileFromQueue(true);
-            fileQueue.removeFileNum(curFileNum, false);
+            removeQueueFile(curFileNum);
         }
     }
     else {
@@ -317,6 +384,9 @@ void PublishQueuePosix::stateWait() {
     }
 
     if (curEvent) {
+        if (rateTokens) {
+            rateTokens--;
+        }
         stateTime = millis();
         stateHandler = &PublishQueuePosix::statePublishWait;
         publishComplete = false;
@@ -347,26 +417,52 @@ void PublishQueuePosix::statePublishWait() {
         // Remove from the queue
         _log.trace("publish success %d", curFileNum);
 
+        // Average the ack latency, and space publishes more when it's high
+        unsigned long latency = millis() - stateTime;
+        ackLatency = ackLatency ? ((ackLatency * 3 + latency) / 4) : latency;
+        failureCount = 0;
+
+        durationMs = waitBetweenPublish;
+        if (ackLatency > ackLatencyThreshold) {
+            durationMs += (unsigned long)((ackLatency - ackLatencyThreshold) * ackLatencyFactor);
+        }
+        pacingPeriod = ackLatency + durationMs;
+        if (pacingPeriod < rateInterval) {
+            pacingPeriod = rateInterval;
+        }
+
         if (curFileNum) {
             // Was from the file-based queue
-            int fileNum = fileQueue.getFileFromQueue(false);
-            if (fileNum == curFileNum) {
-                fileQueue.getFileFromQueue(true);
-                fileQueue.removeFileNum(fileNum, false);
-                _log.trace("removed file %d", fileNum);
+            if (getFileQueueFront() == curFileNum) {
+                removeQueueFile(curFileNum);
+                _log.trace("removed file %d", curFileNum);
             }
             curFileNum = 0;
         }
 
         delete curEvent;
         curEvent = NULL;
-        durationMs = waitBetweenPublish;
     }
     else {
         // Wait and retry
         // This message is monitored by the automated test tool. If you edit this, change that too.
         _log.trace("publish failed %d", curFileNum);
+
+        // Exponential backoff with jitter
+        failureCount++;
         durationMs = waitAfterFailure;
+        for(int ii = 1; ii < failureCount && durationMs < maxWaitAfterFailure; ii++) {
+            durationMs *= 2;
+        }
+        if (durationMs > maxWaitAfterFailure) {
+            durationMs = maxWaitAfterFailure;
+        }
+        long jitter = (long)(durationMs / 100 * failureJitterPercent);
+        if (jitter > 0) {
+            durationMs = durationMs - jitter + random(2 * jitter + 1);
+        }
+        pacingPeriod = durationMs;
+        _log.trace("retry in %lu ms after %d failures", durationMs, failureCount);
 
         if (curFileNum) {
             // Was from the file-based queue
@@ -388,6 +484,27 @@ void PublishQueuePosix::statePublishWait() {
     stateTime = millis();
 }
 
+void PublishQueuePosix::refillRateTokens() {
+    unsigned long now = millis();
+    while(rateTokens < rateBurst && now - rateRefillTime >= rateInterval) {
+        rateTokens++;
+        rateRefillTime += rateInterval;
+    }
+    if (rateTokens >= rateBurst) {
+        rateRefillTime = now;
+    }
+}
+
+void PublishQueuePosix::consumeRateToken() {
+    refillRateTokens();
+    if (rateTokens) {
+        rateTokens--;
+    }
+    else {
+        // Already over the limit, so the next token is earned an interval from now
+        rateRefillTime = millis();
+    }
+}
 
 PublishQueuePosix::PublishQueuePosix() {
     fileQueue.withDirPath("/usr/pubqueue");
@@ -404,3 +521,263 @@ void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
     }
 }
 
+
+PublishQueueRingFile::~PublishQueueRingFile() {
+    if (fd != -1) {
+        close(fd);
+    }
+    delete[] buf;
+}
+
+bool PublishQueueRingFile::load() {
+    if (fd != -1) {
+        return true;
+    }
+    if (!buf) {
+        buf = new uint8_t[sizeof(PublishQueueRingRecord) + sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH];
+        if (!buf) {
+            return false;
+        }
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        _log.error("failed to open ring file %s", path.c_str());
+        return false;
+    }
+
+    dataSize = size - sizeof(PublishQueueRingHeader);
+    sizes.clear();
+
+    PublishQueueRingHeader hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != PublishQueuePosix::RING_MAGIC ||
+        hdr.version != PublishQueuePosix::FILE_VERSION ||
+        hdr.headerSize != sizeof(PublishQueueRingHeader) ||
+        hdr.nameLen != sizeof(PublishQueueEvent::eventName) ||
+        hdr.dataSize != dataSize ||
+        hdr.head >= dataSize ||
+        hdr.headSeq == 0 || hdr.headSeq > 0x7fffffff ||
+        hdr.crc != _crc32(&hdr, offsetof(PublishQueueRingHeader, crc))) {
+        // New file, or created with a different size. Reserve the space now so adding events
+        // never needs to allocate flash sectors.
+        _log.info("creating ring file %s size=%u", path.c_str(), (unsigned)size);
+
+        memset(buf, 0, 512);
+        lseek(fd, 0, SEEK_SET);
+        for(size_t offset = 0; offset < size; offset += 512) {
+            write(fd, buf, (size - offset < 512) ? (size - offset) : 512);
+        }
+
+        head = tail = 0;
+        wrapOffset = dataSize;
+        headSeq = tailSeq = 1;
+        writeHeader();
+        return true;
+    }
+
+    head = hdr.head;
+    headSeq = (int)hdr.headSeq;
+    wrapOffset = dataSize;
+
+    // Follow the records from the oldest. The first one that isn't the next sequence number was
+    // left from before the ring wrapped, unless the writer wrapped to the start of the file.
+    uint32_t pos = head;
+    uint32_t limit = dataSize;
+    int seq = headSeq;
+    bool wrapped = false;
+    while(true) {
+        size_t len = readRecord(pos, limit, seq);
+        if (!len && !wrapped && pos != 0) {
+            len = readRecord(0, head, seq);
+            if (len) {
+                wrapOffset = pos;
+                limit = head;
+                pos = 0;
+                wrapped = true;
+            }
+        }
+        if (!len) {
+            break;
+        }
+        sizes.push_back((uint16_t)len);
+        pos += len;
+        seq = nextSeq(seq);
+    }
+    tail = pos;
+    tailSeq = seq;
+
+    if (sizes.empty()) {
+        head = tail = 0;
+    }
+
+    _log.info("loaded ring file %s events=%d head=%lu tail=%lu", path.c_str(), getQueueLen(), (unsigned long)head, (unsigned long)tail);
+    return true;
+}
+
+int PublishQueueRingFile::addEvent(const PublishQueueEvent *event) {
+    if (fd == -1) {
+        return 0;
+    }
+
+    size_t eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+    size_t len = sizeof(PublishQueueRingRecord) + eventSize;
+    if (len > dataSize) {
+        return 0;
+    }
+
+    uint32_t pos;
+    while(!findSpace(len, pos)) {
+        _log.info("discarded event %d", headSeq);
+        removeEvent(headSeq);
+    }
+
+    // The record and the event are one write
+    PublishQueueRingRecord *rec = (PublishQueueRingRecord *)buf;
+    rec->seq = (uint32_t)tailSeq;
+    rec->size = (uint16_t)eventSize;
+    rec->reserved = 0;
+    memcpy(&buf[sizeof(PublishQueueRingRecord)], event, eventSize);
+    rec->crc = _crc32(&rec->size, sizeof(rec->size), _crc32(&rec->seq, sizeof(rec->seq)));
+    rec->crc = _crc32(&buf[sizeof(PublishQueueRingRecord)], eventSize, rec->crc);
+
+    lseek(fd, sizeof(PublishQueueRingHeader) + pos, SEEK_SET);
+    write(fd, buf, len);
+    fsync(fd);
+
+    if (sizes.empty()) {
+        head = pos;
+        headSeq = tailSeq;
+    }
+    sizes.push_back((uint16_t)len);
+    tail = pos + len;
+
+    int seq = tailSeq;
+    tailSeq = nextSeq(tailSeq);
+    return seq;
+}
+
+PublishQueueEvent *PublishQueueRingFile::readEvent(int seq) {
+    if (fd == -1 || sizes.empty() || seq != headSeq) {
+        return NULL;
+    }
+
+    size_t len = readRecord(head, head + sizes.front(), seq);
+    if (len != sizes.front()) {
+        _log.trace("readEvent %d corrupted record", seq);
+        return NULL;
+    }
+
+    size_t eventSize = len - sizeof(PublishQueueRingRecord);
+    PublishQueueEvent *result = (PublishQueueEvent *)new char[eventSize];
+    if (result) {
+        memcpy(result, &buf[sizeof(PublishQueueRingRecord)], eventSize);
+        _log.trace("readEvent %d event=%s data=%s", seq, result->eventName, result->eventData);
+    }
+    return result;
+}
+
+bool PublishQueueRingFile::removeEvent(int seq) {
+    if (fd == -1 || sizes.empty() || seq != headSeq) {
+        return false;
+    }
+
+    head += sizes.front();
+    sizes.pop_front();
+    headSeq = nextSeq(headSeq);
+
+    if (sizes.empty()) {
+        head = tail = 0;
+        wrapOffset = dataSize;
+    }
+    else if (head >= wrapOffset) {
+        // The next record was written at the start of the file
+        head = 0;
+        wrapOffset = dataSize;
+    }
+    writeHeader();
+    return true;
+}
+
+void PublishQueueRingFile::removeAll() {
+    if (fd == -1) {
+        return;
+    }
+    sizes.clear();
+    head = tail = 0;
+    wrapOffset = dataSize;
+    headSeq = tailSeq;
+    writeHeader();
+}
+
+bool PublishQueueRingFile::findSpace(size_t len, uint32_t &pos) {
+    if (sizes.empty()) {
+        pos = 0;
+        return true;
+    }
+    if (tail > head) {
+        // Records from head to tail, free space after tail and before head
+        if (tail + len <= dataSize) {
+            pos = tail;
+            return true;
+        }
+        if (len <= head) {
+            wrapOffset = tail;
+            pos = 0;
+            return true;
+        }
+        return false;
+    }
+    else {
+        // Records from head to wrapOffset and from the start of the file to tail
+        if (tail + len <= head) {
+            pos = tail;
+            return true;
+        }
+        return false;
+    }
+}
+
+size_t PublishQueueRingFile::readRecord(uint32_t pos, uint32_t limit, int seq) {
+    if (pos + sizeof(PublishQueueRingRecord) + sizeof(PublishQueueEvent) > limit) {
+        return 0;
+    }
+
+    // Read as much as the largest event in one read, then check the part that's the record
+    size_t len = limit - pos;
+    if (len > sizeof(PublishQueueRingRecord) + sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        len = sizeof(PublishQueueRingRecord) + sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH;
+    }
+    lseek(fd, sizeof(PublishQueueRingHeader) + pos, SEEK_SET);
+    if (read(fd, buf, len) != (int)len) {
+        return 0;
+    }
+
+    PublishQueueRingRecord *rec = (PublishQueueRingRecord *)buf;
+    if (rec->seq != (uint32_t)seq || rec->size < sizeof(PublishQueueEvent) || sizeof(PublishQueueRingRecord) + rec->size > len) {
+        return 0;
+    }
+
+    uint32_t crc = _crc32(&rec->size, sizeof(rec->size), _crc32(&rec->seq, sizeof(rec->seq)));
+    crc = _crc32(&buf[sizeof(PublishQueueRingRecord)], rec->size, crc);
+    if (crc != rec->crc || buf[sizeof(PublishQueueRingRecord) + rec->size - 1] != 0) {
+        return 0;
+    }
+    return sizeof(PublishQueueRingRecord) + rec->size;
+}
+
+void PublishQueueRingFile::writeHeader() {
+    PublishQueueRingHeader hdr;
+    hdr.magic = PublishQueuePosix::RING_MAGIC;
+    hdr.version = PublishQueuePosix::FILE_VERSION;
+    hdr.headerSize = sizeof(PublishQueueRingHeader);
+    hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+    hdr.dataSize = dataSize;
+    hdr.head = head;
+    hdr.headSeq = (uint32_t)headSeq;
+    hdr.crc = _crc32(&hdr, offsetof(PublishQueueRingHeader, crc));
+
+    lseek(fd, 0, SEEK_SET);
+    write(fd, &hdr, sizeof(hdr));
+    fsync(fd);
+}
@@ -40,6 +40,148 @@ struct PublishQueueEvent {
     char eventData[1]; //!< Variable size event data
 };
 
+/**
+ * @brief Structure stored at the beginning of the ring file, see PublishQueuePosix::withRingFile()
+ * 
+ * The rest of the file is records, each a PublishQueueRingRecord followed by a PublishQueueEvent.
+ * Only the oldest record is stored here; the newest is found when the file is opened by following 
+ * the records from the oldest one while the sequence numbers and CRCs match.
+ */
+struct PublishQueueRingHeader {
+    uint32_t magic;         //!< PublishQueuePosix::RING_MAGIC = 0x31b67664
+    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 1
+    uint8_t headerSize;     //!< sizeof(PublishQueueRingHeader) = 24
+    uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 64
+    uint32_t dataSize;      //!< Bytes for records after the header
+    uint32_t head;          //!< Offset of the oldest record, from the end of the header
+    uint32_t headSeq;       //!< Sequence number of the oldest record
+    uint32_t crc;           //!< CRC-32 of the fields above
+};
+
+/**
+ * @brief Structure stored before each event in the ring file
+ */
+struct PublishQueueRingRecord {
+    uint32_t seq;           //!< Sequence number, one more than the previous record
+    uint32_t crc;           //!< CRC-32 of seq, size, and the event
+    uint16_t size;          //!< Size of the PublishQueueEvent that follows
+    uint16_t reserved;      //!< 0
+};
+
+/**
+ * @brief Event queue in a single preallocated circular file, see PublishQueuePosix::withRingFile()
+ * 
+ * Events are identified by sequence number, which is used in place of the file number of
+ * the SequentialFile queue. The sizes of the queued records are kept in RAM, so adding
+ * an event is one write, reading the oldest is one read, and removing it is one write of
+ * the header.
+ */
+class PublishQueueRingFile {
+public:
+    /**
+     * @brief Closes the file if it was opened by load()
+     */
+    virtual ~PublishQueueRingFile();
+
+    /**
+     * @brief Sets the path to the ring file
+     */
+    PublishQueueRingFile &withPath(const char *path) { this->path = path; return *this; };
+
+    /**
+     * @brief Sets the size of the ring file in bytes, including the header. 0 disables it.
+     */
+    PublishQueueRingFile &withSize(size_t size) { this->size = size; return *this; };
+
+    /**
+     * @brief Returns true if a size has been set
+     */
+    bool isEnabled() const { return size > sizeof(PublishQueueRingHeader); };
+
+    /**
+     * @brief Opens the ring file and finds the queued events, creating it if necessary
+     * 
+     * If the file is not valid or was created with a different size, it's cleared.
+     */
+    bool load();
+
+    /**
+     * @brief Adds an event, discarding the oldest events if there isn't room
+     * 
+     * @return The sequence number of the event, or 0 if it could not be written
+     */
+    int addEvent(const PublishQueueEvent *event);
+
+    /**
+     * @brief Gets the sequence number of the oldest event, or 0 if there are none
+     */
+    int getFrontSeq() const { return sizes.empty() ? 0 : headSeq; };
+
+    /**
+     * @brief Reads the oldest event if its sequence number is seq
+     * 
+     * May return NULL if the record is corrupted, or out of memory.
+     * 
+     * You must delete the result from this method when you are done using it. 
+     */
+    PublishQueueEvent *readEvent(int seq);
+
+    /**
+     * @brief Removes the oldest event if its sequence number is seq
+     * 
+     * @return true if the event was removed
+     */
+    bool removeEvent(int seq);
+
+    /**
+     * @brief Removes all events
+     */
+    void removeAll();
+
+    /**
+     * @brief Gets the number of events in the queue
+     */
+    int getQueueLen() const { return (int)sizes.size(); };
+
+protected:
+    /**
+     * @brief Finds where to write a record of len bytes, updating wrapOffset if it goes at the start
+     * 
+     * @return false if there isn't room until older records are removed
+     */
+    bool findSpace(size_t len, uint32_t &pos);
+
+    /**
+     * @brief Reads the record at pos into buf and checks its sequence number and CRC
+     * 
+     * @return The size of the record including the PublishQueueRingRecord, or 0 if it's not valid
+     */
+    size_t readRecord(uint32_t pos, uint32_t limit, int seq);
+
+    /**
+     * @brief Writes the header with the current head and headSeq
+     */
+    void writeHeader();
+
+    /**
+     * @brief Returns the sequence number after seq
+     */
+    static int nextSeq(int seq) { return (seq < 0x7fffffff) ? (seq + 1) : 1; };
+
+    String path; //!< Path to the ring file
+    size_t size = 0; //!< Size of the ring file, including the header
+    uint32_t dataSize = 0; //!< Size of the ring file after the header
+    int fd = -1; //!< File descriptor, open from load()
+    uint8_t *buf = nullptr; //!< Buffer for one record, allocated by load()
+
+    uint32_t head = 0; //!< Offset of the oldest record
+    uint32_t tail = 0; //!< Offset to write the next record
+    uint32_t wrapOffset = 0; //!< End of the records before the ones at the start of the file, dataSize if not wrapped
+    int headSeq = 1; //!< Sequence number of the oldest record
+    int tailSeq = 1; //!< Sequence number of the next record written
+    std::deque<uint16_t> sizes; //!< Size of each record, oldest first
+};
+
 /**
  * @brief Class for asynchronous publishing of events
  * 
@@ -112,6 +254,104 @@ public:
      */
     const char *getDirPath() const { return fileQueue.getDirPath(); };
 
+    /**
+     * @brief Stores the file queue in a single circular file instead of one file per event
+     * 
+     * @param path The pathname of the file, for example "/usr/pubqueue.dat". The directory must exist.
+     * 
+     * @param size The size of the file in bytes. It's written when created so the space is reserved.
+     * 
+     * Each event takes 12 bytes plus the size of a PublishQueueEvent with its data. When there isn't 
+     * room for a new event, the oldest events are discarded. withFileQueueSize() still limits the 
+     * number of events. The directory set with withDirPath() is not used.
+     * 
+     * Writing an event is one write, instead of creating a file, and removing one after it's 
+     * published is one write to the header at the start of the file, instead of deleting a file.
+     * At setup() the records are followed from the oldest one instead of scanning a directory.
+     */
+    PublishQueuePosix &withRingFile(const char *path, size_t size) { ringFile.withPath(path).withSize(size); return *this; };
+
+    /**
+     * @brief Sets how long to wait after connecting to the cloud before publishing (default 2000)
+     * 
+     * @param ms Time in milliseconds
+     */
+    PublishQueuePosix &withWaitAfterConnect(unsigned long ms) { waitAfterConnect = ms; return *this; };
+
+    /**
+     * @brief Sets the minimum time to wait after a successful publish before the next one (default 0)
+     * 
+     * @param ms Time in milliseconds
+     * 
+     * Publishes are also paced by withRateLimit() and withAckLatencySpacing(), so this is normally 0.
+     */
+    PublishQueuePosix &withWaitBetweenPublish(unsigned long ms) { waitBetweenPublish = ms; return *this; };
+
+    /**
+     * @brief Sets the publish rate limit (default a burst of 4, then one every 1000 milliseconds)
+     * 
+     * @param burst The number of publishes that can be made at once after not publishing for a while
+     * 
+     * @param intervalMs Milliseconds to earn another publish, up to burst
+     * 
+     * The default matches the Particle cloud limit, so a backlog of events is sent as fast as the
+     * cloud accepts them, instead of failing publishes over the limit and waiting after the failure.
+     * A burst of 0 disables the limit.
+     */
+    PublishQueuePosix &withRateLimit(size_t burst, unsigned long intervalMs) { rateBurst = burst; rateInterval = intervalMs; return *this; };
+
+    /**
+     * @brief Sets how long to wait after failed publishes (default 5000 doubling to 300000, +/- 25%)
+     * 
+     * @param minMs Milliseconds to wait after a publish fails
+     * 
+     * @param maxMs The wait doubles with each failure in a row, up to this
+     * 
+     * @param jitterPercent The wait is randomly up to this percent longer or shorter, so devices 
+     * that fail at the same time don't retry at the same time
+     */
+    PublishQueuePosix &withFailureBackoff(unsigned long minMs, unsigned long maxMs, int jitterPercent = 25) { 
+        waitAfterFailure = minMs; 
+        maxWaitAfterFailure = maxMs; 
+        failureJitterPercent = jitterPercent; 
+        return *this; 
+    };
+
+    /**
+     * @brief Adds time between publishes when the cloud is slow to acknowledge them (default 5000, 1.0)
+     * 
+     * @param thresholdMs When the average time from publish to acknowledgement is more than this...
+     * 
+     * @param factor ...wait this much times the difference after each publish
+     * 
+     * Only one publish is in progress at a time, so the publish rate already goes down as
+     * acknowledgements take longer. This slows it down more when the connection is congested, 
+     * leaving room for other traffic. A factor of 0 disables it.
+     */
+    PublishQueuePosix &withAckLatencySpacing(unsigned long thresholdMs, float factor = 1.0) { ackLatencyThreshold = thresholdMs; ackLatencyFactor = factor; return *this; };
+
+    /**
+     * @brief Gets the publish rate the queue is currently pacing to, in publishes per second
+     * 
+     * This is limited by withRateLimit(), the time for publishes to be acknowledged, and 
+     * withAckLatencySpacing(). After a publish fails, it's the rate of retries.
+     */
+    float getPublishRate() const { return pacingPeriod ? (1000.0 / pacingPeriod) : 0.0; };
+
+    /**
+     * @brief Gets the average time from publish to acknowledgement in milliseconds (0 if none yet)
+     */
+    unsigned long getAckLatency() const { return ackLatency; };
+
+    /**
+     * @brief Counts a publish made without the queue against the rate limit
+     * 
+     * Call this when publishing directly with Particle.publish or BackgroundPublishRK, so the
+     * queue doesn't start a burst of its own right after those publishes and go over the cloud
+     * rate limit. SleepHelper::withPublishQueuePosixRK() does this for the SleepHelper publishes.
+     */
+    void consumeRateToken();
+
     /**
      * @brief You must call this from setup() to initialize this library
      */
@@ -290,6 +530,11 @@ public:
      */
     static const uint8_t FILE_VERSION = 1;
 
+    /**
+     * @brief Magic bytes stored at the beginning of the ring file, see withRingFile()
+     */
+    static const uint32_t RING_MAGIC = 0x31b67664;
+
 protected:
     /**
      * @brief Constructor 
@@ -331,7 +576,7 @@ protected:
     /**
      * @brief Read an event from a sequentially numbered file 
      * 
-     * @param fileNum The file number to read 
+     * @param fileNum The file number to read, or sequence number if using withRingFile()
      * 
      * May return NULL if file does not exist, or out of memory.
      * 
@@ -339,6 +584,23 @@ protected:
      */
     PublishQueueEvent *readQueueFile(int fileNum);
 
+    /**
+     * @brief Gets the number of events in the file queue or ring file
+     */
+    int getFileQueueLen() const;
+
+    /**
+     * @brief Gets the file number of the oldest event in the file queue, or sequence number in the ring file
+     * 
+     * Returns 0 if there are no events.
+     */
+    int getFileQueueFront();
+
+    /**
+     * @brief Removes the oldest event from the file queue or ring file, if it's fileNum
+     */
+    void removeQueueFile(int fileNum);
+
     /**
      * @brief Callback for BackgroundPublishRK library
      */
@@ -368,11 +630,20 @@ protected:
      */
     void statePublishWait();
 
+    /**
+     * @brief Adds rate limit tokens for the time since they were last added, up to rateBurst
+     */
+    void refillRateTokens();
+
     /**
      * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
      */
     SequentialFile fileQueue;
 
+    /**
+     * @brief Used instead of fileQueue if withRingFile() is called
+     */
+    PublishQueueRingFile ringFile;
 
     size_t ramQueueSize = 2; //!< size of the queue in RAM
     size_t fileQueueSize = 100; //!< size of the queue on the flash file system
@@ -381,7 +652,7 @@ protected:
     std::deque<PublishQueueEvent*> ramQueue; //!< Queue in RAM
 
     PublishQueueEvent *curEvent = 0; //!< Current event being published
-    int curFileNum = 0; //!< Current file number being published (0 if from RAM queue)
+    int curFileNum = 0; //!< Current file number or ring file sequence number being published (0 if from RAM queue)
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
     bool publishComplete = false; //!< true if the publish has completed (successfully or not)
@@ -390,8 +661,21 @@ protected:
     bool canSleep = false; //!< returns true if this is a good time to go to sleep
 
     unsigned long waitAfterConnect = 2000; //!< time to wait after Particle.connected() before publishing
-    unsigned long waitBetweenPublish = 1000; //!< how long to wait in milliseconds between publishes
-    unsigned long waitAfterFailure = 30000; //!< how long to wait after failing to publish before trying again
+    unsigned long waitBetweenPublish = 0; //!< minimum time to wait in milliseconds between publishes
+    unsigned long waitAfterFailure = 5000; //!< how long to wait after failing to publish before trying again
+    unsigned long maxWaitAfterFailure = 300000; //!< waitAfterFailure doubles after each failure up to this
+    int failureJitterPercent = 25; //!< random percentage to add to or subtract from the wait after failure
+    int failureCount = 0; //!< number of failed publishes since the last one that succeeded
+
+    size_t rateBurst = 4; //!< maximum number of rate limit tokens
+    unsigned long rateInterval = 1000; //!< milliseconds to earn a rate limit token
+    size_t rateTokens = 0; //!< publishes that can be made now, set to rateBurst in setup()
+    unsigned long rateRefillTime = 0; //!< millis() value when a rate limit token was last added
+
+    unsigned long ackLatencyThreshold = 5000; //!< average ack latency above which to add time between publishes
+    float ackLatencyFactor = 1.0; //!< multiplied by the ack latency over ackLatencyThreshold
+    unsigned long ackLatency = 0; //!< average time from publish to acknowledgement in milliseconds
+    unsigned long pacingPeriod = 1000; //!< milliseconds per publish at the current pace, see getPublishRate()
 
     std::function<void(PublishQueuePosix&)> stateHandler = 0; //!< state handler (stateConnectWait, stateWait, etc).
 
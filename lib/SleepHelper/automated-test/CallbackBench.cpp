@@ -0,0 +1,165 @@
+#include "Particle.h"
+#include "SleepHelper.h"
+
+#include <chrono>
+#include <cstdlib>
+
+// Compares SleepHelper::AppCallback (inline AppFunction storage in a fixed array) with the previous
+// implementation (std::vector<std::function>), which is reproduced below as VectorAppCallback.
+//
+// Usage: ./CallbackBench [iterations]
+//
+// For each, it reports the object size, heap bytes and allocations to add 4 callbacks, and the time
+// per callback for forEach() and whileAnyTrue(). Host timings are only useful for comparing the two;
+// on the device, avoiding the heap matters more than dispatch time.
+//
+// It also reports sizeof(SleepHelper), which includes every callback array, and the size it would
+// be with a std::vector for each of them instead.
+
+// Heap accounting for everything allocated with new (std::vector, std::function)
+static size_t heapBytes = 0;
+static size_t heapAllocs = 0;
+
+void *operator new(size_t size) {
+    heapBytes += size;
+    heapAllocs++;
+    void *p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// The previous AppCallback implementation
+template<class... Types>
+class VectorAppCallback {
+public:
+    void add(std::function<bool(Types... args)> callback) {
+        callbackFunctions.push_back(callback);
+    }
+
+    void forEach(Types... args) {
+        for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
+            (*it)(args...);
+        }
+    }
+
+    bool whileAnyTrue(bool defaultResult, Types... args) {
+        bool finalRes = defaultResult;
+
+        for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
+            bool res = (*it)(args...);
+            if (res) {
+                finalRes = true;
+            }
+        }
+        return finalRes;
+    }
+
+    std::vector<std::function<bool(Types... args)>> callbackFunctions;
+};
+
+static const int NUM_CALLBACKS = 4;
+
+// Callback members of SleepHelper (see SleepHelper.h): AppCallback, including ShouldConnectAppCallback
+// and the one in SettingsFile, AppCallbackWithState, which had two vectors, and the arrays in the
+// EventCombiner wakeEventFunctions
+static const size_t NUM_APP_CALLBACK = 10;
+static const size_t NUM_APP_CALLBACK_WITH_STATE = 3;
+static const size_t NUM_EVENT_COMBINER = 1;
+
+static void reportSleepHelperSize() {
+    size_t arrayBytes = NUM_APP_CALLBACK * sizeof(SleepHelper::AppCallback<int>)
+        + NUM_APP_CALLBACK_WITH_STATE * sizeof(SleepHelper::AppCallbackWithState<int>)
+        + NUM_EVENT_COMBINER * SleepHelper::EventCombiner::getCallbackArraySize();
+
+    size_t numVectors = NUM_APP_CALLBACK + 2 * NUM_APP_CALLBACK_WITH_STATE
+        + NUM_EVENT_COMBINER * SleepHelper::EventCombiner::CALLBACK_ARRAY_COUNT;
+    size_t vectorBytes = numVectors * sizeof(std::vector<std::function<bool(int)>>);
+
+    printf("sizeof(SleepHelper) %lu bytes, %lu in callback arrays; with std::vector %lu bytes (%lu vectors, callbacks on the heap)\n",
+        (unsigned long)sizeof(SleepHelper), (unsigned long)arrayBytes,
+        (unsigned long)(sizeof(SleepHelper) - arrayBytes + vectorBytes), (unsigned long)numVectors);
+}
+
+// Captures a pointer, like most SleepHelper callbacks ([this])
+template<class T>
+static void addSmall(T &callbacks, int *counter) {
+    for(int ii = 0; ii < NUM_CALLBACKS; ii++) {
+        callbacks.add([counter](int value) {
+            *counter += value;
+            return false;
+        });
+    }
+}
+
+// Captures a pointer and three values (24 bytes), more than std::function stores without allocating
+template<class T>
+static void addLarge(T &callbacks, int *counter) {
+    for(int ii = 0; ii < NUM_CALLBACKS; ii++) {
+        int a = ii, b = ii * 2;
+        int64_t c = ii * 3;
+        callbacks.add([counter, a, b, c](int value) {
+            *counter += value + a + b + (int)c;
+            return false;
+        });
+    }
+}
+
+template<class T>
+static void bench(const char *name, void (*addFn)(T &, int *), long iterations) {
+    int counter = 0;
+
+    size_t startBytes = heapBytes;
+    size_t startAllocs = heapAllocs;
+    T *callbacks = new T();
+    size_t objBytes = heapBytes - startBytes;
+    addFn(*callbacks, &counter);
+    size_t addBytes = heapBytes - startBytes - objBytes;
+    size_t addAllocs = heapAllocs - startAllocs - 1;
+
+    auto start = std::chrono::steady_clock::now();
+    for(long ii = 0; ii < iterations; ii++) {
+        callbacks->forEach((int)(ii & 1));
+    }
+    auto mid = std::chrono::steady_clock::now();
+    bool any = false;
+    for(long ii = 0; ii < iterations; ii++) {
+        any |= callbacks->whileAnyTrue(false, (int)(ii & 1));
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double calls = (double)iterations * NUM_CALLBACKS;
+    double forEachNs = std::chrono::duration<double, std::nano>(mid - start).count() / calls;
+    double whileNs = std::chrono::duration<double, std::nano>(end - mid).count() / calls;
+
+    printf("%-28s sizeof %4lu  heap %4lu bytes in %2lu allocs  forEach %5.2f ns  whileAnyTrue %5.2f ns  (%d%s)\n",
+        name, (unsigned long)objBytes, (unsigned long)addBytes, (unsigned long)addAllocs, forEachNs, whileNs, counter & 0xff, any ? "!" : "");
+
+    delete callbacks;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 20000000;
+
+    Logger::minimumLevel() = LOG_LEVEL_NONE;
+
+    printf("%d callbacks, %ld iterations, SLEEPHELPER_CALLBACK_STORAGE %lu, SLEEPHELPER_CALLBACK_CAPACITY %d, SLEEPHELPER_EVENT_CALLBACK_CAPACITY %d, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY %d\n",
+        NUM_CALLBACKS, iterations, (unsigned long)SLEEPHELPER_CALLBACK_STORAGE, SLEEPHELPER_CALLBACK_CAPACITY, SLEEPHELPER_EVENT_CALLBACK_CAPACITY, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY);
+    reportSleepHelperSize();
+
+    bench<VectorAppCallback<int>>("vector<function> small", addSmall<VectorAppCallback<int>>, iterations);
+    bench<SleepHelper::AppCallback<int>>("AppCallback small", addSmall<SleepHelper::AppCallback<int>>, iterations);
+    bench<VectorAppCallback<int>>("vector<function> 24 bytes", addLarge<VectorAppCallback<int>>, iterations);
+    bench<SleepHelper::AppCallback<int>>("AppCallback 24 bytes", addLarge<SleepHelper::AppCallback<int>>, iterations);
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "Particle.h"
+#include "SleepHelper.h"
+
+#include <chrono>
+#include <cstdlib>
+
+// Measures the heap use and time of SleepHelper::EventCombiner::generateEvents() for a wake with many
+// callbacks, some of them one-time callbacks added from prepareEvents() (the SleepHelper wake event
+// and sleep event use both).
+//
+// Usage: ./EventBench [iterations]
+//
+// The Makefile builds it with SLEEPHELPER_EVENT_CALLBACK_CAPACITY=16 for the 12 callbacks; the default
+// SLEEPHELPER_EVENT_ONE_TIME_CAPACITY (16) has room for the 8 one-time callbacks.
+// Allocations are counted by wrapping malloc, realloc, and calloc (see LDFLAGS in the Makefile), which
+// includes operator new below and the String objects for the generated events. Each generated event
+// is one String, so there are at least that many allocations per generateEvents().
+
+static size_t heapBytes = 0;
+static size_t heapAllocs = 0;
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__real_calloc(size_t count, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    heapBytes += size;
+    heapAllocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    heapBytes += size;
+    heapAllocs++;
+    return __real_realloc(p, size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    heapBytes += count * size;
+    heapAllocs++;
+    return __real_calloc(count, size);
+}
+}
+
+void *operator new(size_t size) {
+    void *p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+static const int NUM_CALLBACKS = 12;
+static const int NUM_ONE_TIME = 8;
+
+// Each callback has its own keys, like the wake event data from several subsystems. A callback that
+// repeats a key from a higher priority callback is left out entirely.
+static void addCallbacks(SleepHelper::EventCombiner &combiner) {
+    for(int ii = 0; ii < NUM_CALLBACKS; ii++) {
+        combiner.withCallback([ii](JSONWriter &writer, int &priority) {
+            char name[16];
+            snprintf(name, sizeof(name), "k%d", ii);
+            writer.name(name).value(ii * 1000 + 123);
+            snprintf(name, sizeof(name), "v%d", ii);
+            writer.name(name).value((double)ii + 0.25, 2);
+            if (ii % 3 == 0) {
+                snprintf(name, sizeof(name), "s%d", ii);
+                writer.name(name).value("running with a slightly longer string value");
+            }
+            priority = 10 + (ii * 7) % 80;
+            return true;
+        });
+    }
+}
+
+static void addOneTimeCallbacks(SleepHelper::EventCombiner &combiner) {
+    for(int ii = 0; ii < NUM_ONE_TIME; ii++) {
+        combiner.withOneTimeCallback([ii](JSONWriter &writer, int &priority) {
+            char name[16];
+            snprintf(name, sizeof(name), "o%d", ii);
+            writer.name(name).beginObject();
+            writer.name("a").value(ii);
+            writer.name("b").value("one time");
+            writer.endObject();
+            priority = 50 + ii;
+            return true;
+        }, (uint64_t)(ii + 1));
+    }
+}
+
+static void bench(const char *name, bool prepare, size_t maxSize, long iterations) {
+    SleepHelper::EventCombiner combiner;
+    addCallbacks(combiner);
+
+    std::vector<String> events;
+    size_t numEvents = 0;
+    size_t totalSize = 0;
+
+    // Once to size the scratch buffer, arena, and events vector
+    addOneTimeCallbacks(combiner);
+    if (prepare) {
+        combiner.prepareEvents(maxSize);
+    }
+    combiner.generateEvents(events, maxSize);
+
+    size_t startBytes = heapBytes;
+    size_t startAllocs = heapAllocs;
+    auto start = std::chrono::steady_clock::now();
+    for(long ii = 0; ii < iterations; ii++) {
+        addOneTimeCallbacks(combiner);
+        if (prepare) {
+            combiner.prepareEvents(maxSize);
+        }
+        combiner.generateEvents(events, maxSize);
+        numEvents += events.size();
+        for(auto it = events.begin(); it != events.end(); ++it) {
+            totalSize += it->length();
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double us = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+
+    printf("%-24s %5.2f events of %4lu bytes  heap %6.1f bytes in %5.1f allocs  %7.2f us  arena blocks %lu\n",
+        name, (double)numEvents / iterations, (unsigned long)(totalSize / (numEvents ? numEvents : 1)),
+        (double)(heapBytes - startBytes) / iterations, (double)(heapAllocs - startAllocs) / iterations, us,
+        (unsigned long)combiner.getArenaBlockCount());
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 100000;
+
+    Logger::minimumLevel() = LOG_LEVEL_NONE;
+
+    printf("%d callbacks, %d one-time callbacks, %ld iterations, SLEEPHELPER_EVENT_CALLBACK_CAPACITY %d, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY %d\n",
+        NUM_CALLBACKS, NUM_ONE_TIME, iterations, SLEEPHELPER_EVENT_CALLBACK_CAPACITY, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY);
+
+    bench("generate 1024", false, 1024, iterations);
+    bench("prepare+generate 1024", true, 1024, iterations);
+    bench("generate 622", false, 622, iterations);
+    bench("prepare+generate 256", true, 256, iterations);
+
+    return 0;
+}
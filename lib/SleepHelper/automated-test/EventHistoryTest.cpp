@@ -0,0 +1,717 @@
+#include "Particle.h"
+#include "SleepHelper.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Tests for SleepHelper::EventHistory: segment files, the saved read position, and recovery after
+// a simulated reset (deleting the EventHistory and creating a new one with the same path), ranges
+// removed out of order as publishes are acknowledged, and the binary record codec.
+// testColumnar() writes the columnar blocks it reads, and the samples they should decode to, for
+// make test to check with tools/columnar-decode.js.
+// Each test starts with an empty testdata directory. Any failure prints the line and stops with
+// an assertion, so the exit status is non-zero. The Makefile runs it as part of make test.
+
+static const char *testDir = "testdata";
+static const char *eventsPath = "testdata/events.txt";
+
+#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
+void _assertInt(const char *msg, int got, int expected, int line) {
+    if (expected != got) {
+        printf("assertion failed %s line %d\n", msg, line);
+        printf("expected: %d\n", expected);
+        printf("     got: %d\n", got);
+        fflush(stdout);
+        assert(false);
+    }
+}
+
+#define assertStr(msg, got, expected) _assertStr(msg, got, expected, __LINE__)
+void _assertStr(const char *msg, const char *got, const char *expected, int line) {
+    if (strcmp(expected, got) != 0) {
+        printf("assertion failed %s line %d\n", msg, line);
+        printf("expected: %s\n", expected);
+        printf("     got: %s\n", got);
+        fflush(stdout);
+        assert(false);
+    }
+}
+
+// Checks that values is exactly first, first + 1, ... last: nothing missing, repeated, or out of order
+#define assertSequence(msg, values, first, last) _assertSequence(msg, values, first, last, __LINE__)
+void _assertSequence(const char *msg, const std::vector<int> &values, int first, int last, int line) {
+    _assertInt(msg, (int)values.size(), last - first + 1, line);
+    for(size_t ii = 0; ii < values.size(); ii++) {
+        _assertInt(msg, values[ii], first + (int)ii, line);
+    }
+}
+
+static void clearTestDir() {
+    mkdir(testDir, 0777);
+    DIR *dir = opendir(testDir);
+    if (dir) {
+        struct dirent *ent;
+        while((ent = readdir(dir)) != NULL) {
+            if (ent->d_type == DT_REG) {
+                unlink(String(testDir) + "/" + ent->d_name);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+static bool fileExists(const char *path) {
+    struct stat sb;
+    return stat(path, &sb) == 0;
+}
+
+// Number of segment files (events.txt.1, events.txt.2, ...)
+static int countSegments() {
+    int count = 0;
+    DIR *dir = opendir(testDir);
+    if (dir) {
+        struct dirent *ent;
+        while((ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, "events.txt.", 11) == 0 && isdigit(ent->d_name[11])) {
+                count++;
+            }
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+static void addNumbered(SleepHelper::EventHistory &history, int first, int last) {
+    for(int ii = first; ii <= last; ii++) {
+        history.addEvent(String::format("{\"n\":%d}", ii));
+    }
+}
+
+// Returns the array written by one getEvents() call, or an empty string if there were no events
+static String getEvents(SleepHelper::EventHistory &history, size_t maxSize, bool removeEvents) {
+    char buf[4096];
+    SleepHelper::JSONSpliceWriter writer(buf, sizeof(buf) - 1);
+    if (!history.getEvents(writer, maxSize, removeEvents)) {
+        return "";
+    }
+    buf[std::min(writer.dataSize(), sizeof(buf) - 1)] = 0;
+    return buf;
+}
+
+// Appends the value of every "n" key in json to values
+static void appendNumbers(const char *json, std::vector<int> &values) {
+    for(const char *cur = strstr(json, "\"n\":"); cur; cur = strstr(cur + 4, "\"n\":")) {
+        values.push_back(atoi(cur + 4));
+    }
+}
+
+// Gets and removes events maxSize bytes at a time until there are none left
+static std::vector<int> readAll(SleepHelper::EventHistory &history, size_t maxSize) {
+    std::vector<int> values;
+    while(true) {
+        String json = getEvents(history, maxSize, true);
+        if (json.length() <= 2) {
+            // No events, or the next one is larger than maxSize
+            break;
+        }
+        appendNumbers(json, values);
+    }
+    return values;
+}
+
+void testSegments() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+
+    addNumbered(*history, 0, 29);
+    assertInt("events are split into segments", countSegments() > 1, true);
+
+    std::vector<int> values = readAll(*history, 40);
+    assertSequence("events read across segments", values, 0, 29);
+    assertInt("segments deleted once read", countSegments(), 0);
+    assertInt("no events left", history->getHasEvents(), false);
+
+    // Adding after everything was removed starts a new segment
+    addNumbered(*history, 30, 34);
+    values = readAll(*history, 40);
+    assertSequence("events added after removing all", values, 30, 34);
+
+    delete history;
+}
+
+void testCursorRecovery() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 29);
+
+    // Remove some events, spanning more than one segment, then reset
+    std::vector<int> values;
+    appendNumbers(getEvents(*history, 100, true), values);
+    int removed = (int)values.size();
+    assertInt("first read spans segments", removed > 7, true);
+    assertInt("first segment deleted", fileExists(String(eventsPath) + ".1"), false);
+    assertInt("read position saved", fileExists(String(eventsPath) + ".cur"), true);
+    delete history;
+
+    // Continues after the removed events, including in the middle of a segment
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    assertInt("has events after reset", history->getHasEvents(), true);
+    values.clear();
+    appendNumbers(getEvents(*history, 40, true), values);
+    assertInt("continues after removed events", values.front(), removed);
+    removed += (int)values.size();
+    delete history;
+
+    // Reset between getEvents() and removeEvents(): the events are read again
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    values.clear();
+    appendNumbers(getEvents(*history, 40, false), values);
+    assertInt("read without removing", values.front(), removed);
+    delete history;
+
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 30, 34);
+    values = readAll(*history, 40);
+    assertSequence("events not removed are sent again", values, removed, 34);
+    delete history;
+}
+
+void testLostCursor() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 29);
+    std::vector<int> values;
+    appendNumbers(getEvents(*history, 100, true), values);
+    int removed = (int)values.size();
+    delete history;
+
+    // Without path.cur, the oldest remaining segment is read from the start: events may be sent
+    // again, but none are lost
+    unlink(String(eventsPath) + ".cur");
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    values = readAll(*history, 40);
+    assertInt("resends from segment start", values.front() <= removed, true);
+    assertSequence("no events lost", values, values.front(), 29);
+    delete history;
+
+    // A cursor with a bad magic number is ignored the same way
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 9);
+    values.clear();
+    appendNumbers(getEvents(*history, 40, true), values);
+    delete history;
+
+    int fd = open(String(eventsPath) + ".cur", O_RDWR);
+    uint32_t magic = 0;
+    write(fd, &magic, sizeof(magic));
+    close(fd);
+
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    values = readAll(*history, 40);
+    assertSequence("bad cursor ignored", values, values.front(), 9);
+    assertInt("bad cursor resends from segment start", values.front() <= 4, true);
+    delete history;
+}
+
+void testSingleFile() {
+    clearTestDir();
+
+    // The event history from before segments were used becomes the first segment
+    FILE *fp = fopen(eventsPath, "w");
+    for(int ii = 0; ii < 5; ii++) {
+        fprintf(fp, "{\"n\":%d}\n", ii);
+    }
+    fclose(fp);
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath);
+    addNumbered(*history, 5, 9);
+    std::vector<int> values = readAll(*history, 40);
+    assertSequence("single file converted", values, 0, 9);
+    assertInt("single file renamed", fileExists(eventsPath), false);
+    delete history;
+}
+
+void testStaleTempFile() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 9);
+    delete history;
+
+    // A reset while compacting leaves path.N.tmp, for a segment that exists or one already removed
+    String tempPath = String(eventsPath) + ".1.tmp";
+    String oldTempPath = String(eventsPath) + ".0.tmp";
+    FILE *fp = fopen(tempPath, "w");
+    fprintf(fp, "{\"n\":100}\n");
+    fclose(fp);
+    fp = fopen(oldTempPath, "w");
+    fclose(fp);
+
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    assertInt("has events", history->getHasEvents(), true);
+    assertInt("temp file removed", fileExists(tempPath), false);
+    assertInt("old temp file removed", fileExists(oldTempPath), false);
+    assertSequence("segments unchanged", readAll(*history, 40), 0, 9);
+    delete history;
+}
+
+// Gets count ranges of events without removing them, like EventCombiner does for each publish
+static void getRanges(SleepHelper::EventHistory &history, size_t count, size_t maxSize, std::vector<SleepHelper::EventHistory::Range> &ranges, std::vector<std::vector<int>> &rangeValues) {
+    for(size_t ii = 0; ii < count; ii++) {
+        SleepHelper::EventHistory::Range range;
+        std::vector<int> values;
+        range.start = history.getCursor();
+        appendNumbers(getEvents(history, maxSize, false), values);
+        range.end = history.getCursor();
+        ranges.push_back(range);
+        rangeValues.push_back(values);
+    }
+}
+
+// The values from first to last, without the ones in the ranges in removed
+static std::vector<int> withoutRanges(int first, int last, const std::vector<std::vector<int>> &rangeValues, const std::vector<size_t> &removed) {
+    std::vector<int> result;
+    for(int value = first; value <= last; value++) {
+        bool found = false;
+        for(size_t index : removed) {
+            found |= std::find(rangeValues[index].begin(), rangeValues[index].end(), value) != rangeValues[index].end();
+        }
+        if (!found) {
+            result.push_back(value);
+        }
+    }
+    return result;
+}
+
+#define assertValues(msg, got, expected) _assertValues(msg, got, expected, __LINE__)
+void _assertValues(const char *msg, const std::vector<int> &got, const std::vector<int> &expected, int line) {
+    _assertInt(msg, (int)got.size(), (int)expected.size(), line);
+    for(size_t ii = 0; ii < got.size(); ii++) {
+        _assertInt(msg, got[ii], expected[ii], line);
+    }
+}
+
+void testRangesOutOfOrder() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 39);
+
+    std::vector<SleepHelper::EventHistory::Range> ranges;
+    std::vector<std::vector<int>> rangeValues;
+    getRanges(*history, 10, 24, ranges, rangeValues);
+
+    // Acknowledged out of order, with events before them not acknowledged yet
+    std::vector<size_t> removed = { 3, 1, 7, 5 };
+    for(size_t index : removed) {
+        history->removeEvents(ranges[index]);
+    }
+
+    // Not acknowledged before the reset, so sent again, skipping the ranges already removed
+    delete history;
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    assertValues("ranges removed out of order", readAll(*history, 24), withoutRanges(0, 39, rangeValues, removed));
+    delete history;
+
+    // Removing the events in front of a range absorbs it
+    clearTestDir();
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 39);
+    ranges.clear();
+    rangeValues.clear();
+    getRanges(*history, 6, 24, ranges, rangeValues);
+    history->removeEvents(ranges[2]);
+    history->removeEvents(ranges[4]);
+    history->removeEvents(ranges[1]);
+    history->removeEvents(ranges[0]);
+    delete history;
+
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    assertValues("absorbed ranges", readAll(*history, 24), withoutRanges(0, 39, rangeValues, { 0, 1, 2, 4 }));
+    assertInt("all segments removed", countSegments(), 0);
+    delete history;
+}
+
+void testRangesReset() {
+    clearTestDir();
+
+    // Reset between publish and acknowledgement: nothing was removed, so everything is sent again
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 19);
+    std::vector<SleepHelper::EventHistory::Range> ranges;
+    std::vector<std::vector<int>> rangeValues;
+    getRanges(*history, 3, 24, ranges, rangeValues);
+    delete history;
+
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    ranges.clear();
+    rangeValues.clear();
+    getRanges(*history, 3, 24, ranges, rangeValues);
+    assertInt("sent again after reset", rangeValues[0].front(), 0);
+
+    // Acknowledged after the reset, and new events added while waiting
+    history->removeEvents(ranges[1]);
+    addNumbered(*history, 20, 24);
+    history->removeEvents(ranges[0]);
+
+    // The range that was not acknowledged is sent again, followed by the new events
+    history->rewindEvents();
+    assertValues("acknowledged after reset", readAll(*history, 24), withoutRanges(0, 24, rangeValues, { 0, 1 }));
+    delete history;
+}
+
+void testRangesMax() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    addNumbered(*history, 0, 59);
+
+    // One event per range, and every other range is acknowledged, so none of them can be combined
+    size_t count = SleepHelper::EventHistory::REMOVED_RANGES_MAX + 3;
+    std::vector<SleepHelper::EventHistory::Range> ranges;
+    std::vector<std::vector<int>> rangeValues;
+    getRanges(*history, 2 * count, 12, ranges, rangeValues);
+    for(size_t ii = 0; ii < count; ii++) {
+        history->removeEvents(ranges[2 * ii + 1]);
+    }
+    delete history;
+
+    // The ranges over the maximum are sent again, but nothing is lost or sent twice
+    std::vector<size_t> removed;
+    for(size_t ii = 0; ii < SleepHelper::EventHistory::REMOVED_RANGES_MAX; ii++) {
+        removed.push_back(2 * ii + 1);
+    }
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(64);
+    assertValues("more than REMOVED_RANGES_MAX ranges", readAll(*history, 12), withoutRanges(0, 59, rangeValues, removed));
+    delete history;
+}
+
+// Schema for the record tests, like the SleepSim data capture events plus a bool
+static SleepHelper::EventHistory::RecordSchema testSchema() {
+    return SleepHelper::EventHistory::RecordSchema()
+        .withTime("t")
+        .withInt("bs")
+        .withFixed("c", 1)
+        .withBool("ok");
+}
+
+static SleepHelper::EventHistory *newRecordHistory(size_t segmentSize) {
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withSegmentSize(segmentSize).withRecordSchema(testSchema());
+    return history;
+}
+
+// Events added, and the same events as published: records have their keys in schema order and
+// values with the number of decimal places in the schema. Events that can't be stored exactly as
+// a record are kept as JSON.
+static const char *recordEvents[][2] = {
+    { "{\"t\":1656633600,\"bs\":4,\"c\":21.5,\"ok\":true}", "{\"t\":1656633600,\"bs\":4,\"c\":21.5,\"ok\":true}" },
+    { "{\"t\":1656633900,\"bs\":-3,\"c\":-0.5,\"ok\":false}", "{\"t\":1656633900,\"bs\":-3,\"c\":-0.5,\"ok\":false}" },
+    { "{\"c\":-12.3,\"ok\":true,\"bs\":2147483647,\"t\":1656634200}", "{\"t\":1656634200,\"bs\":2147483647,\"c\":-12.3,\"ok\":true}" },
+    { "{\"t\":1656630000,\"bs\":-2147483648,\"c\":0,\"ok\":false}", "{\"t\":1656630000,\"bs\":-2147483648,\"c\":0.0,\"ok\":false}" },
+    { "{\"t\":1656634500,\"bs\":1,\"c\":21.55,\"ok\":true}", "{\"t\":1656634500,\"bs\":1,\"c\":21.55,\"ok\":true}" },
+    { "{\"t\":1656634800,\"bs\":4294967296,\"c\":1.0,\"ok\":true}", "{\"t\":1656634800,\"bs\":4294967296,\"c\":1.0,\"ok\":true}" },
+    { "{\"alarm\":1}", "{\"alarm\":1}" },
+    { "{\"t\":1656635100,\"bs\":4,\"c\":21.5}", "{\"t\":1656635100,\"bs\":4,\"c\":21.5}" },
+    { "{\"t\":1656635400,\"bs\":5,\"c\":-99999.9,\"ok\":true}", "{\"t\":1656635400,\"bs\":5,\"c\":-99999.9,\"ok\":true}" },
+    { "{\"t\":4294967295,\"bs\":0,\"c\":0.1,\"ok\":true}", "{\"t\":4294967295,\"bs\":0,\"c\":0.1,\"ok\":true}" },
+};
+static const size_t numRecordEvents = sizeof(recordEvents) / sizeof(recordEvents[0]);
+
+// Gets and removes events maxSize bytes at a time, returning the contents of the arrays joined with commas
+static String readAllJSON(SleepHelper::EventHistory &history, size_t maxSize) {
+    String result;
+    while(true) {
+        String json = getEvents(history, maxSize, true);
+        if (json.length() < 2) {
+            break;
+        }
+        if (result.length()) {
+            result += ",";
+        }
+        result += json.substring(1, json.length() - 1);
+    }
+    return result;
+}
+
+static String expectedRecordJSON() {
+    String result;
+    for(size_t ii = 0; ii < numRecordEvents; ii++) {
+        if (ii) {
+            result += ",";
+        }
+        result += recordEvents[ii][1];
+    }
+    return result;
+}
+
+void testRecords() {
+    clearTestDir();
+
+    // Events 4 - 7 don't fit the schema. The others are records of at most 3 + 5 + 5 + 5 + 1 bytes.
+    SleepHelper::EventHistory *history = newRecordHistory(4096);
+    size_t maxSize = 0;
+    for(size_t ii = 0; ii < numRecordEvents; ii++) {
+        history->addEvent(recordEvents[ii][0]);
+        maxSize += (ii >= 4 && ii <= 7) ? strlen(recordEvents[ii][0]) + 1 : 19;
+    }
+
+    struct stat sb;
+    stat(String(eventsPath) + ".1", &sb);
+    assertInt("events that fit the schema are records", (int)sb.st_size <= (int)maxSize, true);
+
+    assertStr("records round trip", readAllJSON(*history, 1024), expectedRecordJSON());
+    delete history;
+}
+
+void testRecordSegments() {
+    clearTestDir();
+
+    // Small segments, so records start in many segments and the read position is often in the
+    // middle of delta-coded times when the device resets
+    SleepHelper::EventHistory *history = newRecordHistory(24);
+    for(size_t ii = 0; ii < numRecordEvents; ii++) {
+        history->addEvent(recordEvents[ii][0]);
+    }
+
+    String result;
+    while(true) {
+        String json = getEvents(*history, 60, true);
+        if (json.length() < 2) {
+            break;
+        }
+        if (result.length()) {
+            result += ",";
+        }
+        result += json.substring(1, json.length() - 1);
+
+        delete history;
+        history = newRecordHistory(24);
+    }
+    assertStr("records across segments and resets", result, expectedRecordJSON());
+    delete history;
+
+    // A reset between adding records continues with an absolute time
+    clearTestDir();
+    history = newRecordHistory(4096);
+    history->addEvent(recordEvents[0][0]);
+    delete history;
+    history = newRecordHistory(4096);
+    history->addEvent(recordEvents[1][0]);
+    String expected = String(recordEvents[0][1]) + "," + recordEvents[1][1];
+    assertStr("records added after reset", readAllJSON(*history, 1024), expected);
+    delete history;
+}
+
+void testRecordSchemaId() {
+    clearTestDir();
+
+    // Records from a schema with a different identifier are skipped; JSON events are not
+    SleepHelper::EventHistory *history = newRecordHistory(4096);
+    history->addEvent(recordEvents[0][0]);
+    history->addEvent("{\"alarm\":1}");
+    history->addEvent(recordEvents[1][0]);
+    delete history;
+
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withRecordSchema(testSchema().withSchemaId(2));
+    assertStr("other schema skipped", readAllJSON(*history, 1024), "{\"alarm\":1}");
+    delete history;
+}
+
+void testRecordSchemaFieldsMax() {
+    // An event with a time and numFields - 1 integers, and a schema for it
+    auto makeEvent = [](size_t numFields) {
+        String json = "{\"t\":1656633600";
+        for(size_t ii = 1; ii < numFields; ii++) {
+            json += String::format(",\"f%u\":%u", (unsigned)ii, (unsigned)ii);
+        }
+        return json + "}";
+    };
+    auto makeSchema = [](size_t numFields, bool columnar) {
+        SleepHelper::EventHistory::RecordSchema schema;
+        schema.withTime("t").withColumnar(columnar);
+        for(size_t ii = 1; ii < numFields; ii++) {
+            schema.withInt(String::format("f%u", (unsigned)ii));
+        }
+        return schema;
+    };
+    const size_t fieldsMax = SleepHelper::EventHistory::RecordSchema::FIELDS_MAX;
+    struct stat sb;
+
+    // FIELDS_MAX fields is a record, both as JSON objects and columnar blocks
+    for(int columnar = 0; columnar < 2; columnar++) {
+        clearTestDir();
+        String event = makeEvent(fieldsMax);
+        SleepHelper::EventHistory::RecordSchema schema = makeSchema(fieldsMax, columnar);
+        assertInt("FIELDS_MAX fields not empty", schema.isEmpty(), false);
+        SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+        history->withPath(eventsPath).withRecordSchema(schema);
+        history->addEvent(event);
+        history->addEvent(event);
+        stat(String(eventsPath) + ".1", &sb);
+        assertInt("FIELDS_MAX fields is a record", (int)sb.st_size < (int)event.length(), true);
+        if (!columnar) {
+            assertStr("FIELDS_MAX fields round trip", readAllJSON(*history, 1024), event + "," + event);
+        }
+        delete history;
+    }
+
+    // One more rejects the whole schema, and a fixed field after the limit doesn't change the last one
+    SleepHelper::EventHistory::RecordSchema schema = makeSchema(fieldsMax + 1, false);
+    assertInt("more than FIELDS_MAX fields is empty", schema.isEmpty(), true);
+    assertInt("more than FIELDS_MAX fields not added", (int)schema.fields.size(), (int)fieldsMax);
+    schema.withFixed("c", 2);
+    assertInt("fixed field after FIELDS_MAX", (int)schema.fields.back().decimals, 0);
+
+    clearTestDir();
+    String event = makeEvent(fieldsMax);
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withRecordSchema(schema);
+    history->addEvent(event);
+    stat(String(eventsPath) + ".1", &sb);
+    assertInt("rejected schema stores JSON", (int)sb.st_size, (int)event.length() + 1);
+    assertStr("rejected schema round trip", readAllJSON(*history, 1024), event);
+    delete history;
+}
+
+void testOldCursor() {
+    clearTestDir();
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath);
+    addNumbered(*history, 0, 9);
+    std::vector<int> values;
+    appendNumbers(getEvents(*history, 20, true), values);
+    int removed = (int)values.size();
+    delete history;
+
+    // Cursors saved before records were added have no lastTime
+    truncate(String(eventsPath) + ".cur", 12);
+    history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath);
+    values = readAll(*history, 40);
+    assertSequence("12-byte cursor", values, removed, 9);
+    delete history;
+}
+
+// A sample for testColumnar(): the event to add, and the same event as printed by columnar-decode.js
+static void addSample(SleepHelper::EventHistory &history, FILE *expected, uint32_t t, int bs, int c10, bool ok) {
+    history.addEvent(String::format("{\"t\":%lu,\"bs\":%d,\"c\":%.1f,\"ok\":%s}", (unsigned long)t, bs, (double)c10 / 10.0, ok ? "true" : "false"));
+
+    // JavaScript prints whole numbers without a decimal point
+    String c = (c10 % 10 == 0) ? String::format("%d", c10 / 10) : String::format("%.1f", (double)c10 / 10.0);
+    fprintf(expected, "{\"t\":%lu,\"bs\":%d,\"c\":%s,\"ok\":%s}\n", (unsigned long)t, bs, c.c_str(), ok ? "true" : "false");
+}
+
+static void addJSON(SleepHelper::EventHistory &history, FILE *expected, const char *json) {
+    history.addEvent(json);
+    fprintf(expected, "%s\n", json);
+}
+
+void testColumnar() {
+    clearTestDir();
+
+    // Run last: the files are left in testdata for make test
+    FILE *blocks = fopen(String(testDir) + "/columnar-blocks.txt", "w");
+    FILE *expected = fopen(String(testDir) + "/columnar-expected.txt", "w");
+
+    SleepHelper::EventHistory *history = new SleepHelper::EventHistory();
+    history->withPath(eventsPath).withRecordSchema(testSchema().withColumnar());
+
+    // Single-sample blocks between JSON events
+    addSample(*history, expected, 1656633600, 4, 215, true);
+    addJSON(*history, expected, "{\"alarm\":1}");
+    addSample(*history, expected, 1656633900, 4, 215, true);
+    addJSON(*history, expected, "{\"alarm\":2}");
+
+    // Negative fixed values, crossing zero
+    uint32_t t = 1656634200;
+    const int fixedValues[] = { -5, -123, 0, 1, -1, 32767, -32768, -999999, 999999, -5 };
+    for(int c10 : fixedValues) {
+        addSample(*history, expected, t, -3, c10, false);
+        t += 300;
+    }
+
+    // Differences that need the 36-bit code: int32 limits, and a large jump in time and back
+    addSample(*history, expected, t, 2147483647, 0, true);
+    addSample(*history, expected, t + 300, -2147483648, 0, true);
+    addSample(*history, expected, t + 600, 0, 0, true);
+    addSample(*history, expected, t + 100000000, 0, 0, false);
+    addSample(*history, expected, t + 900, 0, 0, true);
+    addSample(*history, expected, 4294967295, 1, 1, true);
+    addSample(*history, expected, 0, -1, -1, false);
+    t += 1200;
+
+    // More samples than fit in one event, so blocks are ended by encoder.undo()
+    for(int ii = 0; ii < 300; ii++) {
+        addSample(*history, expected, t, (ii * 37) % 101 - 50, (ii * 7919) % 2001 - 1000, (ii % 3) == 0);
+        t += 300 + (ii % 5);
+    }
+
+    int blockLines = 0;
+    bool singleSample = false;
+    while(true) {
+        String json = getEvents(*history, 120, true);
+        if (json.length() <= 2) {
+            break;
+        }
+        fprintf(blocks, "{\"eh\":%s}\n", json.c_str());
+        singleSample |= (json.indexOf("\"n\":1,") >= 0);
+        blockLines++;
+    }
+    assertInt("single-sample blocks", singleSample, true);
+    assertInt("blocks split across events", blockLines > 10, true);
+    assertInt("all read", history->getHasEvents(), false);
+    delete history;
+
+    fclose(blocks);
+    fclose(expected);
+}
+
+int main(int argc, char *argv[]) {
+    Logger::minimumLevel() = LOG_LEVEL_NONE;
+
+    testSegments();
+    testCursorRecovery();
+    testLostCursor();
+    testSingleFile();
+    testStaleTempFile();
+    testRangesOutOfOrder();
+    testRangesReset();
+    testRangesMax();
+    testRecords();
+    testRecordSegments();
+    testRecordSchemaId();
+    testRecordSchemaFieldsMax();
+    testOldCursor();
+
+    // Must be last, see testColumnar()
+    testColumnar();
+
+    printf("EventHistoryTest passed\n");
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include "Particle.h"
+#include "SleepHelper.h"
+
+#include <functional>
+#include <random>
+
+// Tests for SleepHelper::ScheduleCache: every cached lookup is compared with calling
+// LocalTimeScheduleManager::getNextWake, getNextFullWake, and getNextDataCapture directly, across
+// daylight saving time changes, schedule edits, and timezone changes (withTimeConfig).
+// Any failure prints the line and stops with an assertion, so the exit status is non-zero. The
+// Makefile runs it as part of make test.
+
+static const char *whichNames[SleepHelper::ScheduleCache::COUNT] = { "next wake", "next full wake", "next data capture" };
+
+static std::mt19937 rng(1);
+
+#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
+void _assertInt(const char *msg, int got, int expected, int line) {
+    if (expected != got) {
+        printf("assertion failed %s line %d\n", msg, line);
+        printf("expected: %d\n", expected);
+        printf("     got: %d\n", got);
+        fflush(stdout);
+        assert(false);
+    }
+}
+
+// Compares the cached and uncached values at time t
+static time_t compareAt(const char *msg, time_t t, int line) {
+    SleepHelper &sleepHelper = SleepHelper::instance();
+
+    LocalTimeConvert conv;
+    conv.withTime(t).convert();
+
+    time_t nextWake = 0;
+    for(size_t which = 0; which < SleepHelper::ScheduleCache::COUNT; which++) {
+        time_t expected = 0;
+        switch(which) {
+            case SleepHelper::ScheduleCache::NEXT_WAKE:
+                expected = sleepHelper.scheduleManager.getNextWake(conv);
+                nextWake = expected;
+                break;
+
+            case SleepHelper::ScheduleCache::NEXT_FULL_WAKE:
+                expected = sleepHelper.scheduleManager.getNextFullWake(conv);
+                break;
+
+            case SleepHelper::ScheduleCache::NEXT_DATA_CAPTURE:
+                expected = sleepHelper.scheduleManager.getNextDataCapture(conv);
+                break;
+        }
+        time_t got = sleepHelper.scheduleCache.getNextTime(sleepHelper.scheduleManager, which, conv);
+        if (got != expected) {
+            printf("%s from %s\n", whichNames[which], LocalTime::timeToString(t).c_str());
+        }
+        _assertInt(msg, (int)got, (int)expected, line);
+    }
+    return nextWake;
+}
+
+// Fills the cache at time t, makes a change that affects the values at t, and checks that the
+// cache returns the new values there
+#define changeAt(msg, t, change) _changeAt(msg, t, change, __LINE__)
+static void _changeAt(const char *msg, time_t t, std::function<void()> change, int line) {
+    SleepHelper &sleepHelper = SleepHelper::instance();
+
+    compareAt(msg, t, line);
+    LocalTimeConvert beforeConv;
+    beforeConv.withTime(t).convert();
+    time_t before[3] = { sleepHelper.scheduleManager.getNextWake(beforeConv), sleepHelper.scheduleManager.getNextFullWake(beforeConv), sleepHelper.scheduleManager.getNextDataCapture(beforeConv) };
+
+    change();
+
+    // A new LocalTimeConvert, so it uses the timezone after the change
+    LocalTimeConvert afterConv;
+    afterConv.withTime(t).convert();
+    time_t after[3] = { sleepHelper.scheduleManager.getNextWake(afterConv), sleepHelper.scheduleManager.getNextFullWake(afterConv), sleepHelper.scheduleManager.getNextDataCapture(afterConv) };
+    _assertInt(msg, memcmp(before, after, sizeof(before)) != 0, 1, line);
+
+    compareAt(msg, t, line);
+}
+
+// Steps from start to end the way SleepHelper does: usually to the next wake, sometimes a little
+// later (a slow wake or a button press), or back (a coalesced data capture), and compares every
+// lookup. Returns the number of times the cache was used, so the test can check it was exercised.
+#define walk(msg, start, end) _walk(msg, start, end, __LINE__)
+static uint32_t _walk(const char *msg, time_t start, time_t end, int line) {
+    SleepHelper::ScheduleCache &cache = SleepHelper::instance().scheduleCache;
+    uint32_t startHits = cache.getHitCount();
+
+    time_t t = start;
+    while(t < end) {
+        time_t nextWake = compareAt(msg, t, line);
+
+        int step = (int)(rng() % 10);
+        if (step < 6 && nextWake > t) {
+            t = nextWake;
+        }
+        else
+        if (step < 8) {
+            t += 1 + (time_t)(rng() % 600);
+        }
+        else
+        if (step < 9) {
+            t -= 1 + (time_t)(rng() % 300);
+        }
+        else {
+            t++;
+        }
+    }
+    return cache.getHitCount() - startHits;
+}
+
+static void configure(const char *tzConfig) {
+    SleepHelper::instance().scheduleManager.forEach([](LocalTimeSchedule &schedule) {
+        schedule.clear();
+    });
+    SleepHelper::instance().withTimeConfig(tzConfig);
+
+    // Set by SleepHelper::setup()
+    SleepHelper::instance().getScheduleQuick().withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
+    SleepHelper::instance().getScheduleDataCapture().withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
+    SleepHelper::instance().getScheduleFull().withFlags(LocalTimeSchedule::FLAG_FULL_WAKE);
+
+    // Same schedules as SleepSim (the SleepHelper-Demo configuration)
+    SleepHelper::instance().getScheduleFull()
+        .withMinuteOfHour(15, LocalTimeRange(LocalTimeHMS("09:00:00"), LocalTimeHMS("21:59:59"), LocalTimeRestrictedDate(LocalTimeDayOfWeek::MASK_WEEKDAY)))
+        .withHourOfDay(2);
+    SleepHelper::instance().getScheduleDataCapture()
+        .withMinuteOfHour(5);
+}
+
+void testDst() {
+    configure("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00");
+
+    // Spring forward: 2022-03-13, 02:00 EST becomes 03:00 EDT
+    uint32_t hits = walk("spring forward", LocalTime::stringToTime("2022-03-12 00:00:00"), LocalTime::stringToTime("2022-03-15 00:00:00"));
+    assertInt("spring forward hits", hits > 0, 1);
+
+    // Fall back: 2022-11-06, 02:00 EDT becomes 01:00 EST, so 01:00 to 02:00 happens twice
+    hits = walk("fall back", LocalTime::stringToTime("2022-11-05 00:00:00"), LocalTime::stringToTime("2022-11-08 00:00:00"));
+    assertInt("fall back hits", hits > 0, 1);
+
+    // Starting in the repeated hour
+    walk("fall back repeated hour", LocalTime::stringToTime("2022-11-06 05:30:00"), LocalTime::stringToTime("2022-11-06 07:30:00"));
+}
+
+void testScheduleEdit() {
+    configure("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00");
+
+    // Friday 09:02 EDT
+    time_t t = LocalTime::stringToTime("2022-07-01 13:02:00");
+    time_t start = LocalTime::stringToTime("2022-07-01 00:00:00");
+    time_t end = LocalTime::stringToTime("2022-07-04 00:00:00");
+    walk("before edit", start, end);
+
+    changeAt("data capture interval", t, []() {
+        SleepHelper::instance().getScheduleDataCapture().clear();
+        SleepHelper::instance().getScheduleDataCapture().withMinuteOfHour(10);
+    });
+    walk("data capture interval", start, end);
+
+    changeAt("full wake days", t, []() {
+        SleepHelper::instance().getScheduleFull().clear();
+        SleepHelper::instance().getScheduleFull()
+            .withMinuteOfHour(15, LocalTimeRange(LocalTimeHMS("09:00:00"), LocalTimeHMS("21:59:59"), LocalTimeRestrictedDate(LocalTimeDayOfWeek::MASK_WEEKEND)))
+            .withHourOfDay(2);
+    });
+    walk("full wake days", start, end);
+
+    // Saturday 09:02 EDT
+    changeAt("full wake time range", t + 86400, []() {
+        SleepHelper::instance().getScheduleFull().clear();
+        SleepHelper::instance().getScheduleFull()
+            .withMinuteOfHour(15, LocalTimeRange(LocalTimeHMS("10:00:00"), LocalTimeHMS("21:59:59"), LocalTimeRestrictedDate(LocalTimeDayOfWeek::MASK_WEEKEND)))
+            .withHourOfDay(2);
+    });
+    walk("full wake time range", start, end);
+
+    changeAt("quick wake added", t, []() {
+        // withMinuteOfHour requires a value that 60 is divisible by
+        SleepHelper::instance().getScheduleQuick().withMinuteOfHour(6);
+    });
+    walk("quick wake added", start, end);
+
+    // No data capture schedule, so its cached value is 0
+    changeAt("data capture removed", t, []() {
+        SleepHelper::instance().getScheduleDataCapture().clear();
+    });
+    walk("data capture removed", start, end);
+}
+
+void testTimeConfig() {
+    configure("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00");
+
+    // One full wake a day, so it's at a different UTC time in each timezone
+    SleepHelper::instance().getScheduleFull().clear();
+    SleepHelper::instance().getScheduleFull().withTime(LocalTimeHMS("12:00:00"));
+
+    time_t t = LocalTime::stringToTime("2022-04-02 13:02:00");
+    time_t start = LocalTime::stringToTime("2022-04-01 00:00:00");
+    time_t end = LocalTime::stringToTime("2022-04-05 00:00:00");
+    walk("EST5EDT", start, end);
+
+    // Only the daylight saving time offset is different
+    changeAt("EST5EDT3", t, []() {
+        SleepHelper::instance().withTimeConfig("EST5EDT3,M3.2.0/02:00:00,M11.1.0/02:00:00");
+    });
+    walk("EST5EDT3", start, end);
+
+    // Only the daylight saving time start is different
+    changeAt("EST5EDT M3.5.0", t, []() {
+        SleepHelper::instance().withTimeConfig("EST5EDT,M3.5.0/02:00:00,M11.1.0/02:00:00");
+    });
+    walk("EST5EDT M3.5.0", start, end);
+
+    changeAt("PST8PDT", t, []() {
+        SleepHelper::instance().withTimeConfig("PST8PDT,M3.2.0/2:00:00,M11.1.0/2:00:00");
+    });
+    walk("PST8PDT", start, end);
+
+    // Half hour offset, and daylight saving time ends on 2022-04-03
+    changeAt("ACST-9:30ACDT", t, []() {
+        SleepHelper::instance().withTimeConfig("ACST-9:30ACDT,M10.1.0/02:00:00,M4.1.0/03:00:00");
+    });
+    walk("ACST-9:30ACDT", start, end);
+
+    changeAt("UTC", t, []() {
+        SleepHelper::instance().withTimeConfig("UTC");
+    });
+    walk("UTC", start, end);
+
+    changeAt("EST6EDT4", t, []() {
+        SleepHelper::instance().withTimeConfig("EST6EDT4,M3.2.0/02:00:00,M11.1.0/02:00:00");
+    });
+
+    // Only the standard time offset is different, on a winter day
+    changeAt("EST5EDT4", LocalTime::stringToTime("2022-01-14 13:02:00"), []() {
+        SleepHelper::instance().withTimeConfig("EST5EDT4,M3.2.0/02:00:00,M11.1.0/02:00:00");
+    });
+
+    // Only the daylight saving time start is different, between the two start dates
+    changeAt("EST5EDT4 M3.4.0", LocalTime::stringToTime("2022-03-18 13:02:00"), []() {
+        SleepHelper::instance().withTimeConfig("EST5EDT4,M3.4.0/02:00:00,M11.1.0/02:00:00");
+    });
+    walk("EST5EDT4 M3.4.0", LocalTime::stringToTime("2022-03-12 00:00:00"), LocalTime::stringToTime("2022-03-30 00:00:00"));
+}
+
+int main(int argc, char *argv[]) {
+    Logger::minimumLevel() = LOG_LEVEL_NONE;
+
+    testDst();
+    testScheduleEdit();
+    testTimeConfig();
+
+    printf("ScheduleCacheTest passed\n");
+    return 0;
+}
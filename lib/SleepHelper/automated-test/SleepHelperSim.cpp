@@ -0,0 +1,567 @@
+#include "SleepHelperSim.h"
+#include <cmath>
+#include <cstdarg>
+
+SystemClass System;
+CloudClass Particle;
+CellularClass Cellular;
+
+SleepHelperSim *SleepHelperSim::_instance;
+
+//
+// File system operation counts. The Makefile links with --wrap=open,--wrap=write so these
+// see the calls made by SleepHelper, which would be flash file system operations on the device.
+//
+extern "C" int __real_open(const char *path, int flags, ...);
+extern "C" ssize_t __real_write(int fd, const void *buf, size_t count);
+
+extern "C" int __wrap_open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    SleepHelperSim::instance().fileOpen();
+    return __real_open(path, flags, mode);
+}
+
+extern "C" ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    if (fd > 2) {
+        SleepHelperSim::instance().fileWrite(count);
+    }
+    return __real_write(fd, buf, count);
+}
+
+//
+// Virtual clock. These replace the weak versions in UnitTestLib.
+//
+uint32_t millis() {
+    return (uint32_t) SleepHelperSim::instance().getSystemMillis();
+}
+
+time32_t TimeClass::now() {
+    if (SleepHelperSim::instance().getTimeValid()) {
+        return (time32_t) SleepHelperSim::instance().getTime();
+    }
+    else {
+        // RTC not set yet; like a device it counts up from 0
+        return (time32_t) (SleepHelperSim::instance().getSystemMillis() / 1000);
+    }
+}
+
+bool TimeClass::isValid() {
+    return SleepHelperSim::instance().getTimeValid();
+}
+
+//
+// Semaphore
+//
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial) {
+    *semaphore = new unsigned(initial);
+    return 0;
+}
+
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved) {
+    return SleepHelperSim::instance().semaphoreTake((unsigned *)semaphore, timeout);
+}
+
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved) {
+    (*(unsigned *)semaphore)++;
+    return 0;
+}
+
+//
+// System
+//
+uint64_t SystemClass::millis() const {
+    return SleepHelperSim::instance().getSystemMillis();
+}
+
+bool SystemClass::on(system_event_t events, system_event_handler_t *handler) {
+    SleepHelperSim::instance().eventHandler = handler;
+    return true;
+}
+
+SystemSleepResult SystemClass::sleep(const SystemSleepConfiguration &config) {
+    return SleepHelperSim::instance().sleep(config);
+}
+
+float SystemClass::batteryCharge() const {
+    return SleepHelperSim::instance().getBatteryCharge();
+}
+
+//
+// Particle
+//
+particle::Future<bool> CloudClass::publish(const char *name, const char *data, PublishFlags flags) {
+    return SleepHelperSim::instance().publishFuture(name, data, flags);
+}
+
+void CloudClass::connect() {
+    SleepHelperSim::instance().cloudConnect();
+}
+
+int CloudClass::maxEventDataSize() const {
+    return SleepHelperSim::instance().getMaxEventDataSize();
+}
+
+bool CloudClass::connected() const {
+    return SleepHelperSim::instance().cloudConnected;
+}
+
+void CloudClass::disconnect(const CloudDisconnectOptions &options) {
+    SleepHelperSim::instance().cloudDisconnect();
+}
+
+//
+// Cellular
+//
+bool NetworkClass::ready() const {
+    return SleepHelperSim::instance().networkReady;
+}
+
+void NetworkClass::disconnect() {
+    SleepHelperSim::instance().networkDisconnect();
+}
+
+void NetworkClass::off() {
+    SleepHelperSim::instance().networkOff();
+}
+
+bool NetworkClass::isOff() const {
+    return !SleepHelperSim::instance().networkOn;
+}
+
+//
+// BackgroundPublishRK
+//
+// [static]
+BackgroundPublishRK &BackgroundPublishRK::instance() {
+    static BackgroundPublishRK backgroundPublish;
+    return backgroundPublish;
+}
+
+bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context) {
+    return SleepHelperSim::instance().publish(name, data, flags, cb, context);
+}
+
+//
+// SleepHelperSim
+//
+
+// [static]
+SleepHelperSim &SleepHelperSim::instance() {
+    if (!_instance) {
+        _instance = new SleepHelperSim();
+    }
+    return *_instance;
+}
+
+void SleepHelperSim::advance(uint64_t ms) {
+    consume(ms, networkOn ? modemMa : awakeMa);
+    nowMs += ms;
+
+    if (networkReadyAt && nowMs >= networkReadyAt) {
+        networkReadyAt = 0;
+        networkReady = true;
+        systemEvent(network_status, network_status_connected);
+    }
+    if (cloudConnectAt && nowMs >= cloudConnectAt) {
+        cloudConnectAt = 0;
+        cloudConnected = true;
+        timeValid = true;
+        if (!cycle.connectMs) {
+            cycle.connectMs = nowMs - connectStartMs;
+        }
+        systemEvent(cloud_status, cloud_status_connected);
+    }
+    if (cloudDisconnectAt && nowMs >= cloudDisconnectAt) {
+        cloudDisconnectAt = 0;
+        cloudConnected = false;
+        systemEvent(cloud_status, cloud_status_disconnected);
+    }
+    if (networkOffAt && nowMs >= networkOffAt) {
+        networkOffAt = 0;
+        networkOn = false;
+        systemEvent(network_status, network_status_off);
+    }
+
+    if (cloudLostAt && nowMs >= cloudLostAt) {
+        // Before the publish that was in flight is acknowledged, and out of coverage until the device sleeps
+        cloudLostAt = 0;
+        cloudLostCount++;
+        cloudLost = true;
+        cloudConnectAt = 0;
+        if (cloudConnected) {
+            cloudConnected = false;
+            systemEvent(cloud_status, cloud_status_disconnected);
+        }
+    }
+
+    if (resetAt && nowMs >= resetAt) {
+        // Before the publish that was in flight is acknowledged
+        reset();
+        throw Reset();
+    }
+
+    for(size_t ii = 0; ii < publishInFlight.size(); ) {
+        if (nowMs < publishInFlight[ii].doneAt) {
+            ii++;
+            continue;
+        }
+        PublishInFlight pub = publishInFlight[ii];
+        publishInFlight.erase(publishInFlight.begin() + ii);
+
+        bool succeeded = pub.succeeded && cloudConnected;
+        if (succeeded) {
+            cycle.publishCount++;
+            if (publishAckedFunction) {
+                publishAckedFunction(pub.name, pub.data);
+            }
+        }
+        else {
+            cycle.publishFailCount++;
+        }
+        if (pub.future) {
+            pub.future->succeeded = succeeded;
+            pub.future->done = true;
+        }
+        if (pub.callback) {
+            backgroundPublishBusy = false;
+            pub.callback(succeeded, pub.name, pub.data, pub.context);
+        }
+    }
+}
+
+void SleepHelperSim::cloudConnect() {
+    cycle.connectAttempts++;
+    if (cloudConnected || cloudConnectAt) {
+        return;
+    }
+    connectStartMs = nowMs;
+    networkOn = true;
+    networkOffAt = 0;
+
+    if ((int)random(100) < connectFailPercent || (nowMs >= outageStartMs && nowMs < outageEndMs) || cloudLost) {
+        // This attempt never completes; SleepHelper has to time out
+        return;
+    }
+
+    uint64_t jitter = connectJitterMs ? random(connectJitterMs) : 0;
+    if (!networkReady) {
+        networkReadyAt = nowMs + networkReadyMs + jitter;
+        cloudConnectAt = networkReadyAt + cloudConnectMs;
+    }
+    else {
+        cloudConnectAt = nowMs + cloudConnectMs;
+    }
+}
+
+void SleepHelperSim::cloudDisconnect() {
+    cloudConnectAt = 0;
+    if (cloudConnected) {
+        cloudDisconnectAt = nowMs + cloudDisconnectMs;
+    }
+}
+
+void SleepHelperSim::networkDisconnect() {
+    networkReadyAt = 0;
+    cloudConnectAt = 0;
+    networkReady = false;
+}
+
+void SleepHelperSim::networkOff() {
+    networkDisconnect();
+    if (networkOn && !networkOffAt) {
+        networkOffAt = nowMs + networkOffMs;
+    }
+}
+
+SystemSleepResult SleepHelperSim::sleep(const SystemSleepConfiguration &config) {
+    endCycle(config);
+
+    bool standby = cycles.back().cellularStandby;
+
+    // The cloud session always drops during sleep; the modem only stays on in network standby
+    cloudConnected = false;
+    cloudConnectAt = cloudDisconnectAt = networkOffAt = cloudLostAt = 0;
+    cloudLost = false;
+    if (!standby) {
+        networkReadyAt = 0;
+        networkReady = false;
+        networkOn = false;
+    }
+
+    bool hibernate = cycles.back().hibernate;
+    if (hibernate) {
+        // RAM is lost, so everything in flight is gone and the device boots again on wake
+        publishInFlight.clear();
+        backgroundPublishBusy = false;
+        eventHandler = 0;
+        consume(config.sleepDuration(), hibernateMa);
+        nowMs += config.sleepDuration();
+        bootAtMs = nowMs;
+        consume(bootMs, awakeMa);
+        nowMs += bootMs;
+    }
+    else {
+        consume(config.sleepDuration(), standby ? standbyMa : sleepMa);
+        nowMs += config.sleepDuration();
+    }
+
+    cycle = CycleStats();
+    cycleStartMs = nowMs;
+    cycle.wakeTime = getTimeValid() ? getTime() : 0;
+
+    if (hibernate) {
+        throw HibernateReset();
+    }
+
+    if (standby) {
+        // Device OS resumes the cloud session on its own after waking from network standby
+        connectStartMs = nowMs;
+        cloudConnectAt = nowMs + standbyReconnectMs;
+    }
+
+    return SystemSleepResult(SystemSleepWakeupReason::BY_RTC);
+}
+
+bool SleepHelperSim::publish(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context) {
+    if (backgroundPublishBusy) {
+        return false;
+    }
+    backgroundPublishBusy = true;
+
+    PublishInFlight pub;
+    pub.name = name;
+    pub.data = data ? data : "";
+    pub.callback = cb;
+    pub.context = context;
+    publishStart(std::move(pub));
+    return true;
+}
+
+particle::Future<bool> SleepHelperSim::publishFuture(const char *name, const char *data, PublishFlags flags) {
+    particle::Future<bool> result;
+
+    PublishInFlight pub;
+    pub.name = name;
+    pub.data = data ? data : "";
+    pub.future = result.state;
+    publishStart(std::move(pub));
+    return result;
+}
+
+void SleepHelperSim::publishStart(PublishInFlight &&pub) {
+    // Refill the cloud rate limit tokens
+    while(publishRateTokens < 4 && nowMs >= publishRateRefillMs + 1000) {
+        publishRateTokens++;
+        publishRateRefillMs += 1000;
+    }
+    if (publishRateTokens == 4) {
+        publishRateRefillMs = nowMs;
+    }
+
+    pub.doneAt = nowMs + publishAckMs;
+    pub.succeeded = ((int)random(100) >= publishFailPercent);
+    if (resetPercent && !resetAt && (int)random(100) < resetPercent) {
+        resetAt = nowMs + publishAckMs / 2;
+    }
+    if (cloudLostPercent && !cloudLostAt && (int)random(100) < cloudLostPercent) {
+        cloudLostAt = nowMs + publishAckMs / 2;
+    }
+    if (publishRateTokens > 0) {
+        publishRateTokens--;
+    }
+    else {
+        // The cloud rejects publishes over the rate limit
+        pub.succeeded = false;
+        cycle.publishRateLimited++;
+    }
+    if ((int)pub.data.length() > maxEventDataSize) {
+        pub.succeeded = false;
+        cycle.publishTooLarge++;
+    }
+
+    if (publishStartedFunction) {
+        publishStartedFunction(pub.name, pub.data);
+    }
+
+    publishInFlight.push_back(std::move(pub));
+    if ((int)publishInFlight.size() > cycle.publishMaxInFlight) {
+        cycle.publishMaxInFlight = (int)publishInFlight.size();
+    }
+}
+
+int SleepHelperSim::semaphoreTake(unsigned *count, system_tick_t timeout) {
+    // Nothing else runs while blocked, so skip ahead to whichever comes first: the timeout or
+    // the next simulated operation that completes (and may give the semaphore)
+    uint64_t endMs = nowMs + timeout;
+    while(*count == 0 && nowMs < endMs) {
+        uint64_t next = nextPendingMs();
+        if (next == 0 || next > endMs) {
+            next = endMs;
+        }
+        advance((next > nowMs) ? (next - nowMs) : 1);
+    }
+    if (*count == 0) {
+        return -1;
+    }
+    (*count)--;
+    return 0;
+}
+
+uint64_t SleepHelperSim::nextPendingMs() const {
+    uint64_t next = 0;
+    uint64_t pending[6] = { networkReadyAt, cloudConnectAt, cloudDisconnectAt, networkOffAt, resetAt, cloudLostAt };
+    for(size_t ii = 0; ii < sizeof(pending) / sizeof(pending[0]); ii++) {
+        if (pending[ii] && (next == 0 || pending[ii] < next)) {
+            next = pending[ii];
+        }
+    }
+    for(auto it = publishInFlight.begin(); it != publishInFlight.end(); ++it) {
+        if (next == 0 || it->doneAt < next) {
+            next = it->doneAt;
+        }
+    }
+    return next;
+}
+
+void SleepHelperSim::systemEvent(system_event_t event, int param) {
+    if (eventHandler) {
+        eventHandler(event, param);
+    }
+}
+
+void SleepHelperSim::reset() {
+    // RAM is lost and the modem is reset, then the device boots again
+    resetAt = 0;
+    resetCount++;
+    cloudLostAt = 0;
+    cloudLost = false;
+    publishInFlight.clear();
+    backgroundPublishBusy = false;
+    eventHandler = 0;
+    cloudConnected = networkReady = networkOn = false;
+    networkReadyAt = cloudConnectAt = cloudDisconnectAt = networkDownAt = networkOffAt = 0;
+    bootAtMs = nowMs;
+    consume(bootMs, awakeMa);
+    nowMs += bootMs;
+}
+
+void SleepHelperSim::consume(uint64_t ms, float mA) {
+    usedMah += (double)mA * (double)ms / 3600000.0;
+    if (getBatteryCharge() < 10.0) {
+        chargedMah = usedMah;
+    }
+}
+
+float SleepHelperSim::getBatteryCharge() const {
+    double soc = (double)batteryCharge - (usedMah - chargedMah) * 100.0 / (double)batteryCapacityMah;
+    if (soc < 0) {
+        soc = 0;
+    }
+    return (float)(floor(soc * 256.0) / 256.0);
+}
+
+uint32_t SleepHelperSim::random(uint32_t range) {
+    // xorshift32, so runs are repeatable for a given seed
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return range ? (seed % range) : 0;
+}
+
+void SleepHelperSim::endCycle(const SystemSleepConfiguration &config) {
+    cycle.awakeMs = nowMs - cycleStartMs;
+    cycle.sleepMs = config.sleepDuration();
+    cycle.cellularStandby = (config.sleepNetwork() == NETWORK_INTERFACE_CELLULAR) && networkReady;
+    cycle.hibernate = (config.sleepMode() == SystemSleepMode::HIBERNATE);
+    cycles.push_back(cycle);
+}
+
+void SleepHelperSim::report(FILE *fp, bool verbose) const {
+    if (verbose) {
+        fprintf(fp, "cycle,wakeTime,type,awakeMs,connectAttempts,connectMs,publishes,publishFails,sleepMs,standby,hibernate,loops\n");
+    }
+
+    int fullCount = 0;
+    int quickCount = 0;
+    uint64_t fullAwakeMs = 0;
+    uint64_t quickAwakeMs = 0;
+    uint64_t connectMs = 0;
+    int connectedCount = 0;
+    int connectAttempts = 0;
+    int publishCount = 0;
+    int publishFailCount = 0;
+    int publishRateLimited = 0;
+    int publishTooLarge = 0;
+    int publishMaxInFlight = 0;
+    int standbyCount = 0;
+    int hibernateCount = 0;
+    uint64_t fullLoops = 0;
+    uint64_t quickLoops = 0;
+
+    for(size_t ii = 0; ii < cycles.size(); ii++) {
+        const CycleStats &c = cycles[ii];
+        bool isFull = (c.connectAttempts > 0);
+
+        if (verbose) {
+            fprintf(fp, "%lu,%ld,%s,%lu,%d,%lu,%d,%d,%lu,%d,%d,%d\n", (unsigned long)ii, (long)c.wakeTime, isFull ? "full" : "quick",
+                (unsigned long)c.awakeMs, c.connectAttempts, (unsigned long)c.connectMs,
+                c.publishCount, c.publishFailCount, (unsigned long)c.sleepMs, (int)c.cellularStandby, (int)c.hibernate, c.loopCount);
+        }
+
+        if (isFull) {
+            fullCount++;
+            fullAwakeMs += c.awakeMs;
+            fullLoops += c.loopCount;
+        }
+        else {
+            quickCount++;
+            quickAwakeMs += c.awakeMs;
+            quickLoops += c.loopCount;
+        }
+        if (c.connectMs) {
+            connectMs += c.connectMs;
+            connectedCount++;
+        }
+        connectAttempts += c.connectAttempts;
+        publishCount += c.publishCount;
+        publishFailCount += c.publishFailCount;
+        publishRateLimited += c.publishRateLimited;
+        publishTooLarge += c.publishTooLarge;
+        if (c.publishMaxInFlight > publishMaxInFlight) {
+            publishMaxInFlight = c.publishMaxInFlight;
+        }
+        if (c.cellularStandby) {
+            standbyCount++;
+        }
+        if (c.hibernate) {
+            hibernateCount++;
+        }
+    }
+
+    fprintf(fp, "simulated %.1f days, %lu cycles (%d full, %d quick, %d cellular standby, %d hibernate)\n",
+        (double)nowMs / 86400000.0, (unsigned long)cycles.size(), fullCount, quickCount, standbyCount, hibernateCount);
+    fprintf(fp, "awake %lu s total, full wake avg %lu ms, quick wake avg %lu ms\n",
+        (unsigned long)((fullAwakeMs + quickAwakeMs) / 1000),
+        (unsigned long)(fullCount ? fullAwakeMs / fullCount : 0),
+        (unsigned long)(quickCount ? quickAwakeMs / quickCount : 0));
+    fprintf(fp, "connect attempts %d, connected %d, avg time to connect %lu ms\n",
+        connectAttempts, connectedCount, (unsigned long)(connectedCount ? connectMs / connectedCount : 0));
+    fprintf(fp, "publishes %d, failed %d (%d over rate limit, %d too large), max in flight %d\n", publishCount, publishFailCount, publishRateLimited, publishTooLarge, publishMaxInFlight);
+    fprintf(fp, "loop calls per full wake avg %lu, per quick wake avg %lu\n",
+        (unsigned long)(fullCount ? fullLoops / fullCount : 0),
+        (unsigned long)(quickCount ? quickLoops / quickCount : 0));
+    fprintf(fp, "file system opens %lu, writes %lu (%lu bytes)\n", (unsigned long)fileOpens, (unsigned long)fileWrites, (unsigned long)fileWriteBytes);
+    fprintf(fp, "battery used %.1f mAh, avg %.3f mA\n", usedMah, nowMs ? usedMah * 3600000.0 / (double)nowMs : 0.0);
+    if (resetCount) {
+        fprintf(fp, "resets while publishing %d\n", resetCount);
+    }
+    if (cloudLostCount) {
+        fprintf(fp, "cloud connections lost while publishing %d\n", cloudLostCount);
+    }
+}
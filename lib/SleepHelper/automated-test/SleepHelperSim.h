@@ -0,0 +1,530 @@
+#ifndef __SLEEPHELPERSIM_H
+#define __SLEEPHELPERSIM_H
+
+// Host-native stand-ins for the Device OS APIs that SleepHelper uses but that are not part
+// of UnitTestLib (System, Particle, Cellular, sleep configuration, BackgroundPublishRK).
+// PublishQueuePosixRK's host tests also use it, with the mutex and thread stand-ins.
+//
+// This file is only used when compiling with -DUNITTEST (see Makefile). Everything runs
+// against a virtual clock owned by SleepHelperSim, so a year of wake and sleep cycles can
+// be simulated in seconds.
+
+#include "Particle.h"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+#define Wiring_Cellular 1
+#define HAL_PLATFORM_POWER_MANAGEMENT 1
+
+//
+// System events
+//
+typedef uint64_t system_event_t;
+typedef void (system_event_handler_t)(system_event_t event, int param);
+
+const system_event_t reset = 0x0001;
+const system_event_t firmware_update = 0x0002;
+const system_event_t firmware_update_pending = 0x0004;
+const system_event_t out_of_memory = 0x0008;
+const system_event_t network_status = 0x0020;
+const system_event_t cloud_status = 0x0040;
+
+enum {
+    network_status_off = 0,
+    network_status_disconnected = 1,
+    network_status_connected = 2
+};
+
+enum {
+    cloud_status_disconnected = 0,
+    cloud_status_connected = 1,
+    cloud_status_disconnecting = 2
+};
+
+enum {
+    firmware_update_failed = -1,
+    firmware_update_begin = 0,
+    firmware_update_complete = 1,
+    firmware_update_progress = 2
+};
+
+//
+// Semaphore (concurrent_hal). Taking an empty semaphore advances the virtual clock until it's given or times out.
+//
+typedef void *os_semaphore_t;
+
+int os_semaphore_create(os_semaphore_t *semaphore, unsigned max, unsigned initial);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
+
+//
+// Mutexes (concurrent_hal). Only one thread runs, so these do nothing.
+//
+typedef int os_mutex_t;
+typedef int os_mutex_recursive_t;
+
+inline int os_mutex_create(os_mutex_t *mutex) { *mutex = 0; return 0; }
+inline int os_mutex_lock(os_mutex_t mutex) { return 0; }
+inline int os_mutex_unlock(os_mutex_t mutex) { return 0; }
+inline int os_mutex_recursive_create(os_mutex_recursive_t *mutex) { *mutex = 0; return 0; }
+inline int os_mutex_recursive_lock(os_mutex_recursive_t mutex) { return 0; }
+inline bool os_mutex_recursive_trylock(os_mutex_recursive_t mutex) { return true; }
+inline int os_mutex_recursive_unlock(os_mutex_recursive_t mutex) { return 0; }
+
+//
+// SYSTEM_THREAD(ENABLED) is assumed
+//
+namespace spark { 
+namespace feature { 
+    enum State { DISABLED, ENABLED }; 
+} 
+}
+
+inline spark::feature::State system_thread_get_state(void *reserved) { return spark::feature::ENABLED; }
+
+//
+// Sleep configuration
+//
+typedef int network_interface_t;
+const network_interface_t NETWORK_INTERFACE_CELLULAR = 2;
+
+enum class SystemSleepMode : uint8_t {
+    NONE = 0,
+    STOP = 1,
+    ULTRA_LOW_POWER = 2,
+    HIBERNATE = 3
+};
+
+enum class SystemSleepWakeupReason : uint16_t {
+    UNKNOWN = 0,
+    BY_GPIO = 1,
+    BY_ADC = 2,
+    BY_DAC = 3,
+    BY_RTC = 4,
+    BY_LPCOMP = 5,
+    BY_USART = 6,
+    BY_CAN = 7,
+    BY_NFC = 8,
+    BY_NETWORK = 9,
+    BY_BLE = 10
+};
+
+/**
+ * @brief Subset of the Device OS SystemSleepConfiguration
+ *
+ * The sleepMode(), sleepDuration() and sleepNetwork() accessors do not exist in Device OS; they
+ * are used by the simulated System.sleep().
+ */
+class SystemSleepConfiguration {
+public:
+    SystemSleepConfiguration &mode(SystemSleepMode mode) {
+        sleepMode_ = mode;
+        return *this;
+    }
+    SystemSleepConfiguration &duration(system_tick_t ms) {
+        duration_ = ms;
+        return *this;
+    }
+    SystemSleepConfiguration &duration(std::chrono::milliseconds ms) {
+        return duration((system_tick_t)ms.count());
+    }
+    SystemSleepConfiguration &network(network_interface_t netif) {
+        network_ = netif;
+        return *this;
+    }
+
+    SystemSleepMode sleepMode() const { return sleepMode_; }
+    system_tick_t sleepDuration() const { return duration_; }
+    network_interface_t sleepNetwork() const { return network_; }
+
+protected:
+    SystemSleepMode sleepMode_ = SystemSleepMode::NONE;
+    system_tick_t duration_ = 0;
+    network_interface_t network_ = 0;
+};
+
+class SystemSleepResult {
+public:
+    SystemSleepResult() {};
+    SystemSleepResult(SystemSleepWakeupReason reason) : reason_(reason) {};
+
+    SystemSleepWakeupReason wakeupReason() const { return reason_; }
+    int error() const { return 0; }
+
+protected:
+    SystemSleepWakeupReason reason_ = SystemSleepWakeupReason::UNKNOWN;
+};
+
+//
+// System
+//
+class SystemClass {
+public:
+    uint64_t millis() const;
+    int resetReason() const { return 0; }
+    bool on(system_event_t events, system_event_handler_t *handler);
+    SystemSleepResult sleep(const SystemSleepConfiguration &config);
+    float batteryCharge() const;
+};
+extern SystemClass System;
+
+//
+// Cloud
+//
+class PublishFlags {
+public:
+    constexpr PublishFlags(uint8_t value = 0) : value_(value) {};
+    uint8_t value() const { return value_; }
+    PublishFlags operator|(PublishFlags other) const { return PublishFlags(value_ | other.value_); }
+protected:
+    uint8_t value_;
+};
+
+const PublishFlags PUBLIC(0x00);
+const PublishFlags PRIVATE(0x01);
+const PublishFlags NO_ACK(0x02);
+const PublishFlags WITH_ACK(0x08);
+
+class CloudDisconnectOptions {
+public:
+    CloudDisconnectOptions &graceful(bool value) {
+        graceful_ = value;
+        return *this;
+    }
+    CloudDisconnectOptions &timeout(unsigned int ms) {
+        timeout_ = ms;
+        return *this;
+    }
+protected:
+    bool graceful_ = false;
+    unsigned int timeout_ = 0;
+};
+
+namespace particle {
+
+class Error {
+public:
+    enum Type {
+        NONE = 0,
+        UNKNOWN = -100,
+    };
+    Error(Type type = NONE) : type_(type) {};
+    Type type() const { return type_; };
+protected:
+    Type type_;
+};
+
+/**
+ * @brief Result of an asynchronous operation, only the parts used by SleepHelper
+ */
+template<typename ResultT>
+class Future {
+public:
+    class State {
+    public:
+        bool done = false;
+        bool succeeded = false;
+    };
+
+    Future() : state(std::make_shared<State>()) {};
+
+    bool isDone() const { return state->done; };
+    bool isSucceeded() const { return state->done && state->succeeded; };
+
+    std::shared_ptr<State> state; //!< Shared with the simulator, which completes it
+};
+
+}
+
+class CloudClass {
+public:
+    particle::Future<bool> publish(const char *name, const char *data, PublishFlags flags);
+    void connect();
+    bool connected() const;
+    bool disconnected() const { return !connected(); }
+    int maxEventDataSize() const;
+    void disconnect(const CloudDisconnectOptions &options = CloudDisconnectOptions());
+};
+extern CloudClass Particle;
+
+//
+// Network
+//
+class NetworkClass {
+public:
+    virtual bool ready() const;
+    virtual void disconnect();
+    virtual void off();
+    virtual bool isOff() const;
+};
+
+class CellularClass : public NetworkClass {
+};
+extern CellularClass Cellular;
+
+//
+// BackgroundPublishRK (like the real library, only one publish can be in flight at a time)
+//
+typedef std::function<void(bool succeeded,
+    const char *event_name,
+    const char *event_data,
+    const void *event_context)> PublishCompletedCallback;
+
+class BackgroundPublishRK {
+public:
+    static BackgroundPublishRK &instance();
+    void start() {};
+    void stop() {};
+    bool publish(const char *name, const char *data = NULL, PublishFlags flags = PRIVATE, PublishCompletedCallback cb = NULL, const void *context = NULL);
+};
+
+
+/**
+ * @brief Controls the simulated device: virtual clock, modem, cloud, and statistics
+ *
+ * This is a singleton. Configure it before calling SleepHelper::instance().setup(), then
+ * call loop() instead of advancing time yourself.
+ */
+class SleepHelperSim {
+public:
+    /**
+     * @brief Thrown by System.sleep() in HIBERNATE mode, which does not return on a real device
+     * 
+     * The caller should call SleepHelper::simulateReset(), then configure SleepHelper and call setup() again.
+     */
+    class HibernateReset {
+    };
+
+    /**
+     * @brief Thrown by advance() when the device resets while a publish is in flight, see withResetPercent()
+     * 
+     * This is handled the same way as HibernateReset.
+     */
+    class Reset {
+    };
+
+    /**
+     * @brief Statistics for a single wake cycle (wake or boot to the next System.sleep)
+     */
+    class CycleStats {
+    public:
+        time_t wakeTime = 0; //!< Virtual RTC time at wake (0 if not valid yet)
+        uint64_t awakeMs = 0; //!< Milliseconds awake, from wake to sleep
+        int connectAttempts = 0; //!< Number of Particle.connect() calls
+        uint64_t connectMs = 0; //!< Milliseconds from Particle.connect() to cloud connected, 0 if not connected
+        int publishCount = 0; //!< Number of successful publishes
+        int publishFailCount = 0; //!< Number of failed publishes
+        int publishRateLimited = 0; //!< Number of publishes that exceeded the cloud rate limit (included in publishFailCount)
+        int publishTooLarge = 0; //!< Number of publishes with more data than maxEventDataSize (included in publishFailCount)
+        int publishMaxInFlight = 0; //!< Maximum number of publishes in flight at the same time
+        uint64_t sleepMs = 0; //!< Requested sleep duration
+        bool cellularStandby = false; //!< Slept with the modem on (network standby)
+        bool hibernate = false; //!< Slept in HIBERNATE mode (the device resets on wake)
+        int loopCount = 0; //!< Number of times through loop(), a measure of CPU time while awake
+    };
+
+    static SleepHelperSim &instance();
+
+    SleepHelperSim &withStartTime(time_t value) { startTime = value; return *this; };
+    SleepHelperSim &withTimeValidAtBoot(bool value) { timeValidAtBoot = value; return *this; };
+    SleepHelperSim &withLoopIntervalMs(uint32_t value) { loopIntervalMs = value; return *this; };
+    SleepHelperSim &withNetworkReadyMs(uint32_t value) { networkReadyMs = value; return *this; };
+    SleepHelperSim &withCloudConnectMs(uint32_t value) { cloudConnectMs = value; return *this; };
+    SleepHelperSim &withConnectJitterMs(uint32_t value) { connectJitterMs = value; return *this; };
+    SleepHelperSim &withConnectFailPercent(int value) { connectFailPercent = value; return *this; };
+    SleepHelperSim &withOutage(uint64_t startMs, uint64_t endMs) { outageStartMs = startMs; outageEndMs = endMs; return *this; };
+    SleepHelperSim &withStandbyReconnectMs(uint32_t value) { standbyReconnectMs = value; return *this; };
+    SleepHelperSim &withCloudDisconnectMs(uint32_t value) { cloudDisconnectMs = value; return *this; };
+    SleepHelperSim &withNetworkOffMs(uint32_t value) { networkOffMs = value; return *this; };
+    SleepHelperSim &withPublishAckMs(uint32_t value) { publishAckMs = value; return *this; };
+    SleepHelperSim &withPublishFailPercent(int value) { publishFailPercent = value; return *this; };
+    SleepHelperSim &withMaxEventDataSize(int value) { maxEventDataSize = value; return *this; };
+    SleepHelperSim &withBatteryCharge(float value) { batteryCharge = value; return *this; };
+    SleepHelperSim &withBatteryCapacityMah(float value) { batteryCapacityMah = value; return *this; };
+    SleepHelperSim &withAwakeMa(float value) { awakeMa = value; return *this; };
+    SleepHelperSim &withModemMa(float value) { modemMa = value; return *this; };
+    SleepHelperSim &withSleepMa(float value) { sleepMa = value; return *this; };
+    SleepHelperSim &withStandbyMa(float value) { standbyMa = value; return *this; };
+    SleepHelperSim &withHibernateMa(float value) { hibernateMa = value; return *this; };
+    SleepHelperSim &withBootMs(uint32_t value) { bootMs = value; return *this; };
+    SleepHelperSim &withSeed(uint32_t value) { seed = value; return *this; };
+    SleepHelperSim &withResetPercent(int value) { resetPercent = value; return *this; };
+    int getResetPercent() const { return resetPercent; };
+    SleepHelperSim &withCloudLostPercent(int value) { cloudLostPercent = value; return *this; };
+
+    /**
+     * @brief Sets a function called with the name and data of each publish that succeeds
+     * 
+     * Failed publishes, and publishes in flight when the device resets, are not passed to it. 
+     */
+    SleepHelperSim &withPublishAckedFunction(std::function<void(const char *name, const char *data)> fn) { publishAckedFunction = fn; return *this; };
+
+    /**
+     * @brief Sets a function called with the name and data of each publish when it's started, including ones that will fail
+     */
+    SleepHelperSim &withPublishStartedFunction(std::function<void(const char *name, const char *data)> fn) { publishStartedFunction = fn; return *this; };
+
+    /**
+     * @brief Call after each SleepHelper::instance().loop(). Advances the clock by loopIntervalMs.
+     */
+    void loop() { 
+        cycle.loopCount++;
+        advance(loopIntervalMs); 
+    };
+
+    /**
+     * @brief Advance the virtual clock, completing any modem, cloud, and publish operations that become due
+     */
+    void advance(uint64_t ms);
+
+    uint64_t getMillis() const { return nowMs; };
+    int getMaxEventDataSize() const { return maxEventDataSize; };
+
+    /**
+     * @brief Milliseconds since the simulated device booted, the value of millis() and System.millis()
+     */
+    uint64_t getSystemMillis() const { return nowMs - bootAtMs; };
+    time_t getTime() const { return startTime + (time_t)(nowMs / 1000); };
+    bool getTimeValid() const { return timeValid || timeValidAtBoot; };
+
+    /**
+     * @brief Battery SoC from the starting charge and the current used so far, with the 1/256 percent resolution of the fuel gauge
+     */
+    float getBatteryCharge() const;
+
+    /**
+     * @brief Statistics for the current wake cycle, which are added to getCycles() when the device sleeps
+     */
+    const CycleStats &getCycle() const { return cycle; };
+
+    const std::vector<CycleStats> &getCycles() const { return cycles; };
+
+    /**
+     * @brief Print per-cycle CSV (if verbose) and a summary
+     */
+    void report(FILE *fp, bool verbose) const;
+
+    // Used by the Device OS stand-ins
+    void cloudConnect();
+    void cloudDisconnect();
+    void networkDisconnect();
+    void networkOff();
+    SystemSleepResult sleep(const SystemSleepConfiguration &config);
+    bool publish(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context);
+    particle::Future<bool> publishFuture(const char *name, const char *data, PublishFlags flags);
+    uint32_t random(uint32_t range);
+    int semaphoreTake(unsigned *count, system_tick_t timeout);
+    void fileOpen() { fileOpens++; };
+    void fileWrite(size_t count) { fileWrites++; fileWriteBytes += count; };
+
+    bool networkReady = false; //!< Cellular.ready()
+    bool networkOn = false; //!< !Cellular.isOff()
+    bool cloudConnected = false; //!< Particle.connected()
+    float batteryCharge = 80.0; //!< System.batteryCharge() at boot
+    system_event_handler_t *eventHandler = 0; //!< Handler registered with System.on()
+
+protected:
+    SleepHelperSim() {};
+
+    void endCycle(const SystemSleepConfiguration &config);
+    void systemEvent(system_event_t event, int param);
+    void reset();
+    void consume(uint64_t ms, float mA);
+    uint64_t nextPendingMs() const;
+
+    time_t startTime = 1656633600; // 2022-07-01 00:00:00 UTC
+    bool timeValidAtBoot = false;
+    uint32_t loopIntervalMs = 10;
+    uint32_t networkReadyMs = 15000;
+    uint32_t cloudConnectMs = 3000;
+    uint32_t connectJitterMs = 5000;
+    int connectFailPercent = 0;
+    uint64_t outageStartMs = 0; //!< Connection attempts started from here until outageEndMs never complete
+    uint64_t outageEndMs = 0;
+    uint32_t standbyReconnectMs = 1500;
+    uint32_t cloudDisconnectMs = 1000;
+    uint32_t networkOffMs = 2000;
+    uint32_t publishAckMs = 600;
+    int publishFailPercent = 0;
+    int maxEventDataSize = 1024; //!< Particle.maxEventDataSize(), larger publishes fail
+    uint32_t seed = 1;
+    int resetPercent = 0; //!< Percentage of publishes interrupted by a reset before they are acknowledged
+    int cloudLostPercent = 0; //!< Percentage of publishes during which the cloud connection is lost until the device sleeps
+
+    // Battery model. Currents are typical of a Boron LTE; awake with the modem on includes the MCU.
+    float batteryCapacityMah = 2000.0;
+    float awakeMa = 30.0;
+    float modemMa = 60.0;
+    float sleepMa = 0.13;
+    float standbyMa = 1.5;
+    float hibernateMa = 0.05;
+    uint32_t bootMs = 1500; //!< Time to boot after HIBERNATE, before setup() is called
+    double usedMah = 0; //!< Total used, for the report
+    uint64_t fileOpens = 0; //!< Number of open() calls, for the report
+    uint64_t fileWrites = 0; //!< Number of write() calls to files, for the report
+    uint64_t fileWriteBytes = 0; //!< Bytes written to files, for the report
+    int resetCount = 0; //!< Number of resets from resetPercent, for the report
+    int cloudLostCount = 0; //!< Number of cloud connections lost from cloudLostPercent, for the report
+    double chargedMah = 0; //!< The battery is recharged to batteryCharge when it gets low, so long runs don't end with a dead battery
+
+    uint64_t nowMs = 0;
+    uint64_t bootAtMs = 0; //!< nowMs at the last simulated reset
+    bool timeValid = false;
+
+    // Pending operations (0 = none), in virtual millis
+    uint64_t networkReadyAt = 0;
+    uint64_t cloudConnectAt = 0;
+    uint64_t cloudDisconnectAt = 0;
+    uint64_t networkDownAt = 0;
+    uint64_t networkOffAt = 0;
+    uint64_t connectStartMs = 0;
+    uint64_t resetAt = 0;
+    uint64_t cloudLostAt = 0;
+    bool cloudLost = false; //!< Connection attempts don't complete until the device sleeps or resets
+
+    /**
+     * @brief A publish in flight, from BackgroundPublishRK (callback) or Particle.publish (future)
+     */
+    class PublishInFlight {
+    public:
+        uint64_t doneAt = 0;
+        bool succeeded = false;
+        String name;
+        String data;
+        PublishCompletedCallback callback = 0;
+        const void *context = 0;
+        std::shared_ptr<particle::Future<bool>::State> future;
+    };
+    std::vector<PublishInFlight> publishInFlight;
+    bool backgroundPublishBusy = false;
+    std::function<void(const char *name, const char *data)> publishAckedFunction;
+    std::function<void(const char *name, const char *data)> publishStartedFunction;
+
+    // Cloud publish rate limit: bursts of up to 4, refilled at 1 per second
+    int publishRateTokens = 4;
+    uint64_t publishRateRefillMs = 0;
+
+    /**
+     * @brief Start a simulated publish (shared by BackgroundPublishRK and Particle.publish)
+     */
+    void publishStart(PublishInFlight &&pub);
+
+    CycleStats cycle;
+    uint64_t cycleStartMs = 0;
+    std::vector<CycleStats> cycles;
+
+    static SleepHelperSim *_instance;
+};
+
+/**
+ * @brief Wiring random(max), from the simulator's random number generator so runs are repeatable
+ */
+inline long random(long max) { 
+    return (max > 0) ? (long)SleepHelperSim::instance().random((uint32_t)max) : 0; 
+}
+
+#endif /* __SLEEPHELPERSIM_H */
@@ -0,0 +1,520 @@
+#include "Particle.h"
+#include "SleepHelper.h"
+
+#include <getopt.h>
+#include <dirent.h>
+
+// Runs the SleepHelper state machine against a virtual clock and simulated modem, then prints
+// per-cycle statistics. The configuration below is the same as the SleepHelper-Demo application
+// (src/sleep_helper_config.cpp) without the hardware-specific parts.
+//
+// Usage: ./SleepSim [-d days] [-n networkReadyMs] [-c cloudConnectMs] [-j connectJitterMs]
+//                   [-f connectFailPercent] [-p publishAckMs] [-u publishFailPercent] [-z maxEventDataSize] [-s seed] [-b maxBlockMs] [-m] [-i captureMinutes]
+//                   [-q publishWindow] [-r publishBurst] [-h hibernateMinutes] [-o sleepHour:wakeHour] [-k] [-e stagingBytes] [-t] [-C] [-a maxBytes[:maxAgeHours]]
+//                   [-g startDay:days] [-x alarmHours[:priority]] [-y publishIntervalHours] [-R resetPercent] [-L cloudLostPercent] [-P publishFile] [-K] [-W] [-H] [-v] [-l]
+//
+// -b enables SleepHelper::withLoopBlocking, -m enables SleepHelper::withCellularCostModel.
+// -u sets the percentage of publishes that fail. SleepHelper tries them again, and only removes the event history
+// in a wake event once it has been published.
+// -z sets the simulated Particle.maxEventDataSize() (default 1024). Publishes with more data fail.
+// -q sets SleepHelper::withPublishWindow and -r the burst for SleepHelper::withPublishRateLimit (at 1 per second). The simulated
+// cloud fails publishes over its rate limit (burst of 4, 1 per second).
+// -h enables SleepHelper::withHibernateMinimumTime. Waking from HIBERNATE resets the device, so SleepHelper is
+// deleted, configured, and set up again, keeping the files in simdata.
+// -o sets SleepHelper::withDormancyWindow, for example -o 22:6 to stay asleep from 10:00 PM to 6:00 AM local time.
+// -k enables SleepHelper::withShortSleepCoalescing.
+// -e enables SleepHelper::withEventHistoryStaging with a buffer of that size. The buffer is static, so like retained memory
+// it survives simulated resets.
+// -t enables SleepHelper::withEventHistoryRecordSchema for the data capture events, so they're stored as binary records.
+// -C also enables RecordSchema::withColumnar, so the records are published as columnar blocks (decode them with 
+// tools/columnar-decode.js).
+// -a also enables SleepHelper::withEventHistoryRetentionPolicy, compacting samples into hourly aggregates past that many bytes
+// (0 for no limit) or hours old.
+// -g simulates an outage: connection attempts fail for that many days, starting that many days into the simulation.
+// -x adds an alarm event ({"t":...,"alarm":1}) to the event history every alarmHours. With a priority, alarms go in their own
+// channel (SleepHelper::withEventHistoryChannel) with that priority and the key "al".
+// -y sets a publish interval for the default event history channel, so data capture events are only published that often.
+// -R sets the percentage of publishes during which the device resets (like a watchdog reset) before the publish is acknowledged.
+// -L sets the percentage of publishes during which the cloud connection is lost before the publish is acknowledged. It
+// can't reconnect until the device sleeps, so SleepHelper times out and keeps the wake event for the next full wake.
+// -P writes the data of each acknowledged publish to publishFile, one per line. Failed publishes and publishes interrupted by
+// a reset are not written.
+// -K checks the data capture samples in the acknowledged publishes: sorted by time, there must be no duplicates, and no gaps
+// longer than the data capture interval, except for the -o dormant period. SleepSim exits with status 1 if the check fails.
+// It can't be used with -C or -a.
+// -W checks that the state dwell times ("sd") in the acknowledged publishes add up to the simulated time, so none are lost
+// or reported twice when publishes fail. SleepSim exits with status 1 if the check fails.
+// -H checks that the device used HIBERNATE (see -h), that each wake from HIBERNATE was a quick or full wake as scheduled,
+// and that the wake event from every wake that connected was published. SleepSim exits with status 1 if the check fails.
+// It can't be used with -R, since a reset loses the wake events that are waiting.
+// -i sets the data capture interval in minutes (default 5, 0 for none, so there are only full wakes). -v prints one CSV line per wake cycle, -l shows the SleepHelper log messages and publish data.
+
+static const char *dataDir = "simdata";
+
+static int loopBlockingMs = 0;
+static bool costModel = false;
+static int captureMinutes = 5;
+static int publishWindow = 0;
+static int publishBurst = 0;
+static int hibernateMinutes = 0;
+static int dormancySleepHour = 0;
+static int dormancyWakeHour = 0;
+static bool shortSleepCoalescing = false;
+static size_t stagingSize = 0;
+static uint8_t stagingBuffer[16384];
+static bool recordSchema = false;
+static bool columnar = false;
+static size_t retentionBytes = 0;
+static int retentionHours = 0;
+static int alarmHours = 0;
+static int alarmPriority = 0;
+static time_t nextAlarm = 0;
+static int publishIntervalHours = 0;
+static bool showLog = false;
+static FILE *publishFile = nullptr;
+static bool checkSamples = false;
+static std::vector<int> sampleTimes;
+static bool checkStateDwell = false;
+static bool checkHibernate = false;
+static int wakeEventCount = 0;
+static uint64_t stateDwellMs = 0;
+static uint64_t stateDwellAckMs = 0;
+
+// Called at boot, and again after each simulated reset
+static void configure() {
+    if (loopBlockingMs) {
+        SleepHelper::instance().withLoopBlocking(std::chrono::milliseconds(loopBlockingMs));
+    }
+    if (costModel) {
+        SleepHelper::instance().withCellularCostModel();
+    }
+    if (publishWindow) {
+        SleepHelper::instance().withPublishWindow(publishWindow);
+    }
+    if (publishBurst) {
+        SleepHelper::instance().withPublishRateLimit(publishBurst, 1s);
+    }
+    if (hibernateMinutes) {
+        SleepHelper::instance().withHibernateMinimumTime(std::chrono::minutes(hibernateMinutes));
+    }
+    if (dormancySleepHour != dormancyWakeHour) {
+        SleepHelper::instance().withDormancyWindow(LocalTimeHMS().withHour(dormancySleepHour), LocalTimeHMS().withHour(dormancyWakeHour));
+    }
+    if (shortSleepCoalescing) {
+        SleepHelper::instance().withShortSleepCoalescing();
+    }
+    if (stagingSize) {
+        SleepHelper::instance().withEventHistoryStaging(stagingBuffer, stagingSize);
+    }
+    if (recordSchema) {
+        SleepHelper::instance().withEventHistoryRecordSchema(SleepHelper::EventHistory::RecordSchema()
+            .withTime("t")
+            .withInt("bs")
+            .withFixed("c", 1)
+            .withColumnar(columnar));
+    }
+    if (retentionBytes || retentionHours) {
+        SleepHelper::instance().withEventHistoryRetentionPolicy(SleepHelper::EventHistory::RetentionPolicy()
+            .withMaxBytes(retentionBytes)
+            .withMaxAge(std::chrono::hours(retentionHours)));
+    }
+    if (alarmPriority) {
+        SleepHelper::instance().withEventHistoryChannel(SleepHelper::EventCombiner::HistoryChannel("alarms")
+            .withPath(String(dataDir) + "/alarms.txt")
+            .withKey("al")
+            .withPriority(alarmPriority));
+    }
+    if (publishIntervalHours) {
+        SleepHelper::instance().withEventHistoryChannel(SleepHelper::EventCombiner::HistoryChannel()
+            .withPublishInterval(std::chrono::hours(publishIntervalHours)));
+    }
+    if (showLog) {
+        SleepHelper::instance().withLogEnabledEnable(SleepHelper::logEnabledPublishData);
+    }
+
+    String settingsPath = String(dataDir) + "/sleepSettings.json";
+    String dataPath = String(dataDir) + "/sleepData.dat";
+    String eventsPath = String(dataDir) + "/events.txt";
+
+    SleepHelper::instance().settingsFile.withPath(settingsPath);
+    SleepHelper::instance().persistentData.withPath(dataPath);
+
+    SleepHelper::instance()
+        .withMinimumCellularOffTime(5min)
+        .withMaximumTimeToConnect(11min)
+        .withTimeConfig("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00")
+        .withEventHistory(eventsPath, "eh")
+        .withDataCaptureFunction([](SleepHelper::AppCallbackState &state) {
+            if (Time.isValid()) {
+                SleepHelper::instance().addEvent([](JSONWriter &writer) {
+                    writer.name("t").value((int) Time.now());
+                    writer.name("bs").value(4);
+                    writer.name("c").value(21.5);
+                });
+
+                if (alarmHours && Time.now() >= nextAlarm) {
+                    nextAlarm = Time.now() + alarmHours * 3600;
+                    auto alarm = [](JSONWriter &writer) {
+                        writer.name("t").value((int) Time.now());
+                        writer.name("alarm").value(1);
+                    };
+                    if (alarmPriority) {
+                        SleepHelper::instance().addEvent("alarms", alarm);
+                    }
+                    else {
+                        SleepHelper::instance().addEvent(alarm);
+                    }
+                }
+            }
+            return false;
+        });
+
+    // Every 15 minutes from 9:00 AM to 10:00 PM local time on weekdays, every 2 hours other times
+    SleepHelper::instance().getScheduleFull()
+        .withMinuteOfHour(15, LocalTimeRange(LocalTimeHMS("09:00:00"), LocalTimeHMS("21:59:59"), LocalTimeRestrictedDate(LocalTimeDayOfWeek::MASK_WEEKDAY)))
+        .withHourOfDay(2);
+
+    // Data capture every 5 minutes
+    if (captureMinutes > 0) {
+        SleepHelper::instance().getScheduleDataCapture()
+            .withMinuteOfHour(captureMinutes);
+    }
+
+    SleepHelper::instance().setup();
+}
+
+// Called by the simulator for each acknowledged publish
+static void publishAcked(const char *name, const char *data) {
+    if (publishFile) {
+        fprintf(publishFile, "%s\n", data);
+    }
+    if (checkStateDwell) {
+        JSONValue outerObj = JSONValue::parseCopy(data);
+        JSONObjectIterator iter(outerObj);
+        while(iter.next()) {
+            if (iter.name() != "sd") {
+                continue;
+            }
+            JSONObjectIterator groupIter(iter.value());
+            while(groupIter.next()) {
+                if (groupIter.name() != "mAh") {
+                    stateDwellMs += groupIter.value().toInt();
+                }
+            }
+            stateDwellAckMs = SleepHelperSim::instance().getMillis();
+        }
+    }
+    if (checkHibernate && strstr(data, "\"ttc\":")) {
+        // Each wake that connects adds its time to connect to the wake event
+        wakeEventCount++;
+    }
+    if (!checkSamples) {
+        return;
+    }
+
+    // Samples are the data capture events in the default event history, the ones with a bs key
+    JSONValue outerObj = JSONValue::parseCopy(data);
+    JSONObjectIterator iter(outerObj);
+    while(iter.next()) {
+        if (iter.name() != "eh" || !iter.value().isArray()) {
+            continue;
+        }
+        JSONArrayIterator eventIter(iter.value());
+        while(eventIter.next()) {
+            int t = 0;
+            bool isSample = false;
+            JSONObjectIterator fieldIter(eventIter.value());
+            while(fieldIter.next()) {
+                if (fieldIter.name() == "t") {
+                    t = fieldIter.value().toInt();
+                }
+                else
+                if (fieldIter.name() == "bs") {
+                    isSample = true;
+                }
+            }
+            if (isSample) {
+                sampleTimes.push_back(t);
+            }
+        }
+    }
+}
+
+// Returns the end of the -o dormant period that t is in, or 0 if it isn't in one. Same as SleepHelper::getDormancyEnd().
+static time_t getDormancyEnd(time_t t) {
+    if (dormancySleepHour == dormancyWakeHour) {
+        return 0;
+    }
+
+    LocalTimeConvert conv;
+    conv.withTime(t).convert();
+
+    int hour = conv.getLocalTimeHMS().hour;
+    bool dormant;
+    if (dormancySleepHour < dormancyWakeHour) {
+        dormant = hour >= dormancySleepHour && hour < dormancyWakeHour;
+    }
+    else {
+        dormant = hour >= dormancySleepHour || hour < dormancyWakeHour;
+    }
+    if (!dormant) {
+        return 0;
+    }
+
+    conv.nextLocalTime(LocalTimeHMS().withHour(dormancyWakeHour));
+    return conv.time;
+}
+
+// Returns false if a sample was published more than once or one is missing, see -K
+static bool checkSampleTimes() {
+    if (sampleTimes.empty()) {
+        printf("sample check failed: no samples published\n");
+        return false;
+    }
+    std::sort(sampleTimes.begin(), sampleTimes.end());
+
+    // Samples are taken when the device wakes at each capture time, which can be a few seconds late
+    int maxGap = captureMinutes * 60 + 60;
+    for(size_t ii = 1; ii < sampleTimes.size(); ii++) {
+        int gap = sampleTimes[ii] - sampleTimes[ii - 1];
+        if (gap == 0) {
+            printf("sample check failed: sample at %d published more than once\n", sampleTimes[ii]);
+            return false;
+        }
+        if (gap > maxGap) {
+            // No data capture during the dormant period, the next sample is when it ends
+            time_t dormancyEnd = getDormancyEnd(sampleTimes[ii - 1] + captureMinutes * 60);
+            if (dormancyEnd != 0 && sampleTimes[ii] <= dormancyEnd + maxGap) {
+                continue;
+            }
+            printf("sample check failed: no samples from %d to %d\n", sampleTimes[ii - 1], sampleTimes[ii]);
+            return false;
+        }
+    }
+    printf("sample check passed: %lu samples from %d to %d\n", (unsigned long)sampleTimes.size(), sampleTimes.front(), sampleTimes.back());
+    return true;
+}
+
+// Returns false if the state dwell times in the acknowledged publishes don't add up to the simulated time, see -W
+static bool checkStateDwellTimes(uint64_t endMs) {
+    // Time after the last report is in the next one, and a reset loses the time that wasn't saved in
+    // the persistent data yet. Without the publish check, each reset would lose a whole report.
+    uint64_t slackMs = 20 * 60 * 1000;
+    if (stateDwellMs > endMs || stateDwellMs + slackMs < stateDwellAckMs) {
+        printf("state dwell check failed: %.1f s reported, %.1f s simulated, last report at %.1f s\n", 
+            (double)stateDwellMs / 1000.0, (double)endMs / 1000.0, (double)stateDwellAckMs / 1000.0);
+        return false;
+    }
+    printf("state dwell check passed: %.1f s reported, last report at %.1f s\n", (double)stateDwellMs / 1000.0, (double)stateDwellAckMs / 1000.0);
+    return true;
+}
+
+// Returns false if the device never hibernated, a wake from HIBERNATE was not the type of wake the schedule
+// calls for, or a wake event was lost, see -H. The quick or full wake decision is saved in the persistent data
+// before HIBERNATE, and SleepHelper doesn't use HIBERNATE while wake events are waiting to be published.
+static bool checkHibernateWakes() {
+    const std::vector<SleepHelperSim::CycleStats> &cycles = SleepHelperSim::instance().getCycles();
+
+    // Wake events from the wakes after the last successful publish can still be waiting
+    int connectedCount = 0;
+    int pendingCount = 0;
+    for(size_t ii = 0; ii < cycles.size(); ii++) {
+        if (cycles[ii].connectMs) {
+            connectedCount++;
+            pendingCount++;
+        }
+        if (cycles[ii].publishCount) {
+            pendingCount = 0;
+        }
+    }
+    if (wakeEventCount < connectedCount - pendingCount) {
+        printf("hibernate check failed: %d wakes connected but only %d wake events published\n", connectedCount - pendingCount, wakeEventCount);
+        return false;
+    }
+
+    int hibernateCount = 0;
+    int quickCount = 0;
+    for(size_t ii = 1; ii < cycles.size(); ii++) {
+        if (!cycles[ii - 1].hibernate) {
+            continue;
+        }
+        hibernateCount++;
+
+        // The wake time includes the time to boot, so it's a little after the scheduled time
+        const SleepHelperSim::CycleStats &c = cycles[ii];
+        time_t scheduleTime = c.wakeTime - 60;
+        LocalTimeConvert conv;
+        conv.withTime(scheduleTime).convert();
+        time_t nextFullWake = SleepHelper::instance().scheduleManager.getNextFullWake(conv);
+        time_t dormancyEnd = getDormancyEnd(scheduleTime);
+        bool expectFull = (nextFullWake != 0 && nextFullWake <= c.wakeTime) || (dormancyEnd != 0 && dormancyEnd <= c.wakeTime);
+        bool isFull = (c.connectAttempts > 0);
+        if (isFull != expectFull) {
+            printf("hibernate check failed: %s wake at %ld after HIBERNATE, expected %s\n", isFull ? "full" : "quick", (long)c.wakeTime, expectFull ? "full" : "quick");
+            return false;
+        }
+        if (!isFull) {
+            quickCount++;
+        }
+    }
+    if (hibernateCount == 0) {
+        printf("hibernate check failed: no HIBERNATE sleeps\n");
+        return false;
+    }
+    printf("hibernate check passed: %d wakes from HIBERNATE, %d quick, %d wake events published\n", hibernateCount, quickCount, wakeEventCount);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    double days = 365;
+    bool verbose = false;
+
+    SleepHelperSim &sim = SleepHelperSim::instance();
+
+    int opt;
+    while((opt = getopt(argc, argv, "d:n:c:j:f:p:u:z:s:b:mi:q:r:h:o:ke:tCa:g:x:y:WR:L:P:KHvl")) != -1) {
+        switch(opt) {
+            case 'd': days = atof(optarg); break;
+            case 'n': sim.withNetworkReadyMs(atoi(optarg)); break;
+            case 'c': sim.withCloudConnectMs(atoi(optarg)); break;
+            case 'j': sim.withConnectJitterMs(atoi(optarg)); break;
+            case 'f': sim.withConnectFailPercent(atoi(optarg)); break;
+            case 'p': sim.withPublishAckMs(atoi(optarg)); break;
+            case 'u': sim.withPublishFailPercent(atoi(optarg)); break;
+            case 'z': sim.withMaxEventDataSize(atoi(optarg)); break;
+            case 's': sim.withSeed(atoi(optarg)); break;
+            case 'b': loopBlockingMs = atoi(optarg); break;
+            case 'm': costModel = true; break;
+            case 'i': captureMinutes = atoi(optarg); break;
+            case 'q': publishWindow = atoi(optarg); break;
+            case 'r': publishBurst = atoi(optarg); break;
+            case 'h': hibernateMinutes = atoi(optarg); break;
+            case 'o': 
+                if (sscanf(optarg, "%d:%d", &dormancySleepHour, &dormancyWakeHour) != 2) {
+                    fprintf(stderr, "-o must be sleepHour:wakeHour\n");
+                    return 1;
+                }
+                break;
+            case 'k': shortSleepCoalescing = true; break;
+            case 'e': 
+                stagingSize = atoi(optarg);
+                if (stagingSize > sizeof(stagingBuffer)) {
+                    fprintf(stderr, "-e maximum is %lu\n", (unsigned long)sizeof(stagingBuffer));
+                    return 1;
+                }
+                break;
+            case 't': recordSchema = true; break;
+            case 'C': recordSchema = columnar = true; break;
+            case 'a':
+                if (sscanf(optarg, "%lu:%d", &retentionBytes, &retentionHours) < 1) {
+                    fprintf(stderr, "-a must be maxBytes or maxBytes:maxAgeHours\n");
+                    return 1;
+                }
+                recordSchema = true;
+                break;
+            case 'g': {
+                double outageStart, outageDays;
+                if (sscanf(optarg, "%lf:%lf", &outageStart, &outageDays) != 2) {
+                    fprintf(stderr, "-g must be startDay:days\n");
+                    return 1;
+                }
+                sim.withOutage((uint64_t)(outageStart * 86400000.0), (uint64_t)((outageStart + outageDays) * 86400000.0));
+                break;
+            }
+            case 'x':
+                if (sscanf(optarg, "%d:%d", &alarmHours, &alarmPriority) < 1) {
+                    fprintf(stderr, "-x must be alarmHours or alarmHours:priority\n");
+                    return 1;
+                }
+                break;
+            case 'y': publishIntervalHours = atoi(optarg); break;
+            case 'R': sim.withResetPercent(atoi(optarg)); break;
+            case 'L': sim.withCloudLostPercent(atoi(optarg)); break;
+            case 'P':
+                publishFile = fopen(optarg, "w");
+                if (!publishFile) {
+                    fprintf(stderr, "could not open %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'K': checkSamples = true; break;
+            case 'W': checkStateDwell = true; break;
+            case 'H': checkHibernate = true; break;
+            case 'v': verbose = true; break;
+            case 'l': showLog = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-d days] [-n networkReadyMs] [-c cloudConnectMs] [-j connectJitterMs] [-f connectFailPercent] [-p publishAckMs] [-u publishFailPercent] [-z maxEventDataSize] [-s seed] [-b maxBlockMs] [-m] [-i captureMinutes] [-q publishWindow] [-r publishBurst] [-h hibernateMinutes] [-o sleepHour:wakeHour] [-k] [-e stagingBytes] [-t] [-C] [-a maxBytes[:maxAgeHours]] [-g startDay:days] [-x alarmHours[:priority]] [-y publishIntervalHours] [-R resetPercent] [-L cloudLostPercent] [-P publishFile] [-K] [-W] [-H] [-v] [-l]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (checkSamples && (columnar || retentionBytes || retentionHours || captureMinutes <= 0)) {
+        fprintf(stderr, "-K can't check columnar blocks (-C), aggregates (-a), or without data capture (-i 0)\n");
+        return 1;
+    }
+    if (checkHibernate && sim.getResetPercent()) {
+        fprintf(stderr, "-H can't check wake events with resets (-R)\n");
+        return 1;
+    }
+    if (publishFile || checkSamples || checkStateDwell || checkHibernate) {
+        sim.withPublishAckedFunction(publishAcked);
+    }
+    if (!showLog) {
+        Logger::minimumLevel() = LOG_LEVEL_NONE;
+    }
+
+    // Start from empty files each run
+    mkdir(dataDir, 0777);
+    DIR *dir = opendir(dataDir);
+    if (dir) {
+        struct dirent *ent;
+        while((ent = readdir(dir)) != NULL) {
+            if (ent->d_type == DT_REG) {
+                unlink(String(dataDir) + "/" + ent->d_name);
+            }
+        }
+        closedir(dir);
+    }
+
+    configure();
+
+    uint64_t endMs = (uint64_t)(days * 86400000.0);
+    while(sim.getMillis() < endMs) {
+        try {
+            SleepHelper::instance().loop();
+        }
+        catch(const SleepHelperSim::HibernateReset &) {
+            // Waking from HIBERNATE resets the device
+            SleepHelper::simulateReset();
+            configure();
+        }
+        catch(const SleepHelperSim::Reset &) {
+            SleepHelper::simulateReset();
+            configure();
+        }
+        try {
+            sim.loop();
+        }
+        catch(const SleepHelperSim::Reset &) {
+            SleepHelper::simulateReset();
+            configure();
+        }
+    }
+
+    sim.report(stdout, verbose);
+    printf("schedule cache hits %lu, evaluations %lu\n", 
+        (unsigned long)SleepHelper::instance().scheduleCache.getHitCount(), (unsigned long)SleepHelper::instance().scheduleCache.getMissCount());
+
+    if (publishFile) {
+        fclose(publishFile);
+    }
+    if (checkSamples && !checkSampleTimes()) {
+        return 1;
+    }
+    if (checkStateDwell && !checkStateDwellTimes(sim.getMillis())) {
+        return 1;
+    }
+    if (checkHibernate && !checkHibernateWakes()) {
+        return 1;
+    }
+    return 0;
+}
@@ -6,7 +6,10 @@
 
 #include <cmath>
 #include <fcntl.h>
+#include <dirent.h>
 #include <algorithm> // std::sort
+#include <climits> // INT_MIN, INT_MAX
+#include <cassert>
 
 SleepHelper *SleepHelper::_instance;
 
@@ -18,6 +21,24 @@ SleepHelper &SleepHelper::instance() {
     return *_instance;
 }
 
+// [static]
+void SleepHelper::callbackCapacityExceeded(size_t capacity) {
+    instance().appLog.error("too many callbacks (%u), increase SLEEPHELPER_CALLBACK_CAPACITY, or SLEEPHELPER_EVENT_CALLBACK_CAPACITY or SLEEPHELPER_EVENT_ONE_TIME_CAPACITY for event callbacks", (unsigned)capacity);
+#if defined(UNITTEST)
+    assert(!"too many callbacks, increase the SLEEPHELPER_CALLBACK_CAPACITY or SLEEPHELPER_EVENT_*_CAPACITY setting");
+#elif defined(DEBUG_BUILD)
+    SPARK_ASSERT(false);
+#endif
+}
+
+#ifdef UNITTEST
+// [static]
+void SleepHelper::simulateReset() {
+    delete _instance;
+    _instance = nullptr;
+}
+#endif
+
 /**
  * @brief Structure that defines wake events and the JSON keys used for them (internal)
  */
@@ -32,6 +53,14 @@ static SleepHelperWakeEvents _wakeEvents[] = {
     { SleepHelper::eventsEnabledTimeToConnect, "ttc", 50 },
     { SleepHelper::eventsEnabledResetReason, "rr", 50 },
     { SleepHelper::eventsEnabledBatterySoC, "soc", 50 },
+    { SleepHelper::eventsEnabledStateDwell, "sd", 50 },
+};
+
+/**
+ * @brief JSON keys in the "sd" wake event, indexed by STATE_DWELL_AWAKE, etc.
+ */
+static const char * const _stateDwellNames[SleepHelper::STATE_DWELL_COUNT] = {
+    "aw", "cw", "cn", "pw", "rw", "dw", "co", "ss", "sl", "sb"
 };
 
 static const SleepHelperWakeEvents *_findWakeEvent(uint64_t flag) {
@@ -77,16 +106,32 @@ SleepHelper::SleepHelper() : appLog("app.sleep") {
 SleepHelper::~SleepHelper() {
 }
 
-#ifndef UNITTEST
 void SleepHelper::setup() {
     int resetReason = (int) System.resetReason();
 
     // Register for system events
-    System.on(firmware_update | firmware_update_pending | reset | out_of_memory, systemEventHandlerStatic);
+    System.on(firmware_update | firmware_update_pending | reset | out_of_memory | network_status | cloud_status, systemEventHandlerStatic);
+
+    os_semaphore_create(&stateEventSemaphore, 1, 0);
 
     settingsFile.setup();
     persistentData.setup();
 
+    withSleepOrResetFunction([this](bool isReset) {
+        // RAM is kept in ULTRA_LOW_POWER sleep, so staged event history only needs to be written 
+        // to the file before a reset or HIBERNATE
+        if (isReset || sleepParams.hibernate) {
+            wakeEventFunctions.flushEventHistory();
+        }
+        return true;
+    });
+
+    stateDwellStartMillis = millis();
+
+    if (persistentData.getValue_hibernateSleepMs()) {
+        hibernateWake();
+    }
+
     // Setup empty quick and full wake schedules to start. Data schedule is a quick wake, but also runs 
     // while the device is running, including while it's trying to connect.
     getScheduleQuick().withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
@@ -132,7 +177,7 @@ void SleepHelper::setup() {
         LocalTimeConvert conv;
         conv.withTime(t).convert();
 
-        t = scheduleManager.getNextFullWake(conv);
+        t = scheduleCache.getNextTime(scheduleManager, ScheduleCache::NEXT_FULL_WAKE, conv);
         if (t <= Time.now()) {
             // It's time to do a full wake
             appLog.info("time to do full wake");
@@ -154,9 +199,125 @@ void SleepHelper::loop() {
     // The data capture handler runs in parallel to the main state machine
     dataCaptureHandler();
 
-    // Call the connection state handler
-    stateHandler(*this);
+    // The publish callback can change the state from another thread
+    stateChangeCheck();
+
+    // Call the connection state handler if it's waiting for an event that occurred, or its time has come
+    if (stateEvent || (int32_t)(millis() - stateDeadlineMillis) >= 0) {
+        stateEvent = false;
+        stateDeadlineMillis = millis();
+
+        (this->*stateHandler)();
+
+        stateChangeCheck();
+    }
+
+    if (loopBlockingMaxMs) {
+        system_tick_t idleMs = getIdleTimeMs();
+        if (idleMs > loopBlockingMaxMs) {
+            idleMs = loopBlockingMaxMs;
+        }
+        if (idleMs) {
+            // Returns early if stateEventNotify() is called
+            os_semaphore_take(stateEventSemaphore, idleMs, false);
+        }
+    }
+}
+
+system_tick_t SleepHelper::getIdleTimeMs() const {
+    if (stateEvent || stateHandler != stateDwellHandler) {
+        return 0;
+    }
+
+    system_tick_t now = millis();
+    if ((int32_t)(stateDeadlineMillis - now) <= 0) {
+        return 0;
+    }
+    system_tick_t idleMs = stateDeadlineMillis - now;
+
+    system_tick_t dataCaptureElapsedMs = now - dataCaptureIdleMillis;
+    if (dataCaptureIdleMs <= dataCaptureElapsedMs) {
+        return 0;
+    }
+    if (idleMs > dataCaptureIdleMs - dataCaptureElapsedMs) {
+        idleMs = dataCaptureIdleMs - dataCaptureElapsedMs;
+    }
+    return idleMs;
+}
+
+void SleepHelper::stateChangeCheck() {
+    if (stateHandler != stateDwellHandler) {
+        stateDwellUpdate();
+        stateDwellHandler = stateHandler;
+        stateDeadlineMillis = millis();
+    }
+}
+
+void SleepHelper::stateWait(system_tick_t ms) {
+    stateDeadlineMillis = millis() + ms;
+}
+
+void SleepHelper::stateEventNotify() {
+    stateEvent = true;
+    if (stateEventSemaphore) {
+        os_semaphore_give(stateEventSemaphore, false);
+    }
+}
+
+void SleepHelper::stateDwellUpdate() {
+    system_tick_t now = millis();
+    persistentData.addValue_stateDwellMs(stateDwellGroup(stateDwellHandler), now - stateDwellStartMillis);
+    stateDwellStartMillis = now;
+}
+
+// [static]
+void SleepHelper::stateDwellAcknowledge() {
+    // The "sd" report can be in any part of the wake event, so wait for all of them
+    for(auto it = publishData.begin(); it != publishData.end(); ++it) {
+        if (it->stateDwell) {
+            return;
+        }
+    }
+
+    for(size_t ii = 0; ii < STATE_DWELL_COUNT; ii++) {
+        if (stateDwellReportedMs[ii]) {
+            // Time added since the report stays for the next one
+            WITH_LOCK(persistentData) {
+                persistentData.setValue_stateDwellMs(ii, persistentData.getValue_stateDwellMs(ii) - stateDwellReportedMs[ii]);
+            }
+            stateDwellReportedMs[ii] = 0;
+        }
+    }
+}
 
+size_t SleepHelper::stateDwellGroup(void (SleepHelper::*handler)()) {
+    static const struct {
+        void (SleepHelper::*handler)();
+        size_t group;
+    } groups[] = {
+        { &SleepHelper::stateHandlerConnectWait, STATE_DWELL_CONNECT_WAIT },
+        { &SleepHelper::stateHandlerTimeValidWait, STATE_DWELL_CONNECT_WAIT },
+        { &SleepHelper::stateHandlerConnectedStart, STATE_DWELL_CONNECTED },
+        { &SleepHelper::stateHandlerConnectedWakeEvents, STATE_DWELL_CONNECTED },
+        { &SleepHelper::stateHandlerConnected, STATE_DWELL_CONNECTED },
+        { &SleepHelper::stateHandlerPublishWait, STATE_DWELL_PUBLISH_WAIT },
+        { &SleepHelper::stateHandlerPublishRateLimit, STATE_DWELL_PUBLISH_WAIT },
+        { &SleepHelper::stateHandlerReconnectWait, STATE_DWELL_RECONNECT_WAIT },
+        { &SleepHelper::stateHandlerDisconnectBeforeSleep, STATE_DWELL_DISCONNECT_WAIT },
+        { &SleepHelper::stateHandlerDisconnectWait, STATE_DWELL_DISCONNECT_WAIT },
+        { &SleepHelper::stateHandlerWaitCellularDisconnected, STATE_DWELL_DISCONNECT_WAIT },
+        { &SleepHelper::stateHandlerWaitCellularOff, STATE_DWELL_CELLULAR_OFF },
+        { &SleepHelper::stateHandlerSleepShort, STATE_DWELL_SLEEP_SHORT },
+        { &SleepHelper::stateHandlerSleepCoalesce, STATE_DWELL_SLEEP_SHORT },
+    };
+
+    for(size_t ii = 0; ii < sizeof(groups) / sizeof(groups[0]); ii++) {
+        if (groups[ii].handler == handler) {
+            return groups[ii].group;
+        }
+    }
+    // stateHandlerStart, stateHandlerNoConnection, stateHandlerSleep, stateHandlerSleepDone
+    return STATE_DWELL_AWAKE;
 }
 
 void SleepHelper::systemEventHandler(system_event_t event, int param) {
@@ -184,6 +345,12 @@ void SleepHelper::systemEventHandler(system_event_t event, int param) {
             sleepOrResetFunctions.forEach(true);
             break;
 
+        case network_status:
+        case cloud_status:
+            // States waiting for a connection or disconnection check right away
+            stateEventNotify();
+            break;
+
         case out_of_memory:
             outOfMemory = true;
             break;
@@ -209,18 +376,49 @@ void SleepHelper::calculateSleepSettings(bool isConnected) {
 
     //
     LocalTimeConvert conv;
-    conv.withCurrentTime().convert();
-    time_t nextWake = scheduleManager.getNextWake(conv);
+    if (coalescedWakeTime > Time.now()) {
+        // The data capture at coalescedWakeTime was already done, see withShortSleepCoalescing()
+        conv.withTime(coalescedWakeTime).convert();
+    }
+    else {
+        conv.withCurrentTime().convert();
+    }
+    time_t nextWake = scheduleCache.getNextTime(scheduleManager, ScheduleCache::NEXT_WAKE, conv);
     if (nextWake != 0) {
         sleepParams.sleepTimeMs = (nextWake - Time.now()) * 1000;
     }
 
-    sleepParams.nextFullWakeTime = scheduleManager.getNextFullWake(conv);
+    sleepParams.nextFullWakeTime = scheduleCache.getNextTime(scheduleManager, ScheduleCache::NEXT_FULL_WAKE, conv);
+
+    // Skip the scheduled wakes in the dormant period and sleep until it ends, then do a full wake
+    time_t dormancyEnd = getDormancyEnd((nextWake != 0) ? nextWake : Time.now() + sleepParams.sleepTimeMs / 1000);
+    if (dormancyEnd != 0) {
+        appLog.info("dormant for %d sec", (int)(dormancyEnd - Time.now()));
+        nextWake = sleepParams.nextFullWakeTime = dormancyEnd;
+        sleepParams.sleepTimeMs = (nextWake - Time.now()) * 1000;
+    }
+    sleepParams.nextWakeTime = nextWake;
+
     if (sleepParams.nextFullWakeTime != 0) {
         sleepParams.timeUntilNextFullWakeMs = (sleepParams.nextFullWakeTime - Time.now()) * 1000;
     }
     sleepParams.disconnectCellular = (sleepParams.timeUntilNextFullWakeMs >= minimumCellularOffTimeMs);
 
+    // Optionally replace the fixed threshold with a measured cost comparison
+    sleepParams.costOff = sleepParams.costStandby = 0;
+    if (cellularCostFunction && isConnected) {
+        sleepParams.coldConnectMs = persistentData.getValue_coldConnectMs();
+        sleepParams.warmConnectMs = persistentData.getValue_warmConnectMs();
+        sleepParams.awakeSocPerHour = socPerHour(SOC_SEGMENT_AWAKE);
+        sleepParams.sleepOffSocPerHour = socPerHour(SOC_SEGMENT_SLEEP_OFF);
+        sleepParams.sleepStandbySocPerHour = socPerHour(SOC_SEGMENT_SLEEP_STANDBY);
+        cellularCostFunction(sleepParams);
+    }
+
+    // Use HIBERNATE for long sleeps if enabled and nothing would be lost by the reset on wake
+    sleepParams.hibernate = (hibernateMinimumMs != 0 && sleepParams.sleepTimeMs >= hibernateMinimumMs && 
+        (!isConnected || sleepParams.disconnectCellular) && canHibernate());
+
     // Allow other sleep configuration to be overridden
     sleepConfigurationFunctions.forEach(sleepConfig, sleepParams);
     if (sleepParams.sleepTimeMs < 1000) {
@@ -231,15 +429,171 @@ void SleepHelper::calculateSleepSettings(bool isConnected) {
     if (sleepParams.isConnected && !sleepParams.disconnectCellular) {
         // If we are connected and should not disconnect cellular, use cellular standby mode
         sleepConfig.network(NETWORK_INTERFACE_CELLULAR);
+
+        // Cellular standby requires ULTRA_LOW_POWER
+        sleepParams.hibernate = false;
+    }
+    if (sleepParams.hibernate) {
+        sleepConfig.mode(SystemSleepMode::HIBERNATE);
     }
 
     sleepConfig.duration(sleepParams.sleepTimeMs);
 }
 
+void SleepHelper::cellularCostModel(SleepConfigurationParameters &params) {
+    if (params.nextFullWakeTime == 0) {
+        return;
+    }
+
+    // Standby only saves the connection if the modem stays up until the full wake. With a quick
+    // wake in between, the full wake will connect from cellular off anyway.
+    bool standbyUseful = (params.sleepTimeMs >= params.timeUntilNextFullWakeMs);
+
+    // Never turn cellular off for less than the minimum time, regardless of cost
+    bool offAllowed = (params.timeUntilNextFullWakeMs >= minimumCellularOffTimeMs);
+
+    if (!standbyUseful || !offAllowed) {
+        params.disconnectCellular = offAllowed;
+        return;
+    }
+
+    bool haveStandby = (params.warmConnectMs != 0 && params.sleepStandbySocPerHour != 0);
+    bool haveOff = (params.coldConnectMs != 0 && params.sleepOffSocPerHour != 0);
+    if (!haveStandby || !haveOff || params.awakeSocPerHour == 0) {
+        // Measure whichever option hasn't been measured yet
+        params.disconnectCellular = haveStandby;
+        appLog.trace("cellular cost model measuring %s", haveStandby ? "off" : "standby");
+        return;
+    }
+
+    // SoC used until the next full wake is connected: sleep until then, plus the time awake connecting
+    double hours = (double)params.timeUntilNextFullWakeMs / 3600000.0;
+    params.costOff = (float)(params.sleepOffSocPerHour * hours + params.awakeSocPerHour * (double)params.coldConnectMs / 3600000.0);
+    params.costStandby = (float)(params.sleepStandbySocPerHour * hours + params.awakeSocPerHour * (double)params.warmConnectMs / 3600000.0);
+
+    params.disconnectCellular = (params.costOff <= params.costStandby);
+
+    // Occasionally use the other option so its measurements track changes in signal and battery
+    if ((++cellularCostDecisions % CELLULAR_COST_EXPLORE_INTERVAL) == 0) {
+        params.disconnectCellular = !params.disconnectCellular;
+    }
+
+    appLog.trace("cellular cost model off=%.4f standby=%.4f disconnect=%d", params.costOff, params.costStandby, (int)params.disconnectCellular);
+}
+
+float SleepHelper::socPerHour(uint32_t type) const {
+    uint32_t seconds = persistentData.getValue_socSeconds(type);
+    if (seconds == 0) {
+        return 0;
+    }
+    float drop = persistentData.getValue_socDrop(type);
+    if (drop <= 0) {
+        // Measured, but below the fuel gauge resolution. Use a small non-zero value so it still counts as measured.
+        drop = 0.001;
+    }
+    return drop * 3600.0 / (float)seconds;
+}
+
+void SleepHelper::socSegment(uint32_t type) {
+#if HAL_PLATFORM_POWER_MANAGEMENT
+    if (!cellularCostFunction) {
+        return;
+    }
+
+    float soc = System.batteryCharge();
+    time_t now = Time.isValid() ? Time.now() : 0;
+
+    uint32_t prevType = persistentData.getValue_socSegmentType();
+    if (prevType < SOC_SEGMENT_COUNT && soc >= 0 && now != 0) {
+        float drop = persistentData.getValue_socSegmentStart() - soc;
+        time_t seconds = now - persistentData.getValue_socSegmentStartTime();
+
+        // Segments where the battery charged are not useful for estimating the cost
+        if (drop >= 0 && seconds > 0) {
+            drop += persistentData.getValue_socDrop(prevType);
+            seconds += persistentData.getValue_socSeconds(prevType);
+
+            // Halve the totals periodically so older measurements count for less
+            time_t window = (prevType == SOC_SEGMENT_AWAKE) ? SOC_WINDOW_AWAKE_SEC : SOC_WINDOW_SLEEP_SEC;
+            if (seconds > window) {
+                drop /= 2;
+                seconds /= 2;
+            }
+            persistentData.setValue_socDrop(prevType, drop);
+            persistentData.setValue_socSeconds(prevType, (uint32_t)seconds);
+        }
+    }
+
+    if (type < SOC_SEGMENT_COUNT && soc >= 0 && now != 0) {
+        persistentData.setValue_socSegment(type, soc, now);
+    }
+    else {
+        persistentData.setValue_socSegment(SOC_SEGMENT_NONE, 0, 0);
+    }
+#endif // HAL_PLATFORM_POWER_MANAGEMENT
+}
+
+bool SleepHelper::canHibernate() const {
+    // Unpublished wake events and one-time wake event callbacks are only in RAM. The event history
+    // and persistent data are saved in the file system.
+    return publishData.empty() && !wakeEventFunctions.hasUnsavedCallbacks();
+}
+
+time_t SleepHelper::getDormancyEnd(time_t t) const {
+    if (dormancySleepTime == dormancyWakeTime) {
+        return 0;
+    }
+
+    LocalTimeConvert conv;
+    conv.withTime(t).convert();
+
+    LocalTimeHMS hms = conv.getLocalTimeHMS();
+    bool dormant;
+    if (dormancySleepTime < dormancyWakeTime) {
+        // Same day, such as 01:00 to 05:00
+        dormant = !(hms < dormancySleepTime) && hms < dormancyWakeTime;
+    }
+    else {
+        // Crosses midnight, such as 22:00 to 06:00
+        dormant = !(hms < dormancySleepTime) || hms < dormancyWakeTime;
+    }
+    if (!dormant) {
+        return 0;
+    }
+
+    conv.nextLocalTime(dormancyWakeTime);
+    return conv.time;
+}
+
+void SleepHelper::hibernateWake() {
+    uint32_t sleptMs = persistentData.getValue_hibernateSleepMs();
+    time_t start = persistentData.getValue_hibernateStart();
+    if (start && Time.isValid() && Time.now() >= start) {
+        sleptMs = (uint32_t)(Time.now() - start) * 1000;
+    }
+    appLog.info("woke from hibernate after %lu sec", (unsigned long)(sleptMs / 1000));
+
+    persistentData.addValue_stateDwellMs(STATE_DWELL_SLEEP, sleptMs);
+    socSegment(SOC_SEGMENT_NONE);
+
+    // Used by stateHandlerStart to tell if this is a quick wake
+    sleepParams.nextFullWakeTime = persistentData.getValue_hibernateNextFullWake();
+    persistentData.setValue_hibernate(0, 0, 0);
+
+    wakeReasonInt = WAKEUP_REASON_HIBERNATE;
+    withWakeEventFlagOneTimeFunction(eventsEnabledWakeReason, [this](JSONWriter &writer, int &priority) {
+        writer.value(wakeReasonInt);
+    });     
+}
+
 void SleepHelper::dataCaptureHandler() {
     // Data capture runs in a separate state machine so it will continue to run while in any state
     // as long as there is valid RTC time
 
+    // Until set below, data capture does not limit how long loop() can block
+    dataCaptureIdleMillis = millis();
+    dataCaptureIdleMs = 0xffffffff;
+
     if (dataCaptureFunctions.isEmpty()) {
         // If no data capture functions are defined, exit quickly
         return;
@@ -261,6 +615,7 @@ void SleepHelper::dataCaptureHandler() {
         if (!dataCaptureFunctions.whileAnyTrue()) {
             dataCaptureActive = false;
         }
+        dataCaptureIdleMs = 0;
     }
     else {
         bool updateSchedule = false;
@@ -271,22 +626,48 @@ void SleepHelper::dataCaptureHandler() {
         }
         else {
             if (persistentData.getValue_nextDataCapture() <= Time.now()) {
-                // Capture now
-                dataCaptureFunctions.setStartState();
-                dataCaptureActive = true;
+                if (getDormancyEnd(Time.now()) == 0) {
+                    // Capture now
+                    dataCaptureFunctions.setStartState();
+                    dataCaptureActive = true;
+                }
                 updateSchedule = true;
             }
         }
 
         if (updateSchedule) {
             LocalTimeConvert conv;
-            conv.withCurrentTime().convert();
+            if (coalescedWakeTime > Time.now()) {
+                // Captured early, so the next capture is the one after the scheduled time
+                conv.withTime(coalescedWakeTime).convert();
+            }
+            else {
+                conv.withCurrentTime().convert();
+            }
 
-            time_t t = scheduleManager.getNextDataCapture(conv);
+            time_t t = scheduleCache.getNextTime(scheduleManager, ScheduleCache::NEXT_DATA_CAPTURE, conv);
             if (t != 0) {
+                // No data capture during the dormant period
+                time_t dormancyEnd = getDormancyEnd(t);
+                if (dormancyEnd != 0) {
+                    t = dormancyEnd;
+                }
                 persistentData.setValue_nextDataCapture(t);
             }
         }
+
+        if (!dataCaptureActive) {
+            // The RTC only has 1 second resolution, so check more often in the last second
+            time_t now = Time.now();
+            time_t next = persistentData.getValue_nextDataCapture();
+            dataCaptureIdleMs = (next > now + 1) ? (system_tick_t)(next - now - 1) * 1000 : 0;
+            if (dataCaptureIdleMs < STATE_POLL_MS) {
+                dataCaptureIdleMs = STATE_POLL_MS;
+            }
+        }
+        else {
+            dataCaptureIdleMs = 0;
+        }
     }
 
 }
@@ -312,6 +693,8 @@ void SleepHelper::stateHandlerStart() {
     }
     appLog.info("connecting to cloud");
 
+    socSegment(SOC_SEGMENT_AWAKE);
+
     Particle.connect();    
     stateHandler = &SleepHelper::stateHandlerConnectWait;
     connectAttemptStartMillis = millis();
@@ -332,14 +715,22 @@ void SleepHelper::stateHandlerConnectWait() {
         appLog.info("connected to network in %lu ms", elapsedMs);
     }
 
+    if (!dataCaptureActive) {
+        // Build what we can of the wake event payload now, instead of after connecting
+        wakeEventFunctions.prepareEvents();
+    }
+
     system_tick_t elapsedMs = millis() - connectAttemptStartMillis;
 
-    if (maximumTimeToConnectFunctions.whileAnyFalse(false, elapsedMs)) {
+    if (!maximumTimeToConnectFunctions.whileAnyFalse(true, elapsedMs)) {
         appLog.info("timed out connecting to cloud");
         stateHandler = &SleepHelper::stateHandlerDisconnectBeforeSleep;
         return;
     }
 
+    // Cloud and network status system events end the wait early, so this only needs to
+    // check often enough for the maximum time to connect, which is in minutes
+    stateWait(1000);
 }
 
 void SleepHelper::stateHandlerTimeValidWait() {
@@ -350,6 +741,7 @@ void SleepHelper::stateHandlerTimeValidWait() {
         stateHandler = &SleepHelper::stateHandlerConnectedStart;
         return;
     }
+    stateWait(STATE_POLL_MS);
 }
 
 
@@ -361,6 +753,18 @@ void SleepHelper::stateHandlerConnectedStart() {
     system_tick_t elapsedMs = connectedStartMillis - connectAttemptStartMillis;
     appLog.info("connected to cloud in %lu ms", elapsedMs);
 
+    if (cellularCostFunction) {
+        // Exponentially weighted moving average with alpha = 1/8
+        uint32_t avg = wokeFromStandby ? persistentData.getValue_warmConnectMs() : persistentData.getValue_coldConnectMs();
+        avg = (avg == 0) ? elapsedMs : (avg * 7 + elapsedMs) / 8;
+        if (wokeFromStandby) {
+            persistentData.setValue_warmConnectMs(avg);
+        }
+        else {
+            persistentData.setValue_coldConnectMs(avg);
+        }
+    }
+
     withWakeEventFlagOneTimeFunction(eventsEnabledTimeToConnect, [elapsedMs](JSONWriter &writer, int &priority) {
         writer.value((int)elapsedMs);
     });
@@ -374,6 +778,37 @@ void SleepHelper::stateHandlerConnectedStart() {
     });
 #endif // HAL_PLATFORM_POWER_MANAGEMENT
 
+    withWakeEventFlagOneTimeFunction(eventsEnabledStateDwell, [this](JSONWriter &writer, int &priority) {
+        // Totals since the last report, including quick wake cycles. Time connected in this
+        // wake cycle is included in the next report.
+        stateDwellUpdate();
+
+        double mAh = 0;
+        bool hasCurrent = false;
+
+        writer.beginObject();
+        for(size_t ii = 0; ii < STATE_DWELL_COUNT; ii++) {
+            // Time already in a wake event that hasn't been published yet is not reported again
+            uint32_t ms = persistentData.getValue_stateDwellMs(ii) - stateDwellReportedMs[ii];
+            if (ms == 0) {
+                // Groups with no time are omitted to keep the event small
+                continue;
+            }
+            writer.name(_stateDwellNames[ii]).value((unsigned int)ms);
+            stateDwellReportedMs[ii] += ms;
+
+            if (stateDwellCurrentMa[ii] != 0) {
+                mAh += (double)stateDwellCurrentMa[ii] * (double)ms / 3600000.0;
+                hasCurrent = true;
+            }
+        }
+        if (hasCurrent) {
+            writer.name("mAh").value(mAh, 3);
+        }
+        writer.endObject();
+        stateDwellInPayload = true;
+    });
+
 
 
     stateHandler = &SleepHelper::stateHandlerConnectedWakeEvents;
@@ -388,7 +823,7 @@ void SleepHelper::stateHandlerConnectedWakeEvents() {
     }
 
     // Call the wake event handlers to see if they have JSON data to publish
-    wakeEventFunctions.generateEvents(wakeEventPayload);
+    wakeEventFunctions.generateEvents(wakeEventPayload, wakeEventHistory);
 
     lastEventHistoryCheckMillis = 0;
     sleepReadyFunctions.setStartState();
@@ -409,42 +844,24 @@ void SleepHelper::stateHandlerConnected() {
             lastEventHistoryCheckMillis = millis();
 
             // If there are events, add to the publish queue
-            for(auto it = wakeEventPayload.begin(); it != wakeEventPayload.end(); ++it) {
-                publishData.push_back(PublishData(wakeEventName, *it));            
+            for(size_t ii = 0; ii < wakeEventPayload.size(); ii++) {
+                publishData.push_back(PublishData(wakeEventName, wakeEventPayload[ii]));
+                if (ii < wakeEventHistory.size()) {
+                    publishData.back().historyRanges = wakeEventHistory[ii];
+                }
+                publishData.back().stateDwell = stateDwellInPayload;
+            }
+            if (!wakeEventPayload.empty()) {
+                stateDwellInPayload = false;
             }
             wakeEventPayload.clear();
+            wakeEventHistory.clear();
         }
     }
 
     if (!publishData.empty()) {
-        PublishData event = publishData.front();
-
-        stateTime = millis();
-
         // TODO: Pause PublishQueuePosixRK processing until our immediate events are finished
-
         stateHandler = &SleepHelper::stateHandlerPublishWait;
-
-        // 
-        if (logEnableEnabled(logEnabledPublishData)) {
-            appLog.trace("publishing name=%s flags=0x%x", event.eventName.c_str(), (int)event.flags.value());
-            appLog.write(LOG_LEVEL_TRACE, event.eventData.c_str(), event.eventData.length());
-            appLog.write(LOG_LEVEL_TRACE, "\r\n", 2);
-        }
-        
-
-        bool bResult = BackgroundPublishRK::instance().publish(event.eventName, event.eventData, event.flags, 
-            [this](bool succeeded, const char *event_name, const char *event_data, const void *event_context) {
-            // Callback
-            if (succeeded) {
-                appLog.info("removing item from publishData");
-                publishData.erase(publishData.begin());
-            }
-            stateHandler = &SleepHelper::stateHandlerPublishRateLimit;
-        });
-        if (!bResult) {
-            stateHandler = &SleepHelper::stateHandlerConnected;
-        }
         return;
     }
 
@@ -459,14 +876,173 @@ void SleepHelper::stateHandlerConnected() {
 }
 
 void SleepHelper::stateHandlerPublishWait() {
-    // Exiting this state happens from the background publish callback lambda, see stateHandlerConnected state
+    if (!Particle.connected()) {
+        // Publishes in flight stay in their slots and are handled after reconnecting
+        stateHandler = &SleepHelper::stateHandlerConnected;
+        return;
+    }
+
+    system_tick_t waitMs = publishPipeline();
+    if (publishData.empty()) {
+        stateHandler = &SleepHelper::stateHandlerConnected;
+        return;
+    }
+    if (!waitMs) {
+        if (publishRateWaitMs()) {
+            stateHandler = &SleepHelper::stateHandlerPublishRateLimit;
+            return;
+        }
+        // BackgroundPublishRK is busy with a publish that was not made by this library
+        waitMs = STATE_POLL_MS;
+    }
+    stateWait(waitMs);
 }
 
 void SleepHelper::stateHandlerPublishRateLimit() {
-    if (millis() - stateTime > 1000) {
+    system_tick_t waitMs = publishRateWaitMs();
+    if (!waitMs) {
         stateHandler = &SleepHelper::stateHandlerConnected;
         return;
     }
+    stateWait(waitMs);
+}
+
+system_tick_t SleepHelper::publishPipeline() {
+    size_t inFlight = 0;
+    bool pollFuture = false;
+
+    // Handle completed publishes
+    for(size_t ii = 0; ii < PUBLISH_WINDOW_MAX; ii++) {
+        PublishSlot &slot = publishSlots[ii];
+        if (!slot.publishId) {
+            continue;
+        }
+        if (!slot.background && slot.future.isDone()) {
+            slot.succeeded = slot.future.isSucceeded();
+            slot.done = true;
+        }
+        if (!slot.done) {
+            inFlight++;
+            if (!slot.background) {
+                pollFuture = true;
+            }
+            continue;
+        }
+
+        for(auto it = publishData.begin(); it != publishData.end(); ++it) {
+            if (it->publishId == slot.publishId) {
+                if (slot.succeeded) {
+                    appLog.info("removing item from publishData");
+                    if (!it->historyRanges.isEmpty()) {
+                        // Only remove the event history once it has been published
+                        wakeEventFunctions.acknowledgeEventHistory(it->historyRanges);
+                    }
+                    bool stateDwell = it->stateDwell;
+                    publishData.erase(it);
+                    if (stateDwell) {
+                        stateDwellAcknowledge();
+                    }
+                }
+                else {
+                    it->publishId = 0;
+                }
+                break;
+            }
+        }
+        slot.publishId = 0;
+    }
+
+    // Start new publishes, oldest first
+    for(auto it = publishData.begin(); it != publishData.end() && inFlight < publishWindow; ++it) {
+        if (it->publishId) {
+            continue;
+        }
+        if (publishRateWaitMs()) {
+            break;
+        }
+
+        PublishSlot *slot = nullptr;
+        for(size_t ii = 0; ii < PUBLISH_WINDOW_MAX; ii++) {
+            if (!publishSlots[ii].publishId) {
+                slot = &publishSlots[ii];
+                break;
+            }
+        }
+        if (!slot) {
+            break;
+        }
+
+        if (logEnableEnabled(logEnabledPublishData)) {
+            appLog.trace("publishing name=%s flags=0x%x", it->eventName.c_str(), (int)it->flags.value());
+            appLog.write(LOG_LEVEL_TRACE, it->eventData.c_str(), it->eventData.length());
+            appLog.write(LOG_LEVEL_TRACE, "\r\n", 2);
+        }
+
+        slot->done = false;
+        slot->succeeded = false;
+        slot->background = (publishWindow == 1);
+        if (slot->background) {
+            bool bResult = BackgroundPublishRK::instance().publish(it->eventName, it->eventData, it->flags, 
+                [this, slot](bool succeeded, const char *event_name, const char *event_data, const void *event_context) {
+                // Called from the background publish thread, publishPipeline() handles the result
+                slot->succeeded = succeeded;
+                slot->done = true;
+                stateEventNotify();
+            });
+            if (!bResult) {
+                // Still busy with an earlier publish
+                break;
+            }
+        }
+        else {
+            slot->future = Particle.publish(it->eventName, it->eventData, it->flags);
+            pollFuture = true;
+        }
+
+        if (++publishNextId == 0) {
+            publishNextId = 1;
+        }
+        slot->publishId = it->publishId = publishNextId;
+
+        if (publishRateTokens == publishRateBurst) {
+            publishRateRefillMillis = millis();
+        }
+        publishRateTokens--;
+        publishStartedFunctions.forEach(it->eventName.c_str());
+        inFlight++;
+    }
+
+    if (!inFlight) {
+        return 0;
+    }
+
+    // The BackgroundPublishRK callback calls stateEventNotify() so there's no need to check often
+    system_tick_t waitMs = pollFuture ? STATE_POLL_MS : 1000;
+    if (inFlight < publishWindow) {
+        system_tick_t rateWaitMs = publishRateWaitMs();
+        if (rateWaitMs && rateWaitMs < waitMs) {
+            waitMs = rateWaitMs;
+        }
+    }
+    return waitMs;
+}
+
+system_tick_t SleepHelper::publishRateWaitMs() {
+    if (publishRateTokens < publishRateBurst) {
+        system_tick_t elapsedMs = millis() - publishRateRefillMillis;
+        size_t earned = elapsedMs / publishRateIntervalMs;
+        if (earned) {
+            if (earned > publishRateBurst - publishRateTokens) {
+                earned = publishRateBurst - publishRateTokens;
+            }
+            publishRateTokens += earned;
+            publishRateRefillMillis += earned * publishRateIntervalMs;
+        }
+        if (!publishRateTokens) {
+            return publishRateIntervalMs - (millis() - publishRateRefillMillis);
+        }
+    }
+    return 0;
 }
 
 
@@ -478,11 +1054,12 @@ void SleepHelper::stateHandlerReconnectWait() {
 
     system_tick_t elapsedMs = millis() - reconnectAttemptStartMillis;
 
-    if (maximumTimeToConnectFunctions.whileAnyFalse(false, elapsedMs)) {
+    if (!maximumTimeToConnectFunctions.whileAnyFalse(true, elapsedMs)) {
         appLog.info("timed out reconnecting to cloud");
         stateHandler = &SleepHelper::stateHandlerDisconnectBeforeSleep;
         return;
     }
+    stateWait(1000);
 }
 
 void SleepHelper::stateHandlerNoConnection() {
@@ -536,6 +1113,7 @@ void SleepHelper::stateHandlerDisconnectWait() {
         stateHandler = &SleepHelper::stateHandlerWaitCellularDisconnected;
         return;
     }
+    stateWait(STATE_POLL_MS);
 }
 
 void SleepHelper::stateHandlerWaitCellularDisconnected() {
@@ -548,6 +1126,7 @@ void SleepHelper::stateHandlerWaitCellularDisconnected() {
         stateHandler = &SleepHelper::stateHandlerWaitCellularOff;
         return;
     }
+    stateWait(STATE_POLL_MS);
 }
 
 
@@ -560,7 +1139,7 @@ void SleepHelper::stateHandlerWaitCellularOff() {
         stateHandler = &SleepHelper::stateHandlerSleep;
         return;
     }
-
+    stateWait(STATE_POLL_MS);
 }
 
 void SleepHelper::stateHandlerSleep() {
@@ -569,6 +1148,20 @@ void SleepHelper::stateHandlerSleep() {
     // stateHandlerDisconnectBeforeSleep (trigger: not turning cellular off due to short sleep)
     appLog.info("stateHandlerSleep");
 
+    if (shortSleepCoalescing && Time.isValid() && !dataCaptureActive) {
+        // If the next wake is too soon to sleep and is only for data capture, do the capture now
+        time_t nextWake = sleepParams.nextWakeTime;
+        int remainingMs = (int)sleepParams.sleepTimeMs - (int)(System.millis() - sleepParams.calculatedMillis);
+        if (remainingMs < (int)minimumSleepTimeMs && nextWake != 0 && nextWake != sleepParams.nextFullWakeTime && 
+            nextWake == persistentData.getValue_nextDataCapture()) {
+            appLog.info("data capture %d sec early instead of a short sleep", (int)(nextWake - Time.now()));
+            coalescedWakeTime = nextWake;
+            persistentData.setValue_nextDataCapture(Time.now());
+            stateHandler = &SleepHelper::stateHandlerSleepCoalesce;
+            return;
+        }
+    }
+
     sleepOrResetFunctions.forEach(false);
 
     // Especially in the cloud disconnect case it can take several seconds to disconnect, so
@@ -584,12 +1177,49 @@ void SleepHelper::stateHandlerSleep() {
 
     wakeReasonInt = 0; // SystemSleepWakeupReason::UNKNOWN
 
-    if (sleepParams.sleepTimeMs >= minimumSleepTimeMs) {
+    // Periods too short for a normal sleep can still use a short ULTRA_LOW_POWER sleep
+    bool shortSleep = (shortSleepCoalescing && sleepParams.sleepTimeMs < minimumSleepTimeMs && sleepParams.sleepTimeMs >= SLEEP_SHORT_MIN_MS);
+    if (shortSleep && sleepParams.hibernate) {
+        sleepParams.hibernate = false;
+        sleepConfig.mode(SystemSleepMode::ULTRA_LOW_POWER);
+    }
+
+    if (sleepParams.sleepTimeMs >= minimumSleepTimeMs || shortSleep) {
         appLog.info("sleeping for %d sec adjustmentMs=%d", (int)(sleepParams.sleepTimeMs / 1000), adjustmentMs);
 
+        // Time asleep is accounted for separately below
+        stateDwellUpdate();
+        time_t sleepStartTime = Time.now();
+
+        bool sleepStandby = (sleepParams.isConnected && !sleepParams.disconnectCellular);
+        socSegment(sleepStandby ? SOC_SEGMENT_SLEEP_STANDBY : SOC_SEGMENT_SLEEP_OFF);
+
+        if (sleepParams.hibernate) {
+            // RAM is lost, so save what setup() needs to continue after the reset on wake
+            appLog.info("using hibernate");
+            persistentData.setValue_hibernate(sleepParams.sleepTimeMs, Time.isValid() ? sleepStartTime : 0, sleepParams.nextFullWakeTime);
+            persistentData.flush(true);
+        }
+
         // Sleep!
         SystemSleepResult sleepResult = System.sleep(sleepConfig);
 
+        if (sleepParams.hibernate) {
+            // Only returns from HIBERNATE if the sleep failed
+            persistentData.setValue_hibernate(0, 0, 0);
+        }
+
+        // millis() does not necessarily advance during sleep, so use the RTC if valid, otherwise the requested duration
+        uint32_t sleptMs = sleepParams.sleepTimeMs;
+        if (Time.isValid() && Time.now() >= sleepStartTime) {
+            sleptMs = (uint32_t)(Time.now() - sleepStartTime) * 1000;
+        }
+        persistentData.addValue_stateDwellMs(sleepStandby ? STATE_DWELL_SLEEP_STANDBY : STATE_DWELL_SLEEP, sleptMs);
+        stateDwellStartMillis = millis();
+
+        socSegment(SOC_SEGMENT_NONE);
+        wokeFromStandby = sleepStandby;
+
         wakeFunctions.forEach(sleepResult);
 
         wakeReasonInt = (int) sleepResult.wakeupReason();
@@ -620,15 +1250,30 @@ void SleepHelper::stateHandlerSleepDone() {
 
 }
 
+void SleepHelper::stateHandlerSleepCoalesce() {
+    // Prior state: stateHandlerSleep (trigger: next wake is a data capture less than minimumSleepTimeMs away)
+    // Next state: stateHandlerSleep (trigger: data capture complete)
+
+    if (dataCaptureActive || persistentData.getValue_nextDataCapture() <= Time.now()) {
+        // Wait for the data capture to start and finish
+        return;
+    }
+
+    // Cellular may have been turned off before entering stateHandlerSleep
+    calculateSleepSettings(sleepParams.isConnected && !sleepParams.disconnectCellular);
+    stateHandler = &SleepHelper::stateHandlerSleep;
+}
+
 void SleepHelper::stateHandlerSleepShort() {
-    if (millis() - stateTime >= sleepParams.sleepTimeMs) {
+    system_tick_t elapsedMs = millis() - stateTime;
+    if (elapsedMs >= sleepParams.sleepTimeMs) {
         stateHandler = &SleepHelper::stateHandlerSleepDone;
         return;
     }
+    stateWait(sleepParams.sleepTimeMs - elapsedMs);
 }
 
 
-#endif // UNITTEST
 
 //
 // SettingsFile
@@ -926,6 +1571,113 @@ uint32_t SleepHelper::CloudSettingsFile::murmur3_32(const uint8_t* key, size_t l
 	return h;
 }
 
+//
+// ScheduleCache
+//
+
+time_t SleepHelper::ScheduleCache::getNextTime(const LocalTimeScheduleManager &scheduleManager, size_t which, const LocalTimeConvert &conv) {
+    if (which >= COUNT) {
+        return 0;
+    }
+
+    uint32_t newKey = hash(scheduleManager, conv.config);
+    if (newKey != key) {
+        invalidate();
+        key = newKey;
+    }
+
+    Entry &entry = entries[which];
+    if (entry.valid && conv.time >= entry.startTime && (conv.time < entry.nextTime || (entry.nextTime == 0 && conv.time < entry.startTime + 86400))) {
+        // Nothing is scheduled between startTime and nextTime. When there is no schedule, check again daily
+        // in case a schedule item is beyond the lookahead limit.
+        hitCount++;
+        return entry.nextTime;
+    }
+    missCount++;
+
+    time_t nextTime = 0;
+    switch(which) {
+        case NEXT_WAKE:
+            nextTime = scheduleManager.getNextWake(conv);
+            break;
+
+        case NEXT_FULL_WAKE:
+            nextTime = scheduleManager.getNextFullWake(conv);
+            break;
+
+        case NEXT_DATA_CAPTURE:
+            nextTime = scheduleManager.getNextDataCapture(conv);
+            break;
+    }
+
+    if (entry.valid && nextTime == entry.nextTime && nextTime != 0 && conv.time < entry.startTime) {
+        // Same result from an earlier time, so extend the window instead of replacing it
+        entry.startTime = conv.time;
+    }
+    else {
+        entry.valid = true;
+        entry.startTime = conv.time;
+        entry.nextTime = nextTime;
+    }
+    return nextTime;
+}
+
+void SleepHelper::ScheduleCache::invalidate() {
+    for(size_t ii = 0; ii < COUNT; ii++) {
+        entries[ii].valid = false;
+    }
+}
+
+// [static]
+uint32_t SleepHelper::ScheduleCache::hash(const LocalTimeScheduleManager &scheduleManager, const LocalTimePosixTimezone &tz) {
+    uint32_t h = CloudSettingsFile::HASH_SEED;
+
+    auto add = [&h](const void *buf, size_t len) {
+        h = CloudSettingsFile::murmur3_32((const uint8_t *)buf, len, h);
+    };
+    auto addHMS = [&add](const LocalTimeHMS &hms) {
+        int8_t values[4] = { hms.hour, hms.minute, hms.second, hms.ignore };
+        add(values, sizeof(values));
+    };
+    auto addChange = [&add, &addHMS](const LocalTimeChange &change) {
+        int8_t values[4] = { change.month, change.week, change.dayOfWeek, change.valid };
+        add(values, sizeof(values));
+        addHMS(change.hms);
+    };
+
+    add(tz.dstName.c_str(), tz.dstName.length());
+    addHMS(tz.dstHMS);
+    add(tz.standardName.c_str(), tz.standardName.length());
+    addHMS(tz.standardHMS);
+    addChange(tz.dstStart);
+    addChange(tz.standardStart);
+
+    for(auto it = scheduleManager.schedules.begin(); it != scheduleManager.schedules.end(); ++it) {
+        add(it->name.c_str(), it->name.length() + 1);
+        add(&it->flags, sizeof(it->flags));
+
+        for(auto item = it->scheduleItems.begin(); item != it->scheduleItems.end(); ++item) {
+            int values[4] = { (int)item->scheduleItemType, item->increment, item->dayOfWeek, item->flags };
+            add(values, sizeof(values));
+
+            addHMS(item->timeRange.hmsStart);
+            addHMS(item->timeRange.hmsEnd);
+            uint8_t mask = item->timeRange.onlyOnDays.getMask();
+            add(&mask, sizeof(mask));
+
+            for(auto ymd = item->timeRange.onlyOnDates.begin(); ymd != item->timeRange.onlyOnDates.end(); ++ymd) {
+                add(&ymd->ymd, sizeof(ymd->ymd));
+            }
+            // Separator so a date can't move between the lists without changing the hash
+            add("x", 1);
+            for(auto ymd = item->timeRange.exceptDates.begin(); ymd != item->timeRange.exceptDates.end(); ++ymd) {
+                add(&ymd->ymd, sizeof(ymd->ymd));
+            }
+        }
+    }
+    return h;
+}
+
 
 //
 // PersistentDataBase
@@ -1078,6 +1830,222 @@ void SleepHelper::PersistentDataFile::flush(bool force) {
 // EventHistory
 //
 
+// Unsigned LEB128, 7 bits per byte. Returns nullptr if it doesn't fit before end.
+static uint8_t *_putVarint(uint8_t *p, const uint8_t *end, uint64_t value) {
+    do {
+        if (p >= end) {
+            return nullptr;
+        }
+        uint8_t b = value & 0x7f;
+        value >>= 7;
+        *p++ = value ? (b | 0x80) : b;
+    } while(value);
+    return p;
+}
+
+// Returns nullptr if the value is not complete before end
+static const uint8_t *_getVarint(const uint8_t *p, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+// Small negative numbers are small positive numbers: 0, -1, 1, -2, ... => 0, 1, 2, 3, ...
+static uint64_t _zigzagEncode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t _zigzagDecode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Used to find the size of JSON without writing it
+class _JSONCountWriter : public JSONWriter {
+public:
+    size_t count = 0;
+protected:
+    virtual void write(const char *data, size_t size) override {
+        count += size;
+    }
+};
+
+// Encodes consecutive binary records as one {"cols":"t:t,bs:i,c:f1","n":12,"z85":"..."} object, see
+// RecordSchema::withColumnar(). Each value is a bit code for the difference from the value of the same
+// field in the previous sample (for time fields, the difference between differences), so values that
+// don't change take 1 bit. The bits are Z85 encoded. tools/columnar-decode.js is the reference decoder.
+class _ColumnarEncoder {
+public:
+    // state is 4 values per field of schema
+    _ColumnarEncoder(const SleepHelper::EventHistory::RecordSchema &schema, uint8_t *buf, size_t size, int64_t *state) : 
+        schema(schema), buf(buf), size(size), numFields(schema.fields.size()), 
+        prev(state), prevDelta(&state[numFields]), savedPrev(&state[2 * numFields]), savedDelta(&state[3 * numFields]) {
+        for(size_t ii = 0; ii < numFields; ii++) {
+            descLen += schema.fields[ii].name.length() + ((ii > 0) ? 3 : 2);
+            if (schema.fields[ii].type == SleepHelper::EventHistory::RecordSchema::FieldType::FIXED) {
+                descLen++;
+            }
+        }
+    }
+
+    // Starts a new block
+    void clear() {
+        count = 0;
+        bits = 0;
+    }
+
+    // Adds a sample, values as from getRecordValues(). Returns false if there's no room in buf.
+    bool add(const int64_t *values) {
+        if (bits + numFields * 40 > size * 8) {
+            return false;
+        }
+        savedBits = bits;
+        memcpy(savedPrev, prev, numFields * sizeof(int64_t));
+        memcpy(savedDelta, prevDelta, numFields * sizeof(int64_t));
+
+        for(size_t ii = 0; ii < numFields; ii++) {
+            int64_t delta = values[ii] - ((count > 0) ? prev[ii] : 0);
+            if (schema.fields[ii].type == SleepHelper::EventHistory::RecordSchema::FieldType::TIME) {
+                if (count == 0) {
+                    putBits((uint64_t)values[ii], 32);
+                    delta = 0;
+                }
+                else {
+                    putValue(_zigzagEncode(delta - prevDelta[ii]));
+                }
+                prevDelta[ii] = delta;
+            }
+            else {
+                putValue(_zigzagEncode(delta));
+            }
+            prev[ii] = values[ii];
+        }
+        count++;
+        return true;
+    }
+
+    // Removes the sample added last
+    void undo() {
+        bits = savedBits;
+        memcpy(prev, savedPrev, numFields * sizeof(int64_t));
+        memcpy(prevDelta, savedDelta, numFields * sizeof(int64_t));
+        count--;
+    }
+
+    size_t getCount() const {
+        return count;
+    }
+
+    // Size of the JSON object written by write()
+    size_t getJSONSize() const {
+        char countStr[12];
+        return strlen("{\"cols\":\"\",\"n\":,\"z85\":\"\"}") + descLen + snprintf(countStr, sizeof(countStr), "%u", (unsigned)count) + getZ85Size();
+    }
+
+    // text must have room for getZ85Size() and descLen characters
+    void write(JSONWriter &writer, char *text) {
+        char *cur = text;
+        for(size_t ii = 0; ii < numFields; ii++) {
+            const SleepHelper::EventHistory::RecordSchema::Field &field = schema.fields[ii];
+            if (ii > 0) {
+                *cur++ = ',';
+            }
+            memcpy(cur, field.name.c_str(), field.name.length());
+            cur += field.name.length();
+            *cur++ = ':';
+            switch(field.type) {
+                case SleepHelper::EventHistory::RecordSchema::FieldType::TIME: *cur++ = 't'; break;
+                case SleepHelper::EventHistory::RecordSchema::FieldType::INT: *cur++ = 'i'; break;
+                case SleepHelper::EventHistory::RecordSchema::FieldType::FIXED: *cur++ = 'f'; *cur++ = '0' + field.decimals; break;
+                case SleepHelper::EventHistory::RecordSchema::FieldType::BOOL: *cur++ = 'b'; break;
+            }
+        }
+        writer.beginObject();
+        writer.name("cols").value(text, cur - text);
+        writer.name("n").value((unsigned)count);
+
+        // Z85 encodes 4 bytes as 5 characters, so pad with zeros. The decoder stops after n samples.
+        static const char z85[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+        size_t len = (bits + 31) / 32 * 4;
+        memset(&buf[(bits + 7) / 8], 0, len - (bits + 7) / 8);
+        cur = text;
+        for(size_t ii = 0; ii < len; ii += 4) {
+            uint32_t value = ((uint32_t)buf[ii] << 24) | ((uint32_t)buf[ii + 1] << 16) | ((uint32_t)buf[ii + 2] << 8) | buf[ii + 3];
+            for(int jj = 4; jj >= 0; jj--) {
+                cur[jj] = z85[value % 85];
+                value /= 85;
+            }
+            cur += 5;
+        }
+        writer.name("z85").value(text, cur - text);
+        writer.endObject();
+    }
+
+    size_t getZ85Size() const {
+        return (bits + 31) / 32 * 5;
+    }
+
+    size_t getDescSize() const {
+        return descLen;
+    }
+
+protected:
+    // 0 is '0', then '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits, '1111' + 36 bits
+    void putValue(uint64_t value) {
+        if (value == 0) {
+            putBits(0, 1);
+        }
+        else if (value < (1 << 7)) {
+            putBits(0b10, 2);
+            putBits(value, 7);
+        }
+        else if (value < (1 << 9)) {
+            putBits(0b110, 3);
+            putBits(value, 9);
+        }
+        else if (value < (1 << 12)) {
+            putBits(0b1110, 4);
+            putBits(value, 12);
+        }
+        else {
+            putBits(0b1111, 4);
+            putBits(value, 36);
+        }
+    }
+
+    // Most significant bit first
+    void putBits(uint64_t value, int count) {
+        for(int ii = count - 1; ii >= 0; ii--) {
+            uint8_t mask = 0x80 >> (bits % 8);
+            if ((value >> ii) & 1) {
+                buf[bits / 8] |= mask;
+            }
+            else {
+                buf[bits / 8] &= ~mask;
+            }
+            bits++;
+        }
+    }
+
+    const SleepHelper::EventHistory::RecordSchema &schema;
+    uint8_t *buf;
+    size_t size;
+    size_t numFields;
+    int64_t *prev;
+    int64_t *prevDelta;
+    int64_t *savedPrev;
+    int64_t *savedDelta;
+    size_t descLen = 0;
+    size_t count = 0;
+    size_t bits = 0;
+    size_t savedBits = 0;
+};
+
 
 void SleepHelper::EventHistory::addEvent(const char *jsonObj) {
     // Log
@@ -1087,15 +2055,52 @@ void SleepHelper::EventHistory::addEvent(const char *jsonObj) {
         SleepHelper::instance().appLog.write(LOG_LEVEL_TRACE, "\r\n", 2);
     }
 
-    // Append to the file
+    // Events are stored one per line and are copied into the published event without parsing them again
+    size_t len = strlen(jsonObj);
+    if (memchr(jsonObj, '\n', len) || !JSONValue::parseCopy(jsonObj, len).isObject()) {
+        SleepHelper::instance().appLog.error("EventHistory::addEvent ignored, not a JSON object on one line");
+        return;
+    }
+
     WITH_LOCK(*this) {
-        int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+
+        if (staging) {
+            if (staging->used + len + 1 > staging->size - STAGING_HEADER_SIZE) {
+                // Make room for this event
+                flush();
+            }
+            if (staging->used + len + 1 <= staging->size - STAGING_HEADER_SIZE) {
+                // Copy the event before updating used so a reset in between doesn't leave a partial event
+                char *dst = (char *)staging + STAGING_HEADER_SIZE + staging->used;
+                memcpy(dst, jsonObj, len);
+                dst[len] = '\n';
+                staging->used += len + 1;
+
+                hasEvents = true;
+                changeCount++;
+                return;
+            }
+            // Larger than the staging buffer, so append to the file directly
+        }
+
+        // Append to the segment file
+        int fd = openWriteSegment(len + 1);
         if (fd != -1) {
-            write(fd, jsonObj, strlen(jsonObj));
-            write(fd, "\n", 1);
+            uint8_t record[RECORD_MAX_SIZE];
+            size_t recordLen = encodeRecord(jsonObj, len, record);
+            if (recordLen) {
+                write(fd, record, recordLen);
+            }
+            else {
+                write(fd, jsonObj, len);
+                write(fd, "\n", 1);
+                recordLen = len + 1;
+            }
             close(fd);
 
+            writeSize += recordLen;
             hasEvents = true;
+            changeCount++;
         }
     }    
 }
@@ -1114,11 +2119,93 @@ void SleepHelper::EventHistory::addEvent(std::function<void(JSONWriter &)>callba
 }
 
 
-bool SleepHelper::EventHistory::getEvents(JSONWriter &writer, size_t maxSize, bool bRemoveEvents) {
-    if (maxSize < 2 || !hasEvents) {
+SleepHelper::EventHistory &SleepHelper::EventHistory::withStagingBuffer(void *buffer, size_t size) {
+    WITH_LOCK(*this) {
+        staging = (StagingHeader *)buffer;
+        if (staging->magic != STAGING_MAGIC || staging->size != size || staging->used > size - STAGING_HEADER_SIZE) {
+            // Not initialized, or a different size than before
+            staging->magic = STAGING_MAGIC;
+            staging->size = size;
+            staging->used = 0;
+        }
+        else if (staging->used) {
+            // Events from before the reset that weren't written to the file yet
+            hasEvents = true;
+        }
+    }
+    return *this;
+}
+
+void SleepHelper::EventHistory::flush() {
+    WITH_LOCK(*this) {
+        if (staging && staging->used) {
+            const char *data = (const char *)staging + STAGING_HEADER_SIZE;
+
+            int fd = openWriteSegment(staging->used);
+            if (fd != -1) {
+                size_t dataLen = staging->used;
+                if (schema.isEmpty()) {
+                    write(fd, data, dataLen);
+                }
+                else {
+                    // Convert matching events to binary records, in groups so there are still few writes. 
+                    // The staging buffer is not modified, so a reset during conversion doesn't lose events.
+                    uint8_t buf[512];
+                    size_t bufLen = 0;
+                    dataLen = 0;
+
+                    const char *cur = data;
+                    const char *end = &data[staging->used];
+                    while(cur < end) {
+                        const char *lf = (const char *)memchr(cur, '\n', end - cur);
+                        if (!lf) {
+                            break;
+                        }
+                        if (sizeof(buf) - bufLen < RECORD_MAX_SIZE) {
+                            write(fd, buf, bufLen);
+                            bufLen = 0;
+                        }
+                        size_t recordLen = encodeRecord(cur, lf - cur, &buf[bufLen]);
+                        if (recordLen) {
+                            bufLen += recordLen;
+                        }
+                        else {
+                            recordLen = (lf + 1) - cur;
+                            if (recordLen <= sizeof(buf) - bufLen) {
+                                memcpy(&buf[bufLen], cur, recordLen);
+                                bufLen += recordLen;
+                            }
+                            else {
+                                write(fd, buf, bufLen);
+                                bufLen = 0;
+                                write(fd, cur, recordLen);
+                            }
+                        }
+                        dataLen += recordLen;
+                        cur = lf + 1;
+                    }
+                    if (bufLen) {
+                        write(fd, buf, bufLen);
+                    }
+                }
+                close(fd);
+
+                writeSize += dataLen;
+                staging->used = 0;
+            }
+        }
+    }
+}
+
+bool SleepHelper::EventHistory::getEventsInternal(JSONWriter &writer, JSONSpliceWriter *spliceWriter, size_t maxSize, bool bRemoveEvents) {
+    if (maxSize < 2 || !getHasEvents()) {
         return false;
     }
-    char *buf = (char *)malloc(maxSize);
+    flush();
+
+    // With columnar blocks, buf is followed by the block's bits and the text to write it
+    bool columnar = schema.columnar && !schema.isEmpty();
+    char *buf = (char *)malloc(columnar ? 3 * maxSize : maxSize);
     if (!buf) {
         return false;
     }
@@ -1126,42 +2213,141 @@ bool SleepHelper::EventHistory::getEvents(JSONWriter &writer, size_t maxSize, bo
     bool bResult = false;
 
     WITH_LOCK(*this) {
-        int fd = open(path, O_RDONLY);
-        if (fd != -1) {
-            int dataSize = read(fd, buf, maxSize);
-            if (dataSize > 0) {
-                // Remove partial event
-                while(dataSize > 0 && buf[dataSize - 1] != '\n') {
-                    dataSize--;
-                }                    
-
-                if (dataSize > 0 && buf[dataSize - 1] == '\n') {
+        size_t bytesUsed = 2;
+        bool full = false;
+
+        int64_t values[RecordSchema::FIELDS_MAX];
+        int64_t encoderState[4 * RecordSchema::FIELDS_MAX];
+        _ColumnarEncoder encoder(schema, (uint8_t *)&buf[maxSize], columnar ? maxSize : 0, encoderState);
+        auto writeBlock = [&]() {
+            if (encoder.getCount()) {
+                bytesUsed += encoder.getJSONSize() + 1;
+                encoder.write(writer, &buf[2 * maxSize]);
+                encoder.clear();
+            }
+        };
+
+        // Continue after events already retrieved but not removed, across segments
+        while(!full) {
+            int dataSize = 0;
+
+            int fd = open(getSegmentPath(getSegment), O_RDONLY);
+            if (fd != -1) {
+                lseek(fd, getOffset, SEEK_SET);
+                dataSize = read(fd, buf, maxSize);
+                close(fd);
+            }
+            if (dataSize < 0) {
+                dataSize = 0;
+            }
+
+            // Events are JSON lines or binary records. A partial event at the end is left for the next read.
+            char *cur = buf;
+            char *end = &buf[dataSize];
+            bool skipped = false;
+            while(cur < end) {
+                if (removedRangeCount && skipRemoved()) {
+                    // Removed after events before it that haven't been, read again from the end of the range
+                    skipped = true;
+                    break;
+                }
+
+                size_t eventLen;
+                char *lf = nullptr;
+                if ((uint8_t)*cur == RECORD_MARKER) {
+                    if (end - cur < 2 || end - cur < 2 + (uint8_t)cur[1]) {
+                        break;
+                    }
+                    eventLen = 2 + (uint8_t)cur[1];
+                }
+                else {
+                    lf = (char *)memchr(cur, '\n', end - cur);
+                    if (!lf) {
+                        break;
+                    }
+                    eventLen = (lf + 1) - cur;
+                }
+
+                if (!bResult) {
                     // Have valid data
                     bResult = true;
-                    size_t bytesUsed = 2;
-
                     writer.beginArray();
+                }
 
-                    char *cur = buf;
-                    char *end = &buf[dataSize];
-                    while(cur < end) {
-                        char *lf = strchr(cur, '\n');
-                        *lf = 0;
+                if (lf) {
+                    *lf = 0;
 
-                        bytesUsed += strlen(cur) + 1;
+                    // Samples before this event are published before it
+                    writeBlock();
+
+                    size_t jsonLen = lf - cur;
+                    bytesUsed += jsonLen + 1;
+                    if (bytesUsed > maxSize) {
+                        full = true;
+                        break;
+                    }
+                    if (spliceWriter && jsonLen >= 2 && cur[0] == '{' && cur[jsonLen - 1] == '}') {
+                        // Validated by addEvent, so it can be copied as-is
+                        spliceWriter->rawValue(cur, jsonLen);
+                    }
+                    else {
+                        SleepHelper::JSONCopy(cur, writer);
+                    }
+                }
+                else if (columnar) {
+                    // Added to the block, which is written before the next JSON event or at the end
+                    uint32_t lastTime = getLastTime;
+                    if (getRecordValues((const uint8_t *)cur, lastTime, values)) {
+                        if (!encoder.add(values)) {
+                            full = true;
+                            break;
+                        }
+                        if (bytesUsed + encoder.getJSONSize() + 1 > maxSize) {
+                            encoder.undo();
+                            full = true;
+                            break;
+                        }
+                        getLastTime = lastTime;
+                    }
+                }
+                else {
+                    // Find the size of the JSON first, so a record that doesn't fit is left for the next event
+                    _JSONCountWriter countWriter;
+                    uint32_t lastTime = getLastTime;
+                    if (writeRecord((const uint8_t *)cur, lastTime, countWriter)) {
+                        bytesUsed += countWriter.count + 1;
                         if (bytesUsed > maxSize) {
+                            full = true;
                             break;
                         }
-                        SleepHelper::JSONCopy(cur, writer);                        
-
-                        cur = lf + 1;
-                        removeOffset = (cur - buf);                        
+                        writeRecord((const uint8_t *)cur, getLastTime, writer);
                     }
-
-                    writer.endArray();
                 }
+
+                getOffset += eventLen;
+                cur += eventLen;
             }
-            close(fd);
+
+            if (skipped || (!full && removedRangeCount && skipRemoved())) {
+                // A range can also start at the end of a segment
+                continue;
+            }
+            if (columnar && !full && dataSize == (int)maxSize && cur != buf) {
+                // Columnar samples are smaller than the records, read more of this segment
+                continue;
+            }
+            if (!full && dataSize < (int)maxSize && getSegment < writeSegment) {
+                // Read to the end of this segment, continue with the next one
+                getSegment++;
+                getOffset = 0;
+                continue;
+            }
+            break;
+        }
+
+        if (bResult) {
+            writeBlock();
+            writer.endArray();
         }
     }    
 
@@ -1176,239 +2362,1365 @@ bool SleepHelper::EventHistory::getEvents(JSONWriter &writer, size_t maxSize, bo
 
 void SleepHelper::EventHistory::removeEvents() {
     WITH_LOCK(*this) {
-        const size_t bufSize = 512;
-        char *buf = (char *)malloc(bufSize);
-        if (buf) {
-            int fdsrc = open(path, O_RDONLY);
-            if (fdsrc != -1) {
-                struct stat sb;
-                fstat(fdsrc, &sb);
-                size_t fileSize = sb.st_size;  
-                if (removeOffset < fileSize) {
-                    lseek(fdsrc, removeOffset, SEEK_SET);
-
-                    String tempPath = String(path) + ".tmp";
-                    int fddst = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
-                    if (fddst) {
-                        while(removeOffset < fileSize) {
-                            int count = read(fdsrc, buf, bufSize);
-                            if (count > 0) {
-                                write(fddst, buf, count);
-                                removeOffset += count;
-                            }
-                            else {
-                                break;
-                            }
-                        }
-                        close(fddst);
-                    }
-                    close(fdsrc);
-
-                    // Swap src and dst files
-                    unlink(path);
-                    rename(tempPath, path);
-                    removeOffset = 0;
-                }
-                else {
-                    unlink(path);
-                    hasEvents = false;
-                }
-            }
-            free(buf);
+        if (firstRun) {
+            getHasEvents();
         }
-
+        removeTo(getCursor());
     }
 }
 
-bool SleepHelper::EventHistory::getHasEvents() { 
-    if (firstRun) {
-        firstRun = false;
-
-        struct stat sb;
-        int res = stat(path, &sb);
-
-        hasEvents = (res == 0 && sb.st_size > 0);
+void SleepHelper::EventHistory::removeEvents(const Range &range) {
+    if (range.isEmpty()) {
+        return;
     }
-    return hasEvents; 
-};
 
+    WITH_LOCK(*this) {
+        if (firstRun) {
+            getHasEvents();
+        }
+
+        Cursor read;
+        read.segment = readSegment;
+        read.offset = readOffset;
+        if (!(read < range.start)) {
+            // Continues from the events already removed
+            if (read < range.end) {
+                removeTo(range.end);
+            }
+            return;
+        }
 
-//
-// EventCombiner
-//
-void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events) {
-    size_t maxSize = particle::protocol::MAX_EVENT_DATA_LENGTH;
+        // There are events before this range that have not been removed yet, so save it to skip it.
+        // Adjacent ranges are combined, since they're usually removed in order.
+        changeCount++;
 
-    // TODO: Also use Particle.maxEventDataSize() (available in 3.1 and later) to limit event size
-    generateEvents(events, maxSize);
+        bool added = false;
+        for(size_t ii = 0; ii < removedRangeCount; ii++) {
+            if (removedRanges[ii].end == range.start) {
+                removedRanges[ii].end = range.end;
+                added = true;
+                break;
+            }
+            if (range.end == removedRanges[ii].start) {
+                removedRanges[ii].start = range.start;
+                added = true;
+                break;
+            }
+        }
+        if (!added) {
+            if (removedRangeCount >= REMOVED_RANGES_MAX) {
+                SleepHelper::instance().appLog.error("too many removed event history ranges, will be sent again after reset");
+                return;
+            }
+            removedRanges[removedRangeCount++] = range;
+        }
+        saveCursor();
+    }
 }
 
+void SleepHelper::EventHistory::removeTo(const Cursor &cursor) {
+    changeCount++;
+
+    // Removed ranges that start at or before the new read position are removed with it
+    Cursor read = cursor;
+    bool found = true;
+    while(found) {
+        found = false;
+        for(size_t ii = 0; ii < removedRangeCount; ii++) {
+            if (!(read < removedRanges[ii].start)) {
+                if (read < removedRanges[ii].end) {
+                    read = removedRanges[ii].end;
+                }
+                removedRanges[ii] = removedRanges[--removedRangeCount];
+                found = true;
+                break;
+            }
+        }
+    }
 
-void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events, size_t maxSize) {
-    
-    events.clear();
-
-    std::vector<EventInfo> infoArray;
-    char *buf = (char *)malloc(maxSize + 1);
-    if (!buf) {
-        return;
+    // Whole segments that have been retrieved are deleted. Unread data is never rewritten.
+    while(readSegment < read.segment) {
+        unlink(getSegmentPath(readSegment++));
     }
+    readOffset = read.offset;
+    readLastTime = read.lastTime;
 
-    // Process one-time callbacks in reverse order (most recently added first) because keys added at the same 
-    // priority level will use the first value set, and we want the latest value to be used.
-    for(auto it = oneTimeCallbacks.callbackFunctions.rbegin(); it != oneTimeCallbacks.callbackFunctions.rend(); ++it) {
-        generateEventInternal(*it, buf, maxSize, infoArray);        
+    // getEvents() never continues from events that have been removed
+    if (getSegment < readSegment || (getSegment == readSegment && getOffset < readOffset)) {
+        getSegment = readSegment;
+        getOffset = readOffset;
+        getLastTime = readLastTime;
     }
 
-    for(auto it = callbacks.callbackFunctions.begin(); it != callbacks.callbackFunctions.end(); ++it) {
-        generateEventInternal(*it, buf, maxSize, infoArray);        
+    if (readSegment == writeSegment && readOffset >= writeSize) {
+        // Everything has been removed, so start a new segment for the next event
+        unlink(getSegmentPath(writeSegment));
+        readSegment = getSegment = ++writeSegment;
+        readOffset = getOffset = writeSize = 0;
+        readLastTime = getLastTime = writeLastTime = 0;
+        removedRangeCount = 0;
+        hasEvents = (staging && staging->used);
     }
 
-    bool doRemoveEvents = false;
+    // Save the read position so removed events are not sent again after a reset
+    saveCursor();
+}
 
-    if (eventHistory.getHasEvents()) {
-        memset(buf, 0, maxSize);
-        JSONBufferWriter writer(buf, maxSize);
+void SleepHelper::EventHistory::saveCursor() {
+    int fd = open(path + ".cur", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        CursorData cursor;
+        cursor.magic = CURSOR_MAGIC;
+        cursor.segment = readSegment;
+        cursor.offset = readOffset;
+        cursor.lastTime = readLastTime;
+        write(fd, &cursor, sizeof(cursor));
+        if (removedRangeCount) {
+            write(fd, removedRanges, removedRangeCount * sizeof(Range));
+        }
+        close(fd);
+    }
+}
 
-        writer.beginObject();
-        writer.name(eventHistoryKey);
+bool SleepHelper::EventHistory::skipRemoved() {
+    for(size_t ii = 0; ii < removedRangeCount; ii++) {
+        if (removedRanges[ii].start.segment == getSegment && removedRanges[ii].start.offset == getOffset) {
+            getSegment = removedRanges[ii].end.segment;
+            getOffset = removedRanges[ii].end.offset;
+            getLastTime = removedRanges[ii].end.lastTime;
+            return true;
+        }
+    }
+    return false;
+}
 
-        // Overhead:
-        // { " (eventHistoryKey) " : [ (array data) ]  }
-        size_t overhead = eventHistoryKey.length() + 7;
+void SleepHelper::EventHistory::seekEvents(const Cursor &cursor) {
+    if (firstRun) {
+        getHasEvents();
+    }
+    WITH_LOCK(*this) {
+        Cursor read;
+        read.segment = readSegment;
+        read.offset = readOffset;
+        if (cursor.isValid() && read < cursor) {
+            getSegment = cursor.segment;
+            getOffset = cursor.offset;
+            getLastTime = cursor.lastTime;
+        }
+        else {
+            rewindEvents();
+        }
+    }
+}
 
-        if (eventHistory.getEvents(writer, maxSize - overhead, false)) {
-            EventInfo eventInfo;
-            eventInfo.priority = 1;
-            eventInfo.keys.push_back(eventHistoryKey);
+bool SleepHelper::EventHistory::getHasEvents() { 
+    WITH_LOCK(*this) {
+        if (firstRun) {
+            firstRun = false;
+            loadSegments();
+        }
+    }
+    return hasEvents; 
+};
 
-            writer.endObject();
+String SleepHelper::EventHistory::getSegmentPath(uint32_t segment) const {
+    return String::format("%s.%lu", path.c_str(), (unsigned long)segment);
+}
 
-            // Remove the } at the end of the object
-            buf[strlen(buf) - 1] = 0;
-            eventInfo.json = &buf[1];
+int SleepHelper::EventHistory::openWriteSegment(size_t len) {
+    if (firstRun) {
+        getHasEvents();
+    }
+    if (writeSize > 0 && writeSize + len > segmentSize) {
+        // Start a new segment. Events are never split across segments.
+        writeSegment++;
+        writeSize = 0;
+    }
+    if (writeSize == 0) {
+        // Each segment starts with an absolute time so it can be read without the ones before it
+        writeLastTime = 0;
+    }
+    return open(getSegmentPath(writeSegment), O_RDWR | O_CREAT | O_APPEND, 0666);
+}
 
-            infoArray.push_back(eventInfo);
+void SleepHelper::EventHistory::loadSegments() {
+    // Segments are named path.1, path.2, ... in the same directory as path
+    String dirPath = ".";
+    String baseName = path;
+    int slash = path.lastIndexOf('/');
+    if (slash >= 0) {
+        dirPath = (slash > 0) ? path.substring(0, slash) : String("/");
+        baseName = path.substring(slash + 1);
+    }
+
+    uint32_t first = 0, last = 0;
+    std::vector<String> tempPaths;
+    DIR *dir = opendir(dirPath);
+    if (dir) {
+        while(true) {
+            struct dirent *ent = readdir(dir);
+            if (!ent) {
+                break;
+            }
+            const char *name = ent->d_name;
+            if (strncmp(name, baseName, baseName.length()) != 0 || name[baseName.length()] != '.' || !isdigit(name[baseName.length() + 1])) {
+                continue;
+            }
+            char *end;
+            uint32_t segment = strtoul(&name[baseName.length() + 1], &end, 10);
+            if (strcmp(end, ".tmp") == 0) {
+                // Left by a reset while compacting the segment (see compactEvents). The segment itself is intact.
+                tempPaths.push_back(dirPath + "/" + name);
+                continue;
+            }
+            if (*end != 0 || segment == 0) {
+                continue;
+            }
+            if (first == 0 || segment < first) {
+                first = segment;
+            }
+            if (segment > last) {
+                last = segment;
+            }
+        }
+        closedir(dir);
+    }
+    for(auto it = tempPaths.begin(); it != tempPaths.end(); ++it) {
+        unlink(*it);
+    }
+
+    CursorData cursor;
+    bool cursorValid = false;
+    int fd = open(path + ".cur", O_RDONLY);
+    if (fd != -1) {
+        // Cursors saved before lastTime was added are 4 bytes shorter
+        memset(&cursor, 0, sizeof(cursor));
+        int count = read(fd, &cursor, sizeof(cursor));
+        cursorValid = (count >= (int)offsetof(CursorData, lastTime) && cursor.magic == CURSOR_MAGIC);
+        removedRangeCount = 0;
+        if (cursorValid && count == (int)sizeof(cursor)) {
+            count = read(fd, removedRanges, sizeof(removedRanges));
+            if (count > 0) {
+                removedRangeCount = count / sizeof(Range);
+            }
+        }
+        close(fd);
+    }
 
+    struct stat sb;
+    if (first == 0) {
+        // No segments. Start after the saved read position so it can't apply to the new segment.
+        first = last = cursorValid ? cursor.segment + 1 : 1;
 
-            doRemoveEvents = true;
+        // Use the event history file from before segments were used, if there is one
+        if (stat(path, &sb) == 0 && sb.st_size > 0) {
+            rename(path, getSegmentPath(first));
+        }
+    }
+    readSegment = first;
+    writeSegment = last;
+
+    // Read position in the first segment
+    readOffset = 0;
+    readLastTime = 0;
+    if (cursorValid && cursor.segment == readSegment) {
+        readOffset = cursor.offset;
+        readLastTime = cursor.lastTime;
+    }
+    getSegment = readSegment;
+    getOffset = readOffset;
+    getLastTime = readLastTime;
+
+    // Removed ranges that are no longer after the read position are not needed
+    Cursor read = getCursor();
+    for(size_t ii = 0; ii < removedRangeCount; ) {
+        if (read < removedRanges[ii].end) {
+            ii++;
+        }
+        else {
+            removedRanges[ii] = removedRanges[--removedRangeCount];
         }
     }
 
-    if (!infoArray.empty()) {
-        // Sort highest priority first
-        std::sort(infoArray.begin(), infoArray.end(), [](EventInfo a, EventInfo b) {
-            return a.priority > b.priority;
-        });
+    // The time in the last record written is not saved, so the next record has an absolute time
+    writeLastTime = 0;
 
-        // Dedupe keys in case a one-time callback is called more than once
-        std::vector<String> keysAdded;
-        for(auto it = infoArray.begin(); it != infoArray.end(); ) {
-            bool keyExists = false;
+    writeSize = 0;
+    if (stat(getSegmentPath(writeSegment), &sb) == 0) {
+        writeSize = sb.st_size;
+    }
 
-            for(auto it2 = it->keys.begin(); it2 != it->keys.end(); ++it2) {
-                for(auto it3 = keysAdded.begin(); it3 != keysAdded.end(); ++it3) {
-                    if (*it3 == *it2) {
-                        keyExists = true;
-                        break;
-                    }
+    hasEvents = (readSegment < writeSegment || readOffset < writeSize || (staging && staging->used));
+}
+
+size_t SleepHelper::EventHistory::encodeRecord(const char *jsonObj, size_t jsonLen, uint8_t *record) {
+    if (schema.isEmpty()) {
+        return 0;
+    }
+
+    int64_t values[RecordSchema::FIELDS_MAX];
+    if (!getSampleValues(jsonObj, jsonLen, values)) {
+        return 0;
+    }
+
+    bool absolute = (writeLastTime == 0);
+    uint32_t recordTime = 0;
+
+    uint8_t *p = &record[3];
+    const uint8_t *end = &record[RECORD_MAX_SIZE];
+    for(size_t ii = 0; ii < schema.fields.size() && p; ii++) {
+        uint64_t encoded;
+        switch(schema.fields[ii].type) {
+            case RecordSchema::FieldType::TIME:
+                if (recordTime == 0) {
+                    recordTime = (uint32_t)values[ii];
                 }
-                keysAdded.push_back(*it2);
+                encoded = absolute ? (uint64_t)values[ii] : _zigzagEncode(values[ii] - (int64_t)writeLastTime);
+                break;
+
+            case RecordSchema::FieldType::BOOL:
+                encoded = (uint64_t)values[ii];
+                break;
+
+            default:
+                encoded = _zigzagEncode(values[ii]);
+                break;
+        }
+        p = _putVarint(p, end, encoded);
+    }
+    if (!p || (size_t)(p - record) > jsonLen + 1) {
+        // Too large for a record, or larger than the JSON line
+        return 0;
+    }
+
+    record[0] = RECORD_MARKER;
+    record[1] = (uint8_t)(p - record - 2);
+    record[2] = schema.schemaId | (absolute ? RECORD_FLAG_ABSOLUTE : 0);
+
+    if (recordTime) {
+        writeLastTime = recordTime;
+    }
+    return p - record;
+}
+
+bool SleepHelper::EventHistory::writeRecord(const uint8_t *record, uint32_t &lastTime, JSONWriter &writer) const {
+    // Decode before writing anything, so a corrupted record is skipped instead of writing a partial object
+    int64_t values[RecordSchema::FIELDS_MAX];
+    if (!getRecordValues(record, lastTime, values)) {
+        return false;
+    }
+
+    writer.beginObject();
+    for(size_t ii = 0; ii < schema.fields.size(); ii++) {
+        const RecordSchema::Field &field = schema.fields[ii];
+        writer.name(field.name);
+        switch(field.type) {
+            case RecordSchema::FieldType::TIME:
+                writer.value((unsigned long)values[ii]);
+                break;
+
+            case RecordSchema::FieldType::INT:
+                writer.value((int)values[ii]);
+                break;
+
+            case RecordSchema::FieldType::FIXED:
+                writer.value((double)values[ii] / pow(10, field.decimals), field.decimals);
+                break;
+
+            case RecordSchema::FieldType::BOOL:
+                writer.value(values[ii] != 0);
+                break;
+        }
+    }
+    writer.endObject();
+    return true;
+}
+
+bool SleepHelper::EventHistory::getSampleValues(const char *jsonObj, size_t jsonLen, int64_t *values) const {
+    if (schema.isEmpty()) {
+        return false;
+    }
+
+    JSONValue obj = JSONValue::parseCopy(jsonObj, jsonLen);
+    if (!obj.isObject()) {
+        return false;
+    }
+
+    // Must have exactly the keys in the schema. A duplicate key leaves a field missing below.
+    size_t numKeys = 0;
+    JSONObjectIterator keyIter(obj);
+    while(keyIter.next()) {
+        numKeys++;
+    }
+    if (numKeys != schema.fields.size()) {
+        return false;
+    }
+
+    for(size_t ii = 0; ii < schema.fields.size(); ii++) {
+        const RecordSchema::Field &field = schema.fields[ii];
+        JSONValue value;
+        JSONObjectIterator iter(obj);
+        while(iter.next()) {
+            if (iter.name() == field.name) {
+                value = iter.value();
+                break;
             }
+        }
 
-            if (keyExists) {
-                it = infoArray.erase(it);
+        if (field.type == RecordSchema::FieldType::BOOL) {
+            if (!value.isBool()) {
+                return false;
             }
-            else {
-                ++it;
+            values[ii] = value.toBool() ? 1 : 0;
+            continue;
+        }
+
+        if (!value.isNumber()) {
+            return false;
+        }
+        JSONString str = value.toString();
+        bool isInteger = (memchr(str.data(), '.', str.size()) == nullptr && memchr(str.data(), 'e', str.size()) == nullptr && memchr(str.data(), 'E', str.size()) == nullptr);
+
+        if (field.type == RecordSchema::FieldType::FIXED) {
+            // Only if no precision is lost
+            double scaled = value.toDouble() * pow(10, field.decimals);
+            double rounded = round(scaled);
+            if (fabs(scaled - rounded) > 1e-6 || fabs(rounded) > (double)INT32_MAX) {
+                return false;
             }
+            values[ii] = (int64_t)rounded;
+            continue;
         }
 
-        // 
-        char *cur = buf;
-        char *end = &buf[maxSize - 2]; // Room for leading , and trailing }
+        if (!isInteger) {
+            return false;
+        }
+        long long n = strtoll(str.data(), nullptr, 10);
+        if (field.type == RecordSchema::FieldType::TIME) {
+            if (n <= 0 || n > (long long)UINT32_MAX) {
+                return false;
+            }
+        }
+        else if (n < INT32_MIN || n > INT32_MAX) {
+            return false;
+        }
+        values[ii] = n;
+    }
+    return true;
+}
 
-        *cur++ = '{';
-        bool firstEventBuffer = true;
+bool SleepHelper::EventHistory::getRecordValues(const uint8_t *record, uint32_t &lastTime, int64_t *values) const {
+    const uint8_t *p = &record[3];
+    const uint8_t *end = &record[2 + record[1]];
+    if (p > end || (record[2] & ~RECORD_FLAG_ABSOLUTE) != schema.schemaId || schema.isEmpty()) {
+        return false;
+    }
+    bool absolute = (record[2] & RECORD_FLAG_ABSOLUTE) != 0;
 
-        for(auto it = infoArray.begin(); it != infoArray.end(); ++it) {
-            
-            if (&cur[strlen(it->json)] >= end) {
-                // Buffer is full
-                if (cur > &buf[1]) {
-                    *cur++ = '}';
-                    *cur = 0;
-                    events.push_back(buf);
-                    cur = &buf[1];
+    uint32_t recordTime = 0;
+    for(size_t ii = 0; ii < schema.fields.size(); ii++) {
+        uint64_t raw;
+        p = _getVarint(p, end, raw);
+        if (!p) {
+            return false;
+        }
+        switch(schema.fields[ii].type) {
+            case RecordSchema::FieldType::TIME: {
+                uint32_t t = absolute ? (uint32_t)raw : (uint32_t)(lastTime + _zigzagDecode(raw));
+                if (recordTime == 0) {
+                    recordTime = t;
                 }
-                firstEventBuffer = false;
+                values[ii] = t;
+                break;
             }
 
-            if (!firstEventBuffer && it->priority < 50) {
+            case RecordSchema::FieldType::BOOL:
+                values[ii] = (raw != 0) ? 1 : 0;
                 break;
-            }        
 
-            if (cur != &buf[1]) {
-                *cur++ = ',';
+            default:
+                values[ii] = _zigzagDecode(raw);
+                break;
+        }
+    }
+
+    if (recordTime) {
+        lastTime = recordTime;
+    }
+    return true;
+}
+
+bool SleepHelper::EventHistory::compactEvents(const Cursor &from) {
+    if (firstRun) {
+        getHasEvents();
+    }
+
+    bool compacted = false;
+    WITH_LOCK(*this) {
+        if (!retention.isEnabled() || schema.isEmpty() || removedRangeCount) {
+            // Removed ranges are positions in the segments, which compacting would change
+            return false;
+        }
+
+        // A partially removed segment is left alone so the saved read position stays valid, and so is
+        // everything before from, since those events are being sent
+        uint32_t first = (readOffset > 0) ? readSegment + 1 : readSegment;
+        if (from.isValid()) {
+            uint32_t afterFrom = (from.offset > 0) ? from.segment + 1 : from.segment;
+            if (afterFrom > first) {
+                first = afterFrom;
+            }
+        }
+        if (first <= compactedSegment) {
+            first = compactedSegment + 1;
+        }
+        if (first >= writeSegment) {
+            // Only the segment being appended to
+            return false;
+        }
+
+        size_t total = 0;
+        if (retention.maxBytes) {
+            for(uint32_t segment = readSegment; segment <= writeSegment; segment++) {
+                struct stat sb;
+                if (stat(getSegmentPath(segment), &sb) == 0) {
+                    total += sb.st_size;
+                }
+            }
+            total -= (readOffset < total) ? readOffset : total;
+        }
+
+        uint32_t cutoff = 0;
+        if (retention.maxAge && Time.isValid() && (uint32_t)Time.now() > retention.maxAge) {
+            cutoff = (uint32_t)Time.now() - retention.maxAge;
+        }
+
+        // Oldest first, stopping at the first segment that is new enough
+        for(uint32_t segment = first; segment < writeSegment; segment++) {
+            bool overBytes = retention.maxBytes && total > retention.maxBytes;
+            if (!overBytes && !cutoff) {
+                break;
             }
 
-            strcpy(cur, it->json);
-            cur += strlen(cur);
+            size_t oldSize = 0, newSize = 0;
+            int result = compactSegment(segment, overBytes ? 0 : cutoff, oldSize, newSize);
+            if (result < 0) {
+                break;
+            }
+            if (result > 0) {
+                total -= oldSize - newSize;
+                compacted = true;
+            }
+            compactedSegment = segment;
         }
 
-        if (cur > &buf[1]) {
-            // Write out last object
-            *cur++ = '}';
-            *cur = 0;
-            events.push_back(buf);
+        if (compacted) {
+            changeCount++;
+            rewindEvents();
         }
     }
+    return compacted;
+}
+
+int SleepHelper::EventHistory::compactSegment(uint32_t segment, uint32_t cutoff, size_t &oldSize, size_t &newSize) {
+    String segmentPath = getSegmentPath(segment);
 
-    if (doRemoveEvents) {
-        doRemoveEvents = false;
+    struct stat sb;
+    if (stat(segmentPath, &sb) != 0 || sb.st_size == 0) {
+        return 0;
+    }
+    oldSize = newSize = sb.st_size;
 
-        // Makes sure event was actually added
-        for(auto it = events.begin(); it != events.end(); ++it) {
-            JSONValue obj = JSONValue::parseCopy(*it);
+    // The aggregates are on the first time field
+    size_t numFields = schema.fields.size();
+    size_t timeField = numFields;
+    for(size_t ii = 0; ii < numFields; ii++) {
+        if (schema.fields[ii].type == RecordSchema::FieldType::TIME) {
+            timeField = ii;
+            break;
+        }
+    }
+    if (timeField == numFields) {
+        return 0;
+    }
+
+    // The segment, then the compacted version, which is only useful if it's smaller
+    char *buf = (char *)malloc(2 * oldSize);
+    if (!buf) {
+        return 0;
+    }
+    int fd = open(segmentPath, O_RDONLY);
+    if (fd == -1) {
+        free(buf);
+        return 0;
+    }
+    int count = read(fd, buf, oldSize);
+    close(fd);
+    if (count != (int)oldSize) {
+        free(buf);
+        return 0;
+    }
+    char *out = &buf[oldSize];
+    size_t outLen = 0;
+    bool fits = true;
+
+    int64_t values[RecordSchema::FIELDS_MAX], minValues[RecordSchema::FIELDS_MAX], maxValues[RecordSchema::FIELDS_MAX], sums[RecordSchema::FIELDS_MAX];
+    uint32_t windowStart = 0;
+    size_t windowCount = 0;
+    size_t sampleCount = 0;
+    uint32_t newest = 0;
+    uint32_t lastTime = 0;
+
+    const char *cur = buf;
+    const char *end = &buf[oldSize];
+    while(cur < end && fits) {
+        size_t eventLen;
+        bool isSample;
+        if ((uint8_t)*cur == RECORD_MARKER) {
+            if (end - cur < 2 || end - cur < 2 + (uint8_t)cur[1]) {
+                // Incomplete
+                break;
+            }
+            eventLen = 2 + (uint8_t)cur[1];
+            if (!getRecordValues((const uint8_t *)cur, lastTime, values)) {
+                // Records for a different schema are skipped by getEvents() too
+                cur += eventLen;
+                continue;
+            }
+            isSample = true;
+        }
+        else {
+            const char *lf = (const char *)memchr(cur, '\n', end - cur);
+            if (!lf) {
+                break;
+            }
+            eventLen = lf + 1 - cur;
+            isSample = getSampleValues(cur, lf - cur, values);
+        }
 
-            JSONObjectIterator iter(obj);
-            while(iter.next()) {
-                String key = (const char *)iter.name();
-                if (key == eventHistoryKey) {
-                    doRemoveEvents = true;
+        if (isSample) {
+            uint32_t t = (uint32_t)values[timeField];
+            if (t > newest) {
+                newest = t;
+            }
+            uint32_t sampleWindow = t - t % retention.window;
+            if (windowCount && sampleWindow != windowStart) {
+                size_t len = writeAggregate(&out[outLen], oldSize - outLen, timeField, windowStart, windowCount, minValues, maxValues, sums);
+                fits = (len > 0);
+                outLen += len;
+                windowCount = 0;
+            }
+            for(size_t ii = 0; ii < numFields; ii++) {
+                if (windowCount == 0 || values[ii] < minValues[ii]) {
+                    minValues[ii] = values[ii];
+                }
+                if (windowCount == 0 || values[ii] > maxValues[ii]) {
+                    maxValues[ii] = values[ii];
                 }
+                sums[ii] = (windowCount ? sums[ii] : 0) + values[ii];
+            }
+            windowStart = sampleWindow;
+            windowCount++;
+            sampleCount++;
+        }
+        else {
+            // Other events are kept as they are
+            if (eventLen > oldSize - outLen) {
+                fits = false;
+                break;
             }
+            memcpy(&out[outLen], cur, eventLen);
+            outLen += eventLen;
         }
-        if (doRemoveEvents) {
-            eventHistory.removeEvents();
+        cur += eventLen;
+    }
+    if (windowCount && fits) {
+        size_t len = writeAggregate(&out[outLen], oldSize - outLen, timeField, windowStart, windowCount, minValues, maxValues, sums);
+        fits = (len > 0);
+        outLen += len;
+    }
+
+    int result = 0;
+    if (cutoff && newest >= cutoff) {
+        result = -1;
+    }
+    else if (sampleCount && fits && outLen < oldSize) {
+        // Replace the segment in one step, so a reset leaves either the old or the new one
+        String tempPath = segmentPath + ".tmp";
+        fd = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd != -1) {
+            count = write(fd, out, outLen);
+            close(fd);
+            if (count == (int)outLen && rename(tempPath, segmentPath) == 0) {
+                newSize = outLen;
+                result = 1;
+            }
+            else {
+                unlink(tempPath);
+            }
         }
     }
+    free(buf);
+    return result;
+}
 
-    while(eventHistory.getHasEvents()) {
-        // Process any events that did not fit in the first packet
-        memset(buf, 0, maxSize);
-        JSONBufferWriter writer(buf, maxSize);
+size_t SleepHelper::EventHistory::writeAggregate(char *buf, size_t size, size_t timeField, uint32_t windowStart, size_t count, const int64_t *minValues, const int64_t *maxValues, const int64_t *sums) const {
+    if (size < 2) {
+        return 0;
+    }
+    JSONBufferWriter writer(buf, size - 1);
+    writer.beginObject();
+    for(size_t ii = 0; ii < schema.fields.size(); ii++) {
+        const RecordSchema::Field &field = schema.fields[ii];
+        writer.name(field.name);
+        if (ii == timeField) {
+            writer.value((unsigned long)windowStart);
+            writer.name(retention.countKey).value((unsigned long)count);
+            continue;
+        }
 
-        writer.beginObject();
-        writer.name(eventHistoryKey);
+        double mean = (double)sums[ii] / (double)count;
+        writer.beginArray();
+        switch(field.type) {
+            case RecordSchema::FieldType::TIME:
+                writer.value((unsigned long)minValues[ii]).value((unsigned long)maxValues[ii]).value((unsigned long)round(mean));
+                break;
+
+            case RecordSchema::FieldType::INT:
+                writer.value((int)minValues[ii]).value((int)maxValues[ii]).value(mean, 1);
+                break;
+
+            case RecordSchema::FieldType::FIXED: {
+                double scale = pow(10, field.decimals);
+                writer.value((double)minValues[ii] / scale, field.decimals).value((double)maxValues[ii] / scale, field.decimals).value(mean / scale, field.decimals + 1);
+                break;
+            }
 
-        if (eventHistory.getEvents(writer, maxSize - eventHistoryKey.length() - 6, false)) {        
-            writer.endObject();
-            
-            events.push_back(buf);
-            eventHistory.removeEvents();
+            case RecordSchema::FieldType::BOOL:
+                writer.value((int)minValues[ii]).value((int)maxValues[ii]).value(mean, 2);
+                break;
         }
+        writer.endArray();
+    }
+    writer.endObject();
+
+    size_t len = writer.dataSize();
+    if (len >= size) {
+        // Did not fit
+        return 0;
     }
+    buf[len++] = '\n';
+    return len;
+}
+
+//
+// BumpArena
+//
+SleepHelper::BumpArena::~BumpArena() {
+    while(first) {
+        Block *next = first->next;
+        free(first);
+        first = next;
+    }
+}
+
+void *SleepHelper::BumpArena::alloc(size_t size) {
+    static_assert(sizeof(Block) <= ALIGN, "Block header must fit in ALIGN bytes");
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+
+    if (current && currentUsed + size > current->size && current->next && size <= current->next->size) {
+        // Continue in the next block, kept from before rewind()
+        current = current->next;
+        currentUsed = 0;
+    }
+    if (!current || currentUsed + size > current->size) {
+        // Add a block after current. A block kept from before that is too small for this is used later.
+        size_t blockDataSize = (size > blockSize) ? size : blockSize;
+        Block *block = (Block *)malloc(ALIGN + blockDataSize);
+        if (!block) {
+            return nullptr;
+        }
+        block->size = blockDataSize;
+        if (current) {
+            block->next = current->next;
+            current->next = block;
+        }
+        else {
+            block->next = nullptr;
+            first = block;
+        }
+        current = block;
+        currentUsed = 0;
+    }
+
+    void *result = (char *)current + ALIGN + currentUsed;
+    currentUsed += size;
+    return result;
+}
+
+char *SleepHelper::BumpArena::copy(const char *src, size_t len) {
+    char *result = (char *)alloc(len + 1);
+    if (result) {
+        memcpy(result, src, len);
+        result[len] = 0;
+    }
+    return result;
+}
+
+size_t SleepHelper::BumpArena::getBlockCount() const {
+    size_t count = 0;
+    for(const Block *block = first; block; block = block->next) {
+        count++;
+    }
+    return count;
+}
+
 
+//
+// JSONKeyWriter
+//
+void SleepHelper::JSONKeyWriter::write(const char *data, size_t size) {
+    // Numbers written with printf() don't come through here, but they don't affect the nesting or strings
+    size_t offset = dataSize();
+
+    for(size_t ii = 0; ii < size; ii++) {
+        char c = data[ii];
+        if (inString) {
+            if (escape) {
+                escape = false;
+            }
+            else
+            if (c == '\\') {
+                escape = true;
+            }
+            else
+            if (c == '"') {
+                inString = false;
+                stringEnd = offset + ii;
+            }
+            continue;
+        }
+
+        switch(c) {
+            case '"':
+                inString = true;
+                stringStart = offset + ii;
+                break;
+
+            case '{':
+            case '[':
+                depth++;
+                break;
+
+            case '}':
+            case ']':
+                depth--;
+                break;
+
+            case ':':
+                if (depth == 1) {
+                    if (keyCount < SLEEPHELPER_EVENT_KEY_CAPACITY) {
+                        keys[keyCount].offset = (uint16_t)stringStart;
+                        keys[keyCount].len = (uint16_t)(stringEnd - stringStart - 1);
+                    }
+                    keyCount++;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    JSONBufferWriter::write(data, size);
+}
+
+
+//
+// EventCombiner
+//
+void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events) {
+    generateEventsInternal(events, nullptr, getMaxEventSize());
+}
+
+void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events, size_t maxSize) {
+    generateEventsInternal(events, nullptr, maxSize);
+}
+
+void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events, std::vector<HistoryRanges> &history) {
+    generateEventsInternal(events, &history, getMaxEventSize());
+}
+
+void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events, std::vector<HistoryRanges> &history, size_t maxSize) {
+    generateEventsInternal(events, &history, maxSize);
+}
+
+// [static]
+size_t SleepHelper::EventCombiner::getMaxEventSize() {
+    size_t maxSize = particle::protocol::MAX_EVENT_DATA_LENGTH;
+
+#if defined(UNITTEST) || (defined(SYSTEM_VERSION_v310) && SYSTEM_VERSION >= SYSTEM_VERSION_v310)
+    // The cloud can have a lower limit than the Device OS buffer size
+    int cloudMaxSize = Particle.maxEventDataSize();
+    if (cloudMaxSize > 0 && (size_t)cloudMaxSize < maxSize) {
+        maxSize = cloudMaxSize;
+    }
+#endif
+
+    return maxSize;
+}
+
+
+void SleepHelper::EventCombiner::generateEventsInternal(std::vector<String> &events, std::vector<HistoryRanges> *history, size_t maxSize) {
+    
+    events.clear();
+    if (history) {
+        history->clear();
+    }
+
+    char *buf = getScratchBuffer(maxSize + 1);
+    if (!buf) {
+        return;
+    }
+
+    BumpArena &arena = arenas[arenaIndex];
+
+    // Everything that could be in the events, in the arena so there are no allocations once it has grown
+    size_t generatedCapacity = oneTimeCallbacks.callbackFunctions.size() + callbacks.callbackFunctions.size();
+    EventInfo *generated = arena.allocArray<EventInfo>(generatedCapacity);
+    EventInfo **infoArray = arena.allocArray<EventInfo *>(generatedCapacity + preparedInfo.size());
+    if (!generated || !infoArray) {
+        SleepHelper::instance().appLog.error("out of memory generating events");
+        clearOneTimeCallbacks();
+        return;
+    }
+    size_t generatedCount = 0;
+    size_t infoCount = 0;
+
+    // Process one-time callbacks in reverse order (most recently added first) because keys added at the same 
+    // priority level will use the first value set, and we want the latest value to be used.
+    for(auto it = oneTimeCallbacks.callbackFunctions.rbegin(); it != oneTimeCallbacks.callbackFunctions.rend(); ++it) {
+        if (generateEventInternal(*it, buf, maxSize, generated[generatedCount])) {
+            infoArray[infoCount++] = &generated[generatedCount++];
+        }
+    }
+
+    // One-time callbacks called from prepareEvents() were added before the ones above
+    for(auto it = preparedInfo.rbegin(); it != preparedInfo.rend(); ++it) {
+        infoArray[infoCount++] = &*it;
+    }
+
+    for(auto it = callbacks.callbackFunctions.begin(); it != callbacks.callbackFunctions.end(); ++it) {
+        if (generateEventInternal(*it, buf, maxSize, generated[generatedCount])) {
+            infoArray[infoCount++] = &generated[generatedCount++];
+        }
+    }
+
+    // Uses the event history read in prepareEvents() unless it has changed since
+    prepareHistory(buf, maxSize);
+
+    // Sort highest priority first. This is an insertion sort, which keeps the order above for the same
+    // priority, and is fast for the small number of callbacks.
+    for(size_t ii = 1; ii < infoCount; ii++) {
+        EventInfo *info = infoArray[ii];
+        size_t jj = ii;
+        while(jj > 0 && infoArray[jj - 1]->priority < info->priority) {
+            infoArray[jj] = infoArray[jj - 1];
+            jj--;
+        }
+        infoArray[jj] = info;
+    }
+
+    // Dedupe keys in case a one-time callback is called more than once. Keys are interned, so they're compared by index.
+    bool keyAdded[SLEEPHELPER_EVENT_KEY_CAPACITY];
+    memset(keyAdded, 0, sizeof(keyAdded));
+
+    size_t keptCount = 0;
+    for(size_t ii = 0; ii < infoCount; ii++) {
+        const EventInfo *info = infoArray[ii];
+        bool keyExists = false;
+
+        for(size_t kk = 0; kk < info->keyCount; kk++) {
+            uint16_t key = info->keys[kk];
+            if (key != NO_KEY) {
+                if (keyAdded[key]) {
+                    keyExists = true;
+                }
+                keyAdded[key] = true;
+            }
+        }
+        if (!keyExists) {
+            infoArray[keptCount++] = infoArray[ii];
+        }
+    }
+    infoCount = keptCount;
+
+    // Pack the fragments and event history into as few events as possible
+    class EventBin {
+    public:
+        size_t size = 2; //!< Length of the event, starting with the surrounding {}
+        const HistoryPart *history[SLEEPHELPER_HISTORY_CHANNEL_CAPACITY] = {}; //!< Event history array for each channel, or nullptr
+    };
+    static const size_t NO_BIN = (size_t)-1;
+
+    size_t historyCount = 0;
+    for(size_t cc = 0; cc < channelCount; cc++) {
+        historyCount += channels[cc].preparedCount;
+    }
+
+    EventBin *bins = arena.allocArray<EventBin>(historyCount + infoCount);
+    size_t *infoBin = arena.allocArray<size_t>(infoCount); //!< Index into bins for each entry in infoArray
+    size_t *packOrder = arena.allocArray<size_t>(infoCount); //!< Indexes into infoArray
+    if (!bins || !infoBin || !packOrder) {
+        SleepHelper::instance().appLog.error("out of memory generating events");
+        clearOneTimeCallbacks();
+        return;
+    }
+    size_t binCount = 0;
+
+    // Channels highest priority first, keeping the order they were added for the same priority
+    size_t channelOrder[SLEEPHELPER_HISTORY_CHANNEL_CAPACITY];
+    for(size_t cc = 0; cc < channelCount; cc++) {
+        size_t jj = cc;
+        while(jj > 0 && channels[channelOrder[jj - 1]].config.priority < channels[cc].config.priority) {
+            channelOrder[jj] = channelOrder[jj - 1];
+            jj--;
+        }
+        channelOrder[jj] = cc;
+    }
+
+    // Every event history array is sent. They go first, so the history is published in order. Arrays from the 
+    // same channel use the same key, so each is in a later event than the one before it. Higher priority
+    // channels are placed first, and arrays from other channels go in the first event after that with room.
+    for(size_t oo = 0; oo < channelCount; oo++) {
+        size_t cc = channelOrder[oo];
+        size_t historyPrefixLen = channels[cc].config.key.length() + 3;
+        size_t firstBin = 0;
+        for(const HistoryPart *part = channels[cc].prepared; part; part = part->next) {
+            size_t bin = firstBin;
+            while(bin < binCount && bins[bin].size + 1 + historyPrefixLen + part->len > maxSize) {
+                bin++;
+            }
+            if (bin == binCount) {
+                binCount++;
+            }
+            bins[bin].history[cc] = part;
+            bins[bin].size += ((bins[bin].size > 2) ? 1 : 0) + historyPrefixLen + part->len;
+            firstBin = bin + 1;
+        }
+    }
+
+    // Fragments that must be sent (priority 50 and higher) are placed largest first into the first event with 
+    // room, adding events only when none has room (first-fit decreasing). Then lower priority fragments, highest 
+    // priority first, fill the space left over. They only start an event if there are no others.
+    for(size_t ii = 0; ii < infoCount; ii++) {
+        const EventInfo *info = infoArray[ii];
+        size_t jj = ii;
+        while(jj > 0) {
+            const EventInfo *prev = infoArray[packOrder[jj - 1]];
+            bool infoRequired = (info->priority >= 50);
+            bool prevRequired = (prev->priority >= 50);
+            bool before;
+            if (infoRequired != prevRequired) {
+                before = infoRequired;
+            }
+            else
+            if (!infoRequired && info->priority != prev->priority) {
+                before = (info->priority > prev->priority);
+            }
+            else {
+                before = (info->jsonLen > prev->jsonLen);
+            }
+            if (!before) {
+                break;
+            }
+            packOrder[jj] = packOrder[jj - 1];
+            jj--;
+        }
+        packOrder[jj] = ii;
+    }
+
+    for(size_t ii = 0; ii < infoCount; ii++) {
+        size_t index = packOrder[ii];
+        const EventInfo *info = infoArray[index];
+
+        size_t bin = NO_BIN;
+        for(size_t bb = 0; bb < binCount; bb++) {
+            size_t separator = (bins[bb].size > 2) ? 1 : 0;
+            if (bins[bb].size + separator + info->jsonLen <= maxSize) {
+                bin = bb;
+                break;
+            }
+        }
+        if (bin == NO_BIN) {
+            if (info->priority < 50 && binCount > 0) {
+                // Discard low priority data instead of generating another event
+                infoBin[index] = NO_BIN;
+                continue;
+            }
+            bin = binCount++;
+        }
+        bins[bin].size += ((bins[bin].size > 2) ? 1 : 0) + info->jsonLen;
+        infoBin[index] = bin;
+    }
+
+    // Build each event in buf, which is large enough for any bin. Fragments are in priority order.
+    for(size_t bb = 0; bb < binCount; bb++) {
+        char *cur = buf;
+        *cur++ = '{';
+        for(size_t ii = 0; ii < infoCount; ii++) {
+            if (infoBin[ii] == bb) {
+                if (cur > &buf[1]) {
+                    *cur++ = ',';
+                }
+                memcpy(cur, infoArray[ii]->json, infoArray[ii]->jsonLen);
+                cur += infoArray[ii]->jsonLen;
+            }
+        }
+        HistoryRanges ranges;
+        for(size_t oo = 0; oo < channelCount; oo++) {
+            size_t cc = channelOrder[oo];
+            const HistoryPart *part = bins[bb].history[cc];
+            if (!part) {
+                continue;
+            }
+            if (cur > &buf[1]) {
+                *cur++ = ',';
+            }
+            const String &key = channels[cc].config.key;
+            *cur++ = '"';
+            memcpy(cur, key.c_str(), key.length());
+            cur += key.length();
+            *cur++ = '"';
+            *cur++ = ':';
+            memcpy(cur, part->json, part->len);
+            cur += part->len;
+            ranges.ranges[cc] = part->range;
+        }
+        *cur++ = '}';
+        *cur = 0;
+        events.push_back(String(buf, cur - buf));
+        if (history) {
+            history->push_back(ranges);
+        }
+    }
+
+    // Everything read by prepareHistory was added to events above
+    for(size_t cc = 0; cc < channelCount; cc++) {
+        Channel &channel = channels[cc];
+        for(const HistoryPart *part = channel.prepared; part; part = part->next) {
+            if (history) {
+                // Removed by acknowledgeEventHistory() after publishing
+                channel.issued = part->range.end;
+            }
+            else {
+                channel.history.removeEvents(part->range);
+            }
+        }
+        if (channel.prepared && Time.isValid()) {
+            channel.lastPublished = Time.now();
+        }
+    }
+
+    // Also releases the arena
     clearOneTimeCallbacks();
+}
 
-    free(buf);
+void SleepHelper::EventCombiner::prepareEvents() {
+    prepareEvents(getMaxEventSize());
+}
+
+void SleepHelper::EventCombiner::prepareEvents(size_t maxSize) {
+    if (oneTimeCallbacks.callbackFunctions.size() == 0 && isHistoryCurrent(maxSize, true)) {
+        // Nothing new to prepare
+        return;
+    }
+
+    char *buf = getScratchBuffer(maxSize + 1);
+    if (!buf) {
+        return;
+    }
+
+    if (preparedErased) {
+        compactPrepared();
+    }
+
+    // Call the one-time callbacks in the order added. They're removed from oneTimeCallbacks so they are
+    // not called again by generateEvents().
+    for(size_t ii = 0; ii < oneTimeCallbacks.callbackFunctions.size(); ii++) {
+        EventInfo eventInfo;
+        if (generateEventInternal(oneTimeCallbacks.callbackFunctions[ii], buf, maxSize, eventInfo)) {
+            uint64_t id = oneTimeIds[ii];
+            if (!preparedInfo.push_back(std::move(eventInfo)) || !preparedIds.push_back(std::move(id))) {
+                SleepHelper::callbackCapacityExceeded(preparedInfo.capacity());
+            }
+        }
+    }
+    oneTimeCallbacks.removeAll();
+    oneTimeIds.clear();
+
+    prepareHistory(buf, maxSize);
+}
+
+SleepHelper::EventCombiner &SleepHelper::EventCombiner::withEventHistoryChannel(const HistoryChannel &config) {
+    Channel *channel = nullptr;
+    for(size_t ii = 0; ii < channelCount; ii++) {
+        if (channels[ii].config.name == config.name) {
+            channel = &channels[ii];
+            break;
+        }
+    }
+    if (!channel) {
+        if (channelCount >= SLEEPHELPER_HISTORY_CHANNEL_CAPACITY) {
+            SleepHelper::instance().appLog.error("too many event history channels (%u), increase SLEEPHELPER_HISTORY_CHANNEL_CAPACITY", (unsigned)channelCount);
+            return *this;
+        }
+        channel = &channels[channelCount++];
+        channel->config.name = config.name;
+        channel->config.priority = 1;
+    }
+
+    // Only the settings that are set
+    if (config.path.length()) {
+        channel->history.withPath(config.path);
+    }
+    if (config.key.length()) {
+        channel->config.key = config.key;
+    }
+    if (config.priority > 0) {
+        channel->config.priority = config.priority;
+    }
+    if (config.publishInterval) {
+        channel->config.publishInterval = config.publishInterval;
+    }
+    if (config.stagingBuffer) {
+        channel->history.withStagingBuffer(config.stagingBuffer, config.stagingSize);
+    }
+    if (!config.schema.isEmpty()) {
+        channel->history.withRecordSchema(config.schema);
+    }
+    if (config.retention.isEnabled()) {
+        channel->history.withRetentionPolicy(config.retention);
+    }
+    return *this;
+}
+
+SleepHelper::EventCombiner::Channel &SleepHelper::EventCombiner::findChannel(const char *name) {
+    for(size_t ii = 0; ii < channelCount; ii++) {
+        if (channels[ii].config.name == name) {
+            return channels[ii];
+        }
+    }
+    SleepHelper::instance().appLog.error("no event history channel %s, using the default one", name);
+    return channels[0];
 }
 
+bool SleepHelper::EventCombiner::isChannelDue(const Channel &channel) const {
+    if (!channel.config.publishInterval || !channel.lastPublished || !Time.isValid()) {
+        return true;
+    }
+    return (Time.now() - channel.lastPublished) >= (time_t)channel.config.publishInterval;
+}
 
-void SleepHelper::EventCombiner::generateEventInternal(std::function<void(JSONWriter &, int &)> callback, char *buf, size_t maxSize, std::vector<EventInfo> &infoArray) {
-    memset(buf, 0, maxSize);
-    JSONBufferWriter writer(buf, maxSize);
+bool SleepHelper::EventCombiner::isHistoryCurrent(size_t maxSize, bool ignoreEmpty) {
+    for(size_t ii = 0; ii < channelCount; ii++) {
+        Channel &channel = channels[ii];
+        if (channel.preparedSize == maxSize && channel.preparedChangeCount == channel.history.getChangeCount() && channel.preparedDue == isChannelDue(channel)) {
+            continue;
+        }
+        if (ignoreEmpty && !channel.history.getHasEvents()) {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+void SleepHelper::EventCombiner::prepareHistory(char *buf, size_t maxSize) {
+    if (isHistoryCurrent(maxSize, false)) {
+        // Still current
+        return;
+    }
+
+    // All of the channels share historyArena, so they're all read again
+    historyArena.rewind();
+    for(size_t ii = 0; ii < channelCount; ii++) {
+        channels[ii].prepared = nullptr;
+        channels[ii].preparedCount = 0;
+    }
+    for(size_t ii = 0; ii < channelCount; ii++) {
+        if (!prepareChannel(channels[ii], buf, maxSize)) {
+            // Out of memory. Leave all of the events in the event history for later.
+            historyArena.rewind();
+            for(size_t jj = 0; jj < channelCount; jj++) {
+                channels[jj].history.rewindEvents();
+                channels[jj].prepared = nullptr;
+                channels[jj].preparedCount = 0;
+            }
+            break;
+        }
+    }
+}
+
+bool SleepHelper::EventCombiner::prepareChannel(Channel &channel, char *buf, size_t maxSize) {
+    EventHistory &eventHistory = channel.history;
+
+    // Replace old samples with aggregates if the event history is over the retention policy limits. The
+    // events waiting to be acknowledged are left alone.
+    eventHistory.compactEvents(channel.issued);
+
+    channel.preparedSize = maxSize;
+    channel.preparedChangeCount = eventHistory.getChangeCount();
+    channel.preparedDue = isChannelDue(channel);
+
+    if (!channel.preparedDue || !eventHistory.getHasEvents()) {
+        return true;
+    }
+
+    // Overhead:
+    // { " (key) " : [ (array data) ]  }
+    size_t overhead = channel.config.key.length() + 7;
+
+    // Start after the events that are waiting to be acknowledged
+    eventHistory.seekEvents(channel.issued);
+    HistoryPart **next = &channel.prepared;
+    while(true) {
+        JSONSpliceWriter writer(buf, maxSize);
+
+        // Each call continues after the events already read. They're removed by generateEvents, or after
+        // they've been published.
+        EventHistory::Range range;
+        range.start = eventHistory.getCursor();
+        if (!eventHistory.getEvents(writer, maxSize - overhead, false)) {
+            break;
+        }
+        range.end = eventHistory.getCursor();
+        size_t len = writer.dataSize();
+        if (len == 2) {
+            // []
+            break;
+        }
+
+        HistoryPart *part = (HistoryPart *)historyArena.alloc(sizeof(HistoryPart));
+        char *json = historyArena.copy(buf, len);
+        if (!part || !json) {
+            return false;
+        }
+        part->next = nullptr;
+        part->json = json;
+        part->len = len;
+        part->range = range;
+        *next = part;
+        next = &part->next;
+        channel.preparedCount++;
+    }
+    return true;
+}
+
+
+bool SleepHelper::EventCombiner::generateEventInternal(const AppFunction<bool(JSONWriter &, int &)> &callback, char *buf, size_t maxSize, EventInfo &eventInfo) {
+    // Records the top-level keys as they're written, so the data doesn't need to be parsed to find them
+    JSONKeyWriter writer(buf, maxSize);
 
     int priority = 0;
 
@@ -1416,28 +3728,132 @@ void SleepHelper::EventCombiner::generateEventInternal(std::function<void(JSONWr
     callback(writer, priority);
     writer.endObject();
 
-    if (priority > 0 && strlen(buf) > 2) {
-        // Priority is set and not an empty object
-        if (writer.dataSize() <= writer.bufferSize()) {
-            // Callback data was not truncated 
+    size_t len = writer.dataSize();
+    if (priority <= 0 || len <= 2 || len > writer.bufferSize()) {
+        // Priority is not set, an empty object, or the callback data was truncated
+        return false;
+    }
 
-            EventInfo eventInfo;
-            eventInfo.priority = priority;
+    BumpArena &arena = arenas[arenaIndex];
 
-            // Gather keys used in this
-            JSONValue outerObj = JSONValue::parseCopy(buf);
-            JSONObjectIterator iter(outerObj);
-            while(iter.next()) {
-                eventInfo.keys.push_back((const char *)iter.name());
+    size_t keyCount = writer.getKeyCount();
+    uint16_t *keys = arena.allocArray<uint16_t>(keyCount);
+    char *json = arena.copy(&buf[1], len - 2);
+    if (!keys || !json) {
+        return false;
+    }
+
+    for(size_t kk = 0; kk < keyCount; kk++) {
+        const char *name = writer.getKey(kk);
+        keys[kk] = name ? internKey(name, writer.getKeyLength(kk)) : NO_KEY;
+    }
+
+    // Remove the surrounding {}
+    eventInfo.json = json;
+    eventInfo.jsonLen = len - 2;
+    eventInfo.priority = priority;
+    eventInfo.keys = keys;
+    eventInfo.keyCount = keyCount;
+    return true;
+}
+
+char *SleepHelper::EventCombiner::getScratchBuffer(size_t size) {
+    if (size > scratchSize) {
+        char *newBuf = (char *)realloc(scratchBuf, size);
+        if (!newBuf) {
+            return nullptr;
+        }
+        scratchBuf = newBuf;
+        scratchSize = size;
+    }
+    return scratchBuf;
+}
+
+void SleepHelper::EventCombiner::clearPrepared() {
+    arenas[0].rewind();
+    arenas[1].rewind();
+    historyArena.rewind();
+    keyCount = 0;
+    memset(keySlots, 0, sizeof(keySlots));
+    for(size_t ii = 0; ii < channelCount; ii++) {
+        channels[ii].prepared = nullptr;
+        channels[ii].preparedCount = 0;
+        channels[ii].preparedSize = 0;
+    }
+    preparedErased = false;
+}
+
+void SleepHelper::EventCombiner::compactPrepared() {
+    // Keys are interned again in the other arena, since replaced entries may have been the only ones using some
+    BumpArena &from = arenas[arenaIndex];
+    arenaIndex ^= 1;
+    BumpArena &to = arenas[arenaIndex];
+    to.rewind();
+    keyCount = 0;
+    memset(keySlots, 0, sizeof(keySlots));
+
+    // from is not modified until all of the entries have been copied
+    const char *fromKeyNames[SLEEPHELPER_EVENT_KEY_CAPACITY];
+    memcpy(fromKeyNames, keyNames, sizeof(keyNames));
+
+    for(size_t ii = 0; ii < preparedInfo.size(); ii++) {
+        EventInfo &info = preparedInfo[ii];
+
+        uint16_t *keys = to.allocArray<uint16_t>(info.keyCount);
+        char *json = to.copy(info.json, info.jsonLen);
+        if (!keys || !json) {
+            // Out of memory. Entries that were already copied use the new key indexes, so discard all of them.
+            SleepHelper::instance().appLog.error("out of memory saving wake event data");
+            preparedInfo.clear();
+            preparedIds.clear();
+            clearPrepared();
+            return;
+        }
+        for(size_t kk = 0; kk < info.keyCount; kk++) {
+            if (info.keys[kk] != NO_KEY) {
+                const char *name = fromKeyNames[info.keys[kk]];
+                keys[kk] = internKey(name, strlen(name));
             }
+            else {
+                keys[kk] = NO_KEY;
+            }
+        }
+        info.json = json;
+        info.keys = keys;
+    }
 
-            // Remove the } at the end of the object
-            buf[strlen(buf) - 1] = 0;
-            eventInfo.json = &buf[1];
+    from.rewind();
+    preparedErased = false;
+}
 
-            infoArray.push_back(eventInfo);
+uint16_t SleepHelper::EventCombiner::internKey(const char *key, size_t len) {
+    // FNV-1a hash
+    uint32_t hash = 2166136261UL;
+    for(size_t ii = 0; ii < len; ii++) {
+        hash = (hash ^ (uint8_t)key[ii]) * 16777619UL;
+    }
+
+    // Open addressing with linear probing. The table is never more than half full, so there's always an empty slot.
+    size_t slot = hash % KEY_SLOTS;
+    while(keySlots[slot]) {
+        uint16_t index = keySlots[slot] - 1;
+        if (strncmp(keyNames[index], key, len) == 0 && keyNames[index][len] == 0) {
+            return index;
         }
+        slot = (slot + 1) % KEY_SLOTS;
+    }
+
+    if (keyCount >= SLEEPHELPER_EVENT_KEY_CAPACITY) {
+        SleepHelper::instance().appLog.error("too many event keys (%u), increase SLEEPHELPER_EVENT_KEY_CAPACITY", (unsigned)SLEEPHELPER_EVENT_KEY_CAPACITY);
+        return NO_KEY;
+    }
+    char *name = arenas[arenaIndex].copy(key, len);
+    if (!name) {
+        return NO_KEY;
     }
+    keyNames[keyCount] = name;
+    keySlots[slot] = (uint16_t)++keyCount;
+    return (uint16_t)(keyCount - 1);
 }
 
 // [static]
@@ -1484,14 +3900,25 @@ void SleepHelper::JSONCopy(const JSONValue &src, JSONWriter &writer) {
         writer.nullValue();
     }
     else {
-        // isNumber
+        // isNumber. Use the number of decimal places in the original, since value(double) only has 6 significant digits.
+        JSONString str = src.toString();
+        const char *dp = (const char *)memchr(str.data(), '.', str.size());
+        bool exponent = memchr(str.data(), 'e', str.size()) || memchr(str.data(), 'E', str.size());
+
         double d = src.toDouble();
-        if (d == std::floor(d)) {
-            // Is an integer
+        if (exponent) {
+            writer.value(d);
+        }
+        else
+        if (dp) {
+            writer.value(d, (int)(&str.data()[str.size()] - dp - 1));
+        }
+        else
+        if (d >= INT_MIN && d <= INT_MAX) {
             writer.value((int)d);
         }
         else {
-            writer.value(d);
+            writer.value(d, 0);
         }
     }
 }
@@ -2,9 +2,79 @@
 #define __SLEEPHELPER_H
 
 #include "Particle.h"
+#ifdef UNITTEST
+// Host build: Device OS APIs that are not part of UnitTestLib (see automated-test)
+#include "SleepHelperSim.h"
+#endif
 #include "LocalTimeRK.h"
 #include "JsonParserGeneratorRK.h"
 #include <vector>
+#include <iterator> // std::reverse_iterator
+#include <new> // placement new
+#include <cstddef> // std::max_align_t
+#include <type_traits>
+
+/**
+ * @brief Bytes of inline storage for each callback function
+ * 
+ * Lambda captures must fit in this space, which is checked at compile time. The default holds 
+ * a std::function plus a 64-bit value, so capturing a few values or a pointer always fits.
+ */
+#ifndef SLEEPHELPER_CALLBACK_STORAGE
+#define SLEEPHELPER_CALLBACK_STORAGE (sizeof(std::function<void()>) + sizeof(uint64_t))
+#endif
+
+/**
+ * @brief Maximum number of callbacks of each type (withWakeFunction, withSleepReadyFunction, etc.)
+ * 
+ * Callbacks are stored in fixed arrays inside the SleepHelper object, not on the heap. Adding more 
+ * than this many callbacks of one type logs an error and the extra callback is not called. In debug
+ * builds it also fails an assertion, see SleepHelper::callbackCapacityExceeded().
+ */
+#ifndef SLEEPHELPER_CALLBACK_CAPACITY
+#define SLEEPHELPER_CALLBACK_CAPACITY 4
+#endif
+
+/**
+ * @brief Maximum number of event callbacks in each EventCombiner (withWakeEventFunction)
+ * 
+ * Stored inside the SleepHelper object like the other callbacks. Adding more logs an error and, in
+ * debug builds, fails an assertion.
+ */
+#ifndef SLEEPHELPER_EVENT_CALLBACK_CAPACITY
+#define SLEEPHELPER_EVENT_CALLBACK_CAPACITY 8
+#endif
+
+/**
+ * @brief Maximum number of one-time event callbacks in each EventCombiner, including the built-in wake events
+ * 
+ * This is also the number of one-time callback results that prepareEvents() can hold until they
+ * are published.
+ */
+#ifndef SLEEPHELPER_EVENT_ONE_TIME_CAPACITY
+#define SLEEPHELPER_EVENT_ONE_TIME_CAPACITY 16
+#endif
+
+/**
+ * @brief Maximum number of different top-level keys in the wake event callbacks for one wake
+ * 
+ * Keys are used to remove duplicate values (see EventCombiner), and are kept in a fixed table
+ * inside the SleepHelper object. Keys after this many are logged as an error and not checked
+ * for duplicates.
+ */
+#ifndef SLEEPHELPER_EVENT_KEY_CAPACITY
+#define SLEEPHELPER_EVENT_KEY_CAPACITY 64
+#endif
+
+/**
+ * @brief Maximum number of event history channels, including the one set with withEventHistory()
+ * 
+ * Each channel has its own EventHistory inside the SleepHelper object. Adding more channels than
+ * this logs an error and events for the extra channel go to the default one.
+ */
+#ifndef SLEEPHELPER_HISTORY_CHANNEL_CAPACITY
+#define SLEEPHELPER_HISTORY_CHANNEL_CAPACITY 4
+#endif
 
 
 /**
@@ -29,6 +99,25 @@ public:
      */
     static SleepHelper &instance();
 
+#ifdef UNITTEST
+    /**
+     * @brief Host simulation only: deletes the singleton, as if the device had reset
+     * 
+     * The next call to instance() allocates a new one. This is used to simulate HIBERNATE.
+     */
+    static void simulateReset();
+#endif
+
+    /**
+     * @brief Reports that a callback could not be added because the fixed array is full
+     * 
+     * @param capacity The number of callbacks the array holds
+     * 
+     * Logs an error. Debug builds (DEBUG_BUILD in Device OS, and the host build in automated-test) also
+     * stop with an assertion, since a callback that is never called is otherwise easy to miss.
+     */
+    static void callbackCapacityExceeded(size_t capacity);
+
 #ifndef UNITTEST
     /**
      * @brief This is a wrapper around a recursive mutex, similar to Device OS RecursiveMutex
@@ -140,25 +229,303 @@ public:
     };
 #endif /* UNITTEST */
 
+    template<class Signature, size_t StorageSize = SLEEPHELPER_CALLBACK_STORAGE>
+    class AppFunction;
+
+    /**
+     * @brief A function, lambda, or other callable object stored inline without heap allocation
+     * 
+     * @tparam R Return type
+     * @tparam Args Parameter types
+     * @tparam StorageSize Bytes of storage for the callable object (lambda captures)
+     * 
+     * This works like std::function, but the callable object is always stored inside this object.
+     * If it does not fit you get a compile error instead of a heap allocation. Calling it is a 
+     * single indirect call, and copying and destroying lambdas that only capture simple values
+     * does not require a call at all.
+     */
+    template<class R, class... Args, size_t StorageSize>
+    class AppFunction<R(Args...), StorageSize> {
+    public:
+        /**
+         * @brief Construct an empty function. Calling it is not allowed.
+         */
+        AppFunction() {}
+
+        /**
+         * @brief Construct an empty function, for compatibility with std::function
+         */
+        AppFunction(std::nullptr_t) {}
+
+        /**
+         * @brief Construct from a function pointer, lambda, or other callable object
+         * 
+         * @param fn The callable object to copy or move into inline storage
+         */
+        template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, AppFunction>::value>::type>
+        AppFunction(F &&fn) {
+            typedef typename std::decay<F>::type Fn;
+            static_assert(sizeof(Fn) <= StorageSize, "callback captures too much data; capture a pointer instead or increase SLEEPHELPER_CALLBACK_STORAGE");
+            static_assert(alignof(Fn) <= alignof(uint64_t), "callback capture alignment not supported");
+
+            new(storage) Fn(std::forward<F>(fn));
+            invoker = &invoke<Fn>;
+            if (!std::is_trivially_copyable<Fn>::value || !std::is_trivially_destructible<Fn>::value) {
+                manager = &manage<Fn>;
+            }
+        }
+
+        /**
+         * @brief Copy constructor
+         */
+        AppFunction(const AppFunction &other) {
+            copyFrom(other);
+        }
+
+        /**
+         * @brief Move constructor
+         */
+        AppFunction(AppFunction &&other) {
+            moveFrom(other);
+        }
+
+        /**
+         * @brief Destructor
+         */
+        ~AppFunction() {
+            reset();
+        }
+
+        /**
+         * @brief Copy assignment
+         */
+        AppFunction &operator=(const AppFunction &other) {
+            if (this != &other) {
+                reset();
+                copyFrom(other);
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Move assignment
+         */
+        AppFunction &operator=(AppFunction &&other) {
+            if (this != &other) {
+                reset();
+                moveFrom(other);
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Call the function. It must not be empty.
+         */
+        R operator()(Args... args) const {
+            return invoker(storage, std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief Returns true if the function is not empty
+         */
+        explicit operator bool() const {
+            return invoker != 0;
+        }
+
+        /**
+         * @brief Destroy the callable object, making this function empty
+         */
+        void reset() {
+            if (manager) {
+                manager(OP_DESTROY, storage, 0);
+            }
+            invoker = 0;
+            manager = 0;
+        }
+
+    protected:
+        static const int OP_COPY    = 0; //!< manager: copy construct dst from src
+        static const int OP_MOVE    = 1; //!< manager: move construct dst from src, then destroy src
+        static const int OP_DESTROY = 2; //!< manager: destroy dst
+
+        /**
+         * @brief Calls the stored callable object of type Fn
+         */
+        template<class Fn>
+        static R invoke(const unsigned char *storage, Args... args) {
+            // const_cast allows mutable lambdas, like std::function
+            return (*reinterpret_cast<Fn *>(const_cast<unsigned char *>(storage)))(std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief Copies, moves, or destroys a stored callable object of type Fn
+         * 
+         * Only used when Fn is not trivially copyable and destructible. Otherwise the storage is copied directly.
+         */
+        template<class Fn>
+        static void manage(int op, unsigned char *dst, unsigned char *src) {
+            switch(op) {
+                case OP_COPY:
+                    new(dst) Fn(*reinterpret_cast<const Fn *>(src));
+                    break;
+
+                case OP_MOVE:
+                    new(dst) Fn(std::move(*reinterpret_cast<Fn *>(src)));
+                    reinterpret_cast<Fn *>(src)->~Fn();
+                    break;
+
+                case OP_DESTROY:
+                    reinterpret_cast<Fn *>(dst)->~Fn();
+                    break;
+            }
+        }
+
+        void copyFrom(const AppFunction &other) {
+            if (other.manager) {
+                other.manager(OP_COPY, storage, const_cast<unsigned char *>(other.storage));
+            }
+            else
+            if (other.invoker) {
+                memcpy(storage, other.storage, StorageSize);
+            }
+            invoker = other.invoker;
+            manager = other.manager;
+        }
+
+        void moveFrom(AppFunction &other) {
+            if (other.manager) {
+                other.manager(OP_MOVE, storage, other.storage);
+            }
+            else
+            if (other.invoker) {
+                memcpy(storage, other.storage, StorageSize);
+            }
+            invoker = other.invoker;
+            manager = other.manager;
+            other.invoker = 0;
+            other.manager = 0;
+        }
+
+        alignas(uint64_t) unsigned char storage[StorageSize] = {}; //!< The callable object, zeroed so the trivial copy in copyFrom/moveFrom never reads uninitialized bytes
+        R (*invoker)(const unsigned char *, Args...) = 0; //!< Calls the callable object, 0 if empty
+        void (*manager)(int, unsigned char *, unsigned char *) = 0; //!< Copies and destroys the callable object, 0 if trivial
+    };
+
+    /**
+     * @brief Fixed-capacity array used to store callbacks
+     * 
+     * @tparam T Element type 
+     * @tparam Capacity Maximum number of elements
+     * 
+     * Elements are stored contiguously inside this object, and there is no heap allocation. 
+     * Only the small subset of std::vector used for callbacks is implemented.
+     */
+    template<class T, size_t Capacity>
+    class AppCallbackArray {
+    public:
+        AppCallbackArray() {}
+
+        ~AppCallbackArray() {
+            clear();
+        }
+
+        /**
+         * @brief Add an element at the end
+         * 
+         * @return true The element was added
+         * @return false The array is full and the element was not added
+         */
+        bool push_back(T &&value) {
+            if (count >= Capacity) {
+                return false;
+            }
+            new(&data()[count++]) T(std::move(value));
+            return true;
+        }
+
+        /**
+         * @brief Remove an element, moving the later elements down
+         * 
+         * @param index Index of the element to remove
+         */
+        void erase(size_t index) {
+            if (index >= count) {
+                return;
+            }
+            for(size_t ii = index; ii + 1 < count; ii++) {
+                data()[ii] = std::move(data()[ii + 1]);
+            }
+            data()[--count].~T();
+        }
+
+        /**
+         * @brief Remove all elements
+         */
+        void clear() {
+            for(size_t ii = 0; ii < count; ii++) {
+                data()[ii].~T();
+            }
+            count = 0;
+        }
+
+        size_t size() const { return count; };
+        bool empty() const { return count == 0; };
+        static constexpr size_t capacity() { return Capacity; };
+
+        T &operator[](size_t index) { return data()[index]; };
+        const T &operator[](size_t index) const { return data()[index]; };
+
+        T *begin() { return data(); };
+        T *end() { return data() + count; };
+        const T *begin() const { return data(); };
+        const T *end() const { return data() + count; };
+        std::reverse_iterator<T *> rbegin() { return std::reverse_iterator<T *>(end()); };
+        std::reverse_iterator<T *> rend() { return std::reverse_iterator<T *>(begin()); };
+
+    protected:
+        /**
+         * This class cannot be copied
+         */
+        AppCallbackArray(const AppCallbackArray&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        AppCallbackArray& operator=(const AppCallbackArray&) = delete;
+
+        T *data() { return reinterpret_cast<T *>(storage); };
+        const T *data() const { return reinterpret_cast<const T *>(storage); };
+
+        alignas(T) unsigned char storage[Capacity * sizeof(T)]; //!< Elements, only the first count are constructed
+        size_t count = 0; //!< Number of elements
+    };
+
     /**
      * @brief Base class for a list of zero or more callback functions
      * 
+     * @tparam Capacity Maximum number of callback functions
      * @tparam Types 
      * 
      * Callbacks can have different parameters, and this template allows the parameters to be specified.
+     * You normally use AppCallback, which has the default capacity SLEEPHELPER_CALLBACK_CAPACITY.
      */
-    template<class... Types>
-    class AppCallback {
+    template<size_t Capacity, class... Types>
+    class AppCallbackFixed {
     public:
         /**
          * @brief Adds a callback function. Zero or more callbacks can be defined.
          * 
          * @param callback 
+         * @return false if the maximum number of callbacks has already been added
          * 
          * The callback always returns a bool, but the parameters are defined by the template.
          */
-        void add(std::function<bool(Types... args)> callback) {
-            callbackFunctions.push_back(callback);
+        bool add(AppFunction<bool(Types... args)> callback) {
+            if (!callbackFunctions.push_back(std::move(callback))) {
+                SleepHelper::callbackCapacityExceeded(Capacity);
+                return false;
+            }
+            return true;
         }
 
         /**
@@ -267,11 +634,17 @@ public:
         }
 
         /**
-         * @brief Vector of all callbacks, limited only by available RAM.
+         * @brief Array of all callbacks, up to Capacity
          */
-        std::vector<std::function<bool(Types... args)>> callbackFunctions;
+        AppCallbackArray<AppFunction<bool(Types... args)>, Capacity> callbackFunctions;
     };
 
+    /**
+     * @brief A list of zero or more callback functions with the default capacity
+     */
+    template<class... Types>
+    using AppCallback = AppCallbackFixed<SLEEPHELPER_CALLBACK_CAPACITY, Types...>;
+
     /**
      * @brief State data for AppCallbackWithState
      * 
@@ -291,23 +664,28 @@ public:
     };
 
     /**
-     * @brief Works like AppCallback, but includes additional state data
+     * @brief Works like AppCallbackFixed, but includes additional state data
      * 
      * This is used by data capture functions.
      */
-    template<class... Types>
-    class AppCallbackWithState {
+    template<size_t Capacity, class... Types>
+    class AppCallbackWithStateFixed {
     public: 
         /**
          * @brief Adds a callback function. Zero or more callbacks can be defined.
          * 
          * @param callback 
+         * @return false if the maximum number of callbacks has already been added
          * 
          * The callback always returns a bool, but the parameters are defined by the template.
          */
-        void add(std::function<bool(AppCallbackState &, Types... args)> callback) {
-            callbackFunctions.push_back(callback);
+        bool add(AppFunction<bool(AppCallbackState &, Types... args)> callback) {
+            if (!callbackFunctions.push_back(std::move(callback))) {
+                SleepHelper::callbackCapacityExceeded(Capacity);
+                return false;
+            }
             callbackState.push_back(AppCallbackState());
+            return true;
         }
 
         /**
@@ -368,11 +746,17 @@ public:
          */
         bool isEmpty() const { return callbackFunctions.empty(); };
 
-        std::vector<std::function<bool(AppCallbackState &, Types... args)>> callbackFunctions; //!< The callback functions
-        std::vector<AppCallbackState> callbackState; //!< The state for the callback functions. The array indexes match callbackFunctions.
+        AppCallbackArray<AppFunction<bool(AppCallbackState &, Types... args)>, Capacity> callbackFunctions; //!< The callback functions
+        AppCallbackArray<AppCallbackState, Capacity> callbackState; //!< The state for the callback functions. The array indexes match callbackFunctions.
 
     };
 
+    /**
+     * @brief AppCallbackWithStateFixed with the default capacity
+     */
+    template<class... Types>
+    using AppCallbackWithState = AppCallbackWithStateFixed<SLEEPHELPER_CALLBACK_CAPACITY, Types...>;
+
     /**
      * @brief Class for ShouldConnect application callback
      * 
@@ -494,7 +878,7 @@ public:
          * @param fn a function or lamba to call
          * @return SettingsFile& 
          */
-        SettingsFile &withSettingChangeFunction(std::function<bool(const char *)> fn) { 
+        SettingsFile &withSettingChangeFunction(AppFunction<bool(const char *)> fn) { 
             settingChangeFunctions.add(fn);
             return *this;
         }
@@ -782,6 +1166,72 @@ public:
     };
 
 
+    /**
+     * @brief Caches the results of schedule evaluation
+     * 
+     * Finding the next scheduled time walks forward through the days of each schedule item, and the
+     * same values are needed several times per wake (whether to connect, sleep duration, next data
+     * capture). If the next time after t0 is t1, nothing is scheduled between t0 and t1, so the result
+     * is the same for any time in [t0, t1). Results are reused within that window, including across
+     * sleep cycles, until the schedules or timezone change. Changes are detected by a hash of the
+     * schedule contents and the timezone, so schedules can still be modified directly.
+     */
+    class ScheduleCache {
+    public:
+        static const size_t NEXT_WAKE           = 0; //!< LocalTimeScheduleManager::getNextWake
+        static const size_t NEXT_FULL_WAKE      = 1; //!< LocalTimeScheduleManager::getNextFullWake
+        static const size_t NEXT_DATA_CAPTURE   = 2; //!< LocalTimeScheduleManager::getNextDataCapture
+        static const size_t COUNT               = 3; //!< Number of cached values
+
+        /**
+         * @brief Get the next scheduled time, from the cache if possible
+         * 
+         * @param scheduleManager The schedules to evaluate
+         * @param which NEXT_WAKE, NEXT_FULL_WAKE, or NEXT_DATA_CAPTURE
+         * @param conv The time and timezone to start from. convert() must have been called.
+         * @return time_t Time or 0 if there is no schedule
+         */
+        time_t getNextTime(const LocalTimeScheduleManager &scheduleManager, size_t which, const LocalTimeConvert &conv);
+
+        /**
+         * @brief Discard all cached values
+         */
+        void invalidate();
+
+        /**
+         * @brief Number of times a cached value was used
+         */
+        uint32_t getHitCount() const { return hitCount; };
+
+        /**
+         * @brief Number of times the schedule was evaluated
+         */
+        uint32_t getMissCount() const { return missCount; };
+
+        /**
+         * @brief Hash of the schedule contents and timezone, used to detect changes
+         * 
+         * @param scheduleManager The schedules
+         * @param tz The timezone configuration
+         * @return uint32_t 
+         */
+        static uint32_t hash(const LocalTimeScheduleManager &scheduleManager, const LocalTimePosixTimezone &tz);
+
+    protected:
+        /**
+         * @brief A cached value
+         */
+        struct Entry {
+            bool valid; //!< Entry contains a value
+            time_t startTime; //!< The earliest time the value is known to be correct for
+            time_t nextTime; //!< Next scheduled time (0 = none); the value is correct until this time
+        };
+        Entry entries[COUNT] = {}; //!< Cached values
+        uint32_t key = 0; //!< Hash of the schedules and timezone when the entries were set
+        uint32_t hitCount = 0; //!< Statistics, see getHitCount()
+        uint32_t missCount = 0; //!< Statistics, see getMissCount()
+    };
+
     /**
      * @brief Base class for storing persistent binary data to a file or retained memory
      * 
@@ -1067,6 +1517,33 @@ public:
         String path; //!< Path to data file
     };
 
+    // State dwell groups. Time spent in each group of state handlers is accumulated in the
+    // persistent data and reported in the "sd" wake event. The order must match the
+    // JSON keys in _stateDwellNames[] in SleepHelper.cpp.
+    static const size_t STATE_DWELL_AWAKE           = 0; //!< "aw" awake without a connection (start, no connection, sleep done)
+    static const size_t STATE_DWELL_CONNECT_WAIT    = 1; //!< "cw" waiting for the cloud connection and RTC time
+    static const size_t STATE_DWELL_CONNECTED       = 2; //!< "cn" connected, generating wake events and waiting for sleep ready
+    static const size_t STATE_DWELL_PUBLISH_WAIT    = 3; //!< "pw" waiting for a publish to complete, including the rate limit
+    static const size_t STATE_DWELL_RECONNECT_WAIT  = 4; //!< "rw" waiting to reconnect after losing the cloud connection
+    static const size_t STATE_DWELL_DISCONNECT_WAIT = 5; //!< "dw" waiting for cloud and cellular to disconnect
+    static const size_t STATE_DWELL_CELLULAR_OFF    = 6; //!< "co" waiting for the modem to power off
+    static const size_t STATE_DWELL_SLEEP_SHORT     = 7; //!< "ss" awake because the sleep period was too short
+    static const size_t STATE_DWELL_SLEEP           = 8; //!< "sl" sleeping with cellular off
+    static const size_t STATE_DWELL_SLEEP_STANDBY   = 9; //!< "sb" sleeping with cellular standby
+    static const size_t STATE_DWELL_COUNT           = 10; //!< Number of state dwell groups
+
+    // Battery SoC measurement segments for the cellular cost model, see withCellularCostModel()
+    static const uint32_t SOC_SEGMENT_AWAKE         = 0; //!< Full wake, from connecting until sleep
+    static const uint32_t SOC_SEGMENT_SLEEP_OFF     = 1; //!< Sleep with cellular off
+    static const uint32_t SOC_SEGMENT_SLEEP_STANDBY = 2; //!< Sleep with cellular standby
+    static const uint32_t SOC_SEGMENT_COUNT         = 3; //!< Number of segment types
+    static const uint32_t SOC_SEGMENT_NONE          = 0xff; //!< Not currently measuring
+    static const time_t SOC_WINDOW_AWAKE_SEC        = 3600; //!< Awake SoC measurements are halved after this much time
+    static const time_t SOC_WINDOW_SLEEP_SEC        = 86400; //!< Sleep SoC measurements are halved after this much time
+    static const uint32_t CELLULAR_COST_EXPLORE_INTERVAL = 32; //!< Built-in cost model uses the other option once every this many decisions
+
+    static const size_t PUBLISH_WINDOW_MAX = 4; //!< Maximum value for withPublishWindow()
+
     /**
      * @brief Class for storing small data used by SleepHelper in the flash file system
      * 
@@ -1098,6 +1575,17 @@ public:
             uint32_t lastFullWake; //!< time_t last full wake (Unix time, UTC)
             uint32_t lastQuickWake; //!< time_t last quick wake (Unix time, UTC)
             uint32_t nextDataCapture; //!< time_t next data capture time (Unix time, UTC)
+            uint32_t stateDwellMs[STATE_DWELL_COUNT]; //!< milliseconds in each state dwell group since the last published "sd" wake event
+            uint32_t coldConnectMs; //!< Average time to connect after sleep with cellular off or boot, 0 = not measured
+            uint32_t warmConnectMs; //!< Average time to connect after sleep with cellular standby, 0 = not measured
+            float socDrop[SOC_SEGMENT_COUNT]; //!< Battery SoC drop (percent) measured in each type of segment
+            uint32_t socSeconds[SOC_SEGMENT_COUNT]; //!< Duration in seconds that socDrop was measured over
+            float socSegmentStart; //!< Battery SoC at the start of the current segment
+            uint32_t socSegmentStartTime; //!< time_t at the start of the current segment
+            uint32_t socSegmentType; //!< Type of the current segment (SOC_SEGMENT_AWAKE, etc.), SOC_SEGMENT_NONE if not measuring
+            uint32_t hibernateSleepMs; //!< Requested duration of the HIBERNATE sleep in progress, 0 if not in HIBERNATE
+            uint32_t hibernateStart; //!< time_t when HIBERNATE sleep started (Unix time, UTC), 0 if the time was not valid
+            uint32_t hibernateNextFullWake; //!< time_t of the next full wake when HIBERNATE sleep started (Unix time, UTC)
             // OK to add more fields here later without incremeting version.
             // New fields will be zero-initialized.
         };
@@ -1192,52 +1680,743 @@ public:
             setValue<uint32_t>(offsetof(SleepHelperData, nextDataCapture), (uint32_t)value);
         }
 
-    
-        static const uint32_t SAVED_DATA_MAGIC = 0xd87cb6ce; //!< Magic bytes in the data structure
-        static const uint16_t SAVED_DATA_VERSION = 1; //!< Version of the data structure
-
-
-    protected:
-        SleepHelperData sleepHelperData; //!< Data stored in the persistent data file
-    };
+        /**
+         * @brief Get the milliseconds spent in a state dwell group since the last "sd" wake event
+         *
+         * @param index The group, such as STATE_DWELL_CONNECT_WAIT
+         * @return uint32_t milliseconds, or 0 if index is out of range
+         */
+        uint32_t getValue_stateDwellMs(size_t index) const {
+            if (index >= STATE_DWELL_COUNT) {
+                return 0;
+            }
+            return getValue<uint32_t>(offsetof(SleepHelperData, stateDwellMs) + index * sizeof(uint32_t));
+        }
 
+        /**
+         * @brief Set the milliseconds spent in a state dwell group
+         *
+         * @param index The group, such as STATE_DWELL_CONNECT_WAIT
+         * @param value milliseconds
+         */
+        void setValue_stateDwellMs(size_t index, uint32_t value) {
+            if (index < STATE_DWELL_COUNT) {
+                setValue<uint32_t>(offsetof(SleepHelperData, stateDwellMs) + index * sizeof(uint32_t), value);
+            }
+        }
 
-    /**
-     * @brief Class to manage small events, typically used for time-series data
-     * 
-     * For example, if you want to frequently measure the temperature, but publish the data 
-     * less frequently, to save on cellular connections, battery, and data operations, this
-     * class can be helpful.
-     * 
-     * Each event is JSON data. The data is stored in a single file in the flash file
-     * system. When it's time to publish, all of the events that will fit in the appropriate
-     * size will be aggregated into a single JSON array, reducing the number of data 
-     * operations and speeding the Particle event publishing process, which is limited to
-     * one event per second-ish.
-     */
-    class EventHistory : public SleepHelperRecursiveMutex {
-    public:
-        EventHistory() {};
+        /**
+         * @brief Add to the milliseconds spent in a state dwell group. Saturates instead of wrapping around.
+         *
+         * @param index The group, such as STATE_DWELL_CONNECT_WAIT
+         * @param ms milliseconds to add
+         */
+        void addValue_stateDwellMs(size_t index, uint32_t ms) {
+            WITH_LOCK(*this) {
+                uint32_t value = getValue_stateDwellMs(index);
+                setValue_stateDwellMs(index, (value > (0xffffffff - ms)) ? 0xffffffff : value + ms);
+            }
+        }
 
         /**
-         * @brief Sets the path of the event history file
+         * @brief Get the average time to connect after sleep with cellular off (or boot)
          * 
-         * @param path 
-         * @return EventHistory& 
+         * @return uint32_t milliseconds, 0 if not measured yet
          */
-        EventHistory &withPath(const char *path) {
-            this->path = path;
-            return *this;
+        uint32_t getValue_coldConnectMs() const {
+            return getValue<uint32_t>(offsetof(SleepHelperData, coldConnectMs));
         }
 
         /**
-         * @brief Adds an event to the event history
-         * 
-         * @param jsonObj Must be a string containing a JSON object (including the surrounding {}).
+         * @brief Set the average time to connect after sleep with cellular off (or boot)
          * 
-         * If the data you want to send is an array, you should encapsulate the array under a key in the outermost
-         * object. If the data is just a single primitive such as a number or string, also surround it with
-         * a key and object.
+         * @param value milliseconds
+         */
+        void setValue_coldConnectMs(uint32_t value) {
+            setValue<uint32_t>(offsetof(SleepHelperData, coldConnectMs), value);
+        }
+
+        /**
+         * @brief Get the average time to connect after sleep with cellular standby
+         * 
+         * @return uint32_t milliseconds, 0 if not measured yet
+         */
+        uint32_t getValue_warmConnectMs() const {
+            return getValue<uint32_t>(offsetof(SleepHelperData, warmConnectMs));
+        }
+
+        /**
+         * @brief Set the average time to connect after sleep with cellular standby
+         * 
+         * @param value milliseconds
+         */
+        void setValue_warmConnectMs(uint32_t value) {
+            setValue<uint32_t>(offsetof(SleepHelperData, warmConnectMs), value);
+        }
+
+        /**
+         * @brief Get the battery SoC drop measured for a type of segment
+         * 
+         * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, or SOC_SEGMENT_SLEEP_STANDBY
+         * @return float SoC percent
+         */
+        float getValue_socDrop(uint32_t type) const {
+            if (type >= SOC_SEGMENT_COUNT) {
+                return 0;
+            }
+            return getValue<float>(offsetof(SleepHelperData, socDrop) + type * sizeof(float));
+        }
+
+        /**
+         * @brief Set the battery SoC drop measured for a type of segment
+         * 
+         * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, or SOC_SEGMENT_SLEEP_STANDBY
+         * @param value SoC percent
+         */
+        void setValue_socDrop(uint32_t type, float value) {
+            if (type < SOC_SEGMENT_COUNT) {
+                setValue<float>(offsetof(SleepHelperData, socDrop) + type * sizeof(float), value);
+            }
+        }
+
+        /**
+         * @brief Get the number of seconds the SoC drop was measured over for a type of segment
+         * 
+         * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, or SOC_SEGMENT_SLEEP_STANDBY
+         * @return uint32_t seconds, 0 if not measured yet
+         */
+        uint32_t getValue_socSeconds(uint32_t type) const {
+            if (type >= SOC_SEGMENT_COUNT) {
+                return 0;
+            }
+            return getValue<uint32_t>(offsetof(SleepHelperData, socSeconds) + type * sizeof(uint32_t));
+        }
+
+        /**
+         * @brief Set the number of seconds the SoC drop was measured over for a type of segment
+         * 
+         * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, or SOC_SEGMENT_SLEEP_STANDBY
+         * @param value seconds
+         */
+        void setValue_socSeconds(uint32_t type, uint32_t value) {
+            if (type < SOC_SEGMENT_COUNT) {
+                setValue<uint32_t>(offsetof(SleepHelperData, socSeconds) + type * sizeof(uint32_t), value);
+            }
+        }
+
+        /**
+         * @brief Get the battery SoC at the start of the current measurement segment
+         */
+        float getValue_socSegmentStart() const {
+            return getValue<float>(offsetof(SleepHelperData, socSegmentStart));
+        }
+
+        /**
+         * @brief Get the time (Unix time, UTC) at the start of the current measurement segment
+         */
+        time_t getValue_socSegmentStartTime() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, socSegmentStartTime));
+        }
+
+        /**
+         * @brief Get the type of the current measurement segment, or SOC_SEGMENT_NONE
+         * 
+         * A value of 0 is SOC_SEGMENT_AWAKE, but the segment is only valid if the start time is also set.
+         */
+        uint32_t getValue_socSegmentType() const {
+            if (getValue_socSegmentStartTime() == 0) {
+                return SOC_SEGMENT_NONE;
+            }
+            return getValue<uint32_t>(offsetof(SleepHelperData, socSegmentType));
+        }
+
+        /**
+         * @brief Start a measurement segment
+         * 
+         * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, SOC_SEGMENT_SLEEP_STANDBY, or SOC_SEGMENT_NONE
+         * @param soc Battery SoC now
+         * @param time Unix time now, or 0 to end the segment without starting a new one
+         */
+        void setValue_socSegment(uint32_t type, float soc, time_t time) {
+            WITH_LOCK(*this) {
+                setValue<uint32_t>(offsetof(SleepHelperData, socSegmentType), type);
+                setValue<float>(offsetof(SleepHelperData, socSegmentStart), soc);
+                setValue<uint32_t>(offsetof(SleepHelperData, socSegmentStartTime), (uint32_t)time);
+            }
+        }
+
+        /**
+         * @brief Get the requested duration of the HIBERNATE sleep in progress
+         * 
+         * @return uint32_t Milliseconds, or 0 if the last sleep was not HIBERNATE. 
+         * 
+         * RAM is lost in HIBERNATE, so this is how setup() knows the reset was a wake from HIBERNATE.
+         */
+        uint32_t getValue_hibernateSleepMs() const {
+            return getValue<uint32_t>(offsetof(SleepHelperData, hibernateSleepMs));
+        }
+
+        /**
+         * @brief Get the time (Unix time, UTC) when the HIBERNATE sleep started, 0 if unknown
+         */
+        time_t getValue_hibernateStart() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, hibernateStart));
+        }
+
+        /**
+         * @brief Get the time (Unix time, UTC) of the next full wake saved when the HIBERNATE sleep started
+         */
+        time_t getValue_hibernateNextFullWake() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, hibernateNextFullWake));
+        }
+
+        /**
+         * @brief Save the state for a HIBERNATE sleep, or clear it after waking
+         * 
+         * @param sleepMs Requested sleep duration in milliseconds, 0 to clear
+         * @param start Unix time now, or 0 if not valid
+         * @param nextFullWake Unix time of the next full wake
+         */
+        void setValue_hibernate(uint32_t sleepMs, time_t start, time_t nextFullWake) {
+            WITH_LOCK(*this) {
+                setValue<uint32_t>(offsetof(SleepHelperData, hibernateSleepMs), sleepMs);
+                setValue<uint32_t>(offsetof(SleepHelperData, hibernateStart), (uint32_t)start);
+                setValue<uint32_t>(offsetof(SleepHelperData, hibernateNextFullWake), (uint32_t)nextFullWake);
+            }
+        }
+
+    
+        static const uint32_t SAVED_DATA_MAGIC = 0xd87cb6ce; //!< Magic bytes in the data structure
+        static const uint16_t SAVED_DATA_VERSION = 1; //!< Version of the data structure
+
+
+    protected:
+        SleepHelperData sleepHelperData; //!< Data stored in the persistent data file
+    };
+
+
+    /**
+     * @brief JSONBufferWriter that can also insert pre-formatted JSON without parsing it
+     * 
+     * JSONWriter does not have a method to write pre-formatted JSON, and its state (whether the
+     * next value needs a , or :) is private. rawValue() writes a null value, which writes the
+     * separator and updates the state, and write() replaces the null with the pre-formatted JSON.
+     */
+    class JSONSpliceWriter : public JSONBufferWriter {
+    public:
+        /**
+         * @brief Construct a writer into a buffer, same as JSONBufferWriter
+         * 
+         * @param buf Buffer to write to
+         * @param size Size of buf in bytes
+         */
+        JSONSpliceWriter(char *buf, size_t size) : JSONBufferWriter(buf, size) {};
+
+        /**
+         * @brief Inserts pre-formatted JSON as a value
+         * 
+         * @param json A complete JSON value, such as an object. It is copied as-is, so it must be valid.
+         * @param size Length of json in bytes
+         * @return JSONSpliceWriter& 
+         */
+        JSONSpliceWriter &rawValue(const char *json, size_t size) {
+            rawData = json;
+            rawSize = size;
+            nullValue();
+            rawData = nullptr;
+            return *this;
+        }
+
+    protected:
+        /**
+         * @brief Writes to the buffer, replacing the null written by rawValue()
+         */
+        virtual void write(const char *data, size_t size) override {
+            if (rawData && size == 4 && memcmp(data, "null", 4) == 0) {
+                data = rawData;
+                size = rawSize;
+                rawData = nullptr;
+            }
+            JSONBufferWriter::write(data, size);
+        }
+
+        const char *rawData = nullptr; //!< JSON to write instead of the next null, set during rawValue()
+        size_t rawSize = 0; //!< Length of rawData
+    };
+
+    /**
+     * @brief JSONBufferWriter that records the top-level keys of the object as they are written
+     *
+     * This is used by EventCombiner to find the keys in the data from a callback without parsing
+     * it afterwards. write() follows the nesting and strings in the output, and a string followed
+     * by a : inside the outermost object is a key. The keys are not copied; they're offsets into
+     * the buffer, so they're only valid if the data was not truncated (dataSize() <= bufferSize()).
+     *
+     * Names are as written, with JSON escapes, so keys are compared in their escaped form.
+     */
+    class JSONKeyWriter : public JSONBufferWriter {
+    public:
+        /**
+         * @brief Construct a writer into a buffer, same as JSONBufferWriter
+         *
+         * @param buf Buffer to write to
+         * @param size Size of buf in bytes
+         */
+        JSONKeyWriter(char *buf, size_t size) : JSONBufferWriter(buf, size) {};
+
+        /**
+         * @brief Returns the number of top-level keys written
+         *
+         * This can be larger than SLEEPHELPER_EVENT_KEY_CAPACITY, but only that many are saved.
+         */
+        size_t getKeyCount() const { return keyCount; };
+
+        /**
+         * @brief Returns the name of a top-level key, in the buffer (not null terminated)
+         *
+         * @param index 0 = the first key written
+         * @return Pointer into the buffer, or nullptr if index is not a saved key
+         */
+        const char *getKey(size_t index) const {
+            return (index < keyCount && index < SLEEPHELPER_EVENT_KEY_CAPACITY) ? &buffer()[keys[index].offset + 1] : nullptr;
+        }
+
+        /**
+         * @brief Returns the length of the name of a top-level key in bytes
+         *
+         * @param index 0 = the first key written
+         */
+        size_t getKeyLength(size_t index) const {
+            return (index < keyCount && index < SLEEPHELPER_EVENT_KEY_CAPACITY) ? keys[index].len : 0;
+        }
+
+        /**
+         * @brief Returns the offset in the buffer where the member for a top-level key starts
+         *
+         * @param index 0 = the first key written
+         *
+         * This is the offset of the " before the name. The member continues to the , before the
+         * next key, or the closing } of the object.
+         */
+        size_t getKeyOffset(size_t index) const {
+            return (index < keyCount && index < SLEEPHELPER_EVENT_KEY_CAPACITY) ? keys[index].offset : 0;
+        }
+
+    protected:
+        /**
+         * @brief Writes to the buffer, recording top-level keys
+         */
+        virtual void write(const char *data, size_t size) override;
+
+        /**
+         * @brief Location of a key in the buffer
+         */
+        class KeyInfo {
+        public:
+            uint16_t offset; //!< Offset of the " before the name
+            uint16_t len; //!< Length of the name in bytes, not including the quotes
+        };
+        KeyInfo keys[SLEEPHELPER_EVENT_KEY_CAPACITY]; //!< Keys written, in order
+        size_t keyCount = 0; //!< Number of top-level keys written
+        int depth = 0; //!< Nesting depth of objects and arrays, 1 = in the outermost object
+        bool inString = false; //!< Currently in a string
+        bool escape = false; //!< Last character in the string was a backslash
+        size_t stringStart = 0; //!< Offset of the " that started the last string
+        size_t stringEnd = 0; //!< Offset of the " that ended the last string
+    };
+
+    /**
+     * @brief Class to manage small events, typically used for time-series data
+     * 
+     * For example, if you want to frequently measure the temperature, but publish the data 
+     * less frequently, to save on cellular connections, battery, and data operations, this
+     * class can be helpful.
+     * 
+     * Each event is JSON data, one per line. The data is stored in the flash file system as 
+     * a log of segment files (path.1, path.2, ...), each up to the segment size. New events 
+     * are appended to the last segment and events are read from the first one, at the read 
+     * position saved in path.cur. Removing events that have been published only updates the 
+     * read position and deletes segments that have been completely read, so the cost doesn't
+     * depend on how many events are waiting. When it's time to publish, all of the events that will fit in the appropriate
+     * size will be aggregated into a single JSON array, reducing the number of data 
+     * operations and speeding the Particle event publishing process, which is limited to
+     * one event per second-ish.
+     */
+    class EventHistory : public SleepHelperRecursiveMutex {
+    public:
+        /**
+         * @brief Describes the fields of events that are stored as compact binary records
+         * 
+         * Fields are identified by their position in the schema, so the key names are only stored
+         * here, not in each record. For example, for events like {"t":1656633900,"bs":4,"c":21.5}:
+         * 
+         * ```
+         * EventHistory::RecordSchema()
+         *     .withTime("t")
+         *     .withInt("bs")
+         *     .withFixed("c", 1)
+         * ```
+         */
+        class RecordSchema {
+        public:
+            /**
+             * @brief Maximum number of fields in a schema
+             * 
+             * A schema with more fields than this is rejected, and events are stored as JSON.
+             */
+            static const size_t FIELDS_MAX = 16;
+
+            /**
+             * @brief Field types
+             */
+            enum class FieldType : uint8_t {
+                TIME, //!< Unix time (integer >= 0), stored as the difference from the previous record
+                INT, //!< 32-bit signed integer
+                FIXED, //!< Number with a fixed number of decimal places, stored as a scaled integer
+                BOOL //!< true or false
+            };
+
+            /**
+             * @brief One field of the schema
+             */
+            class Field {
+            public:
+                String name; //!< JSON key
+                FieldType type = FieldType::INT; //!< Type of value
+                uint8_t decimals = 0; //!< Decimal places, for FieldType::FIXED
+            };
+
+            /**
+             * @brief Sets the schema identifier stored in each record
+             * 
+             * @param schemaId Identifier 0 - 127 (default: 1)
+             * @return RecordSchema& 
+             * 
+             * Records with a different identifier than the current schema are skipped when reading, so
+             * change this when you change the fields of a schema in a new version of your firmware.
+             */
+            RecordSchema &withSchemaId(uint8_t schemaId) {
+                this->schemaId = schemaId & 0x7f;
+                return *this;
+            }
+
+            /**
+             * @brief Adds a time field (Unix time, integer seconds)
+             * 
+             * @param name JSON key
+             * @return RecordSchema& 
+             */
+            RecordSchema &withTime(const char *name) {
+                return withField(name, FieldType::TIME);
+            }
+
+            /**
+             * @brief Adds a 32-bit signed integer field
+             * 
+             * @param name JSON key
+             * @return RecordSchema& 
+             */
+            RecordSchema &withInt(const char *name) {
+                return withField(name, FieldType::INT);
+            }
+
+            /**
+             * @brief Adds a number field with a fixed number of decimal places
+             * 
+             * @param name JSON key
+             * @param decimals Number of decimal places (0 - 9)
+             * @return RecordSchema& 
+             * 
+             * Events with a value that has more decimal places than this are stored as JSON instead, so 
+             * a value is never rounded. It's rendered with this many decimal places when published.
+             */
+            RecordSchema &withFixed(const char *name, int decimals) {
+                withField(name, FieldType::FIXED);
+                if (tooManyFields) {
+                    return *this;
+                }
+                fields.back().decimals = (uint8_t)((decimals < 0) ? 0 : ((decimals > 9) ? 9 : decimals));
+                return *this;
+            }
+
+            /**
+             * @brief Adds a boolean field
+             * 
+             * @param name JSON key
+             * @return RecordSchema& 
+             */
+            RecordSchema &withBool(const char *name) {
+                return withField(name, FieldType::BOOL);
+            }
+
+            /**
+             * @brief Adds a field
+             * 
+             * @param name JSON key
+             * @param type Type of value
+             * @return RecordSchema& 
+             * 
+             * Adding more than FIELDS_MAX fields logs an error and rejects the whole schema, so 
+             * isEmpty() is true and all events are stored as JSON.
+             */
+            RecordSchema &withField(const char *name, FieldType type) {
+                if (fields.size() >= FIELDS_MAX) {
+                    if (!tooManyFields) {
+                        SleepHelper::instance().appLog.error("record schema has more than %u fields, storing events as JSON", (unsigned)FIELDS_MAX);
+                        tooManyFields = true;
+                    }
+                    return *this;
+                }
+                Field field;
+                field.name = name;
+                field.type = type;
+                fields.push_back(field);
+                return *this;
+            }
+
+            /**
+             * @brief Publish records as columnar blocks instead of one JSON object each
+             * 
+             * @param columnar true to publish columnar blocks (default: false, publish JSON objects)
+             * @return RecordSchema& 
+             * 
+             * Consecutive records in the event history array are published as one object with the 
+             * field names and types once, the number of samples, and the values encoded in Z85 (a
+             * Base85 variant that is safe in JSON strings):
+             * 
+             * ```
+             * {"cols":"t:t,bs:i,c:f1","n":72,"z85":"..."}
+             * ```
+             * 
+             * The type is t (time), i (integer), f followed by the decimal places (fixed), or b (bool).
+             * The values are a stream of bit codes, sample by sample and field by field, for the difference 
+             * from the same field in the previous sample. Time fields code the difference between 
+             * differences instead, after the first time which is 32 bits. A value that doesn't change, or
+             * a time taken at the same interval, is one bit. tools/columnar-decode.js in this library 
+             * is the reference decoder.
+             * 
+             * For {"t":1656633900,"bs":4,"c":21.5} every 5 minutes, this fits over 1800 samples in a 
+             * 1024 byte event instead of 30.
+             */
+            RecordSchema &withColumnar(bool columnar = true) {
+                this->columnar = columnar;
+                return *this;
+            }
+
+            /**
+             * @brief Returns true if no fields have been added, or the schema was rejected for having more than FIELDS_MAX fields
+             */
+            bool isEmpty() const {
+                return fields.empty() || tooManyFields;
+            }
+
+            uint8_t schemaId = 1; //!< Stored in each record, see withSchemaId()
+            std::vector<Field> fields; //!< Fields, in the order they are stored and published, at most FIELDS_MAX
+            bool columnar = false; //!< Publish records as columnar blocks, see withColumnar()
+            bool tooManyFields = false; //!< More than FIELDS_MAX fields were added, see withField()
+        };
+
+        /**
+         * @brief When to replace old samples with aggregates, see withRetentionPolicy()
+         * 
+         * For example, to keep at most 16 Kbytes of events waiting to be published, and replace samples 
+         * older than a day with hourly aggregates:
+         * 
+         * ```
+         * EventHistory::RetentionPolicy()
+         *     .withMaxBytes(16384)
+         *     .withMaxAge(24h)
+         * ```
+         */
+        class RetentionPolicy {
+        public:
+            /**
+             * @brief Compact the oldest samples when the events waiting to be published are larger than this
+             * 
+             * @param maxBytes Size in bytes of the segment files, 0 for no limit (default)
+             * @return RetentionPolicy& 
+             */
+            RetentionPolicy &withMaxBytes(size_t maxBytes) {
+                this->maxBytes = maxBytes;
+                return *this;
+            }
+
+            /**
+             * @brief Compact samples older than this
+             * 
+             * @param maxAge Age, 0 for no limit (default). Only used once the time is valid.
+             * @return RetentionPolicy& 
+             */
+            RetentionPolicy &withMaxAge(std::chrono::seconds maxAge) {
+                this->maxAge = (uint32_t)maxAge.count();
+                return *this;
+            }
+
+            /**
+             * @brief Length of time each aggregate covers
+             * 
+             * @param window Window, starting at a multiple of this in Unix time (default: 1 hour)
+             * @return RetentionPolicy& 
+             */
+            RetentionPolicy &withWindow(std::chrono::seconds window) {
+                this->window = (uint32_t)window.count();
+                return *this;
+            }
+
+            /**
+             * @brief Key for the number of samples in an aggregate
+             * 
+             * @param countKey JSON key (default: "n"). It must not be a field of the schema.
+             * @return RetentionPolicy& 
+             */
+            RetentionPolicy &withCountKey(const char *countKey) {
+                this->countKey = countKey;
+                return *this;
+            }
+
+            /**
+             * @brief Returns true if a limit has been set
+             */
+            bool isEnabled() const {
+                return (maxBytes || maxAge) && window;
+            }
+
+            size_t maxBytes = 0; //!< See withMaxBytes()
+            uint32_t maxAge = 0; //!< Seconds, see withMaxAge()
+            uint32_t window = 3600; //!< Seconds, see withWindow()
+            String countKey = "n"; //!< See withCountKey()
+        };
+
+        EventHistory() {};
+
+        /**
+         * @brief Sets the path of the event history file
+         * 
+         * @param path Path prefix of the segment files, such as /usr/events.txt for /usr/events.txt.1, ...
+         * @return EventHistory& 
+         */
+        EventHistory &withPath(const char *path) {
+            this->path = path;
+            return *this;
+        }
+
+        /**
+         * @brief Sets the size of each segment file
+         * 
+         * @param size Size in bytes (default: 4096)
+         * @return EventHistory& 
+         * 
+         * A new segment is started when adding an event would make the last segment larger than this. 
+         * Events are never split across segments, so a segment can be larger if a single write (an event, 
+         * or the contents of the staging buffer) is larger. A segment is deleted once all of its events
+         * are removed, so smaller segments free space sooner when there is a large backlog, at the 
+         * expense of more files.
+         */
+        EventHistory &withSegmentSize(size_t size) {
+            this->segmentSize = size;
+            return *this;
+        }
+
+        /**
+         * @brief Stage events in RAM and write them to the file in groups
+         * 
+         * @param buffer Buffer to hold events until they are written to the file, typically retained memory
+         * @param size Size of buffer in bytes, including a STAGING_HEADER_SIZE byte header
+         * @return EventHistory& 
+         * 
+         * Without a staging buffer, each addEvent() opens, appends to, and closes the file. With a staging 
+         * buffer, events are copied into the buffer and appended to the file with a single write by flush(), 
+         * which is called when the buffer is full and before reading events to publish (getEvents). SleepHelper
+         * also calls it before a reset or a HIBERNATE sleep.
+         * 
+         * The buffer should be in retained memory:
+         * 
+         * ```
+         * retained uint8_t eventStaging[1024];
+         * ```
+         * 
+         * Events in a retained buffer survive a reset, including a crash or watchdog reset, and are kept 
+         * when withStagingBuffer() is called again after the reset. The header is validated and events are only counted once they have 
+         * been completely copied, so an event being added at the moment of a reset is lost, but earlier 
+         * ones are not. Events that were not flushed yet are lost if power is removed, and also on reset 
+         * if the buffer is not retained.
+         */
+        EventHistory &withStagingBuffer(void *buffer, size_t size);
+
+        /**
+         * @brief Store events that match a schema as compact binary records instead of JSON
+         * 
+         * @param schema The fields of the events to store in binary
+         * @return EventHistory& 
+         * 
+         * An event is stored as a binary record when its keys are exactly the fields of the schema, 
+         * in any order, and every value fits its field type. Other events are stored as JSON as 
+         * before, so events of different kinds can be mixed. Records are converted back to JSON 
+         * by getEvents() when publishing, with the keys in schema order.
+         * 
+         * A record is a 0x01 byte, a length byte, a byte with the schema identifier, then each field
+         * as a variable-length integer. The time field is stored as the difference from the time in 
+         * the previous record, except for the first record in each segment file and after a reset, 
+         * so each segment can be read on its own. For {"t":1656633900,"bs":4,"c":21.5} taken every 
+         * 5 minutes this is 8 bytes instead of 33.
+         * 
+         * Events are converted when they're written to the file, so the staging buffer 
+         * (withStagingBuffer()) still holds JSON.
+         */
+        EventHistory &withRecordSchema(const RecordSchema &schema) {
+            WITH_LOCK(*this) {
+                this->schema = schema;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Replace old samples with per-window aggregates when the event history grows too large or old
+         * 
+         * @param policy The limits, and the length of each window
+         * @return EventHistory& 
+         * 
+         * When a device can't connect for days, every sample is kept until it's published, which uses
+         * flash and makes for a long burst of publishes once it connects. With a policy, compactEvents()
+         * rewrites the oldest segment files, replacing each sample (an event matching the schema set with 
+         * withRecordSchema(), which is required) with one event per window:
+         * 
+         * ```
+         * {"t":1656633600,"n":12,"bs":[3,4,3.5],"c":[21.5,22.8,22.04]}
+         * ```
+         * 
+         * The first time field is the start of the window, the count key is the number of samples, and 
+         * each other field is [min,max,mean]. The mean has one more decimal place than the field (two
+         * for booleans, which are 0 or 1). Other events are kept as they are.
+         * 
+         * Segments are compacted oldest first until the events are under the byte limit and the remaining
+         * samples are newer than the age limit. A segment is written to a temporary file which is then
+         * renamed over it, so a reset leaves either the old or the new one. The segment being appended
+         * to, a partially removed one, and events that have been retrieved and not removed yet are never
+         * compacted.
+         */
+        EventHistory &withRetentionPolicy(const RetentionPolicy &policy) {
+            WITH_LOCK(*this) {
+                this->retention = policy;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Write the events in the staging buffer to the file
+         * 
+         * If there is no staging buffer or it's empty, this does nothing.
+         */
+        void flush();
+
+        /**
+         * @brief Adds an event to the event history
+         * 
+         * @param jsonObj Must be a string containing a JSON object (including the surrounding {}).
+         * 
+         * If the data you want to send is an array, you should encapsulate the array under a key in the outermost
+         * object. If the data is just a single primitive such as a number or string, also surround it with
+         * a key and object.
          */
         void addEvent(const char *jsonObj);
 
@@ -1258,72 +2437,457 @@ public:
          *            .name("c").value("testing!");
 		 * });
          * 
-         * This is using the addEvent method of SleepHelper(), which just calls this
-         * method on the correct object.
-         */;
-        void addEvent(std::function<void(JSONWriter &)>callback);
+         * This is using the addEvent method of SleepHelper(), which just calls this
+         * method on the correct object.
+         */;
+        void addEvent(std::function<void(JSONWriter &)>callback);
+
+        /**
+         * @brief A position in the event history, such as the end of the events retrieved by getEvents()
+         */
+        class Cursor {
+        public:
+            /**
+             * @brief Returns true if this is a position returned by getCursor()
+             */
+            bool isValid() const { return segment != 0; };
+
+            /**
+             * @brief Returns true if this is the same position as other
+             */
+            bool operator==(const Cursor &other) const { return segment == other.segment && offset == other.offset; };
+
+            /**
+             * @brief Returns true if this position is before other
+             */
+            bool operator<(const Cursor &other) const { return segment < other.segment || (segment == other.segment && offset < other.offset); };
+
+            uint32_t segment = 0; //!< Segment number, 0 if not valid
+            uint32_t offset = 0; //!< Offset in segment
+            uint32_t lastTime = 0; //!< Time in the binary record before offset, to decode the next one
+        };
+
+        /**
+         * @brief The events between two cursors, such as the events retrieved by one call to getEvents()
+         */
+        class Range {
+        public:
+            /**
+             * @brief Returns true if there are no events in the range
+             */
+            bool isEmpty() const { return !start.isValid() || !(start < end); };
+
+            Cursor start; //!< Position of the first event
+            Cursor end; //!< Position after the last event
+        };
+
+        /**
+         * @brief Get saved events and insert them as an array to writer
+         * 
+         * @param writer 
+         * @param maxSize 
+         * @param removeEvents 
+         * @return true 
+         * @return false 
+         * 
+         * If there are no events (getHasEvent() == false), this method returns quickly
+         * so there is no need to preflight this call with a test for having events.
+         */
+        bool getEvents(JSONWriter &writer, size_t maxSize, bool removeEvents = true) {
+            return getEventsInternal(writer, nullptr, maxSize, removeEvents);
+        }
+
+        /**
+         * @brief Get saved events and insert them as an array to writer, without parsing them
+         * 
+         * @param writer 
+         * @param maxSize 
+         * @param removeEvents 
+         * @return true 
+         * @return false 
+         * 
+         * Events stored as JSON are copied into the writer as-is, instead of being parsed and written
+         * again using JSONCopy(). This is faster, uses less stack, and the output is identical to 
+         * the event that was added.
+         */
+        bool getEvents(JSONSpliceWriter &writer, size_t maxSize, bool removeEvents = true) {
+            return getEventsInternal(writer, &writer, maxSize, removeEvents);
+        }
+        
+        /**
+         * @brief Remove the events last retrieved using getEvents
+         * 
+         * By default, events are removed automatically so there is no need to call
+         * this. The function exists so you can do a two-phase removal. 
+         * 
+         * It's safe to add events in the time period between getEvents() and
+         * removeEvents(). Calling getEvents() more than once without removing
+         * continues after the events already retrieved, and removeEvents() removes
+         * all of them. Use rewindEvents() to start from the beginning again. Do not 
+         * call getEvents() from different threads.
+         * 
+         * If the device resets between getEvents() and removeEvents(), the events
+         * will be sent again later. To remove the events from each getEvents() separately,
+         * use getCursor() and removeEvents(const Range &) instead.
+         */
+        void removeEvents();
+
+        /**
+         * @brief Forget the events retrieved using getEvents without removing them
+         * 
+         * The next getEvents() starts from the oldest event again.
+         */
+        void rewindEvents() {
+            WITH_LOCK(*this) {
+                getSegment = readSegment;
+                getOffset = readOffset;
+                getLastTime = readLastTime;
+            }
+        }
+
+        /**
+         * @brief Returns the position where the next getEvents() continues
+         * 
+         * Save this before and after getEvents() to get the Range of the events it retrieved,
+         * to remove later using removeEvents(const Range &).
+         */
+        Cursor getCursor() {
+            if (firstRun) {
+                getHasEvents();
+            }
+            Cursor cursor;
+            WITH_LOCK(*this) {
+                cursor.segment = getSegment;
+                cursor.offset = getOffset;
+                cursor.lastTime = getLastTime;
+            }
+            return cursor;
+        }
+
+        /**
+         * @brief Continue getEvents() from a position returned by getCursor()
+         * 
+         * @param cursor The position. If it's not valid, or the events before it have all been removed, 
+         * this is the same as rewindEvents().
+         * 
+         * This is used to skip over events that have been retrieved and are being sent, but have not
+         * been removed yet.
+         */
+        void seekEvents(const Cursor &cursor);
+
+        /**
+         * @brief Remove the events in a range, such as the events retrieved by one getEvents()
+         * 
+         * @param range The events to remove, from getCursor() before and after getEvents()
+         * 
+         * This allows ranges to be removed separately, as each is acknowledged, and not necessarily
+         * in order. If there are events before the range that have not been removed, the range is 
+         * saved in path.cur so getEvents() skips it, even after a reset. It's removed from the file
+         * system when the events before it are. Up to REMOVED_RANGES_MAX ranges can be waiting for
+         * the events before them; after that, a range is logged as an error and will be sent again 
+         * after a reset.
+         */
+        void removeEvents(const Range &range);
+
+        /**
+         * @brief Compact old samples if the event history is over the limits of the retention policy
+         * 
+         * @param from Events before this position are being sent, so they are left alone. Pass the end
+         * of the last range retrieved that has not been removed yet, or an invalid Cursor if there are none.
+         * @return true if any segments were compacted. getEvents() then starts from the oldest event again.
+         * 
+         * This does nothing without withRetentionPolicy(), or while there are ranges removed out of 
+         * order, since they refer to positions in the segments. EventCombiner calls it before reading
+         * the event history to publish.
+         */
+        bool compactEvents(const Cursor &from);
+
+        /**
+         * @brief Returns a value that changes every time events are added or removed
+         * 
+         * This is used to tell if data read from the event history is still current.
+         */
+        uint32_t getChangeCount() const { 
+            return changeCount; 
+        }
+
+        /**
+         * @brief Returns true if there are events to get using getEvents
+         * 
+         * @return true 
+         * @return false 
+         * 
+         * This operation is fast, just checks a flag variable. It's not necessary to
+         * check before calling getEvents(), because that method has the same check
+         * internally.
+         * 
+         * Except for the first run after wake, when it needs to check the file
+         * system to see if there is a file that was not processed before reboot.
+         * This is why this method is not const.
+         */
+        bool getHasEvents();
+
+    protected:
+        /**
+         * This class cannot be copied
+         */
+        EventHistory(const EventHistory&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        EventHistory& operator=(const EventHistory&) = delete;
+
+        /**
+         * @brief Header at the beginning of the staging buffer, then the events, one per line
+         */
+        struct StagingHeader {
+            uint32_t magic; //!< STAGING_MAGIC
+            uint32_t size; //!< Size of the buffer, including this header
+            uint32_t used; //!< Bytes of events after this header
+        };
+
+    public:
+        static const uint32_t STAGING_MAGIC = 0x4ebd72a1; //!< Magic bytes in the staging buffer header
+        static const size_t STAGING_HEADER_SIZE = sizeof(StagingHeader); //!< Bytes of the staging buffer used by the header
+
+    protected:
+        /**
+         * @brief Implementation of getEvents()
+         * 
+         * @param writer Writer to write the array to
+         * @param spliceWriter The same writer if it's a JSONSpliceWriter, or nullptr to use JSONCopy()
+         * @param maxSize 
+         * @param removeEvents 
+         */
+        bool getEventsInternal(JSONWriter &writer, JSONSpliceWriter *spliceWriter, size_t maxSize, bool removeEvents);
+
+        /**
+         * @brief Returns the path of a segment file, path.segment
+         */
+        String getSegmentPath(uint32_t segment) const;
+
+        /**
+         * @brief Opens the segment to append to, starting a new one if adding len bytes would make it larger than segmentSize
+         * 
+         * @return File descriptor, or -1 on error. Add the bytes written to writeSize.
+         */
+        int openWriteSegment(size_t len);
+
+        /**
+         * @brief Find the segments and the saved read position, called the first time the event history is used
+         */
+        void loadSegments();
+
+        /**
+         * @brief Remove events up to cursor, and any removed ranges that continue from there
+         */
+        void removeTo(const Cursor &cursor);
+
+        /**
+         * @brief Saves the read position and removed ranges in path.cur
+         */
+        void saveCursor();
+
+        /**
+         * @brief If the getEvents() position is at the start of a removed range, moves it to the end of the range
+         * 
+         * @return true if the position was moved
+         */
+        bool skipRemoved();
+
+        /**
+         * @brief Converts an event to a binary record if it matches schema
+         * 
+         * @param jsonObj JSON object, does not need to be null terminated
+         * @param jsonLen Length of jsonObj
+         * @param record Buffer of at least RECORD_MAX_SIZE bytes
+         * @return Size of the record in bytes, or 0 to store the event as JSON
+         */
+        size_t encodeRecord(const char *jsonObj, size_t jsonLen, uint8_t *record);
+
+        /**
+         * @brief Writes a binary record as a JSON object
+         * 
+         * @param record The record, starting with RECORD_MARKER
+         * @param lastTime Time in the previous record, updated to the time in this one
+         * @param writer Writer to write the object to
+         * @return false if the record is for a different schema and was skipped
+         */
+        bool writeRecord(const uint8_t *record, uint32_t &lastTime, JSONWriter &writer) const;
+
+        /**
+         * @brief Gets the values of an event that matches schema
+         * 
+         * @param jsonObj JSON object, does not need to be null terminated
+         * @param jsonLen Length of jsonObj
+         * @param values One per field of schema. Times and integers as is, fixed as the scaled integer, bool as 0 or 1.
+         * @return false if the event does not match schema
+         */
+        bool getSampleValues(const char *jsonObj, size_t jsonLen, int64_t *values) const;
+
+        /**
+         * @brief Gets the values of a binary record, like getSampleValues()
+         * 
+         * @param record The record, starting with RECORD_MARKER
+         * @param lastTime Time in the previous record, updated to the time in this one
+         * @param values One per field of schema
+         * @return false if the record is for a different schema or corrupted
+         */
+        bool getRecordValues(const uint8_t *record, uint32_t &lastTime, int64_t *values) const;
+
+        /**
+         * @brief Replaces the samples in a segment with aggregates, see withRetentionPolicy()
+         * 
+         * @param segment The segment to compact
+         * @param cutoff If not 0, the segment is left alone if it has samples at or after this time
+         * @param oldSize Set to the size of the segment before compacting
+         * @param newSize Set to the size of the segment after compacting
+         * @return 1 if the segment was compacted, 0 if there was nothing to gain, -1 if it has samples newer than cutoff
+         */
+        int compactSegment(uint32_t segment, uint32_t cutoff, size_t &oldSize, size_t &newSize);
+
+        /**
+         * @brief Writes one aggregate and a newline to buf
+         * 
+         * @return Bytes written, or 0 if it does not fit in size
+         */
+        size_t writeAggregate(char *buf, size_t size, size_t timeField, uint32_t windowStart, size_t count, const int64_t *minValues, const int64_t *maxValues, const int64_t *sums) const;
+
+        /**
+         * @brief Contents of the path.cur file, followed by the removed ranges (Range) if there are any
+         */
+        struct CursorData {
+            uint32_t magic; //!< CURSOR_MAGIC
+            uint32_t segment; //!< Segment containing the next event to read
+            uint32_t offset; //!< Offset in segment of the next event to read
+            uint32_t lastTime; //!< Time in the binary record before offset, to decode the next one
+        };
+
+    public:
+        static const uint32_t CURSOR_MAGIC = 0x9c3a50e7; //!< Magic bytes in the path.cur file
+        static const uint8_t RECORD_MARKER = 0x01; //!< First byte of a binary record. JSON events start with {.
+        static const uint8_t RECORD_FLAG_ABSOLUTE = 0x80; //!< Set with the schema identifier if the time is not a difference
+        static const size_t RECORD_MAX_SIZE = 2 + 255; //!< Largest binary record, including the marker and length bytes
+        static const size_t REMOVED_RANGES_MAX = 8; //!< Maximum number of ranges removed before the events in front of them
+
+    protected:
+        String path; //!< path to the event history file, used as the prefix for the segment files
+        size_t segmentSize = 4096; //!< Size to start a new segment at, see withSegmentSize()
+        uint32_t readSegment = 1; //!< First segment, where events that have not been removed start
+        size_t readOffset = 0; //!< Offset in readSegment of the first event that has not been removed, saved in path.cur
+        uint32_t writeSegment = 1; //!< Last segment, where events are appended
+        size_t writeSize = 0; //!< Size of writeSegment in bytes
+        uint32_t getSegment = 1; //!< Segment where getEvents continues from
+        size_t getOffset = 0; //!< Offset in getSegment where getEvents continues from, removeEvents removes up to here
+        uint32_t readLastTime = 0; //!< Time in the binary record before readOffset, saved in path.cur
+        uint32_t getLastTime = 0; //!< Time in the binary record before getOffset
+        uint32_t writeLastTime = 0; //!< Time in the last binary record written, 0 to store the next time as absolute
+        RecordSchema schema; //!< Schema for binary records, empty to store all events as JSON. See withRecordSchema().
+        StagingHeader *staging = nullptr; //!< Staging buffer, nullptr if events are appended to the file directly. See withStagingBuffer().
+        bool firstRun = true; //!< Used to flag the first time the file has been accessed
+        bool hasEvents = false; //!< True if there are events in the event history file
+        uint32_t changeCount = 0; //!< Incremented when events are added or removed
+        Range removedRanges[REMOVED_RANGES_MAX]; //!< Ranges removed by removeEvents(const Range &) after readOffset, saved in path.cur
+        size_t removedRangeCount = 0; //!< Number of entries in removedRanges
+        RetentionPolicy retention; //!< When to compact samples, see withRetentionPolicy()
+        uint32_t compactedSegment = 0; //!< Segments up to this one have been checked by compactEvents() and don't change
+    };
+
+    /**
+     * @brief Bump allocator for memory that is all released at the same time
+     * 
+     * Allocations are taken from the end of the current block, and there is no way to free one.
+     * rewind() releases everything but keeps the blocks, so once the arena has grown to the size 
+     * needed, using it again does not use the heap. Destructors are not called, so only use it 
+     * for objects that don't need them.
+     */
+    class BumpArena {
+    public:
+        /**
+         * @brief Construct an arena. No memory is allocated until it's used.
+         * 
+         * @param blockSize Size of each block taken from the heap. Larger allocations get a block of their own size.
+         */
+        BumpArena(size_t blockSize = 1024) : blockSize(blockSize) {};
 
         /**
-         * @brief Get saved events and insert them as an array to writer
-         * 
-         * @param writer 
-         * @param maxSize 
-         * @param removeEvents 
-         * @return true 
-         * @return false 
-         * 
-         * If there are no events (getHasEvent() == false), this method returns quickly
-         * so there is no need to preflight this call with a test for having events.
+         * @brief Frees all of the blocks
          */
-        bool getEvents(JSONWriter &writer, size_t maxSize, bool removeEvents = true);
-        
+        ~BumpArena();
+
         /**
-         * @brief Remove the events last retrieved using getEvents
-         * 
-         * By default, events are removed automatically so there is no need to call
-         * this. The function exists so you can do a two-phase removal. 
-         * 
-         * It's safe to add events in the time period between getEvents() and
-         * removeEvents() however you should not have multiple getEvents() in a row
-         * or from different threads, as you will get the same events multiple times
-         * and data corruption can occur.
+         * @brief Allocate memory, aligned for any type
          * 
-         * If the device resets between getEvents() and removeEvents(), the events
-         * will be sent again later.
+         * @param size Size in bytes
+         * @return Pointer to the memory, or nullptr if out of memory
          */
-        void removeEvents();
+        void *alloc(size_t size);
 
         /**
-         * @brief Returns true if there are events to get using getEvents
-         * 
-         * @return true 
-         * @return false 
+         * @brief Allocate an array of objects that don't need destructors
          * 
-         * This operation is fast, just checks a flag variable. It's not necessary to
-         * check before calling getEvents(), because that method has the same check
-         * internally.
+         * @param count Number of elements, which are default constructed
+         * @return Pointer to the first element, or nullptr if out of memory
+         */
+        template<class T>
+        T *allocArray(size_t count) {
+            T *result = (T *)alloc(count * sizeof(T));
+            if (result) {
+                for(size_t ii = 0; ii < count; ii++) {
+                    new(&result[ii]) T();
+                }
+            }
+            return result;
+        }
+
+        /**
+         * @brief Copy a string into the arena
          * 
-         * Except for the first run after wake, when it needs to check the file
-         * system to see if there is a file that was not processed before reboot.
-         * This is why this method is not const.
+         * @param src String to copy, does not need to be null terminated
+         * @param len Length of src
+         * @return The copy, which is null terminated, or nullptr if out of memory
          */
-        bool getHasEvents();
+        char *copy(const char *src, size_t len);
+
+        /**
+         * @brief Release all allocations, keeping the blocks for reuse
+         */
+        void rewind() {
+            current = first;
+            currentUsed = 0;
+        }
+
+        /**
+         * @brief Returns the number of blocks taken from the heap
+         */
+        size_t getBlockCount() const;
 
     protected:
         /**
          * This class cannot be copied
          */
-        EventHistory(const EventHistory&) = delete;
+        BumpArena(const BumpArena&) = delete;
 
         /**
          * This class cannot be copied
          */
-        EventHistory& operator=(const EventHistory&) = delete;
+        BumpArena& operator=(const BumpArena&) = delete;
 
-        String path; //!< path to the event history file
-        bool firstRun = true; //!< Used to flag the first time the file has been accessed
-        bool hasEvents = false; //!< True if there are events in the event history file
-        size_t removeOffset = 0; //!< Where to remove events from
+        /**
+         * @brief Header at the start of each block
+         */
+        struct Block {
+            Block *next; //!< Next block, or nullptr
+            size_t size; //!< Usable bytes after the header
+        };
+
+        static const size_t ALIGN = alignof(std::max_align_t); //!< Alignment of allocations and the block header size
+
+        size_t blockSize; //!< Size of new blocks, see constructor
+        Block *first = nullptr; //!< First block, or nullptr if nothing has been allocated
+        Block *current = nullptr; //!< Block being allocated from, nullptr to start with first
+        size_t currentUsed = 0; //!< Bytes used in current
     };
 
     /**
@@ -1343,12 +2907,32 @@ public:
          * @brief Container to hold a JSON fragment and a priority value 0 - 100.
          * 
          * Note that this is only a fragment, basically an object without the surrounding {}!
+         * 
+         * The fragment and keys are stored in an EventCombiner arena, which is rewound after 
+         * generating events, so an EventInfo can be moved but not copied.
          */
         class EventInfo {
         public:
-            String json; //!< JSON fragment, an object without the surrounding {}
+            EventInfo() {};
+            EventInfo(EventInfo &&) = default;
+            EventInfo &operator=(EventInfo &&) = default;
+
+            const char *json = nullptr; //!< JSON fragment, an object without the surrounding {}
+            size_t jsonLen = 0; //!< Length of json in bytes
             int priority = 0; //!< Priority 0 - 100 inclusive.
-            std::vector<String> keys; //!< Top level keys
+            const uint16_t *keys = nullptr; //!< Top level keys, as indexes into the EventCombiner key table
+            size_t keyCount = 0; //!< Number of keys
+
+        protected:
+            /**
+             * This class cannot be copied
+             */
+            EventInfo(const EventInfo &) = delete;
+
+            /**
+             * This class cannot be copied
+             */
+            EventInfo &operator=(const EventInfo &) = delete;
         };
 
         /**
@@ -1356,7 +2940,16 @@ public:
          * 
          * Use withCallback to add callback functions
          */
-        EventCombiner() {};
+        EventCombiner() {
+            channels[0].config.priority = 1;
+        };
+
+        /**
+         * @brief Frees the scratch buffer
+         */
+        ~EventCombiner() {
+            free(scratchBuf);
+        }
 
         /**
          * @brief Adds a callback function to generate JSON data
@@ -1375,10 +2968,10 @@ public:
          * 
          * Items are added to the event in priority order, largest first.
          * 
-         * If you have a priority < 50 and the event is full, then your data will be discarded to 
-         * avoid generating another event.
+         * If you have a priority < 50 and the events are full, then your data will be discarded to 
+         * avoid generating another event. See generateEvents().
          */
-        EventCombiner &withCallback(std::function<bool(JSONWriter &, int &)> fn) { 
+        EventCombiner &withCallback(AppFunction<bool(JSONWriter &, int &)> fn) { 
             callbacks.add(fn); 
             return *this;
         }
@@ -1387,26 +2980,253 @@ public:
          * @brief Add a callback that is removed after generating events
          * 
          * @param fn 
+         * @param id If non-zero, removes a previously added callback with the same id
          * @return EventCombiner& 
+         * 
+         * One-time callbacks accumulate until the next full wake, so using an id keeps a callback that is 
+         * added on every wake from using more than one entry. Only the most recently added value of a key 
+         * is used anyway.
          */
-        EventCombiner &withOneTimeCallback(std::function<bool(JSONWriter &, int &)> fn) { 
-            oneTimeCallbacks.add(fn); 
+        EventCombiner &withOneTimeCallback(AppFunction<bool(JSONWriter &, int &)> fn, uint64_t id = 0) { 
+            if (id != 0) {
+                for(size_t ii = 0; ii < oneTimeIds.size(); ii++) {
+                    if (oneTimeIds[ii] == id) {
+                        oneTimeCallbacks.callbackFunctions.erase(ii);
+                        oneTimeIds.erase(ii);
+                        break;
+                    }
+                }
+                for(size_t ii = 0; ii < preparedIds.size(); ii++) {
+                    if (preparedIds[ii] == id) {
+                        preparedInfo.erase(ii);
+                        preparedIds.erase(ii);
+                        preparedErased = true;
+                        break;
+                    }
+                }
+            }
+            if (oneTimeCallbacks.add(std::move(fn))) {
+                oneTimeIds.push_back(std::move(id));
+            }
             return *this;
         }
 
+        /**
+         * @brief Settings of an event history channel, see withEventHistoryChannel()
+         * 
+         * For example, for alarms that are published before other event history, in their own file:
+         * 
+         * ```
+         * EventCombiner::HistoryChannel("alarms")
+         *     .withPath("/usr/alarms.txt")
+         *     .withKey("al")
+         *     .withPriority(90)
+         * ```
+         * 
+         * Settings that are not set leave the channel's current setting as is.
+         */
+        class HistoryChannel {
+        public:
+            /**
+             * @brief Settings for the default channel, the one set with withEventHistory()
+             */
+            HistoryChannel() {};
+
+            /**
+             * @brief Settings for a named channel
+             * 
+             * @param name Name passed to addEvent() to add events to this channel
+             */
+            HistoryChannel(const char *name) : name(name) {};
+
+            /**
+             * @brief Sets the path of the event history files for this channel
+             * 
+             * @param path Path prefix of the segment files, which must be different for each channel
+             * @return HistoryChannel& 
+             */
+            HistoryChannel &withPath(const char *path) {
+                this->path = path;
+                return *this;
+            }
+
+            /**
+             * @brief Sets the JSON key the events are published under
+             * 
+             * @param key JSON key, which must be different for each channel
+             * @return HistoryChannel& 
+             */
+            HistoryChannel &withKey(const char *key) {
+                this->key = key;
+                return *this;
+            }
+
+            /**
+             * @brief Sets the priority of this channel
+             * 
+             * @param priority 1 - 100 (default: 1). Higher priority channels are placed in events first, 
+             * so they're published first.
+             * @return HistoryChannel& 
+             */
+            HistoryChannel &withPriority(int priority) {
+                this->priority = priority;
+                return *this;
+            }
+
+            /**
+             * @brief Only publish this channel this often
+             * 
+             * @param interval Minimum time between the wake events that include this channel's events,
+             * 0 to include them in every wake event (default). Only used once the time is valid.
+             * @return HistoryChannel& 
+             * 
+             * Events are kept in the event history in between, so bulk data can be sent a few times
+             * a day while other channels are sent on every full wake.
+             */
+            HistoryChannel &withPublishInterval(std::chrono::seconds interval) {
+                this->publishInterval = (uint32_t)interval.count();
+                return *this;
+            }
+
+            /**
+             * @brief Stage events in RAM, see EventHistory::withStagingBuffer()
+             * 
+             * @param buffer Buffer to hold events until they are written to the file, typically retained memory
+             * @param size Size of buffer in bytes
+             * @return HistoryChannel& 
+             */
+            HistoryChannel &withStagingBuffer(void *buffer, size_t size) {
+                this->stagingBuffer = buffer;
+                this->stagingSize = size;
+                return *this;
+            }
+
+            /**
+             * @brief Store matching events as binary records, see EventHistory::withRecordSchema()
+             * 
+             * @param schema The fields of the events to store in binary
+             * @return HistoryChannel& 
+             */
+            HistoryChannel &withRecordSchema(const EventHistory::RecordSchema &schema) {
+                this->schema = schema;
+                return *this;
+            }
+
+            /**
+             * @brief Replace old samples with aggregates, see EventHistory::withRetentionPolicy()
+             * 
+             * @param policy The limits, and the length of each window
+             * @return HistoryChannel& 
+             */
+            HistoryChannel &withRetentionPolicy(const EventHistory::RetentionPolicy &policy) {
+                this->retention = policy;
+                return *this;
+            }
+
+            String name; //!< Channel name, empty for the default channel
+            String path; //!< Path prefix of the segment files, see withPath()
+            String key; //!< JSON key, see withKey()
+            int priority = 0; //!< Priority, 0 if not set. See withPriority().
+            uint32_t publishInterval = 0; //!< Seconds, see withPublishInterval()
+            void *stagingBuffer = nullptr; //!< See withStagingBuffer()
+            size_t stagingSize = 0; //!< See withStagingBuffer()
+            EventHistory::RecordSchema schema; //!< See withRecordSchema()
+            EventHistory::RetentionPolicy retention; //!< See withRetentionPolicy()
+        };
+
+        /**
+         * @brief The event history in one event from generateEvents(), with a range for each channel
+         */
+        class HistoryRanges {
+        public:
+            /**
+             * @brief Returns true if there is no event history in the event
+             */
+            bool isEmpty() const {
+                for(size_t ii = 0; ii < SLEEPHELPER_HISTORY_CHANNEL_CAPACITY; ii++) {
+                    if (!ranges[ii].isEmpty()) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            EventHistory::Range ranges[SLEEPHELPER_HISTORY_CHANNEL_CAPACITY]; //!< Range in each channel, in the order added. The default channel is first.
+        };
+
         /**
          * @brief Sets parameters for the EventHistory feature
          * 
          * @param path path to store the event history
          * @param key JSON key to publish event history items under
          * @return EventCombiner& 
+         * 
+         * This is the default channel, which addEvent() without a channel name adds to.
          */
         EventCombiner &withEventHistory(const char *path, const char *key) {
-            eventHistory.withPath(path);
-            this->eventHistoryKey = key;
+            channels[0].history.withPath(path);
+            channels[0].config.key = key;
+            return *this;
+        }
+
+        /**
+         * @brief Adds an event history channel, or changes the settings of one
+         * 
+         * @param channel The channel settings. If it has the same name as an existing channel, the settings 
+         * that are set replace the ones of that channel. An empty name is the default channel.
+         * @return EventCombiner& 
+         * 
+         * Each channel has its own files, JSON key, priority, record schema, and retention policy. When 
+         * generating events, the event history of each channel is split into JSON arrays that fit in an
+         * event, like with a single event history. Arrays from higher priority channels are placed first,
+         * each in the first event that has room and no array from the same channel, so arrays from different 
+         * channels share events and a high priority channel is never behind a large backlog in another one.
+         */
+        EventCombiner &withEventHistoryChannel(const HistoryChannel &channel);
+
+        /**
+         * @brief Stage event history events in RAM, see EventHistory::withStagingBuffer()
+         * 
+         * @param buffer Buffer to hold events until they are written to the file, typically retained memory
+         * @param size Size of buffer in bytes
+         * @return EventCombiner& 
+         */
+        EventCombiner &withEventHistoryStaging(void *buffer, size_t size) {
+            channels[0].history.withStagingBuffer(buffer, size);
+            return *this;
+        }
+
+        /**
+         * @brief Store matching event history events as binary records, see EventHistory::withRecordSchema()
+         * 
+         * @param schema The fields of the events to store in binary
+         * @return EventCombiner& 
+         */
+        EventCombiner &withEventHistoryRecordSchema(const EventHistory::RecordSchema &schema) {
+            channels[0].history.withRecordSchema(schema);
+            return *this;
+        }
+
+        /**
+         * @brief Replace old event history samples with aggregates, see EventHistory::withRetentionPolicy()
+         * 
+         * @param policy The limits, and the length of each window
+         * @return EventCombiner& 
+         */
+        EventCombiner &withEventHistoryRetentionPolicy(const EventHistory::RetentionPolicy &policy) {
+            channels[0].history.withRetentionPolicy(policy);
             return *this;
         }
 
+        /**
+         * @brief Write staged event history events to the file for all channels, see EventHistory::flush()
+         */
+        void flushEventHistory() {
+            for(size_t ii = 0; ii < channelCount; ii++) {
+                channels[ii].history.flush();
+            }
+        }
+
         /**
          * @brief Adds an event to the event history (preformatted JSON)
          * 
@@ -1415,7 +3235,19 @@ public:
          * See the version with a callback for an easier way to build the JSON.
          */
         EventCombiner &addEvent(const char *jsonObj) {
-            eventHistory.addEvent(jsonObj);
+            channels[0].history.addEvent(jsonObj);
+            return *this;
+        }
+
+        /**
+         * @brief Adds an event to an event history channel (preformatted JSON)
+         * 
+         * @param channel Name of the channel, see withEventHistoryChannel(). If there is no channel 
+         * with this name, an error is logged and the event is added to the default channel.
+         * @param jsonObj A string containing a complete JSON object surrounded by {}
+         */
+        EventCombiner &addEvent(const char *channel, const char *jsonObj) {
+            findChannel(channel).history.addEvent(jsonObj);
             return *this;
         }
 
@@ -1437,7 +3269,20 @@ public:
 		 * });
          */
         EventCombiner &addEvent(std::function<void(JSONWriter &)>callback) {
-            eventHistory.addEvent(callback);
+            channels[0].history.addEvent(callback);
+            return *this;
+        }
+
+        /**
+         * @brief Adds an event to an event history channel using a callback and writer
+         * 
+         * @param channel Name of the channel, see withEventHistoryChannel(). If there is no channel 
+         * with this name, an error is logged and the event is added to the default channel.
+         * @param callback The callback function, typically a lambda
+         * @return EventCombiner& 
+         */
+        EventCombiner &addEvent(const char *channel, std::function<void(JSONWriter &)>callback) {
+            findChannel(channel).history.addEvent(callback);
             return *this;
         }
 
@@ -1449,6 +3294,8 @@ public:
          * 
          * The events vector you pass into this method will be cleared. It will be returned filled in
          * with zero or more Strings, each containing event data in valid JSON format.
+         * 
+         * The maximum event size is from getMaxEventSize().
          */
         void generateEvents(std::vector<String> &events);
 
@@ -1460,9 +3307,102 @@ public:
          * 
          * The events vector you pass into this method will be cleared. It will be returned filled in
          * with zero or more Strings, each containing event data in valid JSON format.
+         * 
+         * The data is packed into as few events as possible. Each event history array (there is more 
+         * than one if the event history doesn't fit in one event) gets its own event. The callback 
+         * data with priority 50 and higher is always sent, and is added largest first to the first
+         * event with room for it, generating another event only if none has room (first-fit decreasing).
+         * Data with a priority less than 50 then fills the remaining space, highest priority first, and 
+         * is discarded if it doesn't fit. Within each event, the data is in priority order.
          */
         void generateEvents(std::vector<String> &events, size_t maxSize);
 
+        /**
+         * @brief Generate events, leaving the event history in them to be removed after they're published
+         * 
+         * @param events vector of String objects to fill in with event data
+         * @param history Filled in with the event history in each entry in events, empty if there is none
+         * 
+         * Same as generateEvents(std::vector<String> &) except the event history is not removed. After 
+         * each event is published successfully, pass its entry in history to acknowledgeEventHistory().
+         * Events generated later don't include history that is waiting to be acknowledged. If the device
+         * resets first, the history that was not acknowledged is sent again.
+         */
+        void generateEvents(std::vector<String> &events, std::vector<HistoryRanges> &history);
+
+        /**
+         * @brief Generate events of the desired size, leaving the event history in them to be removed after they're published
+         * 
+         * @param events vector of String objects to fill in with event data
+         * @param history Filled in with the event history in each entry in events, empty if there is none
+         * @param maxSize Maximum size of each even in bytes
+         */
+        void generateEvents(std::vector<String> &events, std::vector<HistoryRanges> &history, size_t maxSize);
+
+        /**
+         * @brief Remove the event history in an event from generateEvents() after it has been published
+         * 
+         * @param ranges The entry in history for the event. Nothing is done if it's empty.
+         * 
+         * Events can be acknowledged in any order.
+         */
+        void acknowledgeEventHistory(const HistoryRanges &ranges) {
+            for(size_t ii = 0; ii < channelCount; ii++) {
+                channels[ii].history.removeEvents(ranges.ranges[ii]);
+            }
+        }
+
+        /**
+         * @brief Returns the maximum event data size
+         * 
+         * This is Particle.maxEventDataSize() in Device OS 3.1 and later, if it's less than 
+         * particle::protocol::MAX_EVENT_DATA_LENGTH. The cloud can have a lower limit than
+         * the Device OS buffer, and it's only known for certain after connecting, so
+         * prepareEvents() may use a different value, in which case generateEvents() reads
+         * the event history again.
+         */
+        static size_t getMaxEventSize();
+
+        /**
+         * @brief Do the work for generateEvents() that does not depend on late data
+         * 
+         * The one-time callbacks added so far are called and their results saved, and the event history
+         * is read and split into event-sized arrays. generateEvents() then only needs to call the one-time 
+         * callbacks added after this and the regular callbacks, and pack the results. 
+         * 
+         * This is called while waiting to connect. It's fast when there is nothing new to prepare, 
+         * so it can be called repeatedly. If events are added to the event history afterwards, the 
+         * event history is read again in generateEvents().
+         */
+        void prepareEvents();
+
+        /**
+         * @brief Do the work for generateEvents() that does not depend on late data
+         * 
+         * @param maxSize Maximum size of each event in bytes. Must be the same value passed to generateEvents().
+         */
+        void prepareEvents(size_t maxSize);
+
+        /**
+         * @brief Returns true if there are one-time callbacks that were added without an id
+         * 
+         * These would be lost by a reset. Callbacks added with an id (such as the built-in wake events) 
+         * are added again on every wake, so they're not counted.
+         */
+        bool hasUnsavedCallbacks() const {
+            for(size_t ii = 0; ii < oneTimeIds.size(); ii++) {
+                if (oneTimeIds[ii] == 0) {
+                    return true;
+                }
+            }
+            for(auto it = preparedIds.begin(); it != preparedIds.end(); ++it) {
+                if (*it == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
         /**
          * @brief Clear the one-time callbacks
          * 
@@ -1470,8 +3410,31 @@ public:
          */
         void clearOneTimeCallbacks() {
             oneTimeCallbacks.removeAll();
+            oneTimeIds.clear();
+            preparedInfo.clear();
+            preparedIds.clear();
+            clearPrepared();
+        }
+
+        /**
+         * @brief Returns the number of heap blocks used by the arenas, which only increases when a generation needs more memory than before
+         */
+        size_t getArenaBlockCount() const {
+            return arenas[0].getBlockCount() + arenas[1].getBlockCount() + historyArena.getBlockCount();
+        }
+
+        /**
+         * @brief Returns the number of bytes used by the fixed callback arrays, which were std::vector before
+         * 
+         * There are CALLBACK_ARRAY_COUNT of them. CallbackBench in automated-test uses this to compare the size
+         * of the SleepHelper object with the std::vector implementation.
+         */
+        static constexpr size_t getCallbackArraySize() {
+            return sizeof(callbacks) + sizeof(oneTimeCallbacks) + sizeof(oneTimeIds) + sizeof(preparedInfo) + sizeof(preparedIds);
         }
 
+        static const size_t CALLBACK_ARRAY_COUNT = 5; //!< Number of arrays included in getCallbackArraySize()
+
     protected:
         /**
          * This class cannot be copied
@@ -1491,14 +3454,129 @@ public:
          * @param maxSize The size of the event buffer
          * @param infoArray Data to be added to the event
          * 
-         * A separate function is used because the process is run twice, once for the regular callbacks and once for the one-time callbacks.
+         * A separate function is used because the process is run twice, once for the regular callbacks and once for the one-time callbacks.
+         */
+        bool generateEventInternal(const AppFunction<bool(JSONWriter &, int &)> &callback, char *buf, size_t maxSize, EventInfo &eventInfo);
+
+        /**
+         * @brief Implementation of generateEvents()
+         * 
+         * @param events vector of String objects to fill in with event data
+         * @param history Filled in with the event history in each event, or nullptr to remove the event history now
+         * @param maxSize Maximum size of each even in bytes
+         */
+        void generateEventsInternal(std::vector<String> &events, std::vector<HistoryRanges> *history, size_t maxSize);
+
+        /**
+         * @brief Returns a buffer of at least size bytes, which is kept for the next call
+         */
+        char *getScratchBuffer(size_t size);
+
+        /**
+         * @brief Release the arenas, keys, and event history read by prepareHistory()
+         * 
+         * Only call when there are no EventInfo objects in preparedInfo.
+         */
+        void clearPrepared();
+
+        /**
+         * @brief Copy the entries in preparedInfo to the other arena, releasing the memory of replaced entries
+         * 
+         * Built-in wake events are replaced on every wake, so without this the arena would grow on
+         * each wake that does not publish.
+         */
+        void compactPrepared();
+
+        /**
+         * @brief Returns the index of key in the key table, adding it if necessary
+         * 
+         * @param key Key as it appears in the JSON, without the quotes
+         * @param len Length of key
+         * @return Index, or NO_KEY if the table is full
+         * 
+         * Keys are found using a hash table, so the same key always returns the same index and 
+         * keys can be compared by index.
+         */
+        uint16_t internKey(const char *key, size_t len);
+
+        /**
+         * @brief Part of the event history read by prepareHistory(), a JSON array that fits in one event
+         */
+        struct HistoryPart {
+            HistoryPart *next; //!< Next part, or nullptr
+            const char *json; //!< JSON array, in historyArena
+            size_t len; //!< Length of json
+            EventHistory::Range range; //!< Where json was read from in the event history
+        };
+
+        /**
+         * @brief An event history channel, see withEventHistoryChannel()
+         */
+        struct Channel {
+            HistoryChannel config; //!< Settings. The path, staging buffer, schema, and retention policy are set in history.
+            EventHistory history; //!< Event history
+            HistoryPart *prepared = nullptr; //!< JSON arrays read by prepareHistory(), oldest first
+            size_t preparedCount = 0; //!< Number of parts in prepared
+            size_t preparedSize = 0; //!< maxSize used for prepared, 0 if prepared is not valid
+            uint32_t preparedChangeCount = 0; //!< history.getChangeCount() when prepared was read
+            bool preparedDue = false; //!< isChannelDue() when prepared was read
+            EventHistory::Cursor issued; //!< End of the event history in events from generateEvents() waiting to be acknowledged
+            time_t lastPublished = 0; //!< Time events from this channel were last generated, see HistoryChannel::withPublishInterval()
+        };
+
+        /**
+         * @brief Returns the channel with a name, or the default channel (after logging an error) if there isn't one
+         */
+        Channel &findChannel(const char *name);
+
+        /**
+         * @brief Returns true if the channel's events should be included in generated events, see HistoryChannel::withPublishInterval()
+         */
+        bool isChannelDue(const Channel &channel) const;
+
+        /**
+         * @brief Returns true if the event history read by prepareHistory() is current for all channels
+         * 
+         * @param maxSize Maximum size of each event in bytes
+         * @param ignoreEmpty Also true if the channels that are not current have no events
+         */
+        bool isHistoryCurrent(size_t maxSize, bool ignoreEmpty);
+
+        /**
+         * @brief Reads the event history of each channel into Channel::prepared if it's not already current
+         * 
+         * @param buf Buffer of at least maxSize bytes
+         * @param maxSize Maximum size of each event in bytes
+         */
+        void prepareHistory(char *buf, size_t maxSize);
+
+        /**
+         * @brief Reads the event history of one channel, called by prepareHistory()
+         * 
+         * @return false if out of memory
          */
-        void generateEventInternal(std::function<void(JSONWriter &, int &)> callback, char *buf, size_t maxSize, std::vector<EventInfo> &infoArray);
-
-        AppCallback<JSONWriter &, int &> callbacks; //!< Callback functions
-        AppCallback<JSONWriter &, int &> oneTimeCallbacks; //!< One-time use callback functions 
-        EventHistory eventHistory; //!< Event history
-        String eventHistoryKey; //!< Key to use when publishing the event history
+        bool prepareChannel(Channel &channel, char *buf, size_t maxSize);
+
+        AppCallbackFixed<SLEEPHELPER_EVENT_CALLBACK_CAPACITY, JSONWriter &, int &> callbacks; //!< Callback functions
+        AppCallbackFixed<SLEEPHELPER_EVENT_ONE_TIME_CAPACITY, JSONWriter &, int &> oneTimeCallbacks; //!< One-time use callback functions, including the built-in wake events
+        AppCallbackArray<uint64_t, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY> oneTimeIds; //!< id passed to withOneTimeCallback for each entry in oneTimeCallbacks
+        AppCallbackArray<EventInfo, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY> preparedInfo; //!< Results of one-time callbacks called from prepareEvents(), oldest first
+        AppCallbackArray<uint64_t, SLEEPHELPER_EVENT_ONE_TIME_CAPACITY> preparedIds; //!< id passed to withOneTimeCallback for each entry in preparedInfo
+        Channel channels[SLEEPHELPER_HISTORY_CHANNEL_CAPACITY]; //!< Event history channels, the default channel (withEventHistory()) first
+        size_t channelCount = 1; //!< Number of channels in use
+
+        static const uint16_t NO_KEY = 0xffff; //!< Returned by internKey() when the key table is full
+        static const size_t KEY_SLOTS = 2 * SLEEPHELPER_EVENT_KEY_CAPACITY; //!< Size of the key hash table, at most half full
+
+        BumpArena arenas[2]; //!< JSON fragments and keys from prepareEvents() until generateEvents() is done. The other one is used by compactPrepared().
+        size_t arenaIndex = 0; //!< Index of the arena in use in arenas
+        BumpArena historyArena; //!< Event history read by prepareHistory(), rewound each time it's read
+        bool preparedErased = false; //!< An entry in preparedInfo was replaced, so compactPrepared() should be called
+        const char *keyNames[SLEEPHELPER_EVENT_KEY_CAPACITY]; //!< Key table, in the arena
+        uint16_t keySlots[KEY_SLOTS] = {}; //!< Hash table of index + 1 into keyNames, 0 for an empty slot
+        size_t keyCount = 0; //!< Number of keys in keyNames
+        char *scratchBuf = nullptr; //!< Buffer for JSONBufferWriter, see getScratchBuffer()
+        size_t scratchSize = 0; //!< Size of scratchBuf
     };
 
     /**
@@ -1541,6 +3619,21 @@ public:
         String eventName; //!< Particle event name
         String eventData; //!< Particle event payload
         PublishFlags flags = PRIVATE; //!< Flags. Default is PRIVATE, can also use NO_ACK
+        uint32_t publishId = 0; //!< Non-zero while a publish of this data is in flight, see PublishSlot
+        EventCombiner::HistoryRanges historyRanges; //!< Event history in eventData, removed when the publish succeeds
+        bool stateDwell = false; //!< Part of a wake event with the "sd" report, see stateDwellAcknowledge()
+    };
+
+    /**
+     * @brief A publish in flight, see withPublishWindow()
+     */
+    class PublishSlot {
+    public:
+        uint32_t publishId = 0; //!< PublishData::publishId being published, 0 if the slot is free
+        bool background = false; //!< true if published using BackgroundPublishRK, false if using future
+        volatile bool done = false; //!< Set when the publish completes (from the BackgroundPublishRK thread)
+        volatile bool succeeded = false; //!< Set with done to indicate success
+        particle::Future<bool> future; //!< Result of Particle.publish if background is false
     };
 
     /**
@@ -1550,9 +3643,10 @@ public:
      * @param writer 
      * 
      * This is used because JSONWriter does not have a method to write pre-formatted JSON into a
-     * writer. It's a little inefficient but works. Note: The JSON that is inserted may not be
-     * identical to the original. This is especially true for JSON that contains double
-     * values because the decimal precision will likely change.
+     * writer. It's a little inefficient but works. Numbers keep the number of decimal places
+     * they have in src, but the JSON that is inserted may not be identical to the original, for 
+     * example white space is removed. If you control the writer, use JSONSpliceWriter::rawValue()
+     * instead, which copies the JSON without parsing it.
      */
     static void JSONCopy(const char *src, JSONWriter &writer);
 
@@ -1563,14 +3657,12 @@ public:
      * @param writer 
      * 
      * This is used because JSONWriter does not have a method to write pre-formatted JSON into a
-     * writer. It's a little inefficient but works. Note: The JSON that is inserted may not be
-     * identical to the original. This is especially true for JSON that contains double
-     * values because the decimal precision will likely change.
+     * writer. It's a little inefficient but works. Numbers keep the number of decimal places
+     * they have in src, except ones in exponential notation.
      */
     static void JSONCopy(const JSONValue &src, JSONWriter &writer);
 
 
-#ifndef UNITTEST
     /**
      * @brief Structure of information about the next planned sleep
      * 
@@ -1580,14 +3672,26 @@ public:
     class SleepConfigurationParameters {
     public:
         // Informational fields to help you determine if you need to modify sleep behavior
-        bool isConnected; //!< Currently connected to cellular if true
-        system_tick_t timeUntilNextFullWakeMs; //!< Number of milliseconds until next full wake
-        time_t nextFullWakeTime; //!< Time of next full wake (Unix time seconds since January 1, 1970, at UTC)
-        uint64_t calculatedMillis; //!< System.millis() when the sleep duration was calculated
+        bool isConnected = false; //!< Currently connected to cellular if true
+        system_tick_t timeUntilNextFullWakeMs = 0; //!< Number of milliseconds until next full wake
+        time_t nextFullWakeTime = 0; //!< Time of next full wake (Unix time seconds since January 1, 1970, at UTC)
+        time_t nextWakeTime = 0; //!< Time of next scheduled wake of any kind, 0 if there is no schedule (Unix time seconds since January 1, 1970, at UTC)
+        uint64_t calculatedMillis = 0; //!< System.millis() when the sleep duration was calculated
 
         // You can update these to change the sleep behavior
-        system_tick_t sleepTimeMs; //!< Override setting for sleep duration
-        bool disconnectCellular; //!< Override setting for disconnecting from cellular
+        system_tick_t sleepTimeMs = 0; //!< Override setting for sleep duration
+        bool disconnectCellular = false; //!< Override setting for disconnecting from cellular
+
+        // Cellular cost model inputs (measured, 0 if not measured yet) and results, see withCellularCostModel()
+        system_tick_t coldConnectMs = 0; //!< Average time to connect after sleep with cellular off
+        system_tick_t warmConnectMs = 0; //!< Average time to connect after sleep with cellular standby
+        float awakeSocPerHour = 0.0; //!< Battery SoC percent used per hour during a full wake
+        float sleepOffSocPerHour = 0.0; //!< Battery SoC percent used per hour sleeping with cellular off
+        float sleepStandbySocPerHour = 0.0; //!< Battery SoC percent used per hour sleeping with cellular standby
+        float costOff = 0.0; //!< Estimated SoC percent used until the next full wake is connected, with cellular off (0 if not known)
+        float costStandby = 0.0; //!< Estimated SoC percent used until the next full wake is connected, with cellular standby (0 if not known)
+
+        bool hibernate = false; //!< Override setting for using HIBERNATE instead of the sleep mode in the sleep configuration, see withHibernateMinimumTime()
     };
 
 
@@ -1608,7 +3712,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSleepConfigurationFunction(std::function<bool(SystemSleepConfiguration &, SleepConfigurationParameters&)> fn) { 
+    SleepHelper &withSleepConfigurationFunction(AppFunction<bool(SystemSleepConfiguration &, SleepConfigurationParameters&)> fn) { 
         sleepConfigurationFunctions.add(fn); 
         return *this;
     }
@@ -1629,7 +3733,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeFunction(std::function<bool(const SystemSleepResult &)> fn) { 
+    SleepHelper &withWakeFunction(AppFunction<bool(const SystemSleepResult &)> fn) { 
         wakeFunctions.add(fn); 
         return *this;
     }
@@ -1647,20 +3751,180 @@ public:
         return *this;
     }
 
+    /**
+     * @brief Choose cellular standby or cellular off for each sleep using measured costs instead of a fixed time
+     * 
+     * @return SleepHelper& 
+     * 
+     * The library measures the time to connect after cellular off and after cellular standby, and the 
+     * battery SoC used per hour while awake, asleep with cellular off, and asleep with cellular standby.
+     * When connected and about to sleep, it estimates the SoC used until the next full wake is connected 
+     * for each option and picks the cheaper one. The inputs and the estimates are in the 
+     * SleepConfigurationParameters passed to sleep configuration functions, which are called afterwards
+     * and can still override the decision.
+     * 
+     * withMinimumCellularOffTime() is still used as a lower limit: cellular is never turned off for a
+     * shorter time, to avoid aggressive reconnection. Until both options have been measured, the 
+     * unmeasured option is used when allowed. After that, the other option is used occasionally 
+     * so its measurements stay current.
+     * 
+     * This requires a fuel gauge (HAL_PLATFORM_POWER_MANAGEMENT). 
+     */
+    SleepHelper &withCellularCostModel() {
+        return withCellularCostFunction([this](SleepConfigurationParameters &params) {
+            cellularCostModel(params);
+        });
+    }
+
+    /**
+     * @brief Use your own function to choose cellular standby or cellular off for each sleep
+     * 
+     * @param fn Callback function or C++11 lambda. It's passed the SleepConfigurationParameters with the 
+     * measured inputs filled in and should set disconnectCellular, and optionally costOff and costStandby.
+     * @return SleepHelper& 
+     * 
+     * Only one cost function is used; setting one replaces the previous one, including withCellularCostModel().
+     * 
+     * @ingroup callbacks
+     */
+    SleepHelper &withCellularCostFunction(AppFunction<void(SleepConfigurationParameters &)> fn) {
+        cellularCostFunction = fn;
+        return *this;
+    }
+
     /**
      * @brief Sets the minimum time to sleep. Default is 10 seconds.
      * 
      * @param timeMs 
      * @return SleepHelper& 
      * 
-     * If the time to sleep is less than that, we stay awake until the event occurs.
+     * If the time to sleep is less than that, we stay awake until the event occurs, unless 
+     * withShortSleepCoalescing() is enabled.
      */
     SleepHelper &withMinimumSleepTimeMs(std::chrono::milliseconds timeMs) { 
         minimumSleepTimeMs = timeMs.count();
         return *this;
     }
 
-#endif
+    /**
+     * @brief Don't stay awake when the time to sleep is less than the minimum sleep time
+     * 
+     * @param enable true to enable (default: false)
+     * @return SleepHelper& 
+     * 
+     * When a wake runs until shortly before the next scheduled wake (a slow connection just before 
+     * a data capture, for example), the time left to sleep can be less than the minimum sleep time 
+     * (withMinimumSleepTimeMs, default 10 seconds). Normally the device then stays awake with the 
+     * modem in whatever state it's in until the scheduled time. With this enabled:
+     * 
+     * - If the next wake is only for data capture, it's merged with the current wake: the data capture is 
+     * done now, up to the minimum sleep time early, and the device then sleeps until the wake after that.
+     * - Otherwise (a full wake), the device sleeps in ULTRA_LOW_POWER mode for the remaining time if it's
+     * at least SLEEP_SHORT_MIN_MS, keeping the same network settings as a normal sleep.
+     */
+    SleepHelper &withShortSleepCoalescing(bool enable = true) {
+        shortSleepCoalescing = enable;
+        return *this;
+    }
+
+    /**
+     * @brief Use HIBERNATE sleep mode for long sleeps
+     * 
+     * @param minTime Sleeps at least this long use HIBERNATE instead of ULTRA_LOW_POWER, as a chrono literal 
+     * such as 2h. Default: 0 (never use HIBERNATE).
+     * @return SleepHelper& 
+     * 
+     * HIBERNATE uses less current than ULTRA_LOW_POWER, but RAM is lost and the device resets on wake, so 
+     * the time to boot and run setup() again is added to each wake. It's only worth it for long sleeps, such 
+     * as overnight.
+     * 
+     * HIBERNATE is only used when:
+     * 
+     * - The sleep duration is at least minTime
+     * - Cellular is being turned off (cellular standby requires ULTRA_LOW_POWER)
+     * - There is no wake event data that is only in RAM: all wake events have been published and there
+     * are no one-time wake event callbacks that were added without an id
+     * 
+     * The next full wake time, the sleep duration (for the state dwell totals), and the cost model 
+     * measurements are saved in the persistent data, so the library continues where it left off after 
+     * the reset, and the wake reason (wr) is WAKEUP_REASON_HIBERNATE. 
+     * 
+     * The device must be able to wake from HIBERNATE by time. Some platforms can't do this using the 
+     * built-in RTC, and the RTC time may not be valid after wake; an external RTC such as the AB1805 
+     * handles both. You can change the decision for each sleep in a sleep configuration function using 
+     * the hibernate field of SleepConfigurationParameters.
+     */
+    SleepHelper &withHibernateMinimumTime(std::chrono::milliseconds minTime) {
+        hibernateMinimumMs = minTime.count();
+        return *this;
+    }
+
+    /**
+     * @brief Local time window each night when the device stays asleep
+     * 
+     * @param sleepTime Local time the dormant period starts, such as LocalTimeHMS("22:00:00")
+     * @param wakeTime Local time the dormant period ends, such as LocalTimeHMS("06:00:00")
+     * @return SleepHelper& 
+     * 
+     * The dormant period can cross midnight (sleepTime later than wakeTime) or not. If sleepTime and
+     * wakeTime are the same, there is no dormant period, which is the default.
+     * 
+     * During the dormant period, the data capture and full wake schedules are ignored. Instead of
+     * waking for each of them, the device takes one long sleep until wakeTime, and that wake is 
+     * a full wake so the data from before the dormant period is published. Data capture resumes at
+     * wakeTime. If the device is awake during the dormant period (after a reset, for example), it
+     * finishes the current wake cycle normally and then sleeps until wakeTime.
+     * 
+     * Combine this with withHibernateMinimumTime() to use HIBERNATE for the long sleep. 
+     * 
+     * The times use the timezone set using withTimeConfig().
+     */
+    SleepHelper &withDormancyWindow(LocalTimeHMS sleepTime, LocalTimeHMS wakeTime) {
+        dormancySleepTime = sleepTime;
+        dormancyWakeTime = wakeTime;
+        return *this;
+    }
+
+    /**
+     * @brief Number of wake event publishes that can be in flight at the same time
+     * 
+     * @param window 1 to PUBLISH_WINDOW_MAX. Default: 1
+     * @return SleepHelper& 
+     * 
+     * With the default of 1, each publish is made using BackgroundPublishRK and the next one
+     * is not started until the previous one has been acknowledged. When a wake generates several 
+     * events (a large event history, for example), this takes one round trip per event while the 
+     * modem is powered.
+     * 
+     * With a larger window, Particle.publish is called directly and the returned futures are 
+     * checked from the state handler, so several publishes can be waiting for their 
+     * acknowledgement at once. Events that fail are published again, so they can arrive out of
+     * order. Use this with withPublishRateLimit() so the cloud rate limit is not exceeded.
+     */
+    SleepHelper &withPublishWindow(size_t window) {
+        publishWindow = (window < 1) ? 1 : ((window > PUBLISH_WINDOW_MAX) ? PUBLISH_WINDOW_MAX : window);
+        return *this;
+    }
+
+    /**
+     * @brief Rate limit for wake event publishes
+     * 
+     * @param burst Number of publishes that can be started back-to-back. Default: 1
+     * @param interval Time to earn another publish, as a chrono literal such as 1s. Default: 1s
+     * @return SleepHelper& 
+     * 
+     * The default of one publish per second (measured from the start of one publish to the
+     * start of the next) is the same as previous versions. The Particle cloud allows bursts of 
+     * up to 4 at one per second on average, so withPublishWindow(4).withPublishRateLimit(4, 1s)
+     * publishes up to 4 events without waiting.
+     */
+    SleepHelper &withPublishRateLimit(size_t burst, std::chrono::milliseconds interval) {
+        publishRateBurst = (burst < 1) ? 1 : burst;
+        publishRateIntervalMs = (interval.count() > 0) ? interval.count() : 1;
+        publishRateTokens = publishRateBurst;
+        return *this;
+    }
+
 
 
 
@@ -1675,7 +3939,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSetupFunction(std::function<bool()> fn) { 
+    SleepHelper &withSetupFunction(AppFunction<bool()> fn) { 
         setupFunctions.add(fn);
         return *this;
     }
@@ -1691,7 +3955,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withLoopFunction(std::function<bool()> fn) { 
+    SleepHelper &withLoopFunction(AppFunction<bool()> fn) { 
         loopFunctions.add(fn); 
         return *this;
     }
@@ -1715,7 +3979,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withDataCaptureFunction(std::function<bool(AppCallbackState &state)> fn) {
+    SleepHelper &withDataCaptureFunction(AppFunction<bool(AppCallbackState &state)> fn) {
         dataCaptureFunctions.add(fn);
         return *this;
     }
@@ -1739,7 +4003,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSleepReadyFunction(std::function<bool(AppCallbackState &, system_tick_t)> fn) {
+    SleepHelper &withSleepReadyFunction(AppFunction<bool(AppCallbackState &, system_tick_t)> fn) {
         sleepReadyFunctions.add(fn); 
         return *this;
     }
@@ -1768,7 +4032,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withShouldConnectFunction(std::function<bool(int &connectConviction, int &noConnectConviction)> fn) { 
+    SleepHelper &withShouldConnectFunction(AppFunction<bool(int &connectConviction, int &noConnectConviction)> fn) { 
         shouldConnectFunctions.add(fn); 
         return *this; 
     }
@@ -1780,7 +4044,7 @@ public:
      * @return SleepHelper& 
      * 
      * - WAKEUP_REASON_SETUP Called from setup after cold boot or reset
-     * - WAKEUP_REASON_NO_SLEEP Called after sleep aborted as it was too short
+     * - WAKEUP_REASON_NO_SLEEP Called after sleep aborted as it was too short (see also withShortSleepCoalescing())
      * - Any result code from for SystemSleepWakeupReason, such as:
      *   - SystemSleepWakeupReason::BY_GPIO
      *   - SystemSleepWakeupReason::BY_ADC
@@ -1790,11 +4054,28 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeOrBootFunction(std::function<bool(int)> fn) { 
+    SleepHelper &withWakeOrBootFunction(AppFunction<bool(int)> fn) { 
         wakeOrBootFunctions.add(fn); 
         return *this;
     }
 
+    /**
+     * @brief Adds a function called when a wake event publish is started
+     * 
+     * @param fn A function or lambda to call. The parameter is the event name. Return true.
+     * @return SleepHelper& 
+     * 
+     * withPublishQueuePosixRK() uses this so the publishes made by this library count against the 
+     * PublishQueuePosixRK rate limit. Both go to the same cloud connection, which only allows bursts 
+     * of 4 at one per second.
+     * 
+     * @ingroup callbacks
+     */
+    SleepHelper &withPublishStartedFunction(AppFunction<bool(const char *)> fn) { 
+        publishStartedFunctions.add(fn); 
+        return *this;
+    }
+
     
     /**
      * @brief Set the event name used for the wake event. Default: sleepHelper.
@@ -1833,12 +4114,12 @@ public:
      * 
      * Items are added to the event in priority order, largest first.
      * 
-     * If you have a priority < 50 and the event is full, then your data will be discarded to 
+     * If you have a priority < 50 and the events are full, then your data will be discarded to 
      * avoid generating another event.
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeEventFunction(std::function<bool(JSONWriter &, int &)> fn) {
+    SleepHelper &withWakeEventFunction(AppFunction<bool(JSONWriter &, int &)> fn) {
         wakeEventFunctions.withCallback(fn);
         return *this;
     }
@@ -1851,7 +4132,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeEventOneTimeFunction(std::function<bool(JSONWriter &, int &)> fn) {
+    SleepHelper &withWakeEventOneTimeFunction(AppFunction<bool(JSONWriter &, int &)> fn) {
         wakeEventFunctions.withOneTimeCallback(fn);
         return *this;
     }
@@ -1864,8 +4145,11 @@ public:
      * @return SleepHelper& 
      * 
      * 
+     * fn is a function or lambda with the prototype void callback(JSONWriter &writer, int &priority).
+     * It's a template parameter so it's stored directly in the wake event callback along with the flag.
      */
-    SleepHelper &withWakeEventFlagOneTimeFunction(uint64_t flag, std::function<void(JSONWriter &, int &)> fn) {
+    template<class F>
+    SleepHelper &withWakeEventFlagOneTimeFunction(uint64_t flag, F fn) {
         if ((eventsEnabled & flag) != 0) {
             wakeEventFunctions.withOneTimeCallback([flag, fn](JSONWriter &writer, int &priority) {
                 const char *name = eventsEnableName(flag);
@@ -1873,7 +4157,7 @@ public:
                 priority = eventsEnablePriority(flag);
                 fn(writer, priority);
                 return true;
-            });
+            }, flag);
         }
         return *this;
     }
@@ -1890,6 +4174,130 @@ public:
         return *this;
     }
 
+    /**
+     * @brief Stage event history events in RAM and write them to the file in groups
+     * 
+     * @param buffer Buffer to hold events, typically retained memory
+     * @param size Size of buffer in bytes
+     * @return SleepHelper& 
+     * 
+     * For example:
+     * 
+     * ```
+     * retained uint8_t eventStaging[1024];
+     * 
+     * SleepHelper::instance()
+     *     .withEventHistory("/usr/events.txt", "eh")
+     *     .withEventHistoryStaging(eventStaging, sizeof(eventStaging));
+     * ```
+     * 
+     * Each addEvent() copies the event into the buffer instead of appending it to the file. The staged 
+     * events are written to the file with a single write when the buffer is full, before the event 
+     * history is read to publish, and before a reset or HIBERNATE sleep. RAM is kept during 
+     * ULTRA_LOW_POWER sleep, so with data capture on quick wakes this replaces a file write for 
+     * each sample with one per full wake.
+     * 
+     * Staged events in retained memory survive a reset, including a crash. They 
+     * are lost if power is removed before they are written. See EventHistory::withStagingBuffer().
+     */
+    SleepHelper &withEventHistoryStaging(void *buffer, size_t size) {
+        wakeEventFunctions.withEventHistoryStaging(buffer, size);
+        return *this;
+    }
+
+    /**
+     * @brief Store event history events that match a schema as compact binary records
+     * 
+     * @param schema The fields of the events to store in binary
+     * @return SleepHelper& 
+     * 
+     * For example, for data capture events like {"t":1656633900,"bs":4,"c":21.5}:
+     * 
+     * ```
+     * SleepHelper::instance()
+     *     .withEventHistory("/usr/events.txt", "eh")
+     *     .withEventHistoryRecordSchema(SleepHelper::EventHistory::RecordSchema()
+     *         .withTime("t")
+     *         .withInt("bs")
+     *         .withFixed("c", 1));
+     * ```
+     * 
+     * Matching events take 8 bytes in the file instead of 33, and are converted back to JSON 
+     * when the event history is published. Other events are stored as JSON. See 
+     * EventHistory::withRecordSchema().
+     */
+    SleepHelper &withEventHistoryRecordSchema(const EventHistory::RecordSchema &schema) {
+        wakeEventFunctions.withEventHistoryRecordSchema(schema);
+        return *this;
+    }
+
+    /**
+     * @brief Bound the event history when the device can't connect for a long time
+     * 
+     * @param policy The limits, and the length of each window
+     * @return SleepHelper& 
+     * 
+     * Past the limits, the oldest samples (events that match the record schema, which is required) are
+     * replaced with one event per window with the number of samples and the [min,max,mean] of each field.
+     * For example, to keep at most 16 Kbytes and hourly aggregates of samples older than a day:
+     * 
+     * ```
+     * SleepHelper::instance()
+     *     .withEventHistoryRecordSchema(SleepHelper::EventHistory::RecordSchema()
+     *         .withTime("t")
+     *         .withInt("bs")
+     *         .withFixed("c", 1))
+     *     .withEventHistoryRetentionPolicy(SleepHelper::EventHistory::RetentionPolicy()
+     *         .withMaxBytes(16384)
+     *         .withMaxAge(24h));
+     * ```
+     * 
+     * This bounds both the flash used and the number of publishes after an outage. See 
+     * EventHistory::withRetentionPolicy().
+     */
+    SleepHelper &withEventHistoryRetentionPolicy(const EventHistory::RetentionPolicy &policy) {
+        wakeEventFunctions.withEventHistoryRetentionPolicy(policy);
+        return *this;
+    }
+
+    /**
+     * @brief Adds an event history channel with its own files, JSON key, priority, and publish interval
+     * 
+     * @param channel The channel settings
+     * @return SleepHelper& 
+     * 
+     * With several kinds of event history, a backlog of one kind doesn't delay the others. For example,
+     * alarms are published ahead of temperature samples, which are only published every 6 hours:
+     * 
+     * ```
+     * SleepHelper::instance()
+     *     .withEventHistory("/usr/events.txt", "eh")
+     *     .withEventHistoryChannel(SleepHelper::EventCombiner::HistoryChannel("alarms")
+     *         .withPath("/usr/alarms.txt")
+     *         .withKey("al")
+     *         .withPriority(90))
+     *     .withEventHistoryChannel(SleepHelper::EventCombiner::HistoryChannel("temp")
+     *         .withPath("/usr/temp.txt")
+     *         .withKey("tp")
+     *         .withPublishInterval(6h)
+     *         .withRecordSchema(SleepHelper::EventHistory::RecordSchema()
+     *             .withTime("t")
+     *             .withFixed("c", 1)));
+     * 
+     * SleepHelper::instance().addEvent("alarms", [](JSONWriter &writer) {
+     *     writer.name("t").value((int)Time.now());
+     *     writer.name("door").value(true);
+     * });
+     * ```
+     * 
+     * Events added without a channel name go to the default channel set with withEventHistory(). See 
+     * EventCombiner::withEventHistoryChannel().
+     */
+    SleepHelper &withEventHistoryChannel(const EventCombiner::HistoryChannel &channel) {
+        wakeEventFunctions.withEventHistoryChannel(channel);
+        return *this;
+    }
+
     /**
      * @brief Adds an event to the event history (preformatted JSON)
      * 
@@ -1924,6 +4332,29 @@ public:
         return *this;
     }
 
+    /**
+     * @brief Adds an event to an event history channel (preformatted JSON)
+     * 
+     * @param channel Name of the channel, see withEventHistoryChannel()
+     * @param jsonObj A string containing a complete JSON object surrounded by {}
+     */
+    SleepHelper &addEvent(const char *channel, const char *jsonObj) {
+        wakeEventFunctions.addEvent(channel, jsonObj);
+        return *this;
+    }
+
+    /**
+     * @brief Adds an event to an event history channel using a callback and writer
+     * 
+     * @param channel Name of the channel, see withEventHistoryChannel()
+     * @param callback The callback function, typically a lambda
+     * @return SleepHelper& 
+     */
+    SleepHelper &addEvent(const char *channel, std::function<void(JSONWriter &)>callback) {
+        wakeEventFunctions.addEvent(channel, callback);
+        return *this;
+    }
+
     /**
      * @brief Adds a function to be called right before sleep or reset.
      * 
@@ -1941,7 +4372,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSleepOrResetFunction(std::function<bool(bool)> fn) { 
+    SleepHelper &withSleepOrResetFunction(AppFunction<bool(bool)> fn) { 
         sleepOrResetFunctions.add(fn); 
         return *this;
     }
@@ -1963,7 +4394,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withMaximumTimeToConnectFunction(std::function<bool(system_tick_t ms)> fn) {
+    SleepHelper &withMaximumTimeToConnectFunction(AppFunction<bool(system_tick_t ms)> fn) {
         maximumTimeToConnectFunctions.add(fn); 
         return *this; 
     }
@@ -1980,7 +4411,7 @@ public:
      */
     SleepHelper &withMaximumTimeToConnect(system_tick_t timeMs) { 
         return withMaximumTimeToConnectFunction([timeMs](system_tick_t ms) {
-            return (ms >= timeMs);
+            return (ms < timeMs);
         }); 
     }
 
@@ -1996,7 +4427,7 @@ public:
      */
     SleepHelper &withMaximumTimeToConnect(std::chrono::milliseconds timeMs) { 
         return withMaximumTimeToConnectFunction([timeMs](system_tick_t ms) {
-            return (ms >= timeMs.count());
+            return (ms < timeMs.count());
         }); 
     }
 
@@ -2018,7 +4449,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withNoConnectionFunction(std::function<bool(AppCallbackState &state)> fn) {
+    SleepHelper &withNoConnectionFunction(AppFunction<bool(AppCallbackState &state)> fn) {
         noConnectionFunctions.add(fn); 
         return *this;
     }
@@ -2065,7 +4496,7 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSettingChangeFunction(std::function<bool(const char *)> fn) { 
+    SleepHelper &withSettingChangeFunction(AppFunction<bool(const char *)> fn) { 
         settingsFile.withSettingChangeFunction(fn);
         return *this;
     }
@@ -2147,6 +4578,12 @@ public:
             return true;
         });
 
+        withPublishStartedFunction([](const char *eventName) {
+            // Share the cloud rate limit, so the queue doesn't burst right after these publishes
+            PublishQueuePosix::instance().consumeRateToken();
+            return true;
+        });
+
         withSleepReadyFunction([maxTimeToPublish](AppCallbackState &state, system_tick_t ms) {
             bool canSleep = false;
 
@@ -2218,12 +4655,31 @@ public:
         return *this;
     }
 
+    /**
+     * @brief Sets the average current for a state dwell group, used to estimate energy use
+     * 
+     * @param index The state dwell group, such as STATE_DWELL_CONNECT_WAIT or STATE_DWELL_SLEEP
+     * @param mA Average current in milliamps for your hardware in that state
+     * @return SleepHelper& 
+     * 
+     * If any current is set, the "sd" wake event includes an "mAh" key with the estimated
+     * charge used since the last report. The values depend on the device, the modem, and your
+     * own circuitry, so there are no defaults.
+     */
+    SleepHelper &withStateDwellCurrent(size_t index, float mA) {
+        if (index < STATE_DWELL_COUNT) {
+            stateDwellCurrentMa[index] = mA;
+        }
+        return *this;
+    }
+
     // When adding a constant here, be sure to update SleepHelperWakeEvents _wakeEvents[] as well!
 
     static const uint64_t eventsEnabledWakeReason           = 0x0000000000000001ul;  //!< "wr" wake reason (int) event
     static const uint64_t eventsEnabledTimeToConnect        = 0x0000000000000002ul;  //!< "ttc" time to connect event
     static const uint64_t eventsEnabledResetReason          = 0x0000000000000004ul;  //!< "rr" reset reason event
     static const uint64_t eventsEnabledBatterySoC           = 0x0000000000000008ul;  //!< "soc" report battery SoC on full wake
+    static const uint64_t eventsEnabledStateDwell           = 0x0000000000000010ul;  //!< "sd" time spent in each state dwell group since the last report
 
     /**
      * @brief Enable an eventsEnable flag. These determine whether the add values to the wake event
@@ -2338,6 +4794,37 @@ public:
      */
     void loop();
 
+    /**
+     * @brief Allow loop() to block until the library next has something to do
+     * 
+     * @param maxBlockTime Maximum time to block in a single call to loop(), as a chrono literal such as 1s. 
+     * The default is 0, which never blocks.
+     * @return SleepHelper& 
+     * 
+     * Each state declares how long it can wait before it needs to run again, or the event it's 
+     * waiting for (cloud or network status change, publish complete). When enabled, loop() waits
+     * on a semaphore until then instead of returning, so the application loop does not spin
+     * while waiting for the cloud connection, publishes, or the modem.
+     * 
+     * This requires SYSTEM_THREAD(ENABLED). Your own loop code and withLoopFunction callbacks 
+     * only run when loop() returns, so set maxBlockTime to the longest latency they can tolerate.
+     */
+    SleepHelper &withLoopBlocking(std::chrono::milliseconds maxBlockTime) {
+        loopBlockingMaxMs = maxBlockTime.count();
+        return *this;
+    }
+
+    /**
+     * @brief Returns how long until the library next needs loop() to be called
+     * 
+     * @return system_tick_t Milliseconds. 0 means call loop() again right away. 
+     * 
+     * This takes into account the current state and the data capture schedule, but not
+     * withLoopFunction callbacks. You can use this if you want to implement your own
+     * blocking instead of using withLoopBlocking().
+     */
+    system_tick_t getIdleTimeMs() const;
+
     /**
      * @brief Class for managing the settings file
      * 
@@ -2359,6 +4846,11 @@ public:
      */
     LocalTimeScheduleManager scheduleManager;
 
+    /**
+     * @brief Results of schedule evaluation for scheduleManager, see ScheduleCache
+     */
+    ScheduleCache scheduleCache;
+
     /**
      * @brief Get the quick wake schedule
      * 
@@ -2390,6 +4882,7 @@ public:
     
     static const int WAKEUP_REASON_SETUP        = 0x10001; //!< Wakeup reason used on reset or cold boot, from setup()
     static const int WAKEUP_REASON_NO_SLEEP     = 0x10002; //!< Wakeup reason when we didn't actually sleep because the period was too short
+    static const int WAKEUP_REASON_HIBERNATE    = 0x10003; //!< Wakeup reason in the wake event after waking from HIBERNATE, see withHibernateMinimumTime()
 
 
 protected:
@@ -2415,7 +4908,6 @@ protected:
      */
     SleepHelper& operator=(const SleepHelper&) = delete;
 
-#ifndef UNITTEST
     /**
      * @brief A system event handler is so the code can be notified of things like firmware update started
      * 
@@ -2446,6 +4938,94 @@ protected:
      */
     void calculateSleepSettings(bool isConnected);
 
+    /**
+     * @brief Returns true if nothing that is only stored in RAM would be lost by HIBERNATE, see withHibernateMinimumTime()
+     */
+    bool canHibernate() const;
+
+    /**
+     * @brief Returns the end of the dormant period, or 0 if a time is not in the dormant period, see withDormancyWindow()
+     * 
+     * @param t The time to check (Unix time seconds since January 1, 1970, at UTC)
+     */
+    time_t getDormancyEnd(time_t t) const;
+
+    /**
+     * @brief Finish a HIBERNATE sleep after the reset on wake, called from setup()
+     * 
+     * Adds the time asleep to the state dwell totals, ends the cost model sleep segment, restores
+     * the next full wake time, and sets the wake reason to WAKEUP_REASON_HIBERNATE.
+     */
+    void hibernateWake();
+
+    /**
+     * @brief Built-in cellular cost model, see withCellularCostModel()
+     * 
+     * @param params Sleep parameters, with the measured inputs filled in
+     */
+    void cellularCostModel(SleepConfigurationParameters &params);
+
+    /**
+     * @brief Ends the current battery SoC measurement segment and starts a new one
+     * 
+     * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, SOC_SEGMENT_SLEEP_STANDBY, or SOC_SEGMENT_NONE to only end the current one
+     */
+    void socSegment(uint32_t type);
+
+    /**
+     * @brief Get the measured battery SoC percent used per hour for a type of segment
+     * 
+     * @param type SOC_SEGMENT_AWAKE, SOC_SEGMENT_SLEEP_OFF, or SOC_SEGMENT_SLEEP_STANDBY
+     * @return float SoC percent per hour, 0 if not measured yet
+     */
+    float socPerHour(uint32_t type) const;
+
+    /**
+     * @brief Adds the time since the last call to the state dwell group of stateDwellHandler
+     * 
+     * Called from loop() when stateHandler changes and before sleep. Time asleep is added
+     * separately by stateHandlerSleep because millis() may not advance during sleep.
+     */
+    void stateDwellUpdate();
+
+    /**
+     * @brief Removes the reported time from the state dwell totals once the wake event with the "sd" report is published
+     * 
+     * Called from publishPipeline() when a publish succeeds. If the device resets before then, the
+     * totals are still in the persistent data and are reported again.
+     */
+    void stateDwellAcknowledge();
+
+    /**
+     * @brief Returns the state dwell group (STATE_DWELL_AWAKE, etc.) for a state handler
+     * 
+     * @param handler State handler member function pointer, such as &SleepHelper::stateHandlerConnectWait
+     */
+    static size_t stateDwellGroup(void (SleepHelper::*handler)());
+
+    /**
+     * @brief Handle a change of stateHandler, which may occur in a state handler or the publish callback
+     * 
+     * The new state always runs on the next loop.
+     */
+    void stateChangeCheck();
+
+    /**
+     * @brief Called from a state handler that stays in the same state and does not need to run again for ms milliseconds
+     * 
+     * @param ms Milliseconds to wait. The state will run sooner if stateEventNotify() is called.
+     * 
+     * If a state handler does not call this, it's called again on the next loop.
+     */
+    void stateWait(system_tick_t ms);
+
+    /**
+     * @brief Wakes the state handler early, from any thread
+     * 
+     * Used for system events (cloud and network status) and publish completion.
+     */
+    void stateEventNotify();
+
     /**
      * @brief Calls the data capture handlers
      * 
@@ -2467,6 +5047,9 @@ protected:
     /**
      * @brief Waits for the Particle cloud connection to be made
      * 
+     * Once data capture is complete, the wake event payload is prepared while waiting (see 
+     * EventCombiner::prepareEvents) so less work is done after connecting.
+     * 
      * Previous state:
      * - stateHandlerStart Cloud connections is started in stateHandlerStart.
      * 
@@ -2513,39 +5096,57 @@ protected:
     /**
      * @brief Handles things while connected to the cloud
      * 
-     * Attempts to publish all saved data. Once all data has been published, the sleep ready functions are 
+     * Adds the wake event payload to publishData. Once all data has been published, the sleep ready functions are 
      * called to see if all callbacks agree it's time to sleep.
      * 
      * Next state:
-     * - stateHandlerPublishWait if a publish is in progress
-     * - stateHandlerPublishRateLimit if a publish was successful and we need to wait before publishing more data 
-     * - stateHandlerConnected stays in state if a publish failed
+     * - stateHandlerPublishWait if there is data to publish
      * - stateHandlerDisconnectBeforeSleep all data has been published and sleep ready function indicate time to sleep
      * - stateHandlerReconnectWait if the cloud connection is lost
      */
     void stateHandlerConnected();
 
     /**
-     * @brief Wait for a publish to complete
+     * @brief Publishes publishData, keeping up to publishWindow publishes in flight
      * 
-     * The state transition occurs from the background publish lambda implemented in stateHandlerConnected.
+     * Completed publishes are handled by publishPipeline(). The BackgroundPublishRK callback only 
+     * marks its slot done and calls stateEventNotify(); futures are checked every STATE_POLL_MS.
      *
      * Previous state:
      * - stateHandlerConnected
      * 
      * Next state:
-     * - stateHandlerPublishRateLimit
+     * - stateHandlerConnected when all data has been published, or if the cloud connection is lost
+     * - stateHandlerPublishRateLimit if there is nothing in flight and the rate limit has been reached
      */
     void stateHandlerPublishWait();
 
     /**
-     * @brief Waits so publishes only occur once per second
+     * @brief Waits until the rate limit allows another publish
+     * 
+     * See withPublishRateLimit(). Default: one per second.
      * 
      * Next state: 
      * - stateHandlerConnected
      */
     void stateHandlerPublishRateLimit();
 
+    /**
+     * @brief Handles completed publishes and starts new ones
+     * 
+     * @return system_tick_t How long stateHandlerPublishWait can wait before checking again, or
+     * 0 if there is nothing in flight.
+     * 
+     * Successfully published data is removed from publishData. Failed data is left in publishData 
+     * and published again.
+     */
+    system_tick_t publishPipeline();
+
+    /**
+     * @brief Milliseconds until the rate limit allows another publish, 0 if one is allowed now
+     */
+    system_tick_t publishRateWaitMs();
+
     /**
      * @brief If the cloud connection is lost, waits here
      * 
@@ -2616,15 +5217,24 @@ protected:
      * 
      * - Calls sleepOrResetFunctions 
      * - Adjust sleep time to account for the time to disconnect from the cloud and cellular (could be a couple seconds)
-     * - Uses System.sleep to sleep
+     * - Uses System.sleep to sleep. In HIBERNATE mode, saves the state needed after the reset on wake first (see hibernateWake)
      * - Records the wakeup reason after wake
      * 
      * Next state: 
      * - stateHandlerSleepDone We've woken up
      * - stateHandlerSleepShort After adjusting sleep duration, the duration was too short so not sleeping at all
+     * - stateHandlerSleepCoalesce The duration was too short and the next wake is a data capture that can be done now
      */
     void stateHandlerSleep();
 
+    /**
+     * @brief Does the data capture for the next wake early, then calculates the sleep again, see withShortSleepCoalescing()
+     * 
+     * Next state:
+     * - stateHandlerSleep
+     */
+    void stateHandlerSleepCoalesce();
+
     /**
      * @brief Handles wake operations
      * 
@@ -2651,7 +5261,6 @@ protected:
     SystemSleepConfiguration sleepConfig; //!< Passed to sleep configuration functions
     SleepConfigurationParameters sleepParams;  //!< Passed to sleep configuration functions
 
-#endif // UNITTEST
 
 
     AppCallback<> setupFunctions; //!< Callback functions called during setup()
@@ -2669,6 +5278,8 @@ protected:
 
     AppCallback<int> wakeOrBootFunctions; //!< Called at either boot or after wake
 
+    AppCallback<const char *> publishStartedFunctions; //!< Called when a wake event publish is started
+
     AppCallback<bool> sleepOrResetFunctions; //!< Called right before sleep or before reset
 
     AppCallback<system_tick_t> maximumTimeToConnectFunctions; //!< Callback to determine if the maximum time to connect has been exceeded
@@ -2686,6 +5297,13 @@ protected:
     int wakeReasonInt = 0; //!< Wake reason after sleep
 
     std::vector<PublishData> publishData; //!< Wake event data to publish (JSON strings)
+    PublishSlot publishSlots[PUBLISH_WINDOW_MAX]; //!< Publishes in flight, up to publishWindow are used
+    uint32_t publishNextId = 0; //!< Last PublishData::publishId assigned
+    size_t publishWindow = 1; //!< Maximum number of publishes in flight, see withPublishWindow()
+    size_t publishRateBurst = 1; //!< Maximum value for publishRateTokens, see withPublishRateLimit()
+    system_tick_t publishRateIntervalMs = 1000; //!< Time to earn a publish rate token
+    size_t publishRateTokens = 1; //!< Number of publishes that can be started now
+    system_tick_t publishRateRefillMillis = 0; //!< millis value publishRateTokens was last refilled from
 
     /**
      * @brief Which event history events are enabled (default: all)
@@ -2701,12 +5319,32 @@ protected:
      */
     uint64_t logEnabled = logEnabledNormal;
 
-#ifndef UNITTEST
     system_tick_t minimumCellularOffTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(13min).count(); //!< Default value for the minimum time to turn cellular off
     system_tick_t minimumSleepTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(10s).count(); //!< Default value for the minimum time to sleep
-
-    std::function<void(SleepHelper&)> stateHandler = &SleepHelper::stateHandlerStart; //!< state handler function
+    system_tick_t hibernateMinimumMs = 0; //!< Minimum sleep duration to use HIBERNATE, 0 to never use it. See withHibernateMinimumTime().
+    bool shortSleepCoalescing = false; //!< Merge or sleep through periods shorter than minimumSleepTimeMs, see withShortSleepCoalescing()
+    time_t coalescedWakeTime = 0; //!< Scheduled data capture that was done early, schedules are evaluated from this time until it passes
+    LocalTimeHMS dormancySleepTime; //!< Local time the dormant period starts, see withDormancyWindow()
+    LocalTimeHMS dormancyWakeTime; //!< Local time the dormant period ends, the same as dormancySleepTime to disable. See withDormancyWindow().
+    AppFunction<void(SleepConfigurationParameters &)> cellularCostFunction; //!< Cellular standby vs. off decision, see withCellularCostModel()
+    uint32_t cellularCostDecisions = 0; //!< Number of times the built-in cost model made a decision, used to occasionally try the other option
+    bool wokeFromStandby = false; //!< The last sleep used cellular standby, so the next connection is a warm connection
+
+    void (SleepHelper::*stateHandler)() = &SleepHelper::stateHandlerStart; //!< state handler function
+    void (SleepHelper::*stateDwellHandler)() = &SleepHelper::stateHandlerStart; //!< state handler that stateDwellStartMillis applies to
+    system_tick_t stateDwellStartMillis = 0; //!< millis value when the state dwell time was last accumulated
+    float stateDwellCurrentMa[STATE_DWELL_COUNT] = {0}; //!< Average current in each state dwell group for the energy estimate, see withStateDwellCurrent()
+    uint32_t stateDwellReportedMs[STATE_DWELL_COUNT] = {0}; //!< Time in each state dwell group in "sd" reports that have not been published yet
+    bool stateDwellInPayload = false; //!< The "sd" report is in wakeEventPayload
     system_tick_t stateTime = 0; //!< millis counter used in certain state handlers
+    system_tick_t stateDeadlineMillis = 0; //!< millis value when stateHandler next needs to run, see stateWait()
+    volatile bool stateEvent = false; //!< Set by stateEventNotify() to run stateHandler on the next loop
+    os_semaphore_t stateEventSemaphore = 0; //!< Given by stateEventNotify(), used for blocking in loop()
+    system_tick_t loopBlockingMaxMs = 0; //!< Maximum time loop() can block, 0 to not block. See withLoopBlocking().
+    system_tick_t dataCaptureIdleMs = 0; //!< Time until the next data capture when dataCaptureIdleMillis was set, 0 if now
+    system_tick_t dataCaptureIdleMillis = 0; //!< millis value when dataCaptureIdleMs was set
+    static const system_tick_t STATE_POLL_MS = 100; //!< How often states that wait for a condition check it
+    static const system_tick_t SLEEP_SHORT_MIN_MS = 1000; //!< Shortest sleep used with withShortSleepCoalescing(), stay awake for less than that
 
     system_tick_t connectAttemptStartMillis = 0; //!< millis value when Particle.connect was called
     system_tick_t reconnectAttemptStartMillis = 0; //!< millis value when Particle.connected returned false after being connected
@@ -2729,6 +5367,11 @@ protected:
      */
     std::vector<String> wakeEventPayload;
 
+    /**
+     * @brief The event history in each entry in wakeEventPayload, removed from the event history after it's published
+     */
+    std::vector<EventCombiner::HistoryRanges> wakeEventHistory;
+
     /**
      * @brief Used instead of Cellular.ready(), etc.
      */     
@@ -2739,7 +5382,6 @@ protected:
     NetworkClass &network = WiFi;
 #endif
 
-#endif // UNITTEST
 
     /**
      * @brief Logger instance used by SleepHelper
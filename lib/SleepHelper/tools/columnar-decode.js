@@ -0,0 +1,207 @@
+// Reference decoder for the columnar event history blocks published with
+// SleepHelper::EventHistory::RecordSchema::withColumnar().
+//
+// A block is an element of the event history array:
+//
+//   {"cols":"t:t,bs:i,c:f1","n":72,"z85":"..."}
+//
+// cols is each field as name:type, where type is t (time), i (integer), f followed by the number
+// of decimal places (fixed), or b (bool). z85 is a bit stream in Z85, most significant bit first,
+// with n samples one after another, each with a code for every field in cols order. Each code is
+// the zigzag encoded difference from the same field in the previous sample (0 before the first):
+//
+//   0                   value 0
+//   10   + 7 bits
+//   110  + 9 bits
+//   1110 + 12 bits
+//   1111 + 36 bits
+//
+// For time fields, the first sample is the time as 32 bits, then each code is the difference between
+// the difference from the previous time and the one before it (0 for the second sample).
+//
+// Use from node:
+//
+//   const { expandEvents } = require('./columnar-decode.js');
+//   const data = JSON.parse(event.data);
+//   data.eh = expandEvents(data.eh);
+//
+// Or from the command line, with one event data JSON object per line on stdin. Each is printed with
+// the blocks replaced by the samples as JSON objects:
+//
+//   node columnar-decode.js < events.txt
+//
+// With --samples, each element of the event history arrays is printed on its own line instead, so 
+// the output doesn't depend on how the samples were split into events:
+//
+//   node columnar-decode.js --samples < events.txt
+
+'use strict';
+
+const Z85_CHARS = '0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#';
+
+function z85Decode(str) {
+    if (str.length % 5 != 0) {
+        throw new Error('z85 length must be a multiple of 5');
+    }
+    const bytes = new Uint8Array(str.length / 5 * 4);
+    for(let ii = 0, out = 0; ii < str.length; ii += 5) {
+        let value = 0;
+        for(let jj = 0; jj < 5; jj++) {
+            const index = Z85_CHARS.indexOf(str.charAt(ii + jj));
+            if (index < 0) {
+                throw new Error('invalid z85 character ' + str.charAt(ii + jj));
+            }
+            value = value * 85 + index;
+        }
+        bytes[out++] = Math.floor(value / 0x1000000) & 0xff;
+        bytes[out++] = Math.floor(value / 0x10000) & 0xff;
+        bytes[out++] = Math.floor(value / 0x100) & 0xff;
+        bytes[out++] = value & 0xff;
+    }
+    return bytes;
+}
+
+class BitReader {
+    constructor(bytes) {
+        this.bytes = bytes;
+        this.pos = 0;
+    }
+
+    bits(count) {
+        let value = 0;
+        for(let ii = 0; ii < count; ii++) {
+            if (this.pos >= this.bytes.length * 8) {
+                throw new Error('z85 data is too short');
+            }
+            const bit = (this.bytes[this.pos >> 3] >> (7 - (this.pos & 7))) & 1;
+            value = value * 2 + bit;
+            this.pos++;
+        }
+        return value;
+    }
+
+    value() {
+        let zigzag;
+        if (this.bits(1) == 0) {
+            zigzag = 0;
+        }
+        else if (this.bits(1) == 0) {
+            zigzag = this.bits(7);
+        }
+        else if (this.bits(1) == 0) {
+            zigzag = this.bits(9);
+        }
+        else if (this.bits(1) == 0) {
+            zigzag = this.bits(12);
+        }
+        else {
+            zigzag = this.bits(36);
+        }
+        return (zigzag % 2 == 0) ? (zigzag / 2) : -(zigzag + 1) / 2;
+    }
+}
+
+// Returns true if value is a columnar block
+function isBlock(value) {
+    return value != null && typeof value == 'object' && typeof value.cols == 'string' && typeof value.z85 == 'string';
+}
+
+// Returns an array of the samples in a block, as objects like {"t":1656633900,"bs":4,"c":21.5}
+function decodeBlock(block) {
+    const fields = block.cols.split(',').map(function(col) {
+        const colon = col.lastIndexOf(':');
+        const type = col.substring(colon + 1);
+        return {
+            name: col.substring(0, colon),
+            type: type.charAt(0),
+            decimals: (type.charAt(0) == 'f') ? parseInt(type.substring(1), 10) : 0
+        };
+    });
+
+    const reader = new BitReader(z85Decode(block.z85));
+    const prev = fields.map(function() { return 0; });
+    const prevDelta = fields.map(function() { return 0; });
+    const samples = [];
+
+    for(let ii = 0; ii < block.n; ii++) {
+        const sample = {};
+        fields.forEach(function(field, ff) {
+            let value;
+            if (field.type == 't') {
+                if (ii == 0) {
+                    value = reader.bits(32);
+                    prevDelta[ff] = 0;
+                }
+                else {
+                    const delta = prevDelta[ff] + reader.value();
+                    value = prev[ff] + delta;
+                    prevDelta[ff] = delta;
+                }
+            }
+            else {
+                value = prev[ff] + reader.value();
+            }
+            prev[ff] = value;
+
+            switch(field.type) {
+                case 't':
+                case 'i':
+                    sample[field.name] = value;
+                    break;
+
+                case 'f':
+                    sample[field.name] = parseFloat((value / Math.pow(10, field.decimals)).toFixed(field.decimals));
+                    break;
+
+                case 'b':
+                    sample[field.name] = (value != 0);
+                    break;
+
+                default:
+                    throw new Error('unknown field type ' + field.type);
+            }
+        });
+        samples.push(sample);
+    }
+    return samples;
+}
+
+// Returns a copy of an event history array with each block replaced by its samples
+function expandEvents(events) {
+    const result = [];
+    for(const event of events) {
+        if (isBlock(event)) {
+            result.push(...decodeBlock(event));
+        }
+        else {
+            result.push(event);
+        }
+    }
+    return result;
+}
+
+module.exports = { decodeBlock, expandEvents, isBlock, z85Decode };
+
+if (require.main === module) {
+    const samplesOnly = process.argv.includes('--samples');
+    const lines = require('fs').readFileSync(0, 'utf8').split('\n');
+    for(const line of lines) {
+        if (!line.startsWith('{')) {
+            continue;
+        }
+        const data = JSON.parse(line);
+        for(const key of Object.keys(data)) {
+            if (Array.isArray(data[key]) && data[key].some(isBlock)) {
+                data[key] = expandEvents(data[key]);
+            }
+            if (samplesOnly && Array.isArray(data[key])) {
+                for(const event of data[key]) {
+                    console.log(JSON.stringify(event));
+                }
+            }
+        }
+        if (!samplesOnly) {
+            console.log(JSON.stringify(data));
+        }
+    }
+}
@@ -1,6 +1,7 @@
 //Particle Functions
 #include "Particle.h"
 #include "particle_fn.h"
+#include "sleep_helper_config.h"
 
 /**
  * @brief Returns an integer to support Particle variable limitations
@@ -52,6 +53,7 @@ int setWakeTime(String command)
   int tempTime = strtol(command,&pEND,10);                             // Looks for the first integer and interprets it
   if ((tempTime < 0) || (tempTime > 23)) return 0;                     // Make sure it falls in a valid range or send a "fail" result
   sysStatus.wakeTime = tempTime;
+  sleepHelperDormancyConfig();                                         // Takes effect at the next sleep
   snprintf(data, sizeof(data), "Open time set to %i",sysStatus.wakeTime);
   Log.info(data);
   if (Particle.connected()) {
@@ -78,6 +80,7 @@ int setSleepTime(String command)
   int tempTime = strtol(command,&pEND,10);                       // Looks for the first integer and interprets it
   if ((tempTime < 0) || (tempTime > 24)) return 0;   // Make sure it falls in a valid range or send a "fail" result
   sysStatus.sleepTime = tempTime;
+  sleepHelperDormancyConfig();                                   // Takes effect at the next sleep
   snprintf(data, sizeof(data), "Closing time set to %i",sysStatus.sleepTime);
   Log.info(data);
   if (Particle.connected()) {
@@ -5,6 +5,9 @@
 // Battery conect information - https://docs.particle.io/reference/device-os/firmware/boron/#batterystate-
 const char* batteryContext[7] = {"Unknown","Not Charging","Charging","Charged","Discharging","Fault","Diconnected"};
 
+// Event history samples are staged here and written to the file system once per full wake
+retained uint8_t eventStaging[1024];
+
 void sleepHelperConfig() {
 
     SleepHelper::instance()
@@ -12,6 +15,7 @@ void sleepHelperConfig() {
         .withMaximumTimeToConnect(11min)
         .withTimeConfig("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00")
         .withEventHistory("/usr/events.txt", "eh")
+        .withEventHistoryStaging(eventStaging, sizeof(eventStaging))
         .withDataCaptureFunction([](SleepHelper::AppCallbackState &state) {
             if (Time.isValid()) {
                 batteryState();
@@ -42,8 +46,11 @@ void sleepHelperConfig() {
         })
         .withAB1805_WDT(ab1805)                     // Stop the watchdog before sleep or reset, and resume after wake
         .withPublishQueuePosixRK()                  // Manage both internal publish queueing and PublishQueuePosixRK
+        .withHibernateMinimumTime(2h)               // Use HIBERNATE for sleeps of 2 hours or more, such as the dormant period overnight
         ;
 
+    sleepHelperDormancyConfig();                    // Stay asleep overnight, from sysStatus.sleepTime to sysStatus.wakeTime
+
     // Full wake and publish
     // Every 15 minutes from 9:00 AM to 10:00 PM local time on weekdays (not Saturday or Sunday)
     // Every 2 hours other times
@@ -55,3 +62,12 @@ void sleepHelperConfig() {
     SleepHelper::instance().getScheduleDataCapture()
         .withMinuteOfHour(5);
 }
+
+void sleepHelperDormancyConfig() {
+    // sysStatus.sleepTime can be 24 (midnight). If the hours are the same, there is no dormant period.
+    int sleepHour = sysStatus.sleepTime % 24;
+    int wakeHour = sysStatus.wakeTime % 24;
+
+    SleepHelper::instance().withDormancyWindow(LocalTimeHMS().withHour(sleepHour), LocalTimeHMS().withHour(wakeHour));
+    Log.info("Dormant from %d:00 to %d:00 local time", sleepHour, wakeHour);
+}
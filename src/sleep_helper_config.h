@@ -23,4 +23,6 @@ extern AB1805 ab1805;                               // This library is initializ
 
 void sleepHelperConfig();                           // Takes temperature and stores in current
 
+void sleepHelperDormancyConfig();                   // Sets the dormant period from sysStatus.sleepTime and sysStatus.wakeTime
+
 #endif
\ No newline at end of file